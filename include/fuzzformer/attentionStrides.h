@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+// Lets the helpers below run inside CUDA kernels as well as on the host.
+#if defined(__CUDACC__)
+#define FUZZFORMER_HOST_DEVICE __host__ __device__
+#else
+#define FUZZFORMER_HOST_DEVICE
+#endif
+
+namespace fuzzformer {
+namespace kernels {
+
+// Element strides of one attention operand indexed as [batch, heads,
+// seq_len, head_dim]; head_dim is always unit-stride. Lets the forward read
+// projection outputs in place, e.g. [batch, seq_len, heads, head_dim] slices
+// of a fused QKV tensor, and write its output in the same token-major layout.
+struct TensorStrides {
+  std::int64_t batch;
+  std::int64_t head;
+  std::int64_t token;
+  // Heads sharing one stored head: head h reads stored head h / head_group.
+  // Above 1 only for the keys and values of grouped-query attention, where
+  // consecutive query heads share a K/V head.
+  std::int64_t head_group = 1;
+
+  // Offset of row (batch_index, head_index, token_index).
+  FUZZFORMER_HOST_DEVICE constexpr std::int64_t offset(std::int64_t batch_index,
+                                                       std::int64_t head_index,
+                                                       std::int64_t token_index) const {
+    return batch_index * batch + head_index / head_group * head + token_index * token;
+  }
+};
+
+struct AttentionStrides {
+  TensorStrides queries;
+  TensorStrides keys;
+  TensorStrides values;
+  TensorStrides output;
+};
+
+// Strides of a contiguous [batch, heads, num_tokens, head_dim] operand.
+constexpr TensorStrides contiguous_tensor_strides(int num_heads, int num_tokens, int head_dim) {
+  const std::int64_t token = head_dim;
+  const std::int64_t head = token * num_tokens;
+  return {head * num_heads, head, token};
+}
+
+// Strides of contiguous operands, the layout kernels assume when given no
+// strides: queries and output have num_queries tokens, keys and values
+// num_keys.
+constexpr AttentionStrides contiguous_strides(int num_heads, int num_queries, int num_keys, int head_dim) {
+  const TensorStrides query_strides = contiguous_tensor_strides(num_heads, num_queries, head_dim);
+  const TensorStrides key_strides = contiguous_tensor_strides(num_heads, num_keys, head_dim);
+  return {query_strides, key_strides, key_strides, query_strides};
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
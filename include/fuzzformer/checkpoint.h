@@ -0,0 +1,28 @@
+#pragma once
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include <torch/torch.h>
+
+#include <string>
+
+namespace fuzzformer {
+
+// Parameters by name, as returned by Module::named_parameters().
+using ParameterDict = torch::OrderedDict<std::string, torch::Tensor>;
+
+// Upgrades parameters saved before the fused QKV projection. Every
+// "<prefix>q_proj.<leaf>", "<prefix>k_proj.<leaf>", "<prefix>v_proj.<leaf>"
+// triple becomes one "<prefix>qkv_proj.<leaf>", concatenated in q, k, v
+// order along the output dimension. Other entries pass through unchanged.
+ParameterDict fuse_legacy_qkv(const ParameterDict& parameters);
+
+// Copies parameters into module by name, after fuse_legacy_qkv, so both
+// current and pre-fusion checkpoints load. Every parameter of module must be
+// present with a matching shape. Throws on a module with int8 weights (see
+// quantize_weights), whose layers have no parameters to load.
+void load_parameters(torch::nn::Module& module, const ParameterDict& parameters);
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+namespace fuzzformer {
+namespace kernels {
+
+// Head dims with compile-time specialised tile kernels in every table.
+inline constexpr int kSpecializedHeadDims[] = {32, 64, 96, 128, 256};
+
+// Key-tile loops of the tiled forward. Specialised entries have head_dim
+// fixed at compile time, so the loops fully unroll, several keys share each
+// load of the query row and the output row stays in registers across the
+// tile; they ignore their head_dim argument.
+struct CpuTileKernels {
+  // 0 for the generic entry.
+  int head_dim;
+  // scores[j] = scale * (q . keys[j]) over num_keys contiguous key rows.
+  void (*scores)(const float* q, const float* keys, int num_keys, int head_dim, float scale, float* scores);
+  // out += sum_j weights[j] * values[j] over num_keys contiguous value rows.
+  void (*accumulate)(const float* weights, const float* values, int num_keys, int head_dim, float* out);
+};
+
+enum class CpuIsa {
+  kScalar = 0,
+  kAvx2,
+  kAvx512,
+  // The AVX-512 table with int8 scores on AVX-512 VNNI (vpdpbusd).
+  kAvx512Vnni,
+  // The VNNI table with bfloat16 rounding on AVX512-BF16 (vcvtneps2bf16).
+  kAvx512Bf16,
+};
+
+// Inner loops of the CPU fuzzy attention kernels for one instruction set.
+struct CpuKernelTable {
+  CpuIsa isa;
+  const char* name;
+  // Returns sum(a[i] * b[i]) over n elements.
+  float (*dot)(const float* a, const float* b, int n);
+  // Writes out[i] = exp(-alpha * (scores[i] - beta)^2) and returns sum(out).
+  float (*membership)(const float* scores, int count, float alpha, float beta, float* out);
+  // membership with exp read from membership_table() (see membershipTable.h).
+  float (*membership_lookup)(const float* scores, int count, float alpha, float beta, float* out);
+  // The compact memberships of membership.h, out[i] = max(0, 1 - alpha |d|)
+  // and clamp(2 - 2 alpha |d|, 0, 1) with d = scores[i] - beta; each returns
+  // sum(out).
+  float (*membership_triangular)(const float* scores, int count, float alpha, float beta, float* out);
+  float (*membership_trapezoidal)(const float* scores, int count, float alpha, float beta, float* out);
+  // y[i] += a * x[i].
+  void (*axpy)(float a, const float* x, float* y, int n);
+  // n elements between float and the 16-bit storage types of storageType.h,
+  // with the results of its scalar conversions.
+  void (*widen_half)(const std::uint16_t* in, int n, float* out);
+  void (*narrow_half)(const float* in, int n, std::uint16_t* out);
+  void (*widen_bfloat16)(const std::uint16_t* in, int n, float* out);
+  void (*narrow_bfloat16)(const float* in, int n, std::uint16_t* out);
+  // Symmetric int8 quantisation of n floats: out[i] = round(in[i] / s) with
+  // s = max|in| / 127, which is returned (0 for an all-zero row), and
+  // *sum = sum(out).
+  float (*quantize_int8)(const float* in, int n, std::int8_t* out, std::int32_t* sum);
+  // scores[j] = q_scale * key_scales[j] * (q . keys[j]) over num_keys int8
+  // key rows head_dim apart, the dot products exact in int32. key_sums[j] is
+  // the sum quantize_int8 returned for keys[j]; VNNI kernels need it to
+  // multiply q + 128 as unsigned bytes.
+  void (*quantized_scores)(const std::int8_t* q, float q_scale, const std::int8_t* keys, const float* key_scales,
+                           const std::int32_t* key_sums, int num_keys, int head_dim, float* scores);
+  // out[i] = in[i] * scale over n int8 elements, the inverse of
+  // quantize_int8; every table rounds once, as the scalar one does.
+  void (*dequantize_int8)(const std::int8_t* in, int n, float scale, float* out);
+  // Tile kernels for any head_dim, built on dot and axpy.
+  CpuTileKernels generic_tiles;
+  // One entry per kSpecializedHeadDims, in the same order.
+  const CpuTileKernels* specialized_tiles;
+};
+
+// The specialised tile kernels for head_dim, or table.generic_tiles when
+// head_dim has none.
+const CpuTileKernels& select_tile_kernels(const CpuKernelTable& table, int head_dim);
+
+// Widest instruction set both compiled in and reported by CPUID.
+CpuIsa detect_cpu_isa();
+
+// Table for `isa`, or nullptr when it was not compiled in or the CPU lacks it.
+const CpuKernelTable* cpu_kernel_table(CpuIsa isa);
+
+// Table used by the CPU kernels. Defaults to detect_cpu_isa(), overridable
+// with FUZZFORMER_CPU_ISA=scalar|avx2|avx512|avx512vnni|avx512bf16 or
+// set_cpu_isa().
+const CpuKernelTable& active_cpu_kernels();
+
+// Returns false, leaving the selection unchanged, if `isa` is unavailable.
+bool set_cpu_isa(CpuIsa isa);
+
+std::string_view to_string(CpuIsa isa);
+
+}  // namespace kernels
+}  // namespace fuzzformer
@@ -6,13 +6,238 @@
 #include "fuzzformer/torchStub.h"
 #endif
 
+#include <vector>
+
+#include "fuzzformer/membership.h"
+
 namespace fuzzformer {
 
+namespace metrics {
+class MetricsCollector;
+}  // namespace metrics
+
+enum class FuzzyAttentionForwardMode {
+  // Tiled on CPU, fused on CUDA.
+  kAuto = 0,
+  // Sweeps the keys once for the row normaliser and again to accumulate V.
+  kTwoPass,
+  // Accumulates membership * V and the normaliser in one sweep, then divides.
+  kFused,
+  // Fused, with K/V streamed in cache-sized tiles shared by a block of
+  // queries. CPU only; CUDA runs the fused kernel.
+  kTiled,
+};
+
+enum class FuzzyAttentionBackwardMode {
+  // No atomics: per-thread partials with a fixed tree reduction on CPU,
+  // row-major then key-major passes on CUDA. Bitwise reproducible for a fixed
+  // thread count.
+  kDeterministic = 0,
+  // CUDA kernel scattering dK, dV, d_alpha and d_beta with atomicAdd; the
+  // CUDA default. CPU tensors always take the deterministic path.
+  kAtomic,
+};
+
+// Axis order of the queries, keys, values and output of the dense forward.
+enum class FuzzyAttentionLayout {
+  // [batch, heads, seq_len, head_dim].
+  kBHSD = 0,
+  // [batch, seq_len, heads, head_dim], the order a [batch, seq_len, model_dim]
+  // projection splits into. The output is contiguous in this order, so it
+  // views as [batch, seq_len, model_dim] without a copy.
+  kBSHD,
+};
+
+struct FuzzyAttentionOptions {
+  FuzzyAttentionForwardMode forward_mode = FuzzyAttentionForwardMode::kAuto;
+  FuzzyAttentionBackwardMode backward_mode = FuzzyAttentionBackwardMode::kAtomic;
+  // Run the kernels compiled for a fixed head_dim when head_dim is one of
+  // them: 32, 64, 96, 128 or 256 for the tiled CPU forward, 32 or 64 for both
+  // CUDA forwards. Other head dims, or false, take the generic kernels.
+  bool specialize_head_dim = true;
+  // Key pruning, off (and exact) at 0. When in (0, 1), the tiled CPU and
+  // fused CUDA forwards skip any block of kernels::kPruneBlockKeys keys whose
+  // memberships are all provably below prune_epsilon for a query, using a
+  // Cauchy-Schwarz bound on the scores (see kernels::KeyPruning). This is
+  // approximate: each skipped block moves a row's normaliser by less than
+  // kPruneBlockKeys * prune_epsilon. Other forward modes ignore it.
+  float prune_epsilon = 0.0f;
+  // Optional. When pruning, receives the counters
+  // "fuzzy_attention.key_blocks" (query x key block pairs examined) and
+  // "fuzzy_attention.pruned_key_blocks" (pairs skipped). On CUDA, reading
+  // them back synchronises the stream.
+  metrics::MetricsCollector* metrics = nullptr;
+  // Layout of the forward's queries, keys, values and output. In either
+  // layout the inputs may be strided views, such as slices of a fused QKV
+  // projection, as long as head_dim is unit-stride; the forward reads them
+  // in place instead of copying them to a contiguous buffer.
+  FuzzyAttentionLayout layout = FuzzyAttentionLayout::kBHSD;
+  // Split-K for the decode forwards (fuzzy_attention_forward_cached and
+  // fuzzy_attention_forward_paged). With only a few query rows per head the
+  // key range of each row is cut into key_splits chunks that run in
+  // parallel, and their partial normalisers and weighted sums are added
+  // before the one division. 0 splits automatically when the rows alone
+  // cannot occupy the CPU thread pool or the GPU and the keys are long
+  // enough (see kernels::choose_key_splits); 1 never splits.
+  int key_splits = 0;
+  // Membership function of every forward and of the backward. Compact ones
+  // (triangular, trapezoidal) skip keys outside their support; the Gaussian
+  // table trades bounded error for the exp (see membership.h).
+  FuzzyMembership membership = FuzzyMembership::kGaussian;
+  // Inference only: score the tiled CPU forward with int8 queries and keys
+  // (see kernels::CpuTileConfig::int8_scores). Rejected when a context is
+  // saved for the backward; other modes and CUDA ignore it.
+  bool int8_scores = false;
+};
+
+// Keys hidden from each query. Every mask hides a prefix and/or a suffix of
+// the key sequence, so kernels shorten their loops instead of zeroing
+// memberships; causal attention does roughly half the work of the unmasked
+// case, and a window of W keys makes it linear in seq_len. With num_queries
+// queries over num_keys keys, query i sits at position
+// i + num_keys - num_queries, aligning the queries with the last keys; below
+// i stands for that position.
+struct FuzzyAttentionMask {
+  // Query i only attends to keys j <= i.
+  bool causal = false;
+  // Optional integer tensor of shape [batch]: keys at positions
+  // >= key_lengths[b] are padding for sequence b.
+  torch::Tensor key_lengths;
+  // Sliding (local) attention: when positive, query i only attends to keys
+  // j > i - window. Requires causal.
+  int64_t window = 0;
+};
+
+// Queries are [batch, heads, num_queries, head_dim] and keys and values
+// [batch, kv_heads, num_keys, head_dim] (token-major under kBSHD), so queries
+// can attend over a memory of a different length, e.g. a few queries over
+// thousands of encoder tokens. The output has the queries' shape.
+//
+// kv_heads must divide heads; query head h reads K/V head
+// h / (heads / kv_heads). Fewer K/V heads than query heads is grouped-query
+// attention (one K/V head is multi-query attention) and shrinks the keys and
+// values, and so a KV cache and its bandwidth, by that group factor. The
+// same holds for the varlen, cached and paged forwards below.
+//
+// Queries, keys and values share one dtype, float32, float16 or bfloat16,
+// and the output takes it too. Scores, normalisers and accumulators are
+// float32 whatever the dtype. The tiled CPU forward (kAuto and kTiled) reads
+// 16-bit operands in place and widens each tile as it packs it, halving its
+// memory traffic; so does the CUDA fused forward (every mode but kTwoPass),
+// widening each element as it loads it. The other modes run on float32
+// copies. The backward of a 16-bit forward returns query, key and value
+// gradients in that dtype; on the CPU it reads the 16-bit context in place,
+// while CUDA differentiates float32 copies of it.
 torch::Tensor fuzzy_attention_forward(const torch::Tensor& queries,
                                       const torch::Tensor& keys,
                                       const torch::Tensor& values,
                                       const torch::Tensor& alpha,
-                                      const torch::Tensor& beta);
+                                      const torch::Tensor& beta,
+                                      const FuzzyAttentionOptions& options = {},
+                                      const FuzzyAttentionMask& mask = {});
+
+// Packed variable-length batch: the tokens of every sequence are
+// concatenated, so queries are [total_tokens, heads, head_dim], keys and
+// values [total_tokens, kv_heads, head_dim], and sequence i owns rows
+// [cu_seqlens[i], cu_seqlens[i + 1]). cu_seqlens is an integer tensor of
+// shape [num_seqs + 1] starting at 0. Sequences only attend within
+// themselves and no work is spent on padding. window is
+// FuzzyAttentionMask::window, membership FuzzyAttentionOptions::membership
+// and int8_scores FuzzyAttentionOptions::int8_scores (CPU only). Returns
+// [total_tokens, heads, head_dim]. Forward only.
+torch::Tensor fuzzy_attention_forward_varlen(const torch::Tensor& queries,
+                                             const torch::Tensor& keys,
+                                             const torch::Tensor& values,
+                                             const torch::Tensor& cu_seqlens,
+                                             const torch::Tensor& alpha,
+                                             const torch::Tensor& beta,
+                                             bool causal = false,
+                                             int64_t window = 0,
+                                             FuzzyMembership membership = FuzzyMembership::kGaussian,
+                                             bool int8_scores = false);
+
+// Attention for incremental decoding. The queries are the num_queries newest
+// tokens of each sequence, and keys/values hold all num_keys tokens seen so
+// far, those included; query i sits at position num_keys - num_queries + i
+// and attends causally up to it, or to its last window keys when window is
+// positive. Shapes follow options.layout with seq_len num_queries for
+// queries and the output, and num_keys for keys and values, which may be
+// views of a larger cache (see KVCache). With num_positions > 0, keys and
+// values are instead rings of R rows holding position p at row p % R, and
+// num_positions takes the place of num_keys; the ring must still hold every
+// position the queries see. As in fuzzy_attention_forward, 16-bit operands
+// are read in place and the output takes their dtype. Only layout,
+// specialize_head_dim, key_splits and membership are read from options.
+// Forward only.
+torch::Tensor fuzzy_attention_forward_cached(const torch::Tensor& queries,
+                                             const torch::Tensor& keys,
+                                             const torch::Tensor& values,
+                                             const torch::Tensor& alpha,
+                                             const torch::Tensor& beta,
+                                             const FuzzyAttentionOptions& options = {},
+                                             int64_t window = 0,
+                                             int64_t num_positions = 0);
+
+// fuzzy_attention_forward_cached over a paged cache (see PagedKVCache).
+// Keys and values live in contiguous [num_blocks, kv_heads, block_size,
+// head_dim] pools; key j of sequence b is row j % block_size of pool block
+// block_tables[b, j / block_size]. seq_lengths[b] counts the cached tokens of
+// sequence b, its num_queries new ones included, so sequences of different
+// lengths share one call. block_tables is an integer [batch, max_blocks]
+// tensor and seq_lengths an integer [batch] tensor; both are validated only
+// when on the CPU. Queries follow options.layout and share their dtype with
+// the pools. Forward only.
+torch::Tensor fuzzy_attention_forward_paged(const torch::Tensor& queries,
+                                            const torch::Tensor& key_pool,
+                                            const torch::Tensor& value_pool,
+                                            const torch::Tensor& block_tables,
+                                            const torch::Tensor& seq_lengths,
+                                            const torch::Tensor& alpha,
+                                            const torch::Tensor& beta,
+                                            const FuzzyAttentionOptions& options = {});
+
+// Linearised approximation of fuzzy_attention_forward for very long
+// contexts. Each head's membership is replaced by a polynomial of order
+// orders[h] in the score, fitted over the score range of that head (see
+// kernels::fit_membership_polynomial), which turns attention into inner
+// products of order-p feature maps of q and k: O(n * head_dim^p * head_dim)
+// instead of O(n^2 * head_dim). Higher orders are more accurate and cost
+// more; order 0 keeps a head on the exact kernel, so sharp heads can stay
+// exact while broad ones go linear. orders holds one entry per head or one
+// for all heads, each in [0, kernels::kMaxLinearOrder]; orders whose
+// running sums would pass 1 GiB are rejected (see kMaxLinearOrder). Causal
+// and key_lengths masks are supported, sliding windows only on exact heads.
+// The polynomial can dip below zero far from beta, so a row's approximate
+// normaliser can vanish where the exact one does not; such rows produce
+// zeros. The polynomial is fitted to the Gaussian, so other memberships
+// need order 0 on every head. Reads options.layout, and the rest of options
+// for exact heads. Forward only.
+torch::Tensor fuzzy_attention_forward_linear(const torch::Tensor& queries,
+                                             const torch::Tensor& keys,
+                                             const torch::Tensor& values,
+                                             const torch::Tensor& alpha,
+                                             const torch::Tensor& beta,
+                                             const std::vector<int>& orders,
+                                             const FuzzyAttentionOptions& options = {},
+                                             const FuzzyAttentionMask& mask = {});
+
+// Hyperparameter sweep: fuzzy_attention_forward for P candidate (alpha,
+// beta) settings in one call. alpha and beta are [P, heads], and entry p of
+// the [P, ...] result equals fuzzy_attention_forward with alpha[p] and
+// beta[p], each in the queries' shape and options.layout. The scores q.k are
+// computed once per query and key and shared by all candidates (on CUDA, by
+// each tile of candidates whose accumulators fit in shared memory), so Q and
+// K are read once instead of P times; only the memberships and the weighted
+// sums are repeated. Masks and grouped K/V heads work as in the dense
+// forward. Reads options.layout, specialize_head_dim and membership; no
+// pruning. Forward only.
+torch::Tensor fuzzy_attention_forward_sweep(const torch::Tensor& queries,
+                                            const torch::Tensor& keys,
+                                            const torch::Tensor& values,
+                                            const torch::Tensor& alpha,
+                                            const torch::Tensor& beta,
+                                            const FuzzyAttentionOptions& options = {},
+                                            const FuzzyAttentionMask& mask = {});
 
 struct FuzzyAttentionContext {
   torch::Tensor queries;
@@ -20,11 +245,36 @@ struct FuzzyAttentionContext {
   torch::Tensor values;
   torch::Tensor alpha;
   torch::Tensor beta;
+  // Optional forward statistics. The backward takes sum_j w_ij * (g_i . v_j)
+  // as g_i . output_i; on CUDA, with both defined, it also reads the row
+  // normaliser from row_norms ([batch, heads, num_queries]).
+  torch::Tensor row_norms;
+  torch::Tensor output;
+  // Mask applied in the forward; the backward honours the same one.
+  FuzzyAttentionMask mask;
+  // Layout of the tensors above (row_norms is always
+  // [batch, heads, num_queries]). The backward takes grad_out and returns
+  // d_queries, d_keys and d_values in the same layout.
+  FuzzyAttentionLayout layout = FuzzyAttentionLayout::kBHSD;
+  // Membership of the forward; the backward differentiates the same one.
+  FuzzyMembership membership = FuzzyMembership::kGaussian;
 };
 
+// Forward that also records the row normalisers. The returned context holds
+// the inputs, row_norms and the attention output (context.output). Throws if
+// options.int8_scores is set.
+FuzzyAttentionContext fuzzy_attention_forward_with_context(const torch::Tensor& queries,
+                                                           const torch::Tensor& keys,
+                                                           const torch::Tensor& values,
+                                                           const torch::Tensor& alpha,
+                                                           const torch::Tensor& beta,
+                                                           const FuzzyAttentionOptions& options = {},
+                                                           const FuzzyAttentionMask& mask = {});
+
 std::vector<torch::Tensor> fuzzy_attention_backward(
     const torch::Tensor& grad_out,
-    const FuzzyAttentionContext& context);
+    const FuzzyAttentionContext& context,
+    const FuzzyAttentionOptions& options = {});
 
 }  // namespace fuzzformer
 
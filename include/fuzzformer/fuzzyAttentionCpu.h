@@ -0,0 +1,329 @@
+#pragma once
+
+#include "fuzzformer/attentionStrides.h"
+#include "fuzzformer/keyPruning.h"
+#include "fuzzformer/keySplits.h"
+#include "fuzzformer/membership.h"
+#include "fuzzformer/storageType.h"
+
+namespace fuzzformer {
+namespace kernels {
+
+// Query and key block sizes for the tiled CPU forward. A key tile's K and V
+// rows are sized to stay resident in L2 while a query tile, whose rows double
+// as the output accumulators, stays in L1.
+struct CpuTileConfig {
+  int query_block;
+  int key_block;
+  // Use the compile-time head_dim tile kernels when head_dim has one (see
+  // select_tile_kernels); otherwise always the generic loops.
+  bool specialize_head_dim = true;
+  // Key chunks per query row in the decode forwards (cached and paged), see
+  // choose_key_splits: 0 picks them from the thread pool size, 1 disables
+  // split-K. Other forwards ignore it.
+  int key_splits = 0;
+  // Score the tiled and varlen forwards with per-row int8 queries and keys
+  // and int32 dot products (VNNI where available). Decode forwards ignore it.
+  bool int8_scores = false;
+};
+
+CpuTileConfig choose_cpu_tiles(int head_dim);
+
+// Host counterpart of launch_fuzzy_attention_forward: float32 [batch, heads,
+// tokens, head_dim] buffers, contiguous unless strides is given, with rows
+// split across the runtime::ThreadPool. Masked keys are skipped, not zeroed.
+void fuzzy_attention_forward_cpu(const float* queries,
+                                 const float* keys,
+                                 const float* values,
+                                 const float* alpha,
+                                 const float* beta,
+                                 FuzzyMembership membership,
+                                 float* output,
+                                 float* row_norms,
+                                 const int* key_lengths,
+                                 bool causal,
+                                 int window,
+                                 int batch_size,
+                                 int num_heads,
+                                 int num_queries,
+                                 int num_keys,
+                                 int head_dim,
+                                 const AttentionStrides* strides);
+
+// Single sweep over the keys: accumulates membership * V together with the
+// normaliser and divides once per row.
+void fuzzy_attention_forward_fused_cpu(const float* queries,
+                                       const float* keys,
+                                       const float* values,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       float* row_norms,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const AttentionStrides* strides);
+
+// Cache-blocked variant of the fused forward: each worker owns a block of
+// queries from one (batch, head) and streams K/V through it one key tile at a
+// time, so every tile is read from memory once per query block instead of
+// once per query. With a non-null pruning, key blocks whose memberships are
+// all provably below pruning->epsilon are skipped per query (see KeyPruning);
+// with a compact membership and epsilon 0 that skips exactly the blocks
+// outside its support. The block bounds are computed here in one pass over
+// the keys, so pruning->centroids and radii are not read.
+void fuzzy_attention_forward_tiled_cpu(const float* queries,
+                                       const float* keys,
+                                       const float* values,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       float* row_norms,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const CpuTileConfig& tiles,
+                                       const KeyPruning* pruning,
+                                       const AttentionStrides* strides);
+
+// The tiled forward over 16-bit storage: queries, keys, values and output
+// are IEEE half or bfloat16 elements as `storage` says (kFloat16 or
+// kBFloat16), with strides counting elements. Each query block and K/V tile
+// is widened to float as it is packed, so scores, normalisers and
+// accumulators stay float32 and only the memory traffic is halved; every
+// output element is rounded once. Row norms are float32.
+void fuzzy_attention_forward_tiled_cpu(const std::uint16_t* queries,
+                                       const std::uint16_t* keys,
+                                       const std::uint16_t* values,
+                                       StorageType storage,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       std::uint16_t* output,
+                                       float* row_norms,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const CpuTileConfig& tiles,
+                                       const KeyPruning* pruning,
+                                       const AttentionStrides* strides);
+
+// Parameter sweep: the tiled forward for num_params candidate (alpha, beta)
+// settings at once, without pruning. alpha and beta are [num_params,
+// num_heads], and candidate p writes its output at output + p * param_stride,
+// addressed through strides like the output of a single forward. Each query
+// row's scores against a key tile are computed once and reused by every
+// candidate, so Q and K are read once rather than num_params times.
+void fuzzy_attention_forward_sweep_cpu(const float* queries,
+                                       const float* keys,
+                                       const float* values,
+                                       const float* alpha,
+                                       const float* beta,
+                                       int num_params,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       std::int64_t param_stride,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const CpuTileConfig& tiles,
+                                       const AttentionStrides* strides);
+
+// Packed variable-length forward. Sequences are concatenated along the
+// token axis of head-major [heads, total_tokens, head_dim] buffers, so every
+// (sequence, head) slice is contiguous. Sequence i owns tokens
+// [cu_seqlens[i], cu_seqlens[i + 1]) and attends only within itself. Each
+// (sequence, head, query block) is a separate work item, so no work is spent
+// on padding. Keys and values have num_kv_heads heads, which must divide
+// num_heads; query head h reads K/V head h / (num_heads / num_kv_heads).
+void fuzzy_attention_forward_varlen_cpu(const float* queries,
+                                        const float* keys,
+                                        const float* values,
+                                        const float* alpha,
+                                        const float* beta,
+                                        FuzzyMembership membership,
+                                        float* output,
+                                        const int* cu_seqlens,
+                                        bool causal,
+                                        int window,
+                                        int num_seqs,
+                                        int num_heads,
+                                        int num_kv_heads,
+                                        int head_dim,
+                                        const CpuTileConfig& tiles);
+
+// Forward for incremental decoding: the num_queries newest tokens of each
+// sequence attend over num_keys cached keys and values that already include
+// them. Query i sits at position num_keys - num_queries + i and sees keys up
+// to and including that position, and only the last window of them when
+// window > 0. Operands are [batch, heads, tokens, head_dim] addressed
+// through strides, so queries and output can be strided projection slices
+// while keys and values live in a larger cache buffer. With ring_rows > 0
+// the key and value buffers are rings of that many rows holding position p
+// at row p % ring_rows; every position a query sees must still be there.
+void fuzzy_attention_forward_cached_cpu(const float* queries,
+                                        const float* keys,
+                                        const float* values,
+                                        const float* alpha,
+                                        const float* beta,
+                                        FuzzyMembership membership,
+                                        float* output,
+                                        int batch_size,
+                                        int num_heads,
+                                        int num_queries,
+                                        int num_keys,
+                                        int head_dim,
+                                        int window,
+                                        int ring_rows,
+                                        const CpuTileConfig& tiles,
+                                        const AttentionStrides& strides);
+
+// The cached forward over 16-bit queries, keys, values and output, widened
+// and rounded as in the 16-bit tiled forward.
+void fuzzy_attention_forward_cached_cpu(const std::uint16_t* queries,
+                                        const std::uint16_t* keys,
+                                        const std::uint16_t* values,
+                                        StorageType storage,
+                                        const float* alpha,
+                                        const float* beta,
+                                        FuzzyMembership membership,
+                                        std::uint16_t* output,
+                                        int batch_size,
+                                        int num_heads,
+                                        int num_queries,
+                                        int num_keys,
+                                        int head_dim,
+                                        int window,
+                                        int ring_rows,
+                                        const CpuTileConfig& tiles,
+                                        const AttentionStrides& strides);
+
+// Incremental forward over a paged KV cache. Keys and values live in
+// [num_blocks, num_kv_heads, block_size, head_dim] pools, shared by query
+// heads as in the varlen forward; logical key j of sequence
+// b is row j % block_size of pool block block_tables[b * max_blocks + j /
+// block_size]. seq_lengths[b] counts the cached keys of sequence b,
+// including its num_queries newest tokens, and query i of sequence b sits at
+// position seq_lengths[b] - num_queries + i. Queries and output are
+// [batch, heads, num_queries, head_dim] addressed through their strides.
+// Key tiles are one pool block each; tiles.key_block is ignored.
+void fuzzy_attention_forward_paged_cpu(const float* queries,
+                                       const float* key_pool,
+                                       const float* value_pool,
+                                       const int* block_tables,
+                                       const int* seq_lengths,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_kv_heads,
+                                       int num_queries,
+                                       int head_dim,
+                                       int block_size,
+                                       int max_blocks,
+                                       const CpuTileConfig& tiles,
+                                       const TensorStrides& query_strides,
+                                       const TensorStrides& output_strides);
+
+// The paged forward over 16-bit queries, pools and output.
+void fuzzy_attention_forward_paged_cpu(const std::uint16_t* queries,
+                                       const std::uint16_t* key_pool,
+                                       const std::uint16_t* value_pool,
+                                       StorageType storage,
+                                       const int* block_tables,
+                                       const int* seq_lengths,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       std::uint16_t* output,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_kv_heads,
+                                       int num_queries,
+                                       int head_dim,
+                                       int block_size,
+                                       int max_blocks,
+                                       const CpuTileConfig& tiles,
+                                       const TensorStrides& query_strides,
+                                       const TensorStrides& output_strides);
+
+// Backward without atomics: (batch, head, query chunk) items write private
+// dK/dV partials (at most 256 MiB in all) summed by a fixed pairwise tree,
+// so gradients are bitwise reproducible for a fixed thread count. With the
+// forward's saved_output non-null, sum_j w_ij * (g_i . v_j) is read off it.
+// Buffers are contiguous, shaped and masked as for
+// fuzzy_attention_forward_cpu; d_keys and d_values take the keys' shape.
+void fuzzy_attention_backward_cpu(const float* grad_out,
+                                  const float* queries,
+                                  const float* keys,
+                                  const float* values,
+                                  const float* alpha,
+                                  const float* beta,
+                                  FuzzyMembership membership,
+                                  const float* saved_output,
+                                  const int* key_lengths,
+                                  bool causal,
+                                  int window,
+                                  float* d_queries,
+                                  float* d_keys,
+                                  float* d_values,
+                                  float* d_alpha,
+                                  float* d_beta,
+                                  int batch_size,
+                                  int num_heads,
+                                  int num_queries,
+                                  int num_keys,
+                                  int head_dim);
+
+// The backward over a 16-bit gradient, operands, saved output (or null) and
+// query, key and value gradients, all `storage`; dK and dV are summed in
+// float32 before they are rounded.
+void fuzzy_attention_backward_cpu(const std::uint16_t* grad_out,
+                                  const std::uint16_t* queries,
+                                  const std::uint16_t* keys,
+                                  const std::uint16_t* values,
+                                  StorageType storage,
+                                  const float* alpha,
+                                  const float* beta,
+                                  FuzzyMembership membership,
+                                  const std::uint16_t* saved_output,
+                                  const int* key_lengths,
+                                  bool causal,
+                                  int window,
+                                  std::uint16_t* d_queries,
+                                  std::uint16_t* d_keys,
+                                  std::uint16_t* d_values,
+                                  float* d_alpha,
+                                  float* d_beta,
+                                  int batch_size,
+                                  int num_heads,
+                                  int num_queries,
+                                  int num_keys,
+                                  int head_dim);
+
+}  // namespace kernels
+}  // namespace fuzzformer
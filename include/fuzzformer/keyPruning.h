@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+namespace fuzzformer {
+namespace kernels {
+
+// Keys per pruning block. Small enough that a block's scores stay close
+// together, large enough that the per-block bound test (one head_dim dot
+// product) is cheap next to the block's own dot products.
+constexpr int kPruneBlockKeys = 32;
+
+// The centroid score, the radius and the scores they bound are all rounded
+// float sums, so before the gap is compared with the cutoff the interval is
+// widened by this fraction of |q.c| + |q| r, well above the rounding error
+// of a head_dim-term dot product.
+constexpr float kPruneRelativeSlack = 1e-4f;
+
+// Exact membership-bound key pruning. Each block of kPruneBlockKeys keys is
+// summarised by its centroid c and radius r = max_j |k_j - c|. By
+// Cauchy-Schwarz every score in the block satisfies
+//
+//   |q.k_j - q.c| <= |q| r,
+//
+// so the block's scores lie in [q.c - |q| r, q.c + |q| r] / head_dim. When
+// beta is at distance g outside that interval, every membership in the block
+// is at most its value at g (exp(-alpha g^2) for the Gaussian), and the
+// block is skipped for that query once g passes the membership's cutoff for
+// epsilon. A skipped block changes a row's normaliser by less than
+// kPruneBlockKeys * epsilon. Compact memberships are exactly zero past
+// their cutoff for epsilon 0, so with them epsilon may be 0 and skipping is
+// lossless.
+struct KeyPruning {
+  // [batch * heads, num_blocks, head_dim] block centroids and
+  // [batch * heads, num_blocks] radii, num_blocks = ceil(seq_len / kPruneBlockKeys),
+  // for the CUDA forwards; the tiled CPU forward bounds the blocks itself.
+  const float* centroids = nullptr;
+  const float* radii = nullptr;
+  // In [0, 1). Blocks whose membership bound is below it are skipped; 0
+  // only skips blocks outside a compact membership's support.
+  float epsilon = 0.0f;
+  // Optional. counts[0] is incremented by the (query, key block) pairs
+  // examined and counts[1] by the pairs skipped.
+  std::int64_t* counts = nullptr;
+};
+
+}  // namespace kernels
+}  // namespace fuzzformer
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace fuzzformer {
+namespace kernels {
+
+// Upper bound on split-K chunks per query row; the merge reads every
+// chunk's partial output row.
+constexpr int kMaxKeySplits = 64;
+
+// Split-K for the decode forwards. A decode step has one or a few query rows
+// per (batch, head), too few to occupy the hardware when rows are the unit
+// of work. The fuzzy normaliser and the membership-weighted sum of values
+// are plain sums over keys, so the key range can be cut into chunks that run
+// in parallel and whose partial sums merge exactly. Returns how many chunks
+// to cut num_keys into when row_tasks independent row tasks run on hardware
+// with room for parallelism concurrent tasks: 1 when the rows already fill
+// it, otherwise enough chunks to fill it, each at least min_split_keys long.
+inline int choose_key_splits(std::int64_t row_tasks,
+                             int num_keys,
+                             std::int64_t parallelism,
+                             int min_split_keys) {
+  if (row_tasks <= 0 || row_tasks >= parallelism) {
+    return 1;
+  }
+  const std::int64_t wanted = (parallelism + row_tasks - 1) / row_tasks;
+  const std::int64_t possible = num_keys / std::max(1, min_split_keys);
+  return static_cast<int>(std::clamp<std::int64_t>(std::min(wanted, possible), 1, kMaxKeySplits));
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
@@ -0,0 +1,77 @@
+#pragma once
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "fuzzformer/modelConfig.h"
+
+namespace fuzzformer {
+
+// Keys and values of every layer for a batch of sequences decoded in
+// lockstep, so each new token only projects and attends its own rows instead
+// of recomputing the whole prefix. Every layer owns a
+// [batch, kv_heads, capacity, head_dim] key buffer and a matching value
+// buffer, kv_heads being ModelConfig::kv_heads(); the first length()
+// positions of each are valid.
+//
+// Layers with a sliding window W (ModelConfig::attention_windows) only ever
+// look back W - 1 positions, so they keep a ring of R rows instead, position
+// p living at row p % R. R is W, except that appending n tokens at once
+// grows it to W + n - 1 until advance(), so a windowed layer costs O(W)
+// memory between steps however long the sequence or prompt, and capacity
+// only bounds the other layers.
+class KVCache {
+ public:
+  KVCache(const ModelConfig& config,
+          std::int64_t batch_size,
+          std::int64_t capacity,
+          const torch::TensorOptions& options = {});
+
+  [[nodiscard]] std::size_t num_layers() const { return keys_.size(); }
+  [[nodiscard]] std::int64_t batch_size() const { return batch_size_; }
+  [[nodiscard]] std::int64_t capacity() const { return capacity_; }
+  // Positions cached in every layer.
+  [[nodiscard]] std::int64_t length() const { return length_; }
+  // Sliding window of layer, 0 when it keeps every position.
+  [[nodiscard]] std::int64_t window(std::size_t layer) const;
+
+  // Cached keys and values of layer, [batch, kv_heads, length(), head_dim]
+  // views, or the whole [batch, kv_heads, R, head_dim] rings of a windowed layer.
+  [[nodiscard]] torch::Tensor keys(std::size_t layer) const;
+  [[nodiscard]] torch::Tensor values(std::size_t layer) const;
+
+  // Writes [batch, kv_heads, n, head_dim] keys and values (any strides) of layer
+  // at positions [length(), length() + n) and returns views of positions
+  // [0, length() + n), or the rings of a windowed layer, which then hold at
+  // least the last W + n - 1 of those positions. length() itself only moves
+  // with advance(), once every layer has appended the same n tokens.
+  std::pair<torch::Tensor, torch::Tensor> append(std::size_t layer,
+                                                 const torch::Tensor& keys,
+                                                 const torch::Tensor& values);
+
+  // Moves length() by num_tokens and shrinks grown rings back to W rows.
+  void advance(std::int64_t num_tokens);
+
+  // Forgets every cached position; the buffers are kept.
+  void reset() { length_ = 0; }
+
+ private:
+  std::int64_t batch_size_;
+  std::int64_t capacity_;
+  std::int64_t length_ = 0;
+  // Whether any layer is unwindowed, and so bounded by capacity_.
+  bool bounded_ = false;
+  std::vector<std::int64_t> windows_;
+  std::vector<torch::Tensor> keys_;
+  std::vector<torch::Tensor> values_;
+};
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cmath>
+
+#include "fuzzformer/attentionStrides.h"
+#include "fuzzformer/membershipTable.h"
+
+namespace fuzzformer {
+
+// Membership of a key in a query's fuzzy set, as a function of the distance
+// diff = s - beta of its score s from the head's centre beta. alpha sets the
+// sharpness in every case; the compact ones are exactly zero beyond a finite
+// |diff|, so keys beyond that never reach the output.
+enum class FuzzyMembership {
+  // exp(-alpha diff^2).
+  kGaussian = 0,
+  // max(0, 1 - alpha |diff|).
+  kTriangular,
+  // clamp(2 - 2 alpha |diff|, 0, 1): 1 up to |diff| = 1 / (2 alpha), then a
+  // linear ramp down to 0 at 1 / alpha.
+  kTrapezoidal,
+  // exp(-alpha diff^2) read from the shared lookup table of
+  // membershipTable.h, within membership_table_error_bound() of kGaussian
+  // and 0 once alpha diff^2 >= kMembershipTableRange. The CPU kernels swap
+  // an exp per (query, key) pair for two table reads.
+  kGaussianTable,
+};
+
+// True for the memberships that vanish for large |diff|: outside
+// [beta - 1 / alpha, beta + 1 / alpha] for the triangle and the trapezoid,
+// and once alpha diff^2 reaches kMembershipTableRange for the table.
+constexpr bool has_compact_support(FuzzyMembership membership) {
+  return membership != FuzzyMembership::kGaussian;
+}
+
+namespace kernels {
+
+// Compile-time membership functors the kernels are templated on. Each
+// provides value(diff, alpha), the partials of that value with respect to
+// diff and alpha given the value itself (the partial with respect to beta is
+// minus the one with respect to diff), and cutoff(alpha, epsilon), a
+// distance beyond which every membership is below epsilon, or exactly zero
+// for epsilon 0. Compact ones say so through kCompactSupport, which lets the
+// kernels drop keys outside the support without changing the result.
+struct GaussianMembership {
+  static constexpr bool kCompactSupport = false;
+
+  FUZZFORMER_HOST_DEVICE static float value(float diff, float alpha) {
+#if defined(__CUDA_ARCH__)
+    return __expf(-alpha * diff * diff);
+#else
+    return std::exp(-alpha * diff * diff);
+#endif
+  }
+
+  FUZZFORMER_HOST_DEVICE static float d_diff(float diff, float alpha, float membership) {
+    return -2.0f * alpha * diff * membership;
+  }
+
+  FUZZFORMER_HOST_DEVICE static float d_alpha(float diff, float, float membership) {
+    return -diff * diff * membership;
+  }
+
+  // exp(-alpha g^2) < epsilon once g^2 > -log(epsilon) / alpha.
+  FUZZFORMER_HOST_DEVICE static float cutoff(float alpha, float epsilon) {
+    if (!(alpha > 0.0f) || !(epsilon > 0.0f)) {
+      return INFINITY;
+    }
+    return sqrtf(-logf(epsilon) / alpha);
+  }
+};
+
+struct TriangularMembership {
+  static constexpr bool kCompactSupport = true;
+
+  FUZZFORMER_HOST_DEVICE static float value(float diff, float alpha) {
+    return fmaxf(1.0f - alpha * fabsf(diff), 0.0f);
+  }
+
+  FUZZFORMER_HOST_DEVICE static float d_diff(float diff, float alpha, float membership) {
+    return membership > 0.0f ? -alpha * static_cast<float>((diff > 0.0f) - (diff < 0.0f)) : 0.0f;
+  }
+
+  FUZZFORMER_HOST_DEVICE static float d_alpha(float diff, float, float membership) {
+    return membership > 0.0f ? -fabsf(diff) : 0.0f;
+  }
+
+  // 1 - alpha g < epsilon once g > (1 - epsilon) / alpha.
+  FUZZFORMER_HOST_DEVICE static float cutoff(float alpha, float epsilon) {
+    return alpha > 0.0f ? (1.0f - epsilon) / alpha : INFINITY;
+  }
+};
+
+struct TrapezoidalMembership {
+  static constexpr bool kCompactSupport = true;
+
+  FUZZFORMER_HOST_DEVICE static float value(float diff, float alpha) {
+    return fminf(fmaxf(2.0f - 2.0f * alpha * fabsf(diff), 0.0f), 1.0f);
+  }
+
+  // Only the ramps have a slope; the plateau and the tails are flat.
+  FUZZFORMER_HOST_DEVICE static float d_diff(float diff, float alpha, float membership) {
+    const bool on_ramp = membership > 0.0f && membership < 1.0f;
+    return on_ramp ? -2.0f * alpha * static_cast<float>((diff > 0.0f) - (diff < 0.0f)) : 0.0f;
+  }
+
+  FUZZFORMER_HOST_DEVICE static float d_alpha(float diff, float, float membership) {
+    return membership > 0.0f && membership < 1.0f ? -2.0f * fabsf(diff) : 0.0f;
+  }
+
+  // 2 - 2 alpha g < epsilon once g > (1 - epsilon / 2) / alpha.
+  FUZZFORMER_HOST_DEVICE static float cutoff(float alpha, float epsilon) {
+    return alpha > 0.0f ? (1.0f - 0.5f * epsilon) / alpha : INFINITY;
+  }
+};
+
+// The Gaussian through membership_table(). Device code keeps __expf, which
+// runs on the special function units at about the cost of one table read,
+// and only applies the cut at kMembershipTableRange, so CUDA results match
+// kGaussian inside the support rather than the table bit for bit.
+struct GaussianTableMembership {
+  static constexpr bool kCompactSupport = true;
+
+  FUZZFORMER_HOST_DEVICE static float value(float diff, float alpha) {
+    const float t = alpha * diff * diff;
+#if defined(__CUDA_ARCH__)
+    // Clamped like the table, so alpha < 0 gives 1 on both devices.
+    return t < kMembershipTableRange ? __expf(-fmaxf(t, 0.0f)) : 0.0f;
+#else
+    return lookup_membership(membership_table(), t);
+#endif
+  }
+
+  // The Gaussian's partials at the tabulated value.
+  FUZZFORMER_HOST_DEVICE static float d_diff(float diff, float alpha, float membership) {
+    return -2.0f * alpha * diff * membership;
+  }
+
+  FUZZFORMER_HOST_DEVICE static float d_alpha(float diff, float, float membership) {
+    return -diff * diff * membership;
+  }
+
+  // Within a bucket the interpolant is at most its left sample, exp(-(t -
+  // step)), so it is below epsilon once t > step - log(epsilon), and 0 from
+  // t = kMembershipTableRange on.
+  FUZZFORMER_HOST_DEVICE static float cutoff(float alpha, float epsilon) {
+    if (!(alpha > 0.0f)) {
+      return INFINITY;
+    }
+    const float t = epsilon > 0.0f ? fminf(kMembershipTableRange, kMembershipTableStep - logf(epsilon))
+                                   : kMembershipTableRange;
+    return sqrtf(t / alpha);
+  }
+};
+
+// Calls fn with the functor for `membership`, so that a runtime choice
+// picks one compile-time instantiation of a kernel.
+template <typename Fn>
+decltype(auto) with_membership(FuzzyMembership membership, Fn&& fn) {
+  switch (membership) {
+    case FuzzyMembership::kTriangular:
+      return fn(TriangularMembership{});
+    case FuzzyMembership::kTrapezoidal:
+      return fn(TrapezoidalMembership{});
+    case FuzzyMembership::kGaussianTable:
+      return fn(GaussianTableMembership{});
+    case FuzzyMembership::kGaussian:
+    default:
+      return fn(GaussianMembership{});
+  }
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
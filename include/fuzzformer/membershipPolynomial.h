@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cmath>
+#include <utility>
+
+namespace fuzzformer {
+namespace kernels {
+
+// Highest polynomial order of the linearised forward. The order-p feature
+// map has head_dim^p entries per token and its running sums head_dim^(p+1)
+// per head, so the top orders only fit at small head dims: order 4 is
+// already 4 GiB per head at head_dim 64, and fuzzy_attention_forward_linear
+// rejects orders whose sums would exceed 1 GiB per call.
+constexpr int kMaxLinearOrder = 4;
+
+// Polynomial stand-in for the fuzzy membership. m(s) = exp(-alpha (s -
+// beta)^2) is a function of the scalar score s = q.k / head_dim, so a
+// polynomial sum_p c_p s^p of it splits over p into inner products of
+// feature maps, s^p = <(q / head_dim)^(x)p, k^(x)p>, and attention becomes
+// linear in the sequence length.
+//
+// Writes c_0 .. c_order of the polynomial interpolating m at the order + 1
+// Chebyshev nodes of [-radius, radius], the range Cauchy-Schwarz allows the
+// scores (|q| |k| / head_dim). Chebyshev nodes keep the error close to the
+// best uniform fit of that order over the whole range, unlike a Taylor
+// expansion, which is only accurate near its centre. Higher orders, smaller
+// radii and smaller alpha all shrink the error.
+inline void fit_membership_polynomial(double alpha, double beta, double radius, int order, double* coefficients) {
+  constexpr double kPi = 3.14159265358979323846;
+  const int n = order + 1;
+  if (!(radius > 0.0)) {
+    radius = 1.0;
+  }
+
+  // Vandermonde system in t = s / radius, which keeps it well conditioned,
+  // solved by Gaussian elimination with partial pivoting.
+  double system[kMaxLinearOrder + 1][kMaxLinearOrder + 2];
+  for (int row = 0; row < n; ++row) {
+    const double t = std::cos(kPi * (2 * row + 1) / (2.0 * n));
+    const double diff = radius * t - beta;
+    double power = 1.0;
+    for (int p = 0; p < n; ++p) {
+      system[row][p] = power;
+      power *= t;
+    }
+    system[row][n] = std::exp(-alpha * diff * diff);
+  }
+  for (int col = 0; col < n; ++col) {
+    int pivot = col;
+    for (int row = col + 1; row < n; ++row) {
+      if (std::fabs(system[row][col]) > std::fabs(system[pivot][col])) {
+        pivot = row;
+      }
+    }
+    std::swap(system[col], system[pivot]);
+    for (int row = col + 1; row < n; ++row) {
+      const double factor = system[row][col] / system[col][col];
+      for (int p = col; p <= n; ++p) {
+        system[row][p] -= factor * system[col][p];
+      }
+    }
+  }
+  for (int p = n - 1; p >= 0; --p) {
+    double value = system[p][n];
+    for (int q = p + 1; q < n; ++q) {
+      value -= system[p][q] * coefficients[q];
+    }
+    coefficients[p] = value / system[p][p];
+  }
+
+  // Back from t to s: c_p = a_p / radius^p.
+  double scale = 1.0;
+  for (int p = 0; p < n; ++p) {
+    coefficients[p] /= scale;
+    scale *= radius;
+  }
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cfloat>
+#include <cmath>
+
+namespace fuzzformer {
+namespace kernels {
+
+// Lookup table for the Gaussian membership. exp(-alpha diff^2) depends on
+// alpha and diff only through t = alpha diff^2, so a single table of exp(-t)
+// serves every head: it samples exp(-t) at kMembershipTableBuckets steps of
+// kMembershipTableStep over [0, kMembershipTableRange) and is read back with
+// linear interpolation. Memberships are 0 from t = kMembershipTableRange on.
+inline constexpr int kMembershipTableBuckets = 1024;
+inline constexpr float kMembershipTableRange = 16.0f;
+inline constexpr float kMembershipTableStep = kMembershipTableRange / kMembershipTableBuckets;
+
+// Bucket i is the pair (exp(-i step), exp(-(i + 1) step) - exp(-i step)),
+// the value at its left edge and the rise across it, so one 64-bit gather
+// fetches everything an interpolation needs. The last bucket ramps down to 0
+// and is followed by a (0, 0) entry, which t clamps to at the range.
+inline const float* membership_table() {
+  struct Table {
+    alignas(64) float pairs[2 * (kMembershipTableBuckets + 1)];
+  };
+  static const Table table = [] {
+    Table built{};
+    float value = 1.0f;
+    for (int i = 0; i < kMembershipTableBuckets; ++i) {
+      const float next =
+          i + 1 < kMembershipTableBuckets
+              ? static_cast<float>(std::exp(-static_cast<double>(i + 1) * kMembershipTableStep))
+              : 0.0f;
+      built.pairs[2 * i] = value;
+      built.pairs[2 * i + 1] = next - value;
+      value = next;
+    }
+    return built;
+  }();
+  return table.pairs;
+}
+
+// exp(-t) for t >= 0 from the table. Negative t (alpha < 0) is clamped to
+// 0, giving membership 1 as in the CUDA kernels, and NaN reads as the
+// range, i.e. 0.
+inline float lookup_membership(const float* table, float t) {
+  const float x = std::fmax(
+      std::fmin(t * (1.0f / kMembershipTableStep), static_cast<float>(kMembershipTableBuckets)), 0.0f);
+  const int index = static_cast<int>(x);
+  const float* bucket = table + 2 * index;
+  return bucket[0] + (x - static_cast<float>(index)) * bucket[1];
+}
+
+// Largest |lookup_membership(t) - exp(-t)| over t >= 0. Linear
+// interpolation of exp(-t), which is convex with exp(-t)'' <= 1, overshoots
+// by at most step^2 / 8 inside a bucket; the last bucket ramps to 0 and
+// beyond the range the table is 0, which costs at most exp(-(range - step));
+// a few float roundings come on top.
+inline float membership_table_error_bound() {
+  return kMembershipTableStep * kMembershipTableStep / 8.0f +
+         std::exp(-(kMembershipTableRange - kMembershipTableStep)) + 4.0f * FLT_EPSILON;
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <memory>
@@ -31,6 +32,19 @@ class MetricsCollector {
 
   void render_throughput_card(const KernelMetrics& metrics) const;
 
+  // Named event counters that accumulate across calls, e.g. the work a
+  // kernel examined and skipped. Unknown counters read as zero.
+  void add_counter(const std::string& name, uint64_t delta);
+  uint64_t get_counter(const std::string& name) const;
+  // get_counter(part) / get_counter(whole) as a percentage, 0 when whole is 0.
+  double counter_percent(const std::string& part, const std::string& whole) const;
+  void reset_counters();
+
+  // Named point-in-time values that are overwritten rather than accumulated,
+  // e.g. how full a memory pool is. Unknown gauges read as zero.
+  void set_gauge(const std::string& name, double value);
+  double get_gauge(const std::string& name) const;
+
   // CUPTI-specific methods
   bool initialize_cupti();
   void shutdown_cupti();
@@ -38,14 +52,17 @@ class MetricsCollector {
 
  private:
   std::unordered_map<std::string, KernelMetrics> metrics_;
+  std::unordered_map<std::string, uint64_t> counters_;
+  std::unordered_map<std::string, double> gauges_;
   std::string current_kernel_;
   std::chrono::high_resolution_clock::time_point start_time_;
   
-  // CUPTI state
+  // CUPTI state, held as opaque handles so the header does not depend on
+  // cupti.h.
   bool cupti_available_;
-  CUpti_SubscriberHandle cupti_context_;
-  CUpti_EventGroup cupti_event_group_;
-  CUpti_MetricGroup cupti_metric_group_;
+  void* cupti_context_;
+  void* cupti_event_group_;
+  void* cupti_metric_group_;
   
   // CUPTI callback helpers
   void collect_cupti_metrics(const std::string& kernel_name);
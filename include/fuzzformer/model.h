@@ -6,7 +6,12 @@
 #include "fuzzformer/torchStub.h"
 #endif
 
+#include <string>
+
+#include "fuzzformer/checkpoint.h"
+#include "fuzzformer/kvCache.h"
 #include "fuzzformer/modelConfig.h"
+#include "fuzzformer/pagedKvCache.h"
 #include "fuzzformer/transformerBlock.h"
 
 namespace fuzzformer {
@@ -15,16 +20,62 @@ class FuzzFormerImpl : public torch::nn::Module {
  public:
   explicit FuzzFormerImpl(ModelConfig config);
 
-  torch::Tensor forward(const torch::Tensor& input);
+  // The mask is applied in every block.
+  torch::Tensor forward(const torch::Tensor& input, const FuzzyAttentionMask& mask = {});
+
+  // Packed variable-length batch, see TransformerBlockImpl::forward_varlen.
+  torch::Tensor forward_varlen(const torch::Tensor& input, const torch::Tensor& cu_seqlens, bool causal = false);
+
+#ifdef FUZZFORMER_HAS_TORCH
+  // Autoregressive decoding. new_tokens ([batch, n, model_dim]) continue the
+  // sequences held in cache, which must come from this model's config; the
+  // result equals the last n rows of a causal forward over the whole
+  // sequence, at the cost of the n new rows only. Advances the cache by n.
+  torch::Tensor step(const torch::Tensor& new_tokens, KVCache& cache);
+
+  // As above for a paged cache: row i of new_tokens continues sequence
+  // sequences[i] of cache, so any subset of the live sequences can be decoded
+  // together whatever their lengths. Advances those sequences by n.
+  torch::Tensor step(const torch::Tensor& new_tokens,
+                     PagedKVCache& cache,
+                     const std::vector<std::int64_t>& sequences);
+
+  // Converts a trained model for inference with int8 weights: every block's
+  // projections (see TransformerBlockImpl::quantize_weights) and
+  // output_head become QuantizedLinear layers, a quarter of their float
+  // size. Load the float parameters first (load_parameters), which then
+  // refuses the converted model; save_quantized_checkpoint and
+  // load_quantized_checkpoint below store and restore the result.
+  void quantize_weights();
+#endif
 
  private:
   ModelConfig config_;
   std::vector<TransformerBlock> blocks_;
   torch::nn::Linear output_head_;
+#ifdef FUZZFORMER_HAS_TORCH
+  // Through output_head_ or its int8 replacement.
+  torch::Tensor project_output(const torch::Tensor& hidden);
+
+  // Set by quantize_weights(), which also nulls output_head_.
+  QuantizedLinear output_head_int8_{nullptr};
+#endif
 };
 
 TORCH_MODULE(FuzzFormer);
 
+#ifdef FUZZFORMER_HAS_TORCH
+// Offline int8 conversion: loads a float checkpoint (see load_parameters)
+// into a model of config, converts it with quantize_weights() and writes its
+// int8 weights, scales and float biases to path with torch::save.
+void save_quantized_checkpoint(const ModelConfig& config, const ParameterDict& parameters, const std::string& path);
+
+// A model of config with int8 weights, loaded from a file written by
+// save_quantized_checkpoint with the same config. Its output matches the
+// model that was converted exactly.
+FuzzFormer load_quantized_checkpoint(const ModelConfig& config, const std::string& path);
+#endif
+
 }  // namespace fuzzformer
 
 
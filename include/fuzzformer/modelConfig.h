@@ -1,16 +1,40 @@
 #pragma once
 
 #include <cstddef>
+#include <vector>
+
+#include "fuzzformer/membership.h"
 
 namespace fuzzformer {
 
 struct ModelConfig {
   std::size_t model_dim = 128;
   std::size_t num_heads = 4;
+  // Key/value heads, each shared by num_heads / num_kv_heads consecutive
+  // query heads (grouped-query attention; 1 is multi-query attention). Must
+  // divide num_heads; 0 gives every query head its own, as in plain
+  // multi-head attention.
+  std::size_t num_kv_heads = 0;
   std::size_t ff_dim = 256;
   float dropout = 0.0F;
   std::size_t num_layers = 2;
+  // Sliding attention window of each layer (see FuzzyAttentionMask::window).
+  // Layers with a positive window always attend causally to their last
+  // window tokens and keep only those in a KVCache; a zero entry, or a layer
+  // past the end, attends to everything its mask allows.
+  std::vector<std::size_t> attention_windows;
+  // Membership function of every layer's attention (see
+  // FuzzyAttentionOptions::membership).
+  FuzzyMembership membership = FuzzyMembership::kGaussian;
+  // int8 Q.K scores in every layer's full-sequence and packed CPU forwards
+  // (see FuzzyAttentionOptions::int8_scores).
+  bool int8_scores = false;
+
+  [[nodiscard]] std::size_t kv_heads() const { return num_kv_heads > 0 ? num_kv_heads : num_heads; }
+
+  [[nodiscard]] std::size_t attention_window(std::size_t layer) const {
+    return layer < attention_windows.size() ? attention_windows[layer] : 0;
+  }
 };
 
 }  // namespace fuzzformer
-
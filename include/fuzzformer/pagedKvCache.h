@@ -0,0 +1,91 @@
+#pragma once
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "fuzzformer/metricsCollector.h"
+#include "fuzzformer/modelConfig.h"
+
+namespace fuzzformer {
+
+// Keys and values of many independent sequences that start, grow and finish
+// at different times. Memory is a preallocated pool of fixed-size blocks per
+// layer, [num_blocks, kv_heads, block_size, head_dim]; each sequence owns a
+// block table listing the pool blocks that hold its positions in order, so a
+// sequence only ever wastes the unused tail of its last block and finished
+// sequences hand their blocks straight back to the pool. Attention reads the
+// pools in place through fuzzy_attention_forward_paged.
+class PagedKVCache {
+ public:
+  PagedKVCache(const ModelConfig& config,
+               std::int64_t num_blocks,
+               std::int64_t block_size,
+               const torch::TensorOptions& options = {});
+
+  [[nodiscard]] std::size_t num_layers() const { return key_pools_.size(); }
+  [[nodiscard]] std::int64_t num_blocks() const { return num_blocks_; }
+  [[nodiscard]] std::int64_t block_size() const { return block_size_; }
+  [[nodiscard]] std::int64_t free_blocks() const { return static_cast<std::int64_t>(free_blocks_.size()); }
+
+  // Starts an empty sequence and returns its id.
+  std::int64_t add_sequence();
+  // Drops a sequence and returns its blocks to the pool.
+  void remove_sequence(std::int64_t sequence);
+  // Positions cached for sequence in every layer.
+  [[nodiscard]] std::int64_t length(std::int64_t sequence) const;
+
+  // Writes [sequences.size(), kv_heads, n, head_dim] keys and values (any
+  // strides) of layer at positions [length(s), length(s) + n) of each
+  // sequence s, taking blocks from the pool as needed. As with KVCache,
+  // lengths only move with advance(), once every layer has appended.
+  void append(std::size_t layer,
+              const std::vector<std::int64_t>& sequences,
+              const torch::Tensor& keys,
+              const torch::Tensor& values);
+
+  void advance(const std::vector<std::int64_t>& sequences, std::int64_t num_tokens);
+
+  // Block tables and lengths of sequences for fuzzy_attention_forward_paged,
+  // with num_pending not yet advanced tokens counted in: an int32
+  // [sequences.size(), max_blocks] table (unused entries are 0) and int32
+  // [sequences.size()] lengths, both on the pool device.
+  [[nodiscard]] std::pair<torch::Tensor, torch::Tensor> block_tables(const std::vector<std::int64_t>& sequences,
+                                                                     std::int64_t num_pending) const;
+
+  [[nodiscard]] const torch::Tensor& key_pool(std::size_t layer) const;
+  [[nodiscard]] const torch::Tensor& value_pool(std::size_t layer) const;
+
+  // Sets pool gauges on collector: kv_pool.blocks_total, kv_pool.blocks_used,
+  // kv_pool.tokens, kv_pool.occupancy_percent (used blocks over all blocks)
+  // and kv_pool.fragmentation_percent (unused positions inside used blocks
+  // over all positions of used blocks).
+  void report_metrics(metrics::MetricsCollector& collector) const;
+
+ private:
+  struct Sequence {
+    std::vector<int> blocks;
+    std::int64_t length = 0;
+  };
+
+  Sequence& sequence(std::int64_t id);
+  const Sequence& sequence(std::int64_t id) const;
+
+  std::int64_t num_blocks_;
+  std::int64_t block_size_;
+  std::int64_t next_sequence_ = 0;
+  std::vector<int> free_blocks_;
+  std::unordered_map<std::int64_t, Sequence> sequences_;
+  std::vector<torch::Tensor> key_pools_;
+  std::vector<torch::Tensor> value_pools_;
+};
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
@@ -0,0 +1,50 @@
+#pragma once
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include <torch/torch.h>
+
+namespace fuzzformer {
+
+// Inference-only stand-in for a torch::nn::Linear with int8 weights, one
+// symmetric scale per output channel, and float32 activations, bias and
+// accumulation, for a quarter of the weight memory. Built from a trained
+// Linear; its buffers keep the Linear's names, "weight" (int8 [out, in])
+// and "bias", plus "scale" (float [out]).
+class QuantizedLinearImpl : public torch::nn::Module {
+ public:
+  explicit QuantizedLinearImpl(const torch::nn::Linear& linear);
+
+  // float32 CPU input of up to a decode-sized batch of rows runs
+  // int8_linear_forward_cpu (see quantizedLinearCpu.h), which records no
+  // autograd history; larger batches and other input run a linear over the
+  // dequantised weights in the input's dtype, which are kept after the first
+  // such call at the cost of a float copy of the weights.
+  torch::Tensor forward(const torch::Tensor& input);
+
+  // float32 [out_features, in_features] copy of the weights it computes with.
+  [[nodiscard]] torch::Tensor dequantized_weight() const;
+
+  [[nodiscard]] int64_t in_features() const { return weight_.size(1); }
+  [[nodiscard]] int64_t out_features() const { return weight_.size(0); }
+
+ private:
+  torch::Tensor weight_;
+  torch::Tensor scale_;
+  // Undefined when the Linear had no bias.
+  torch::Tensor bias_;
+
+  // dequantized_weight() in the dtype of the last input that fell back to a
+  // float linear; rebuilt when that dtype or the module's device changes or
+  // when weight_ or scale_ are written (e.g. by a checkpoint load).
+  const torch::Tensor& fallback_weight(const torch::Tensor& input);
+  torch::Tensor fallback_weight_;
+  int64_t fallback_weight_version_ = -1;
+  int64_t fallback_scale_version_ = -1;
+};
+
+TORCH_MODULE(QuantizedLinear);
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
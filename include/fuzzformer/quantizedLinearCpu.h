@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+namespace fuzzformer {
+namespace kernels {
+
+// Weight-only int8 quantisation of a float [out_features, in_features]
+// Linear weight, one symmetric scale per output channel: row o becomes
+// quantized[o] * scales[o] (see CpuKernelTable::quantize_int8).
+void quantize_linear_weights_cpu(const float* weights,
+                                 int out_features,
+                                 int in_features,
+                                 std::int8_t* quantized,
+                                 float* scales);
+
+// output = input . W^T + bias for rows contiguous float rows of
+// in_features, W being the dequantised weights above; bias may be null. A
+// block of output channels at a time is dequantised into an L1-sized float
+// scratch and reused by every input row, so each weight byte is read from
+// memory once per call whatever the number of rows, and activations and
+// accumulation stay float32. Channel blocks are split across the global
+// runtime::ThreadPool. Meant for few rows: with one dot product per (row,
+// channel) it falls behind a float GEMM once there are more than a handful.
+void int8_linear_forward_cpu(const float* input,
+                             const std::int8_t* weights,
+                             const float* scales,
+                             const float* bias,
+                             float* output,
+                             std::int64_t rows,
+                             int in_features,
+                             int out_features);
+
+}  // namespace kernels
+}  // namespace fuzzformer
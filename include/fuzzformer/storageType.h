@@ -0,0 +1,76 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+namespace fuzzformer {
+namespace kernels {
+
+// Element type of the query, key, value and output buffers of the CPU
+// forward. The 16-bit types halve the memory traffic; they are widened to
+// float as rows are loaded, so scores, memberships, normalisers and
+// accumulators are float32 throughout, and the output is rounded once.
+enum class StorageType {
+  kFloat32 = 0,
+  // IEEE 754 binary16.
+  kFloat16,
+  // The upper half of a float32: its exponent range with an 8-bit mantissa.
+  kBFloat16,
+};
+
+constexpr int storage_bytes(StorageType storage) {
+  return storage == StorageType::kFloat32 ? 4 : 2;
+}
+
+// Scalar conversions; the instruction-set tables in cpuKernels.h have
+// vector versions with the same results. Narrowing rounds to nearest even,
+// overflows to infinity and quiets NaNs, keeping the top of their payload,
+// as F16C does.
+inline float half_to_float(std::uint16_t half) {
+  const std::uint32_t sign = static_cast<std::uint32_t>(half & 0x8000u) << 16;
+  const std::uint32_t exponent = (half >> 10) & 0x1fu;
+  const std::uint32_t mantissa = half & 0x3ffu;
+  if (exponent == 0) {
+    const float magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+    return std::bit_cast<float>(sign | std::bit_cast<std::uint32_t>(magnitude));
+  }
+  if (exponent == 0x1f) {
+    return std::bit_cast<float>(sign | 0x7f800000u | (mantissa != 0 ? 0x400000u | (mantissa << 13) : 0u));
+  }
+  return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+inline std::uint16_t float_to_half(float value) {
+  std::uint32_t bits = std::bit_cast<std::uint32_t>(value);
+  const auto sign = static_cast<std::uint16_t>((bits >> 16) & 0x8000u);
+  bits &= 0x7fffffffu;
+  if (bits >= 0x7f800000u) {
+    return sign | 0x7c00u | (bits > 0x7f800000u ? 0x200u | ((bits >> 13) & 0x3ffu) : 0u);
+  }
+  // 65520 and up round past the largest half, 65504.
+  if (bits >= 0x477ff000u) {
+    return sign | 0x7c00u;
+  }
+  // Below 2^-14 the result is subnormal: a multiple of 2^-24.
+  if (bits < 0x38800000u) {
+    return sign | static_cast<std::uint16_t>(std::nearbyint(std::bit_cast<float>(bits) * 16777216.0f));
+  }
+  const std::uint32_t rounded = bits + 0xfffu + ((bits >> 13) & 1u);
+  return sign | static_cast<std::uint16_t>((rounded - 0x38000000u) >> 13);
+}
+
+inline float bfloat16_to_float(std::uint16_t bfloat16) {
+  return std::bit_cast<float>(static_cast<std::uint32_t>(bfloat16) << 16);
+}
+
+inline std::uint16_t float_to_bfloat16(float value) {
+  const std::uint32_t bits = std::bit_cast<std::uint32_t>(value);
+  if ((bits & 0x7fffffffu) > 0x7f800000u) {
+    return static_cast<std::uint16_t>((bits >> 16) | 0x40u);
+  }
+  return static_cast<std::uint16_t>((bits + 0x7fffu + ((bits >> 16) & 1u)) >> 16);
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
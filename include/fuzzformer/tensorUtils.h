@@ -13,6 +13,10 @@ namespace fuzzformer::tensor {
 
 void ensure_cuda(const torch::Tensor& tensor, std::string_view name);
 
+void ensure_same_device(const torch::Tensor& tensor,
+                        const torch::Tensor& reference,
+                        std::string_view name);
+
 void ensure_contiguous(torch::Tensor& tensor);
 
 void validate_attention_dims(std::int64_t batch_size,
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace fuzzformer {
+namespace runtime {
+
+// Fixed-size pool of compute threads for data-parallel CPU kernels. The
+// calling thread takes part in every job, so a pool of size 1 runs inline.
+class ThreadPool {
+ public:
+  explicit ThreadPool(std::size_t num_threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  [[nodiscard]] std::size_t size() const;
+
+  // Runs task(i) for every i in [0, num_tasks) and blocks until all are done.
+  // Calls made from inside a running task execute serially on that thread.
+  void run(std::size_t num_tasks, const std::function<void(std::size_t)>& task);
+
+  // Splits [begin, end) into at most size() contiguous chunks of at least
+  // grain_size elements. Chunk boundaries depend only on the range, the grain
+  // and the pool size, never on scheduling.
+  void parallel_for(std::int64_t begin,
+                    std::int64_t end,
+                    std::int64_t grain_size,
+                    const std::function<void(std::int64_t, std::int64_t)>& body);
+
+  // Process-wide pool sized from FUZZFORMER_NUM_THREADS, or the hardware
+  // concurrency when the variable is unset.
+  static ThreadPool& global();
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+void parallel_for(std::int64_t begin,
+                  std::int64_t end,
+                  std::int64_t grain_size,
+                  const std::function<void(std::int64_t, std::int64_t)>& body);
+
+}  // namespace runtime
+}  // namespace fuzzformer
@@ -7,22 +7,67 @@
 #endif
 
 #include "fuzzformer/fuzzyAttention.h"
+#include "fuzzformer/kvCache.h"
 #include "fuzzformer/modelConfig.h"
+#include "fuzzformer/pagedKvCache.h"
+#include "fuzzformer/quantizedLinear.h"
 
 namespace fuzzformer {
 
 class TransformerBlockImpl : public torch::nn::Module {
  public:
-  explicit TransformerBlockImpl(ModelConfig config);
+  // layer selects this block's entry of config.attention_windows.
+  explicit TransformerBlockImpl(ModelConfig config, std::size_t layer = 0);
 
-  torch::Tensor forward(const torch::Tensor& input);
+  // mask.key_lengths, when set, marks the padded tail of each input sequence.
+  // A windowed block attends causally over its window whatever mask.causal.
+  torch::Tensor forward(const torch::Tensor& input, const FuzzyAttentionMask& mask = {});
+
+  // Packed variable-length batch: input is [total_tokens, model_dim] and
+  // sequence i owns rows [cu_seqlens[i], cu_seqlens[i + 1]).
+  torch::Tensor forward_varlen(const torch::Tensor& input, const torch::Tensor& cu_seqlens, bool causal = false);
+
+#ifdef FUZZFORMER_HAS_TORCH
+  // Incremental causal decode: input is [batch, new_tokens, model_dim] and
+  // follows the cache.length() tokens already in cache. Appends this block's
+  // keys and values to cache layer `layer` and attends the new tokens over
+  // everything cached, or its window of it; the caller advances the cache
+  // once all layers ran.
+  torch::Tensor step(const torch::Tensor& input, KVCache& cache, std::size_t layer);
+
+  // As above for a paged cache; row i of input continues sequence
+  // sequences[i]. Paged caches keep every position, so the block must not
+  // be windowed.
+  torch::Tensor step(const torch::Tensor& input,
+                     PagedKVCache& cache,
+                     std::size_t layer,
+                     const std::vector<std::int64_t>& sequences);
+
+  // Inference-only conversion to int8 weights: qkv_proj and out_proj become
+  // QuantizedLinear layers under the same names and their float weights are
+  // released. Every forward and step then runs on the int8 weights.
+  void quantize_weights();
+#endif
 
  private:
   ModelConfig config_;
-  torch::nn::Linear q_proj_;
-  torch::nn::Linear k_proj_;
-  torch::nn::Linear v_proj_;
+  // Sliding attention window, 0 for full attention.
+  std::size_t window_;
+  // Q, K and V projections fused into one layer with
+  // (num_heads + 2 * kv_heads) * head_dim outputs, ordered as the query
+  // heads, then the key heads, then the value heads, each head_dim wide.
+  // Without grouped K/V heads that is [model_dim, 3 * model_dim].
+  torch::nn::Linear qkv_proj_;
   torch::nn::Linear out_proj_;
+#ifdef FUZZFORMER_HAS_TORCH
+  // Through qkv_proj_ and out_proj_, or their int8 replacements.
+  torch::Tensor project_qkv(const torch::Tensor& input);
+  torch::Tensor project_out(const torch::Tensor& attention);
+
+  // Set by quantize_weights(), which also nulls the two layers above.
+  QuantizedLinear qkv_proj_int8_{nullptr};
+  QuantizedLinear out_proj_int8_{nullptr};
+#endif
 };
 
 TORCH_MODULE(TransformerBlock);
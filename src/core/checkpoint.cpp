@@ -0,0 +1,111 @@
+#include "fuzzformer/checkpoint.h"
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include <array>
+#include <map>
+
+#include "fuzzformer/quantizedLinear.h"
+
+namespace fuzzformer {
+
+namespace {
+
+constexpr std::array<const char*, 3> kLegacyProjections = {"q_proj", "k_proj", "v_proj"};
+
+struct LegacyName {
+  // Fused parameter name and which of q, k, v this entry holds.
+  std::string fused_name;
+  std::size_t part;
+};
+
+// Splits "<prefix><q|k|v>_proj.<leaf>"; false for any other name.
+bool parse_legacy_name(const std::string& name, LegacyName& parsed) {
+  const auto leaf_dot = name.rfind('.');
+  if (leaf_dot == std::string::npos) {
+    return false;
+  }
+  const auto module_path = name.substr(0, leaf_dot);
+  const auto module_dot = module_path.rfind('.');
+  const auto module_begin = module_dot == std::string::npos ? 0 : module_dot + 1;
+  const auto module_name = module_path.substr(module_begin);
+
+  for (std::size_t part = 0; part < kLegacyProjections.size(); ++part) {
+    if (module_name == kLegacyProjections[part]) {
+      parsed.fused_name = module_path.substr(0, module_begin) + "qkv_proj" + name.substr(leaf_dot);
+      parsed.part = part;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+ParameterDict fuse_legacy_qkv(const ParameterDict& parameters) {
+  std::map<std::string, std::array<torch::Tensor, 3>> groups;
+  for (const auto& item : parameters) {
+    LegacyName parsed;
+    if (parse_legacy_name(item.key(), parsed)) {
+      groups[parsed.fused_name][parsed.part] = item.value();
+    }
+  }
+
+  // Fused entries take the place of their first legacy part, so the order of
+  // everything else is preserved.
+  ParameterDict fused;
+  for (const auto& item : parameters) {
+    LegacyName parsed;
+    if (!parse_legacy_name(item.key(), parsed)) {
+      fused.insert(item.key(), item.value());
+      continue;
+    }
+    if (fused.contains(parsed.fused_name)) {
+      continue;
+    }
+    const auto& parts = groups.at(parsed.fused_name);
+    for (std::size_t part = 0; part < parts.size(); ++part) {
+      TORCH_CHECK(parts[part].defined(),
+                  "legacy checkpoint has no ",
+                  kLegacyProjections[part],
+                  " entry for ",
+                  parsed.fused_name);
+    }
+    TORCH_CHECK(parts[0].sizes() == parts[1].sizes() && parts[0].sizes() == parts[2].sizes(),
+                "q_proj, k_proj and v_proj shapes differ for ",
+                parsed.fused_name);
+    fused.insert(parsed.fused_name, torch::cat({parts[0], parts[1], parts[2]}, 0));
+  }
+  return fused;
+}
+
+void load_parameters(torch::nn::Module& module, const ParameterDict& parameters) {
+  // A converted layer holds buffers, not parameters, so the loop below would
+  // silently leave it as it is.
+  for (const auto& child : module.named_modules()) {
+    TORCH_CHECK(child.value()->as<QuantizedLinearImpl>() == nullptr,
+                "load_parameters needs float weights but ",
+                child.key().empty() ? std::string("the module") : child.key(),
+                " is quantized; load before quantize_weights() or use load_quantized_checkpoint");
+  }
+
+  const auto fused = fuse_legacy_qkv(parameters);
+
+  torch::NoGradGuard no_grad;
+  for (auto& item : module.named_parameters()) {
+    const auto* source = fused.find(item.key());
+    TORCH_CHECK(source != nullptr, "checkpoint has no parameter ", item.key());
+    TORCH_CHECK(source->sizes() == item.value().sizes(),
+                "checkpoint parameter ",
+                item.key(),
+                " has shape ",
+                source->sizes(),
+                ", expected ",
+                item.value().sizes());
+    item.value().copy_(*source);
+  }
+}
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
@@ -0,0 +1,335 @@
+#include "fuzzformer/cpuKernels.h"
+#include "fuzzformer/membershipTable.h"
+#include "fuzzformer/storageType.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <iterator>
+#include <string>
+
+namespace fuzzformer {
+namespace kernels {
+
+#ifdef FUZZFORMER_HAS_AVX2_KERNELS
+const CpuKernelTable& avx2_kernel_table();
+#endif
+#ifdef FUZZFORMER_HAS_AVX512_KERNELS
+const CpuKernelTable& avx512_kernel_table();
+#endif
+#ifdef FUZZFORMER_HAS_AVX512_VNNI_KERNELS
+const CpuKernelTable& avx512_vnni_kernel_table();
+#endif
+#ifdef FUZZFORMER_HAS_AVX512_BF16_KERNELS
+const CpuKernelTable& avx512_bf16_kernel_table();
+#endif
+
+namespace {
+
+float scalar_dot(const float* a, const float* b, int n) {
+  float sum = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+float scalar_membership(const float* scores, int count, float alpha, float beta, float* out) {
+  float sum = 0.0f;
+  for (int i = 0; i < count; ++i) {
+    const float diff = scores[i] - beta;
+    out[i] = std::exp(-alpha * diff * diff);
+    sum += out[i];
+  }
+  return sum;
+}
+
+float scalar_membership_lookup(const float* scores, int count, float alpha, float beta, float* out) {
+  const float* table = membership_table();
+  float sum = 0.0f;
+  for (int i = 0; i < count; ++i) {
+    const float diff = scores[i] - beta;
+    out[i] = lookup_membership(table, alpha * diff * diff);
+    sum += out[i];
+  }
+  return sum;
+}
+
+float scalar_membership_triangular(const float* scores, int count, float alpha, float beta, float* out) {
+  float sum = 0.0f;
+  for (int i = 0; i < count; ++i) {
+    out[i] = std::fmax(1.0f - alpha * std::fabs(scores[i] - beta), 0.0f);
+    sum += out[i];
+  }
+  return sum;
+}
+
+float scalar_membership_trapezoidal(const float* scores, int count, float alpha, float beta, float* out) {
+  const float two_alpha = 2.0f * alpha;
+  float sum = 0.0f;
+  for (int i = 0; i < count; ++i) {
+    out[i] = std::fmin(std::fmax(2.0f - two_alpha * std::fabs(scores[i] - beta), 0.0f), 1.0f);
+    sum += out[i];
+  }
+  return sum;
+}
+
+void scalar_axpy(float a, const float* x, float* y, int n) {
+  for (int i = 0; i < n; ++i) {
+    y[i] += a * x[i];
+  }
+}
+
+void scalar_widen_half(const std::uint16_t* in, int n, float* out) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = half_to_float(in[i]);
+  }
+}
+
+void scalar_narrow_half(const float* in, int n, std::uint16_t* out) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = float_to_half(in[i]);
+  }
+}
+
+void scalar_widen_bfloat16(const std::uint16_t* in, int n, float* out) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = bfloat16_to_float(in[i]);
+  }
+}
+
+void scalar_narrow_bfloat16(const float* in, int n, std::uint16_t* out) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = float_to_bfloat16(in[i]);
+  }
+}
+
+float scalar_quantize_int8(const float* in, int n, std::int8_t* out, std::int32_t* sum) {
+  float max_abs = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    max_abs = std::max(max_abs, std::fabs(in[i]));
+  }
+  const float inv_scale = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+  std::int32_t total = 0;
+  for (int i = 0; i < n; ++i) {
+    out[i] = static_cast<std::int8_t>(std::nearbyint(in[i] * inv_scale));
+    total += out[i];
+  }
+  *sum = total;
+  return max_abs / 127.0f;
+}
+
+void scalar_quantized_scores(const std::int8_t* q, float q_scale, const std::int8_t* keys, const float* key_scales,
+                             const std::int32_t*, int num_keys, int head_dim, float* scores) {
+  for (int j = 0; j < num_keys; ++j) {
+    const std::int8_t* k_vec = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    std::int32_t dot = 0;
+    for (int d = 0; d < head_dim; ++d) {
+      dot += static_cast<std::int32_t>(q[d]) * k_vec[d];
+    }
+    scores[j] = static_cast<float>(dot) * q_scale * key_scales[j];
+  }
+}
+
+void scalar_dequantize_int8(const std::int8_t* in, int n, float scale, float* out) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = static_cast<float>(in[i]) * scale;
+  }
+}
+
+void scalar_scores(const float* q, const float* keys, int num_keys, int head_dim, float scale, float* scores) {
+  for (int j = 0; j < num_keys; ++j) {
+    scores[j] = scalar_dot(q, keys + static_cast<std::ptrdiff_t>(j) * head_dim, head_dim) * scale;
+  }
+}
+
+void scalar_accumulate(const float* weights, const float* values, int num_keys, int head_dim, float* out) {
+  for (int j = 0; j < num_keys; ++j) {
+    scalar_axpy(weights[j], values + static_cast<std::ptrdiff_t>(j) * head_dim, out, head_dim);
+  }
+}
+
+template <int kHeadDim>
+void scalar_scores_fixed(const float* q, const float* keys, int num_keys, int, float scale, float* scores) {
+  for (int j = 0; j < num_keys; ++j) {
+    const float* k_vec = keys + static_cast<std::ptrdiff_t>(j) * kHeadDim;
+    float sum = 0.0f;
+    for (int d = 0; d < kHeadDim; ++d) {
+      sum += q[d] * k_vec[d];
+    }
+    scores[j] = sum * scale;
+  }
+}
+
+template <int kHeadDim>
+void scalar_accumulate_fixed(const float* weights, const float* values, int num_keys, int, float* out) {
+  float acc[kHeadDim];
+  std::copy(out, out + kHeadDim, acc);
+  for (int j = 0; j < num_keys; ++j) {
+    const float* v_vec = values + static_cast<std::ptrdiff_t>(j) * kHeadDim;
+    for (int d = 0; d < kHeadDim; ++d) {
+      acc[d] += weights[j] * v_vec[d];
+    }
+  }
+  std::copy(acc, acc + kHeadDim, out);
+}
+
+template <int kHeadDim>
+constexpr CpuTileKernels scalar_tiles() {
+  return {kHeadDim, scalar_scores_fixed<kHeadDim>, scalar_accumulate_fixed<kHeadDim>};
+}
+
+constexpr CpuTileKernels kScalarTiles[] = {
+    scalar_tiles<32>(), scalar_tiles<64>(), scalar_tiles<96>(), scalar_tiles<128>(), scalar_tiles<256>(),
+};
+
+constexpr CpuKernelTable kScalarTable{
+    CpuIsa::kScalar,
+    "scalar",
+    scalar_dot,
+    scalar_membership,
+    scalar_membership_lookup,
+    scalar_membership_triangular,
+    scalar_membership_trapezoidal,
+    scalar_axpy,
+    scalar_widen_half,
+    scalar_narrow_half,
+    scalar_widen_bfloat16,
+    scalar_narrow_bfloat16,
+    scalar_quantize_int8,
+    scalar_quantized_scores,
+    scalar_dequantize_int8,
+    {0, scalar_scores, scalar_accumulate},
+    kScalarTiles,
+};
+
+bool cpu_supports(CpuIsa isa) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  switch (isa) {
+    case CpuIsa::kScalar:
+      return true;
+    case CpuIsa::kAvx2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    case CpuIsa::kAvx512:
+      return __builtin_cpu_supports("avx512f");
+    case CpuIsa::kAvx512Vnni:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+             __builtin_cpu_supports("avx512vnni");
+    case CpuIsa::kAvx512Bf16:
+      return cpu_supports(CpuIsa::kAvx512Vnni) && __builtin_cpu_supports("avx512vl") &&
+             __builtin_cpu_supports("avx512bf16");
+  }
+  return false;
+#else
+  return isa == CpuIsa::kScalar;
+#endif
+}
+
+const CpuKernelTable* initial_table() {
+  if (const char* env = std::getenv("FUZZFORMER_CPU_ISA")) {
+    const std::string requested(env);
+    for (const auto isa :
+         {CpuIsa::kScalar, CpuIsa::kAvx2, CpuIsa::kAvx512, CpuIsa::kAvx512Vnni, CpuIsa::kAvx512Bf16}) {
+      if (requested == to_string(isa)) {
+        if (const auto* table = cpu_kernel_table(isa)) {
+          return table;
+        }
+      }
+    }
+  }
+  return cpu_kernel_table(detect_cpu_isa());
+}
+
+std::atomic<const CpuKernelTable*>& selected_table() {
+  static std::atomic<const CpuKernelTable*> table{initial_table()};
+  return table;
+}
+
+}  // namespace
+
+CpuIsa detect_cpu_isa() {
+  for (const auto isa : {CpuIsa::kAvx512Bf16, CpuIsa::kAvx512Vnni, CpuIsa::kAvx512, CpuIsa::kAvx2}) {
+    if (cpu_kernel_table(isa) != nullptr) {
+      return isa;
+    }
+  }
+  return CpuIsa::kScalar;
+}
+
+const CpuKernelTable* cpu_kernel_table(CpuIsa isa) {
+  if (!cpu_supports(isa)) {
+    return nullptr;
+  }
+  switch (isa) {
+    case CpuIsa::kScalar:
+      return &kScalarTable;
+    case CpuIsa::kAvx2:
+#ifdef FUZZFORMER_HAS_AVX2_KERNELS
+      return &avx2_kernel_table();
+#else
+      return nullptr;
+#endif
+    case CpuIsa::kAvx512:
+#ifdef FUZZFORMER_HAS_AVX512_KERNELS
+      return &avx512_kernel_table();
+#else
+      return nullptr;
+#endif
+    case CpuIsa::kAvx512Vnni:
+#ifdef FUZZFORMER_HAS_AVX512_VNNI_KERNELS
+      return &avx512_vnni_kernel_table();
+#else
+      return nullptr;
+#endif
+    case CpuIsa::kAvx512Bf16:
+#ifdef FUZZFORMER_HAS_AVX512_BF16_KERNELS
+      return &avx512_bf16_kernel_table();
+#else
+      return nullptr;
+#endif
+  }
+  return nullptr;
+}
+
+const CpuTileKernels& select_tile_kernels(const CpuKernelTable& table, int head_dim) {
+  for (std::size_t i = 0; i < std::size(kSpecializedHeadDims); ++i) {
+    if (kSpecializedHeadDims[i] == head_dim) {
+      return table.specialized_tiles[i];
+    }
+  }
+  return table.generic_tiles;
+}
+
+const CpuKernelTable& active_cpu_kernels() {
+  return *selected_table().load(std::memory_order_acquire);
+}
+
+bool set_cpu_isa(CpuIsa isa) {
+  const auto* table = cpu_kernel_table(isa);
+  if (table == nullptr) {
+    return false;
+  }
+  selected_table().store(table, std::memory_order_release);
+  return true;
+}
+
+std::string_view to_string(CpuIsa isa) {
+  switch (isa) {
+    case CpuIsa::kScalar:
+      return "scalar";
+    case CpuIsa::kAvx2:
+      return "avx2";
+    case CpuIsa::kAvx512:
+      return "avx512";
+    case CpuIsa::kAvx512Vnni:
+      return "avx512vnni";
+    case CpuIsa::kAvx512Bf16:
+      return "avx512bf16";
+  }
+  return "unknown";
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
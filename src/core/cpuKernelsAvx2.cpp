@@ -0,0 +1,523 @@
+// Built with -mavx2 -mfma -mf16c; only reached after CPUID reports all three.
+#include "fuzzformer/cpuKernels.h"
+#include "fuzzformer/membershipTable.h"
+#include "fuzzformer/storageType.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+namespace fuzzformer {
+namespace kernels {
+
+namespace {
+
+inline float horizontal_sum(__m256 v) {
+  const __m128 low = _mm256_castps256_ps128(v);
+  const __m128 high = _mm256_extractf128_ps(v, 1);
+  __m128 sum = _mm_add_ps(low, high);
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+inline std::int32_t horizontal_sum_epi32(__m256i v) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(sum);
+}
+
+// Cephes-style exp: range reduction by ln2, degree-5 polynomial and an
+// exponent-field scale. Inputs below -87 flush to zero, which keeps every
+// result a normal float and avoids denormal stalls.
+inline __m256 exp_ps(__m256 x) {
+  const __m256 max_x = _mm256_set1_ps(88.3762626647949f);
+  const __m256 min_x = _mm256_set1_ps(-87.0f);
+  const __m256 underflow = _mm256_cmp_ps(x, min_x, _CMP_LT_OQ);
+  x = _mm256_max_ps(_mm256_min_ps(x, max_x), min_x);
+
+  const __m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+  r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), r);
+
+  __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+  p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+  const __m256i exponent = _mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+  const __m256 result = _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+  return _mm256_andnot_ps(underflow, result);
+}
+
+inline __m256 membership_ps(__m256 scores, __m256 neg_alpha, __m256 beta) {
+  const __m256 diff = _mm256_sub_ps(scores, beta);
+  return exp_ps(_mm256_mul_ps(neg_alpha, _mm256_mul_ps(diff, diff)));
+}
+
+// lookup_membership on eight lanes: t is scaled to table indices by
+// scaled_alpha = alpha / kMembershipTableStep and clamped to the last one,
+// which also sends NaN there. Each lane's (value, rise) pair comes in with
+// one 64-bit gather, four lanes per gather, and is split back out.
+inline __m256 lookup_membership_ps(const float* table, __m256 scores, __m256 scaled_alpha, __m256 beta) {
+  const __m256 diff = _mm256_sub_ps(scores, beta);
+  // min_ps returns its second operand for NaN, so NaN lands on the range;
+  // negative t (alpha < 0) is clamped to 0 rather than read before the table.
+  const __m256 x = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(scaled_alpha, _mm256_mul_ps(diff, diff)),
+                                               _mm256_set1_ps(static_cast<float>(kMembershipTableBuckets))),
+                                 _mm256_setzero_ps());
+  const __m256i index = _mm256_cvttps_epi32(x);
+  const __m256 frac = _mm256_sub_ps(x, _mm256_cvtepi32_ps(index));
+  const auto* buckets = reinterpret_cast<const long long*>(table);
+  // v0 r0 v1 r1 | v2 r2 v3 r3 and v4 r4 v5 r5 | v6 r6 v7 r7.
+  const __m256 low = _mm256_castsi256_ps(_mm256_i32gather_epi64(buckets, _mm256_castsi256_si128(index), 8));
+  const __m256 high = _mm256_castsi256_ps(_mm256_i32gather_epi64(buckets, _mm256_extracti128_si256(index, 1), 8));
+  // v0 v1 v4 v5 | v2 v3 v6 v7, then back in lane order.
+  const __m256 values = _mm256_castpd_ps(
+      _mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(low, high, 0x88)), 0xD8));
+  const __m256 rises = _mm256_castpd_ps(
+      _mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(low, high, 0xDD)), 0xD8));
+  return _mm256_fmadd_ps(frac, rises, values);
+}
+
+// TriangularMembership and TrapezoidalMembership on eight lanes; two_alpha
+// is 2 alpha. max_ps returns its second operand for NaN, so NaN scores give
+// 0 as fmaxf does.
+inline __m256 triangular_ps(__m256 scores, __m256 alpha, __m256 beta) {
+  const __m256 distance = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(scores, beta));
+  return _mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(alpha, distance)), _mm256_setzero_ps());
+}
+
+inline __m256 trapezoidal_ps(__m256 scores, __m256 two_alpha, __m256 beta) {
+  const __m256 distance = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(scores, beta));
+  const __m256 ramp = _mm256_sub_ps(_mm256_set1_ps(2.0f), _mm256_mul_ps(two_alpha, distance));
+  return _mm256_min_ps(_mm256_max_ps(ramp, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+}
+
+// Runs an eight-lane membership over count scores and returns the sum; the
+// tail is padded with beta and left out of the sum.
+template <typename Lanes>
+float compact_membership(const float* scores, int count, float beta, float* out, Lanes lanes) {
+  const __m256 beta_v = _mm256_set1_ps(beta);
+  __m256 sum = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 m = lanes(_mm256_loadu_ps(scores + i), beta_v);
+    _mm256_storeu_ps(out + i, m);
+    sum = _mm256_add_ps(sum, m);
+  }
+  if (i < count) {
+    alignas(32) float padded[8];
+    const int tail = count - i;
+    for (int j = 0; j < 8; ++j) {
+      padded[j] = j < tail ? scores[i + j] : beta;
+    }
+    const __m256 m = lanes(_mm256_load_ps(padded), beta_v);
+    _mm256_store_ps(padded, m);
+    for (int j = 0; j < tail; ++j) {
+      out[i + j] = padded[j];
+    }
+    const __m256 live = _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7),
+                                      _mm256_set1_ps(static_cast<float>(tail)), _CMP_LT_OQ);
+    sum = _mm256_add_ps(sum, _mm256_and_ps(m, live));
+  }
+  return horizontal_sum(sum);
+}
+
+float avx2_dot(const float* a, const float* b, int n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  __m256 acc2 = _mm256_setzero_ps();
+  __m256 acc3 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+    acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+  }
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+  }
+  float sum = horizontal_sum(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+  for (; i < n; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+float avx2_membership(const float* scores, int count, float alpha, float beta, float* out) {
+  const __m256 neg_alpha = _mm256_set1_ps(-alpha);
+  const __m256 beta_v = _mm256_set1_ps(beta);
+  __m256 sum = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 m = membership_ps(_mm256_loadu_ps(scores + i), neg_alpha, beta_v);
+    _mm256_storeu_ps(out + i, m);
+    sum = _mm256_add_ps(sum, m);
+  }
+  if (i < count) {
+    // Pad the tail to a full vector so every key goes through the same exp.
+    alignas(32) float padded[8];
+    const int tail = count - i;
+    for (int j = 0; j < 8; ++j) {
+      padded[j] = j < tail ? scores[i + j] : beta;
+    }
+    const __m256 m = membership_ps(_mm256_load_ps(padded), neg_alpha, beta_v);
+    _mm256_store_ps(padded, m);
+    for (int j = 0; j < tail; ++j) {
+      out[i + j] = padded[j];
+    }
+    const __m256 live = _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7),
+                                      _mm256_set1_ps(static_cast<float>(tail)), _CMP_LT_OQ);
+    sum = _mm256_add_ps(sum, _mm256_and_ps(m, live));
+  }
+  return horizontal_sum(sum);
+}
+
+float avx2_membership_lookup(const float* scores, int count, float alpha, float beta, float* out) {
+  const float* table = membership_table();
+  const __m256 scaled_alpha = _mm256_set1_ps(alpha / kMembershipTableStep);
+  const __m256 beta_v = _mm256_set1_ps(beta);
+  __m256 sum = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 m = lookup_membership_ps(table, _mm256_loadu_ps(scores + i), scaled_alpha, beta_v);
+    _mm256_storeu_ps(out + i, m);
+    sum = _mm256_add_ps(sum, m);
+  }
+  if (i < count) {
+    alignas(32) float padded[8];
+    const int tail = count - i;
+    for (int j = 0; j < 8; ++j) {
+      padded[j] = j < tail ? scores[i + j] : beta;
+    }
+    const __m256 m = lookup_membership_ps(table, _mm256_load_ps(padded), scaled_alpha, beta_v);
+    _mm256_store_ps(padded, m);
+    for (int j = 0; j < tail; ++j) {
+      out[i + j] = padded[j];
+    }
+    const __m256 live = _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7),
+                                      _mm256_set1_ps(static_cast<float>(tail)), _CMP_LT_OQ);
+    sum = _mm256_add_ps(sum, _mm256_and_ps(m, live));
+  }
+  return horizontal_sum(sum);
+}
+
+float avx2_membership_triangular(const float* scores, int count, float alpha, float beta, float* out) {
+  const __m256 alpha_v = _mm256_set1_ps(alpha);
+  return compact_membership(scores, count, beta, out,
+                            [&](__m256 s, __m256 beta_v) { return triangular_ps(s, alpha_v, beta_v); });
+}
+
+float avx2_membership_trapezoidal(const float* scores, int count, float alpha, float beta, float* out) {
+  const __m256 two_alpha = _mm256_set1_ps(2.0f * alpha);
+  return compact_membership(scores, count, beta, out,
+                            [&](__m256 s, __m256 beta_v) { return trapezoidal_ps(s, two_alpha, beta_v); });
+}
+
+void avx2_axpy(float a, const float* x, float* y, int n) {
+  const __m256 a_v = _mm256_set1_ps(a);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a_v, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    _mm256_storeu_ps(y + i + 8, _mm256_fmadd_ps(a_v, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)));
+  }
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a_v, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    y[i] += a * x[i];
+  }
+}
+
+void avx2_widen_half(const std::uint16_t* in, int n, float* out) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+  }
+  for (; i < n; ++i) {
+    out[i] = half_to_float(in[i]);
+  }
+}
+
+void avx2_narrow_half(const float* in, int n, std::uint16_t* out) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  }
+  for (; i < n; ++i) {
+    out[i] = float_to_half(in[i]);
+  }
+}
+
+void avx2_widen_bfloat16(const std::uint16_t* in, int n, float* out) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+  }
+  for (; i < n; ++i) {
+    out[i] = bfloat16_to_float(in[i]);
+  }
+}
+
+// Round to nearest even by adding 0x7fff plus the lowest kept bit, except
+// for NaNs, which only get their quiet bit set.
+void avx2_narrow_bfloat16(const float* in, int n, std::uint16_t* out) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 value = _mm256_loadu_ps(in + i);
+    const __m256i bits = _mm256_castps_si256(value);
+    const __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    const __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7fff)));
+    const __m256i quiet = _mm256_or_si256(bits, _mm256_set1_epi32(0x400000));
+    const __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(value, value, _CMP_UNORD_Q));
+    const __m256i high = _mm256_srli_epi32(_mm256_blendv_epi8(rounded, quiet, nan), 16);
+    // packus works per 128-bit lane; the permute puts elements 4..7 after 0..3.
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(high, high), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(packed));
+  }
+  for (; i < n; ++i) {
+    out[i] = float_to_bfloat16(in[i]);
+  }
+}
+
+// Two passes: the row's largest magnitude, then eight lanes at a time
+// rounded by cvtps, which rounds to nearest even like nearbyint, and packed
+// down to bytes. |in / s| <= 127, so the saturating packs never clamp.
+float avx2_quantize_int8(const float* in, int n, std::int8_t* out, std::int32_t* sum) {
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 max_v = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    max_v = _mm256_max_ps(max_v, _mm256_and_ps(abs_mask, _mm256_loadu_ps(in + i)));
+  }
+  __m128 max_4 = _mm_max_ps(_mm256_castps256_ps128(max_v), _mm256_extractf128_ps(max_v, 1));
+  max_4 = _mm_max_ps(max_4, _mm_movehl_ps(max_4, max_4));
+  float max_abs = _mm_cvtss_f32(_mm_max_ss(max_4, _mm_movehdup_ps(max_4)));
+  for (; i < n; ++i) {
+    max_abs = std::max(max_abs, std::fabs(in[i]));
+  }
+
+  const float inv_scale = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+  const __m256 inv_scale_v = _mm256_set1_ps(inv_scale);
+  __m256i total_v = _mm256_setzero_si256();
+  for (i = 0; i + 8 <= n; i += 8) {
+    const __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + i), inv_scale_v));
+    total_v = _mm256_add_epi32(total_v, q);
+    const __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi16(words, words));
+  }
+  std::int32_t total = horizontal_sum_epi32(total_v);
+  for (; i < n; ++i) {
+    out[i] = static_cast<std::int8_t>(std::nearbyint(in[i] * inv_scale));
+    total += out[i];
+  }
+  *sum = total;
+  return max_abs / 127.0f;
+}
+
+// Lane r of the result is the sum of the lanes of v[r].
+inline __m128i horizontal_sum4_epi32(const __m256i v[4]) {
+  const __m256i sums = _mm256_hadd_epi32(_mm256_hadd_epi32(v[0], v[1]), _mm256_hadd_epi32(v[2], v[3]));
+  return _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+}
+
+inline __m256i load_int8_as_int16(const std::int8_t* p) {
+  return _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+// Bytes are sign-extended to words and multiplied with madd, whose pairwise
+// int32 sums are exact (maddubs would need unsigned bytes and saturates).
+// Four keys per step share every load of the query row.
+void avx2_quantized_scores(const std::int8_t* q, float q_scale, const std::int8_t* keys, const float* key_scales,
+                           const std::int32_t*, int num_keys, int head_dim, float* scores) {
+  const int vector_dims = head_dim / 16 * 16;
+  auto finish = [&](int j, __m256i acc) {
+    const std::int8_t* k_vec = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    std::int32_t dot = horizontal_sum_epi32(acc);
+    for (int d = vector_dims; d < head_dim; ++d) {
+      dot += static_cast<std::int32_t>(q[d]) * k_vec[d];
+    }
+    scores[j] = static_cast<float>(dot) * q_scale * key_scales[j];
+  };
+
+  int j = 0;
+  for (; j + 4 <= num_keys; j += 4) {
+    const std::int8_t* k_block = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    __m256i acc[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(),
+                      _mm256_setzero_si256()};
+    for (int d = 0; d < vector_dims; d += 16) {
+      const __m256i q_v = load_int8_as_int16(q + d);
+#pragma GCC unroll 4
+      for (int r = 0; r < 4; ++r) {
+        acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(q_v, load_int8_as_int16(k_block + r * head_dim + d)));
+      }
+    }
+    // The four sums and their scores are finished together.
+    __m128i dots = horizontal_sum4_epi32(acc);
+    if (vector_dims < head_dim) {
+      alignas(16) std::int32_t tails[4] = {};
+      for (int r = 0; r < 4; ++r) {
+        for (int d = vector_dims; d < head_dim; ++d) {
+          tails[r] += static_cast<std::int32_t>(q[d]) * k_block[r * head_dim + d];
+        }
+      }
+      dots = _mm_add_epi32(dots, _mm_load_si128(reinterpret_cast<const __m128i*>(tails)));
+    }
+    _mm_storeu_ps(scores + j, _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(dots), _mm_set1_ps(q_scale)),
+                                         _mm_loadu_ps(key_scales + j)));
+  }
+  for (; j < num_keys; ++j) {
+    const std::int8_t* k_vec = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    __m256i acc = _mm256_setzero_si256();
+    for (int d = 0; d < vector_dims; d += 16) {
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(load_int8_as_int16(q + d), load_int8_as_int16(k_vec + d)));
+    }
+    finish(j, acc);
+  }
+}
+
+void avx2_dequantize_int8(const std::int8_t* in, int n, float scale, float* out) {
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i widened = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(widened), scale_v));
+  }
+  for (; i < n; ++i) {
+    out[i] = static_cast<float>(in[i]) * scale;
+  }
+}
+
+void avx2_scores(const float* q, const float* keys, int num_keys, int head_dim, float scale, float* scores) {
+  for (int j = 0; j < num_keys; ++j) {
+    scores[j] = avx2_dot(q, keys + static_cast<std::ptrdiff_t>(j) * head_dim, head_dim) * scale;
+  }
+}
+
+void avx2_accumulate(const float* weights, const float* values, int num_keys, int head_dim, float* out) {
+  for (int j = 0; j < num_keys; ++j) {
+    avx2_axpy(weights[j], values + static_cast<std::ptrdiff_t>(j) * head_dim, out, head_dim);
+  }
+}
+
+// Lane r of the result is the horizontal sum of v[r].
+inline __m256 horizontal_sum8(const __m256* v) {
+  const __m256 sum01 = _mm256_hadd_ps(v[0], v[1]);
+  const __m256 sum23 = _mm256_hadd_ps(v[2], v[3]);
+  const __m256 sum45 = _mm256_hadd_ps(v[4], v[5]);
+  const __m256 sum67 = _mm256_hadd_ps(v[6], v[7]);
+  const __m256 sum0123 = _mm256_hadd_ps(sum01, sum23);
+  const __m256 sum4567 = _mm256_hadd_ps(sum45, sum67);
+  return _mm256_add_ps(_mm256_permute2f128_ps(sum0123, sum4567, 0x20),
+                       _mm256_permute2f128_ps(sum0123, sum4567, 0x31));
+}
+
+// Eight keys per step share every load of the query row.
+template <int kHeadDim>
+void avx2_scores_fixed(const float* q, const float* keys, int num_keys, int, float scale, float* scores) {
+  constexpr int kVectors = kHeadDim / 8;
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  int j = 0;
+  for (; j + 8 <= num_keys; j += 8) {
+    const float* k_block = keys + static_cast<std::ptrdiff_t>(j) * kHeadDim;
+    __m256 acc[8];
+#pragma GCC unroll 8
+    for (int r = 0; r < 8; ++r) {
+      acc[r] = _mm256_setzero_ps();
+    }
+#pragma GCC unroll 32
+    for (int c = 0; c < kVectors; ++c) {
+      const __m256 q_v = _mm256_loadu_ps(q + c * 8);
+#pragma GCC unroll 8
+      for (int r = 0; r < 8; ++r) {
+        acc[r] = _mm256_fmadd_ps(q_v, _mm256_loadu_ps(k_block + r * kHeadDim + c * 8), acc[r]);
+      }
+    }
+    _mm256_storeu_ps(scores + j, _mm256_mul_ps(horizontal_sum8(acc), scale_v));
+  }
+  for (; j < num_keys; ++j) {
+    const float* k_vec = keys + static_cast<std::ptrdiff_t>(j) * kHeadDim;
+    __m256 acc = _mm256_setzero_ps();
+#pragma GCC unroll 32
+    for (int c = 0; c < kVectors; ++c) {
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(q + c * 8), _mm256_loadu_ps(k_vec + c * 8), acc);
+    }
+    scores[j] = horizontal_sum(acc) * scale;
+  }
+}
+
+// The output row is held in registers across all keys, 64 dims at a time
+// beyond 96 so the accumulators and operands fit the 16 YMM registers.
+template <int kHeadDim>
+void avx2_accumulate_fixed(const float* weights, const float* values, int num_keys, int, float* out) {
+  constexpr int kChunk = kHeadDim <= 96 ? kHeadDim : 64;
+  constexpr int kVectors = kChunk / 8;
+  for (int base = 0; base < kHeadDim; base += kChunk) {
+    __m256 acc[kVectors];
+#pragma GCC unroll 16
+    for (int c = 0; c < kVectors; ++c) {
+      acc[c] = _mm256_loadu_ps(out + base + c * 8);
+    }
+    for (int j = 0; j < num_keys; ++j) {
+      const __m256 weight = _mm256_set1_ps(weights[j]);
+      const float* v_vec = values + static_cast<std::ptrdiff_t>(j) * kHeadDim + base;
+#pragma GCC unroll 16
+      for (int c = 0; c < kVectors; ++c) {
+        acc[c] = _mm256_fmadd_ps(weight, _mm256_loadu_ps(v_vec + c * 8), acc[c]);
+      }
+    }
+#pragma GCC unroll 16
+    for (int c = 0; c < kVectors; ++c) {
+      _mm256_storeu_ps(out + base + c * 8, acc[c]);
+    }
+  }
+}
+
+template <int kHeadDim>
+constexpr CpuTileKernels avx2_tiles() {
+  return {kHeadDim, avx2_scores_fixed<kHeadDim>, avx2_accumulate_fixed<kHeadDim>};
+}
+
+constexpr CpuTileKernels kAvx2Tiles[] = {
+    avx2_tiles<32>(), avx2_tiles<64>(), avx2_tiles<96>(), avx2_tiles<128>(), avx2_tiles<256>(),
+};
+
+}  // namespace
+
+const CpuKernelTable& avx2_kernel_table() {
+  static constexpr CpuKernelTable table{
+      CpuIsa::kAvx2,
+      "avx2",
+      avx2_dot,
+      avx2_membership,
+      avx2_membership_lookup,
+      avx2_membership_triangular,
+      avx2_membership_trapezoidal,
+      avx2_axpy,
+      avx2_widen_half,
+      avx2_narrow_half,
+      avx2_widen_bfloat16,
+      avx2_narrow_bfloat16,
+      avx2_quantize_int8,
+      avx2_quantized_scores,
+      avx2_dequantize_int8,
+      {0, avx2_scores, avx2_accumulate},
+      kAvx2Tiles,
+  };
+  return table;
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
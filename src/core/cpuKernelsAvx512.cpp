@@ -0,0 +1,458 @@
+// Built with -mavx512f; only reached after CPUID reports it.
+#include "fuzzformer/cpuKernels.h"
+#include "fuzzformer/membershipTable.h"
+#include "fuzzformer/storageType.h"
+
+#include <immintrin.h>
+
+#include <cstddef>
+
+namespace fuzzformer {
+namespace kernels {
+
+namespace {
+
+inline __mmask16 tail_mask(int remaining) {
+  return static_cast<__mmask16>((1U << remaining) - 1U);
+}
+
+// Same reduction and polynomial as the AVX2 exp; scalef applies 2^n.
+inline __m512 exp_ps(__m512 x) {
+  const __m512 max_x = _mm512_set1_ps(88.3762626647949f);
+  const __m512 min_x = _mm512_set1_ps(-87.0f);
+  const __mmask16 in_range = _mm512_cmp_ps_mask(x, min_x, _CMP_GE_OQ);
+  x = _mm512_max_ps(_mm512_min_ps(x, max_x), min_x);
+
+  const __m512 fx = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)),
+                                         _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(fx, _mm512_set1_ps(0.693359375f), x);
+  r = _mm512_fnmadd_ps(fx, _mm512_set1_ps(-2.12194440e-4f), r);
+
+  __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+  p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+
+  return _mm512_maskz_scalef_ps(in_range, p, fx);
+}
+
+inline __m512 membership_ps(__m512 scores, __m512 neg_alpha, __m512 beta) {
+  const __m512 diff = _mm512_sub_ps(scores, beta);
+  return exp_ps(_mm512_mul_ps(neg_alpha, _mm512_mul_ps(diff, diff)));
+}
+
+// Sixteen-lane triangle and trapezoid; see the AVX2 versions.
+inline __m512 triangular_ps(__m512 scores, __m512 alpha, __m512 beta) {
+  const __m512 distance = _mm512_abs_ps(_mm512_sub_ps(scores, beta));
+  return _mm512_max_ps(_mm512_sub_ps(_mm512_set1_ps(1.0f), _mm512_mul_ps(alpha, distance)), _mm512_setzero_ps());
+}
+
+inline __m512 trapezoidal_ps(__m512 scores, __m512 two_alpha, __m512 beta) {
+  const __m512 distance = _mm512_abs_ps(_mm512_sub_ps(scores, beta));
+  const __m512 ramp = _mm512_sub_ps(_mm512_set1_ps(2.0f), _mm512_mul_ps(two_alpha, distance));
+  return _mm512_min_ps(_mm512_max_ps(ramp, _mm512_setzero_ps()), _mm512_set1_ps(1.0f));
+}
+
+// Runs a sixteen-lane membership over count scores and returns the sum; the
+// tail is masked.
+template <typename Lanes>
+float compact_membership(const float* scores, int count, float beta, float* out, Lanes lanes) {
+  const __m512 beta_v = _mm512_set1_ps(beta);
+  __m512 sum = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512 m = lanes(_mm512_loadu_ps(scores + i), beta_v);
+    _mm512_storeu_ps(out + i, m);
+    sum = _mm512_add_ps(sum, m);
+  }
+  if (i < count) {
+    const __mmask16 mask = tail_mask(count - i);
+    const __m512 m = lanes(_mm512_mask_loadu_ps(beta_v, mask, scores + i), beta_v);
+    _mm512_mask_storeu_ps(out + i, mask, m);
+    sum = _mm512_mask_add_ps(sum, mask, sum, m);
+  }
+  return _mm512_reduce_add_ps(sum);
+}
+
+float avx512_dot(const float* a, const float* b, int n) {
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+  }
+  for (; i + 16 <= n; i += 16) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+  }
+  if (i < n) {
+    const __mmask16 mask = tail_mask(n - i);
+    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+// Sixteen-lane lookup_membership; see the AVX2 version. Two 64-bit gathers
+// fetch the (value, rise) pairs of the low and high eight lanes.
+inline __m512 lookup_membership_ps(const float* table, __m512 scores, __m512 scaled_alpha, __m512 beta) {
+  const __m512 diff = _mm512_sub_ps(scores, beta);
+  // As in the AVX2 version: NaN lands on the range, negative t on 0.
+  const __m512 x = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(scaled_alpha, _mm512_mul_ps(diff, diff)),
+                                               _mm512_set1_ps(static_cast<float>(kMembershipTableBuckets))),
+                                 _mm512_setzero_ps());
+  const __m512i index = _mm512_cvttps_epi32(x);
+  const __m512 frac = _mm512_sub_ps(x, _mm512_cvtepi32_ps(index));
+  const __m512 low = _mm512_castsi512_ps(_mm512_i32gather_epi64(_mm512_castsi512_si256(index), table, 8));
+  const __m512 high = _mm512_castsi512_ps(_mm512_i32gather_epi64(_mm512_extracti64x4_epi64(index, 1), table, 8));
+  const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+  const __m512i odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+  const __m512 values = _mm512_permutex2var_ps(low, even, high);
+  const __m512 rises = _mm512_permutex2var_ps(low, odd, high);
+  return _mm512_fmadd_ps(frac, rises, values);
+}
+
+float avx512_membership(const float* scores, int count, float alpha, float beta, float* out) {
+  const __m512 neg_alpha = _mm512_set1_ps(-alpha);
+  const __m512 beta_v = _mm512_set1_ps(beta);
+  __m512 sum = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512 m = membership_ps(_mm512_loadu_ps(scores + i), neg_alpha, beta_v);
+    _mm512_storeu_ps(out + i, m);
+    sum = _mm512_add_ps(sum, m);
+  }
+  if (i < count) {
+    const __mmask16 mask = tail_mask(count - i);
+    const __m512 m = membership_ps(_mm512_mask_loadu_ps(beta_v, mask, scores + i), neg_alpha, beta_v);
+    _mm512_mask_storeu_ps(out + i, mask, m);
+    sum = _mm512_mask_add_ps(sum, mask, sum, m);
+  }
+  return _mm512_reduce_add_ps(sum);
+}
+
+float avx512_membership_lookup(const float* scores, int count, float alpha, float beta, float* out) {
+  const float* table = membership_table();
+  const __m512 scaled_alpha = _mm512_set1_ps(alpha / kMembershipTableStep);
+  const __m512 beta_v = _mm512_set1_ps(beta);
+  __m512 sum = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512 m = lookup_membership_ps(table, _mm512_loadu_ps(scores + i), scaled_alpha, beta_v);
+    _mm512_storeu_ps(out + i, m);
+    sum = _mm512_add_ps(sum, m);
+  }
+  if (i < count) {
+    const __mmask16 mask = tail_mask(count - i);
+    const __m512 m = lookup_membership_ps(table, _mm512_mask_loadu_ps(beta_v, mask, scores + i), scaled_alpha, beta_v);
+    _mm512_mask_storeu_ps(out + i, mask, m);
+    sum = _mm512_mask_add_ps(sum, mask, sum, m);
+  }
+  return _mm512_reduce_add_ps(sum);
+}
+
+float avx512_membership_triangular(const float* scores, int count, float alpha, float beta, float* out) {
+  const __m512 alpha_v = _mm512_set1_ps(alpha);
+  return compact_membership(scores, count, beta, out,
+                            [&](__m512 s, __m512 beta_v) { return triangular_ps(s, alpha_v, beta_v); });
+}
+
+float avx512_membership_trapezoidal(const float* scores, int count, float alpha, float beta, float* out) {
+  const __m512 two_alpha = _mm512_set1_ps(2.0f * alpha);
+  return compact_membership(scores, count, beta, out,
+                            [&](__m512 s, __m512 beta_v) { return trapezoidal_ps(s, two_alpha, beta_v); });
+}
+
+void avx512_axpy(float a, const float* x, float* y, int n) {
+  const __m512 a_v = _mm512_set1_ps(a);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a_v, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+  }
+  if (i < n) {
+    const __mmask16 mask = tail_mask(n - i);
+    const __m512 y_v = _mm512_maskz_loadu_ps(mask, y + i);
+    _mm512_mask_storeu_ps(y + i, mask, _mm512_fmadd_ps(a_v, _mm512_maskz_loadu_ps(mask, x + i), y_v));
+  }
+}
+
+// AVX-512F converts half precision itself; the bfloat16 conversions are
+// integer shifts and rounding, the same as the AVX2 ones. Tails use the
+// scalar conversions, since masked 16-bit loads need AVX-512BW.
+void avx512_widen_half(const std::uint16_t* in, int n, float* out) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(out + i, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i))));
+  }
+  for (; i < n; ++i) {
+    out[i] = half_to_float(in[i]);
+  }
+}
+
+void avx512_narrow_half(const float* in, int n, std::uint16_t* out) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm512_cvtps_ph(_mm512_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  }
+  for (; i < n; ++i) {
+    out[i] = float_to_half(in[i]);
+  }
+}
+
+void avx512_widen_bfloat16(const std::uint16_t* in, int n, float* out) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)));
+    _mm512_storeu_ps(out + i, _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16)));
+  }
+  for (; i < n; ++i) {
+    out[i] = bfloat16_to_float(in[i]);
+  }
+}
+
+void avx512_narrow_bfloat16(const float* in, int n, std::uint16_t* out) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m512 value = _mm512_loadu_ps(in + i);
+    const __m512i bits = _mm512_castps_si512(value);
+    const __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1));
+    __m512i rounded = _mm512_add_epi32(bits, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff)));
+    const __mmask16 nan = _mm512_cmp_ps_mask(value, value, _CMP_UNORD_Q);
+    rounded = _mm512_mask_or_epi32(rounded, nan, bits, _mm512_set1_epi32(0x400000));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtepi32_epi16(_mm512_srli_epi32(rounded, 16)));
+  }
+  for (; i < n; ++i) {
+    out[i] = float_to_bfloat16(in[i]);
+  }
+}
+
+// The AVX2 quantisation on sixteen lanes, with masked tails: masked-off
+// lanes load as 0, and vpmovsdb stores only the live bytes.
+float avx512_quantize_int8(const float* in, int n, std::int8_t* out, std::int32_t* sum) {
+  __m512 max_v = _mm512_setzero_ps();
+  for (int i = 0; i < n; i += 16) {
+    const __mmask16 mask = n - i >= 16 ? static_cast<__mmask16>(0xffff) : tail_mask(n - i);
+    max_v = _mm512_max_ps(max_v, _mm512_abs_ps(_mm512_maskz_loadu_ps(mask, in + i)));
+  }
+  const float max_abs = _mm512_reduce_max_ps(max_v);
+
+  const float inv_scale = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+  const __m512 inv_scale_v = _mm512_set1_ps(inv_scale);
+  __m512i total = _mm512_setzero_si512();
+  for (int i = 0; i < n; i += 16) {
+    const __mmask16 mask = n - i >= 16 ? static_cast<__mmask16>(0xffff) : tail_mask(n - i);
+    const __m512i q = _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_maskz_loadu_ps(mask, in + i), inv_scale_v));
+    total = _mm512_add_epi32(total, q);
+    _mm512_mask_cvtsepi32_storeu_epi8(out + i, mask, q);
+  }
+  *sum = _mm512_reduce_add_epi32(total);
+  return max_abs / 127.0f;
+}
+
+inline std::int32_t horizontal_sum_epi32(__m256i v) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(sum);
+}
+
+// Lane r of the result is the sum of the lanes of v[r].
+inline __m128i horizontal_sum4_epi32(const __m256i v[4]) {
+  const __m256i sums = _mm256_hadd_epi32(_mm256_hadd_epi32(v[0], v[1]), _mm256_hadd_epi32(v[2], v[3]));
+  return _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+}
+
+inline __m256i load_int8_as_int16(const std::int8_t* p) {
+  return _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+// AVX-512F has no byte or word multiplies (those are AVX-512BW, and the
+// int8 dot product is AVX-512 VNNI, see cpuKernelsAvx512Vnni.cpp), so this
+// is the 256-bit madd loop of the AVX2 table.
+void avx512_quantized_scores(const std::int8_t* q, float q_scale, const std::int8_t* keys, const float* key_scales,
+                             const std::int32_t*, int num_keys, int head_dim, float* scores) {
+  const int vector_dims = head_dim / 16 * 16;
+  auto finish = [&](int j, __m256i acc) {
+    const std::int8_t* k_vec = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    std::int32_t dot = horizontal_sum_epi32(acc);
+    for (int d = vector_dims; d < head_dim; ++d) {
+      dot += static_cast<std::int32_t>(q[d]) * k_vec[d];
+    }
+    scores[j] = static_cast<float>(dot) * q_scale * key_scales[j];
+  };
+
+  int j = 0;
+  for (; j + 4 <= num_keys; j += 4) {
+    const std::int8_t* k_block = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    __m256i acc[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(),
+                      _mm256_setzero_si256()};
+    for (int d = 0; d < vector_dims; d += 16) {
+      const __m256i q_v = load_int8_as_int16(q + d);
+#pragma GCC unroll 4
+      for (int r = 0; r < 4; ++r) {
+        acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(q_v, load_int8_as_int16(k_block + r * head_dim + d)));
+      }
+    }
+    // The four sums and their scores are finished together.
+    __m128i dots = horizontal_sum4_epi32(acc);
+    if (vector_dims < head_dim) {
+      alignas(16) std::int32_t tails[4] = {};
+      for (int r = 0; r < 4; ++r) {
+        for (int d = vector_dims; d < head_dim; ++d) {
+          tails[r] += static_cast<std::int32_t>(q[d]) * k_block[r * head_dim + d];
+        }
+      }
+      dots = _mm_add_epi32(dots, _mm_load_si128(reinterpret_cast<const __m128i*>(tails)));
+    }
+    _mm_storeu_ps(scores + j, _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(dots), _mm_set1_ps(q_scale)),
+                                         _mm_loadu_ps(key_scales + j)));
+  }
+  for (; j < num_keys; ++j) {
+    const std::int8_t* k_vec = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    __m256i acc = _mm256_setzero_si256();
+    for (int d = 0; d < vector_dims; d += 16) {
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(load_int8_as_int16(q + d), load_int8_as_int16(k_vec + d)));
+    }
+    finish(j, acc);
+  }
+}
+
+// Masked byte loads need AVX-512BW, so the tail is scalar.
+void avx512_dequantize_int8(const std::int8_t* in, int n, float scale, float* out) {
+  const __m512 scale_v = _mm512_set1_ps(scale);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m512i widened = _mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(widened), scale_v));
+  }
+  for (; i < n; ++i) {
+    out[i] = static_cast<float>(in[i]) * scale;
+  }
+}
+
+void avx512_scores(const float* q, const float* keys, int num_keys, int head_dim, float scale, float* scores) {
+  for (int j = 0; j < num_keys; ++j) {
+    scores[j] = avx512_dot(q, keys + static_cast<std::ptrdiff_t>(j) * head_dim, head_dim) * scale;
+  }
+}
+
+void avx512_accumulate(const float* weights, const float* values, int num_keys, int head_dim, float* out) {
+  for (int j = 0; j < num_keys; ++j) {
+    avx512_axpy(weights[j], values + static_cast<std::ptrdiff_t>(j) * head_dim, out, head_dim);
+  }
+}
+
+inline __m256 fold_to_256(__m512 v) {
+  return _mm256_add_ps(_mm512_castps512_ps256(v),
+                       _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
+
+// Lane r of the result is the horizontal sum of v[r].
+inline __m256 horizontal_sum8(const __m512* v) {
+  const __m256 sum01 = _mm256_hadd_ps(fold_to_256(v[0]), fold_to_256(v[1]));
+  const __m256 sum23 = _mm256_hadd_ps(fold_to_256(v[2]), fold_to_256(v[3]));
+  const __m256 sum45 = _mm256_hadd_ps(fold_to_256(v[4]), fold_to_256(v[5]));
+  const __m256 sum67 = _mm256_hadd_ps(fold_to_256(v[6]), fold_to_256(v[7]));
+  const __m256 sum0123 = _mm256_hadd_ps(sum01, sum23);
+  const __m256 sum4567 = _mm256_hadd_ps(sum45, sum67);
+  return _mm256_add_ps(_mm256_permute2f128_ps(sum0123, sum4567, 0x20),
+                       _mm256_permute2f128_ps(sum0123, sum4567, 0x31));
+}
+
+// Eight keys per step share every load of the query row.
+template <int kHeadDim>
+void avx512_scores_fixed(const float* q, const float* keys, int num_keys, int, float scale, float* scores) {
+  constexpr int kVectors = kHeadDim / 16;
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  int j = 0;
+  for (; j + 8 <= num_keys; j += 8) {
+    const float* k_block = keys + static_cast<std::ptrdiff_t>(j) * kHeadDim;
+    __m512 acc[8];
+#pragma GCC unroll 8
+    for (int r = 0; r < 8; ++r) {
+      acc[r] = _mm512_setzero_ps();
+    }
+#pragma GCC unroll 16
+    for (int c = 0; c < kVectors; ++c) {
+      const __m512 q_v = _mm512_loadu_ps(q + c * 16);
+#pragma GCC unroll 8
+      for (int r = 0; r < 8; ++r) {
+        acc[r] = _mm512_fmadd_ps(q_v, _mm512_loadu_ps(k_block + r * kHeadDim + c * 16), acc[r]);
+      }
+    }
+    _mm256_storeu_ps(scores + j, _mm256_mul_ps(horizontal_sum8(acc), scale_v));
+  }
+  for (; j < num_keys; ++j) {
+    const float* k_vec = keys + static_cast<std::ptrdiff_t>(j) * kHeadDim;
+    __m512 acc = _mm512_setzero_ps();
+#pragma GCC unroll 16
+    for (int c = 0; c < kVectors; ++c) {
+      acc = _mm512_fmadd_ps(_mm512_loadu_ps(q + c * 16), _mm512_loadu_ps(k_vec + c * 16), acc);
+    }
+    scores[j] = _mm512_reduce_add_ps(acc) * scale;
+  }
+}
+
+// Up to 256 dims of output fit in 16 of the 32 ZMM registers, so the whole
+// row stays in registers across all keys.
+template <int kHeadDim>
+void avx512_accumulate_fixed(const float* weights, const float* values, int num_keys, int, float* out) {
+  constexpr int kVectors = kHeadDim / 16;
+  __m512 acc[kVectors];
+#pragma GCC unroll 16
+  for (int c = 0; c < kVectors; ++c) {
+    acc[c] = _mm512_loadu_ps(out + c * 16);
+  }
+  for (int j = 0; j < num_keys; ++j) {
+    const __m512 weight = _mm512_set1_ps(weights[j]);
+    const float* v_vec = values + static_cast<std::ptrdiff_t>(j) * kHeadDim;
+#pragma GCC unroll 16
+    for (int c = 0; c < kVectors; ++c) {
+      acc[c] = _mm512_fmadd_ps(weight, _mm512_loadu_ps(v_vec + c * 16), acc[c]);
+    }
+  }
+#pragma GCC unroll 16
+  for (int c = 0; c < kVectors; ++c) {
+    _mm512_storeu_ps(out + c * 16, acc[c]);
+  }
+}
+
+template <int kHeadDim>
+constexpr CpuTileKernels avx512_tiles() {
+  return {kHeadDim, avx512_scores_fixed<kHeadDim>, avx512_accumulate_fixed<kHeadDim>};
+}
+
+constexpr CpuTileKernels kAvx512Tiles[] = {
+    avx512_tiles<32>(), avx512_tiles<64>(), avx512_tiles<96>(), avx512_tiles<128>(), avx512_tiles<256>(),
+};
+
+}  // namespace
+
+const CpuKernelTable& avx512_kernel_table() {
+  static constexpr CpuKernelTable table{
+      CpuIsa::kAvx512,
+      "avx512",
+      avx512_dot,
+      avx512_membership,
+      avx512_membership_lookup,
+      avx512_membership_triangular,
+      avx512_membership_trapezoidal,
+      avx512_axpy,
+      avx512_widen_half,
+      avx512_narrow_half,
+      avx512_widen_bfloat16,
+      avx512_narrow_bfloat16,
+      avx512_quantize_int8,
+      avx512_quantized_scores,
+      avx512_dequantize_int8,
+      {0, avx512_scores, avx512_accumulate},
+      kAvx512Tiles,
+  };
+  return table;
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
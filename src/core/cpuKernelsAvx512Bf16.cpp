@@ -0,0 +1,82 @@
+// Built with -mavx512f -mavx512bw -mavx512vl -mavx512bf16; only reached
+// after CPUID reports them and AVX-512 VNNI.
+#include "fuzzformer/cpuKernels.h"
+
+#include <immintrin.h>
+
+#include <bit>
+#include <cstdint>
+
+namespace fuzzformer {
+namespace kernels {
+
+const CpuKernelTable& avx512_vnni_kernel_table();
+
+namespace {
+
+inline __mmask16 tail_mask(int remaining) {
+  return static_cast<__mmask16>((1U << remaining) - 1U);
+}
+
+// Lanes of float bits holding a subnormal, which vcvtne2ps2bf16 flushes to
+// zero where float_to_bfloat16 rounds it.
+inline __mmask16 subnormal_lanes(__m512i bits) {
+  return _mm512_mask_test_epi32_mask(_mm512_testn_epi32_mask(bits, _mm512_set1_epi32(0x7f800000)), bits,
+                                     _mm512_set1_epi32(0x007fffff));
+}
+
+// float_to_bfloat16 in integer arithmetic, as in the AVX-512 table, for
+// finite lanes only.
+inline __m256i round_bfloat16(__m512i bits) {
+  const __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1));
+  return _mm512_cvtepi32_epi16(
+      _mm512_srli_epi32(_mm512_add_epi32(bits, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff))), 16));
+}
+
+// vcvtne2ps2bf16 rounds 32 floats at a time to nearest even and quiets NaNs
+// as float_to_bfloat16 does; the rare subnormal lanes are rounded again in
+// integer arithmetic. The tail goes through the same steps masked.
+void bf16_narrow_bfloat16(const float* in, int n, std::uint16_t* out) {
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m512 low = _mm512_loadu_ps(in + i);
+    const __m512 high = _mm512_loadu_ps(in + i + 16);
+    __m512i narrow = std::bit_cast<__m512i>(_mm512_cvtne2ps_pbh(high, low));
+    const __m512i low_bits = _mm512_castps_si512(low);
+    const __m512i high_bits = _mm512_castps_si512(high);
+    const __mmask32 subnormal =
+        subnormal_lanes(low_bits) | static_cast<__mmask32>(subnormal_lanes(high_bits)) << 16;
+    if (subnormal != 0) {
+      const __m512i rounded =
+          _mm512_inserti64x4(_mm512_castsi256_si512(round_bfloat16(low_bits)), round_bfloat16(high_bits), 1);
+      narrow = _mm512_mask_blend_epi16(subnormal, narrow, rounded);
+    }
+    _mm512_storeu_si512(out + i, narrow);
+  }
+  for (; i < n; i += 16) {
+    const __mmask16 mask = tail_mask(n - i);
+    const __m512 value = _mm512_maskz_loadu_ps(mask, in + i);
+    const __m512i bits = _mm512_castps_si512(value);
+    const __m256i narrow = _mm256_mask_blend_epi16(subnormal_lanes(bits),
+                                                   std::bit_cast<__m256i>(_mm512_cvtneps_pbh(value)),
+                                                   round_bfloat16(bits));
+    _mm256_mask_storeu_epi16(out + i, mask, narrow);
+  }
+}
+
+}  // namespace
+
+// Every other entry is the AVX-512 VNNI table's.
+const CpuKernelTable& avx512_bf16_kernel_table() {
+  static const CpuKernelTable table = [] {
+    CpuKernelTable bf16 = avx512_vnni_kernel_table();
+    bf16.isa = CpuIsa::kAvx512Bf16;
+    bf16.name = "avx512bf16";
+    bf16.narrow_bfloat16 = bf16_narrow_bfloat16;
+    return bf16;
+  }();
+  return table;
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
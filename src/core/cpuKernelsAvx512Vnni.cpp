@@ -0,0 +1,91 @@
+// Built with -mavx512f -mavx512bw -mavx512vnni; only reached after CPUID
+// reports all three.
+#include "fuzzformer/cpuKernels.h"
+
+#include <immintrin.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace fuzzformer {
+namespace kernels {
+
+const CpuKernelTable& avx512_kernel_table();
+
+namespace {
+
+inline __mmask64 byte_mask(int remaining) {
+  return remaining >= 64 ? ~__mmask64{0} : (__mmask64{1} << remaining) - 1;
+}
+
+// Lane r of the result is the sum of the lanes of v[r].
+inline __m128i horizontal_sum4_epi32(const __m512i v[4]) {
+  __m256i halves[4];
+  for (int r = 0; r < 4; ++r) {
+    halves[r] = _mm256_add_epi32(_mm512_castsi512_si256(v[r]), _mm512_extracti64x4_epi64(v[r], 1));
+  }
+  const __m256i sums = _mm256_hadd_epi32(_mm256_hadd_epi32(halves[0], halves[1]),
+                                         _mm256_hadd_epi32(halves[2], halves[3]));
+  return _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+}
+
+// vpdpbusd multiplies unsigned by signed bytes, four at a time, into int32
+// lanes. q ^ 0x80 is q + 128 as an unsigned byte, so every dot product comes
+// out 128 * key_sums[j] too high, which is taken off before dequantising.
+// Masked-off bytes load as zero keys and contribute nothing. Four keys per
+// step share every load of the query row.
+void vnni_quantized_scores(const std::int8_t* q, float q_scale, const std::int8_t* keys, const float* key_scales,
+                           const std::int32_t* key_sums, int num_keys, int head_dim, float* scores) {
+  const __m512i bias = _mm512_set1_epi8(static_cast<char>(0x80));
+  auto finish = [&](int j, __m512i acc) {
+    const std::int32_t dot = _mm512_reduce_add_epi32(acc) - 128 * key_sums[j];
+    scores[j] = static_cast<float>(dot) * q_scale * key_scales[j];
+  };
+
+  int j = 0;
+  for (; j + 4 <= num_keys; j += 4) {
+    const std::int8_t* k_block = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    __m512i acc[4] = {_mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512(),
+                      _mm512_setzero_si512()};
+    for (int d = 0; d < head_dim; d += 64) {
+      const __mmask64 mask = byte_mask(head_dim - d);
+      const __m512i q_v = _mm512_xor_si512(_mm512_maskz_loadu_epi8(mask, q + d), bias);
+#pragma GCC unroll 4
+      for (int r = 0; r < 4; ++r) {
+        acc[r] = _mm512_dpbusd_epi32(acc[r], q_v, _mm512_maskz_loadu_epi8(mask, k_block + r * head_dim + d));
+      }
+    }
+    // The four sums and their scores are finished together.
+    const __m128i bias_sums = _mm_slli_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(key_sums + j)), 7);
+    const __m128i dots = _mm_sub_epi32(horizontal_sum4_epi32(acc), bias_sums);
+    _mm_storeu_ps(scores + j, _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(dots), _mm_set1_ps(q_scale)),
+                                         _mm_loadu_ps(key_scales + j)));
+  }
+  for (; j < num_keys; ++j) {
+    const std::int8_t* k_vec = keys + static_cast<std::ptrdiff_t>(j) * head_dim;
+    __m512i acc = _mm512_setzero_si512();
+    for (int d = 0; d < head_dim; d += 64) {
+      const __mmask64 mask = byte_mask(head_dim - d);
+      acc = _mm512_dpbusd_epi32(acc, _mm512_xor_si512(_mm512_maskz_loadu_epi8(mask, q + d), bias),
+                                _mm512_maskz_loadu_epi8(mask, k_vec + d));
+    }
+    finish(j, acc);
+  }
+}
+
+}  // namespace
+
+// Every other entry is the AVX-512 table's.
+const CpuKernelTable& avx512_vnni_kernel_table() {
+  static const CpuKernelTable table = [] {
+    CpuKernelTable vnni = avx512_kernel_table();
+    vnni.isa = CpuIsa::kAvx512Vnni;
+    vnni.name = "avx512vnni";
+    vnni.quantized_scores = vnni_quantized_scores;
+    return vnni;
+  }();
+  return table;
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
@@ -6,6 +6,20 @@
 #include <c10/cuda/CUDAStream.h>
 #include <cuda_runtime.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "fuzzformer/attentionStrides.h"
+#include "fuzzformer/fuzzyAttentionCpu.h"
+#include "fuzzformer/keyPruning.h"
+#include "fuzzformer/keySplits.h"
+#include "fuzzformer/membership.h"
+#include "fuzzformer/membershipPolynomial.h"
+#include "fuzzformer/metricsCollector.h"
 #include "fuzzformer/tensorUtils.h"
 
 namespace fuzzformer {
@@ -16,136 +30,1662 @@ void launch_fuzzy_attention_forward(const float* queries,
                                     const float* values,
                                     const float* alpha,
                                     const float* beta,
+                                    FuzzyMembership membership,
                                     float* output,
+                                    float* row_norms,
+                                    const int* key_lengths,
+                                    bool causal,
+                                    int window,
                                     int batch_size,
                                     int num_heads,
-                                    int seq_len,
+                                    int num_queries,
+                                    int num_keys,
                                     int head_dim,
+                                    bool specialize_head_dim,
+                                    const AttentionStrides* strides,
                                     cudaStream_t stream);
 
+void launch_fuzzy_attention_forward_fused(const float* queries,
+                                          const float* keys,
+                                          const float* values,
+                                          const float* alpha,
+                                          const float* beta,
+                                          FuzzyMembership membership,
+                                          float* output,
+                                          float* row_norms,
+                                          const int* key_lengths,
+                                          bool causal,
+                                          int window,
+                                          const KeyPruning* pruning,
+                                          int batch_size,
+                                          int num_heads,
+                                          int num_queries,
+                                          int num_keys,
+                                          int head_dim,
+                                          bool specialize_head_dim,
+                                          const AttentionStrides* strides,
+                                          cudaStream_t stream);
+
+void launch_fuzzy_attention_forward_fused_16bit(const std::uint16_t* queries,
+                                                const std::uint16_t* keys,
+                                                const std::uint16_t* values,
+                                                bool bfloat16,
+                                                const float* alpha,
+                                                const float* beta,
+                                                FuzzyMembership membership,
+                                                float* output,
+                                                float* row_norms,
+                                                const int* key_lengths,
+                                                bool causal,
+                                                int window,
+                                                const KeyPruning* pruning,
+                                                int batch_size,
+                                                int num_heads,
+                                                int num_queries,
+                                                int num_keys,
+                                                int head_dim,
+                                                bool specialize_head_dim,
+                                                const AttentionStrides* strides,
+                                                cudaStream_t stream);
+
+void launch_fuzzy_attention_forward_sweep(const float* queries,
+                                          const float* keys,
+                                          const float* values,
+                                          const float* alpha,
+                                          const float* beta,
+                                          int num_params,
+                                          FuzzyMembership membership,
+                                          float* output,
+                                          std::int64_t param_stride,
+                                          const int* key_lengths,
+                                          bool causal,
+                                          int window,
+                                          int batch_size,
+                                          int num_heads,
+                                          int num_queries,
+                                          int num_keys,
+                                          int head_dim,
+                                          const AttentionStrides& strides,
+                                          cudaStream_t stream);
+
+void launch_fuzzy_attention_forward_varlen(const float* queries,
+                                           const float* keys,
+                                           const float* values,
+                                           const float* alpha,
+                                           const float* beta,
+                                           FuzzyMembership membership,
+                                           float* output,
+                                           const int* cu_seqlens,
+                                           bool causal,
+                                           int window,
+                                           int num_seqs,
+                                           int total_tokens,
+                                           int num_heads,
+                                           int num_kv_heads,
+                                           int head_dim,
+                                           cudaStream_t stream);
+
+void launch_fuzzy_attention_forward_cached(const float* queries,
+                                           const float* keys,
+                                           const float* values,
+                                           const float* alpha,
+                                           const float* beta,
+                                           FuzzyMembership membership,
+                                           float* output,
+                                           float* partial_norms,
+                                           float* partial_output,
+                                           const AttentionStrides& strides,
+                                           int batch_size,
+                                           int num_heads,
+                                           int num_queries,
+                                           int num_keys,
+                                           int head_dim,
+                                           int window,
+                                           int ring_rows,
+                                           int key_splits,
+                                           cudaStream_t stream);
+
+void launch_fuzzy_attention_forward_cached_16bit(const std::uint16_t* queries,
+                                                 const std::uint16_t* keys,
+                                                 const std::uint16_t* values,
+                                                 bool bfloat16,
+                                                 const float* alpha,
+                                                 const float* beta,
+                                                 FuzzyMembership membership,
+                                                 float* output,
+                                                 float* partial_norms,
+                                                 float* partial_output,
+                                                 const AttentionStrides& strides,
+                                                 int batch_size,
+                                                 int num_heads,
+                                                 int num_queries,
+                                                 int num_keys,
+                                                 int head_dim,
+                                                 int window,
+                                                 int ring_rows,
+                                                 int key_splits,
+                                                 cudaStream_t stream);
+
+void launch_fuzzy_attention_forward_paged(const float* queries,
+                                          const float* key_pool,
+                                          const float* value_pool,
+                                          const int* block_tables,
+                                          const int* seq_lengths,
+                                          const float* alpha,
+                                          const float* beta,
+                                          FuzzyMembership membership,
+                                          float* output,
+                                          float* partial_norms,
+                                          float* partial_output,
+                                          const TensorStrides& query_strides,
+                                          const TensorStrides& output_strides,
+                                          int batch_size,
+                                          int num_heads,
+                                          int num_kv_heads,
+                                          int num_queries,
+                                          int head_dim,
+                                          int block_size,
+                                          int max_blocks,
+                                          int key_splits,
+                                          cudaStream_t stream);
+
+void launch_fuzzy_attention_forward_paged_16bit(const std::uint16_t* queries,
+                                                const std::uint16_t* key_pool,
+                                                const std::uint16_t* value_pool,
+                                                bool bfloat16,
+                                                const int* block_tables,
+                                                const int* seq_lengths,
+                                                const float* alpha,
+                                                const float* beta,
+                                                FuzzyMembership membership,
+                                                float* output,
+                                                float* partial_norms,
+                                                float* partial_output,
+                                                const TensorStrides& query_strides,
+                                                const TensorStrides& output_strides,
+                                                int batch_size,
+                                                int num_heads,
+                                                int num_kv_heads,
+                                                int num_queries,
+                                                int head_dim,
+                                                int block_size,
+                                                int max_blocks,
+                                                int key_splits,
+                                                cudaStream_t stream);
+
 void launch_fuzzy_attention_backward(const float* grad_out,
                                      const float* queries,
                                      const float* keys,
                                      const float* values,
                                      const float* alpha,
                                      const float* beta,
+                                     FuzzyMembership membership,
+                                     const float* saved_norms,
+                                     const float* saved_output,
                                      float* d_queries,
                                      float* d_keys,
                                      float* d_values,
                                      float* d_alpha,
                                      float* d_beta,
+                                     const int* key_lengths,
+                                     bool causal,
+                                     int window,
                                      int batch_size,
                                      int num_heads,
-                                     int seq_len,
+                                     int num_queries,
+                                     int num_keys,
                                      int head_dim,
                                      cudaStream_t stream);
+
+void launch_fuzzy_attention_backward_deterministic(const float* grad_out,
+                                                   const float* queries,
+                                                   const float* keys,
+                                                   const float* values,
+                                                   const float* alpha,
+                                                   const float* beta,
+                                                   FuzzyMembership membership,
+                                                   const float* saved_norms,
+                                                   const float* saved_output,
+                                                   float* d_queries,
+                                                   float* d_keys,
+                                                   float* d_values,
+                                                   float* d_alpha,
+                                                   float* d_beta,
+                                                   float* row_norm,
+                                                   float* row_sum_gw,
+                                                   float* row_keys,
+                                                   float* param_partials,
+                                                   const int* key_lengths,
+                                                   bool causal,
+                                                   int window,
+                                                   int batch_size,
+                                                   int num_heads,
+                                                   int num_queries,
+                                                   int num_keys,
+                                                   int head_dim,
+                                                   cudaStream_t stream);
 }  // namespace kernels
 
 namespace {
 
+void check_device(const torch::Tensor& tensor) {
+  TORCH_CHECK(tensor.device().is_cuda() || tensor.device().is_cpu(),
+              "fuzzy attention supports CPU and CUDA tensors, got ", tensor.device());
+}
+
 void check_tensor(const torch::Tensor& tensor,
                   const char* name,
-                  torch::ScalarType expected_type) {
-  tensor::ensure_cuda(tensor, name);
+                  torch::ScalarType expected_type,
+                  const torch::Tensor& reference) {
+  tensor::ensure_same_device(tensor, reference, name);
   TORCH_CHECK(tensor.scalar_type() == expected_type,
               name, " must be of type ", expected_type);
   TORCH_CHECK(tensor.dim() == 4,
               name, " must have shape [batch, heads, seq_len, head_dim]");
 }
 
+// Queries, keys and values of the forward and backward may be float32 or
+// 16-bit; see kernels::StorageType.
+void check_storage(const torch::Tensor& tensor, const char* name) {
+  const auto type = tensor.scalar_type();
+  TORCH_CHECK(type == torch::kFloat32 || type == torch::kHalf || type == torch::kBFloat16,
+              name, " must be float32, float16 or bfloat16, got ", type);
+}
+
+kernels::StorageType storage_type(torch::ScalarType type) {
+  switch (type) {
+    case torch::kHalf:
+      return kernels::StorageType::kFloat16;
+    case torch::kBFloat16:
+      return kernels::StorageType::kBFloat16;
+    default:
+      return kernels::StorageType::kFloat32;
+  }
+}
+
+const std::uint16_t* storage_ptr(const torch::Tensor& tensor) {
+  return static_cast<const std::uint16_t*>(tensor.data_ptr());
+}
+
+std::uint16_t* mutable_storage_ptr(torch::Tensor& tensor) {
+  return static_cast<std::uint16_t*>(tensor.data_ptr());
+}
+
+void check_packed_tensor(const torch::Tensor& tensor, const char* name, const torch::Tensor& reference) {
+  tensor::ensure_same_device(tensor, reference, name);
+  TORCH_CHECK(tensor.scalar_type() == torch::kFloat32,
+              name, " must be of type ", torch::kFloat32);
+  TORCH_CHECK(tensor.dim() == 3,
+              name, " must have shape [total_tokens, heads, head_dim]");
+}
+
 void check_parameter(const torch::Tensor& tensor,
                      const char* name,
                      int64_t expected_size,
-                     torch::ScalarType expected_type) {
-  tensor::ensure_cuda(tensor, name);
+                     torch::ScalarType expected_type,
+                     const torch::Tensor& reference) {
+  tensor::ensure_same_device(tensor, reference, name);
   TORCH_CHECK(tensor.scalar_type() == expected_type,
               name, " must be of type ", expected_type);
   TORCH_CHECK(tensor.dim() == 1 && tensor.size(0) == expected_size,
               name, " must have shape [num_heads]");
 }
 
+// Candidate parameters of a sweep, one row of num_heads per candidate.
+void check_parameter_grid(const torch::Tensor& tensor,
+                          const char* name,
+                          int64_t num_heads,
+                          const torch::Tensor& reference) {
+  tensor::ensure_same_device(tensor, reference, name);
+  TORCH_CHECK(tensor.scalar_type() == torch::kFloat32,
+              name, " must be of type ", torch::kFloat32);
+  TORCH_CHECK(tensor.dim() == 2 && tensor.size(0) > 0 && tensor.size(1) == num_heads,
+              name, " must have shape [num_params, num_heads]");
+}
+
+// Sliding windows only make sense under the causal mask, where "the last
+// window keys" of a query is well defined.
+void check_window(int64_t window, bool causal) {
+  TORCH_CHECK(window >= 0, "attention window must be non-negative, got ", window);
+  TORCH_CHECK(window == 0 || causal, "a sliding attention window requires causal attention");
+}
+
+// Key lengths as contiguous int32 on the queries' device, or an undefined
+// tensor when the mask has none.
+torch::Tensor prepare_key_lengths(const FuzzyAttentionMask& mask, const torch::Tensor& reference) {
+  if (!mask.key_lengths.defined()) {
+    return {};
+  }
+  tensor::ensure_same_device(mask.key_lengths, reference, "mask.key_lengths");
+  TORCH_CHECK(!mask.key_lengths.is_floating_point() && !mask.key_lengths.is_complex(),
+              "mask.key_lengths must be an integer tensor");
+  TORCH_CHECK(mask.key_lengths.dim() == 1 && mask.key_lengths.size(0) == reference.size(0),
+              "mask.key_lengths must have shape [batch]");
+  return mask.key_lengths.to(torch::kInt32).contiguous();
+}
+
+const int* key_lengths_ptr(const torch::Tensor& key_lengths) {
+  return key_lengths.defined() ? key_lengths.data_ptr<int>() : nullptr;
+}
+
+bool is_token_major(FuzzyAttentionLayout layout) {
+  return layout == FuzzyAttentionLayout::kBSHD;
+}
+
+// The kernels index rows through strides but read each row as a dense
+// head_dim vector, so only a non-unit innermost stride forces a copy.
+torch::Tensor with_dense_rows(const torch::Tensor& tensor) {
+  return tensor.dim() == 4 && tensor.size(3) > 1 && tensor.stride(3) != 1 ? tensor.contiguous() : tensor;
+}
+
+// group > 1 shares each head of tensor among that many query heads.
+kernels::TensorStrides tensor_strides(const torch::Tensor& tensor, FuzzyAttentionLayout layout, int64_t group = 1) {
+  const bool token_major = is_token_major(layout);
+  return {tensor.stride(0), tensor.stride(token_major ? 2 : 1), tensor.stride(token_major ? 1 : 2), group};
+}
+
+// Query heads per key/value head. Grouped-query attention gives keys and
+// values fewer heads than the queries, each shared by a run of consecutive
+// query heads; multi-query attention is the single-K/V-head case.
+int64_t head_group(int64_t num_heads, int64_t num_kv_heads, const char* name) {
+  TORCH_CHECK(num_kv_heads > 0 && num_heads % num_kv_heads == 0, name, " has ", num_kv_heads,
+              " heads, which must divide the ", num_heads, " query heads");
+  return num_heads / num_kv_heads;
+}
+
+// Contiguous [batch, heads, seq_len, head_dim] copy of an operand in the
+// given layout, for the paths that only handle that layout.
+torch::Tensor to_head_major(const torch::Tensor& tensor, FuzzyAttentionLayout layout) {
+  return is_token_major(layout) ? tensor.transpose(1, 2).contiguous() : tensor.contiguous();
+}
+
+// Inverse of to_head_major, as a view.
+torch::Tensor from_head_major(const torch::Tensor& tensor, FuzzyAttentionLayout layout) {
+  return is_token_major(layout) ? tensor.transpose(1, 2) : tensor;
+}
+
+// Shortest key chunk worth a split-K thread of its own on CUDA.
+constexpr int kCudaMinSplitKeys = 64;
+
+// Split-K chunks for a CUDA decode forward of num_rows query rows over at
+// most max_keys keys; a positive request is used as is.
+int cuda_key_splits(int requested, int64_t num_rows, int64_t max_keys) {
+  if (requested > 0) {
+    return std::min(requested, kernels::kMaxKeySplits);
+  }
+  const auto* properties = at::cuda::getCurrentDeviceProperties();
+  const int64_t parallelism =
+      static_cast<int64_t>(properties->multiProcessorCount) * properties->maxThreadsPerMultiProcessor;
+  return kernels::choose_key_splits(num_rows, static_cast<int>(max_keys), parallelism, kCudaMinSplitKeys);
+}
+
+// Partial normalisers ([0]) and outputs ([1]) of a split-K CUDA decode; both
+// undefined when unsplit.
+std::pair<torch::Tensor, torch::Tensor> split_partials(int key_splits,
+                                                       int64_t num_rows,
+                                                       int64_t head_dim,
+                                                       const torch::Tensor& reference) {
+  if (key_splits <= 1) {
+    return {};
+  }
+  return {torch::empty({num_rows * key_splits}, reference.options()),
+          torch::empty({num_rows * key_splits, head_dim}, reference.options())};
+}
+
+float* data_or_null(const torch::Tensor& tensor) {
+  return tensor.defined() ? tensor.data_ptr<float>() : nullptr;
+}
+
+// Centroid and radius of every block of kernels::kPruneBlockKeys keys for the
+// CUDA forwards, as [batch, heads, num_blocks, head_dim] and [batch, heads,
+// num_blocks]. The last block of a head may be partial; its padding is left
+// out of both.
+// Grouped keys are bounded once per K/V head and repeated for each of the
+// group query heads sharing it, as the kernels index bounds by query head.
+std::pair<torch::Tensor, torch::Tensor> key_block_bounds(const torch::Tensor& keys, int64_t group) {
+  const auto batch_size = keys.size(0);
+  const auto num_heads = keys.size(1);
+  const auto seq_len = keys.size(2);
+  const auto head_dim = keys.size(3);
+  const int64_t block_keys = kernels::kPruneBlockKeys;
+  const auto num_blocks = (seq_len + block_keys - 1) / block_keys;
+
+  auto blocks = torch::constant_pad_nd(keys, {0, 0, 0, num_blocks * block_keys - seq_len})
+                    .view({batch_size, num_heads, num_blocks, block_keys, head_dim});
+  auto valid = (torch::arange(num_blocks * block_keys, keys.options().dtype(torch::kInt64)) < seq_len)
+                   .view({num_blocks, block_keys});
+  auto block_sizes = valid.sum(1).to(keys.scalar_type()).view({1, 1, num_blocks, 1});
+
+  auto centroids = blocks.sum(3) / block_sizes;
+  auto distances = (blocks - centroids.unsqueeze(3)).square().sum(-1).sqrt().masked_fill(valid.logical_not(), 0.0);
+  auto radii = std::get<0>(distances.max(-1));
+  if (group > 1) {
+    return {centroids.repeat_interleave(group, 1).contiguous(), radii.repeat_interleave(group, 1).contiguous()};
+  }
+  return {centroids.contiguous(), radii.contiguous()};
+}
+
+// Shared by both public forwards; row normalisers are only materialised when
+// the caller keeps them for the backward.
+FuzzyAttentionContext run_forward(const torch::Tensor& queries,
+                                  const torch::Tensor& keys,
+                                  const torch::Tensor& values,
+                                  const torch::Tensor& alpha,
+                                  const torch::Tensor& beta,
+                                  const FuzzyAttentionOptions& options,
+                                  const FuzzyAttentionMask& mask,
+                                  bool save_row_norms) {
+  const auto layout = options.layout;
+  auto q = with_dense_rows(queries);
+  auto k = with_dense_rows(keys);
+  auto v = with_dense_rows(values);
+
+  check_device(q);
+  check_storage(q, "queries");
+  const auto storage = q.scalar_type();
+  check_tensor(q, "queries", storage, q);
+  check_tensor(k, "keys", storage, q);
+  check_tensor(v, "values", storage, q);
+
+  // The tiled CPU forward and the fused CUDA forward read 16-bit operands in
+  // place; the CUDA one writes a float32 output that is rounded afterwards.
+  // Every other path runs on float32 copies and rounds its output back, and
+  // the context keeps the caller's tensors either way.
+  const auto mode = options.forward_mode;
+  const bool reads_16bit = q.device().is_cpu()
+                               ? mode == FuzzyAttentionForwardMode::kAuto || mode == FuzzyAttentionForwardMode::kTiled
+                               : mode != FuzzyAttentionForwardMode::kTwoPass;
+  if (storage != torch::kFloat32 && !reads_16bit) {
+    auto context = run_forward(q.to(torch::kFloat32), k.to(torch::kFloat32), v.to(torch::kFloat32), alpha, beta,
+                               options, mask, save_row_norms);
+    context.queries = q;
+    context.keys = k;
+    context.values = v;
+    context.output = context.output.to(storage);
+    return context;
+  }
+
+  const bool token_major = is_token_major(layout);
+  const auto batch_size = q.size(0);
+  const auto num_heads = q.size(token_major ? 2 : 1);
+  const auto num_queries = q.size(token_major ? 1 : 2);
+  const auto num_keys = k.size(token_major ? 1 : 2);
+  const auto num_kv_heads = k.size(token_major ? 2 : 1);
+  const auto head_dim = q.size(3);
+
+  // Cross-attention: the keys may be longer or shorter than the queries.
+  TORCH_CHECK(v.sizes() == k.sizes(), "values must match keys shape");
+  TORCH_CHECK(k.size(0) == batch_size && k.size(3) == head_dim, "keys must match queries in batch and head_dim");
+
+  tensor::validate_attention_dims(batch_size, num_heads, num_queries, head_dim);
+  tensor::validate_attention_dims(batch_size, num_kv_heads, num_keys, head_dim);
+  const auto group = head_group(num_heads, num_kv_heads, "keys");
+
+  auto alpha_vec = alpha.contiguous();
+  auto beta_vec = beta.contiguous();
+  check_parameter(alpha_vec, "alpha", num_heads, torch::kFloat32, q);
+  check_parameter(beta_vec, "beta", num_heads, torch::kFloat32, q);
+
+  auto key_lengths = prepare_key_lengths(mask, q);
+  const int* lengths_ptr = key_lengths_ptr(key_lengths);
+  const bool causal = mask.causal;
+  check_window(mask.window, causal);
+  const auto window = static_cast<int>(std::min(mask.window, num_keys));
+  const auto membership = options.membership;
+
+  TORCH_CHECK(options.prune_epsilon >= 0.0f && options.prune_epsilon < 1.0f,
+              "prune_epsilon must be in [0, 1), got ", options.prune_epsilon);
+  // The triangle and trapezoid always prune: at epsilon 0 only blocks outside
+  // their support go, which is exact. The table's support ends where the
+  // Gaussian is e^-16, which few blocks clear, so like kGaussian it only
+  // prunes with an epsilon.
+  const bool prunes_at_zero = membership == FuzzyMembership::kTriangular ||
+                              membership == FuzzyMembership::kTrapezoidal;
+  const bool prunes_keys = (options.prune_epsilon > 0.0f || prunes_at_zero) &&
+                           (q.device().is_cpu() ? mode == FuzzyAttentionForwardMode::kAuto ||
+                                                      mode == FuzzyAttentionForwardMode::kTiled
+                                                : mode != FuzzyAttentionForwardMode::kTwoPass);
+  torch::Tensor block_centroids;
+  torch::Tensor block_radii;
+  torch::Tensor prune_counts;
+  kernels::KeyPruning pruning;
+  if (prunes_keys) {
+    // The tiled CPU forward bounds the key blocks itself, in one pass.
+    if (!q.device().is_cpu()) {
+      std::tie(block_centroids, block_radii) =
+          key_block_bounds(from_head_major(k, layout).to(torch::kFloat32), group);
+      pruning.centroids = block_centroids.data_ptr<float>();
+      pruning.radii = block_radii.data_ptr<float>();
+    }
+    prune_counts = torch::zeros({2}, q.options().dtype(torch::kInt64));
+    pruning.epsilon = options.prune_epsilon;
+    pruning.counts = prune_counts.data_ptr<int64_t>();
+  }
+  const kernels::KeyPruning* pruning_ptr = prunes_keys ? &pruning : nullptr;
+
+  auto report_pruning = [&] {
+    if (!prunes_keys || options.metrics == nullptr) {
+      return;
+    }
+    auto counts = prune_counts.cpu();
+    options.metrics->add_counter("fuzzy_attention.key_blocks", static_cast<uint64_t>(counts[0].item<int64_t>()));
+    options.metrics->add_counter("fuzzy_attention.pruned_key_blocks", static_cast<uint64_t>(counts[1].item<int64_t>()));
+  };
+
+  // Contiguous in the caller's layout whatever the input strides.
+  const bool cuda_16bit = !q.device().is_cpu() && storage != torch::kFloat32;
+  auto output = torch::empty(q.sizes(), q.options().dtype(cuda_16bit ? torch::kFloat32 : storage));
+  torch::Tensor row_norms;
+  if (save_row_norms) {
+    row_norms = torch::empty({batch_size, num_heads, num_queries}, q.options().dtype(torch::kFloat32));
+  }
+  const kernels::AttentionStrides strides{tensor_strides(q, layout), tensor_strides(k, layout, group),
+                                          tensor_strides(v, layout, group), tensor_strides(output, layout)};
+
+  if (q.device().is_cpu() && storage != torch::kFloat32) {
+    auto tiles = kernels::choose_cpu_tiles(static_cast<int>(head_dim));
+    tiles.specialize_head_dim = options.specialize_head_dim;
+    tiles.int8_scores = options.int8_scores;
+    kernels::fuzzy_attention_forward_tiled_cpu(storage_ptr(q),
+                                               storage_ptr(k),
+                                               storage_ptr(v),
+                                               storage_type(storage),
+                                               alpha_vec.data_ptr<float>(),
+                                               beta_vec.data_ptr<float>(),
+                                               membership,
+                                               mutable_storage_ptr(output),
+                                               save_row_norms ? row_norms.data_ptr<float>() : nullptr,
+                                               lengths_ptr,
+                                               causal,
+                                               window,
+                                               static_cast<int>(batch_size),
+                                               static_cast<int>(num_heads),
+                                               static_cast<int>(num_queries),
+                                               static_cast<int>(num_keys),
+                                               static_cast<int>(head_dim),
+                                               tiles,
+                                               pruning_ptr,
+                                               &strides);
+    report_pruning();
+    return {q, k, v, alpha_vec, beta_vec, row_norms, output, mask, layout, membership};
+  }
+
+  if (q.device().is_cpu()) {
+    const auto* q_ptr = q.data_ptr<float>();
+    const auto* k_ptr = k.data_ptr<float>();
+    const auto* v_ptr = v.data_ptr<float>();
+    const auto* alpha_ptr = alpha_vec.data_ptr<float>();
+    const auto* beta_ptr = beta_vec.data_ptr<float>();
+    auto* out_ptr = output.data_ptr<float>();
+    auto* norms_ptr = save_row_norms ? row_norms.data_ptr<float>() : nullptr;
+    const auto b = static_cast<int>(batch_size);
+    const auto h = static_cast<int>(num_heads);
+    const auto s_q = static_cast<int>(num_queries);
+    const auto s_k = static_cast<int>(num_keys);
+    const auto d = static_cast<int>(head_dim);
+
+    switch (mode) {
+      case FuzzyAttentionForwardMode::kTwoPass:
+        kernels::fuzzy_attention_forward_cpu(q_ptr, k_ptr, v_ptr, alpha_ptr, beta_ptr, membership, out_ptr, norms_ptr,
+                                             lengths_ptr, causal, window, b, h, s_q, s_k, d, &strides);
+        break;
+      case FuzzyAttentionForwardMode::kFused:
+        kernels::fuzzy_attention_forward_fused_cpu(q_ptr, k_ptr, v_ptr, alpha_ptr, beta_ptr, membership, out_ptr,
+                                                   norms_ptr, lengths_ptr, causal, window, b, h, s_q, s_k, d,
+                                                   &strides);
+        break;
+      case FuzzyAttentionForwardMode::kAuto:
+      case FuzzyAttentionForwardMode::kTiled: {
+        auto tiles = kernels::choose_cpu_tiles(d);
+        tiles.specialize_head_dim = options.specialize_head_dim;
+        tiles.int8_scores = options.int8_scores;
+        kernels::fuzzy_attention_forward_tiled_cpu(q_ptr, k_ptr, v_ptr, alpha_ptr, beta_ptr, membership, out_ptr,
+                                                   norms_ptr, lengths_ptr, causal, window, b, h, s_q, s_k, d, tiles,
+                                                   pruning_ptr, &strides);
+        break;
+      }
+    }
+    report_pruning();
+    return {q, k, v, alpha_vec, beta_vec, row_norms, output, mask, layout, membership};
+  }
+
+  if (cuda_16bit) {
+    kernels::launch_fuzzy_attention_forward_fused_16bit(
+        storage_ptr(q),
+        storage_ptr(k),
+        storage_ptr(v),
+        storage == torch::kBFloat16,
+        alpha_vec.data_ptr<float>(),
+        beta_vec.data_ptr<float>(),
+        membership,
+        output.data_ptr<float>(),
+        save_row_norms ? row_norms.data_ptr<float>() : nullptr,
+        lengths_ptr,
+        causal,
+        window,
+        pruning_ptr,
+        static_cast<int>(batch_size),
+        static_cast<int>(num_heads),
+        static_cast<int>(num_queries),
+        static_cast<int>(num_keys),
+        static_cast<int>(head_dim),
+        options.specialize_head_dim,
+        &strides,
+        at::cuda::getCurrentCUDAStream());
+  } else if (mode == FuzzyAttentionForwardMode::kTwoPass) {
+    kernels::launch_fuzzy_attention_forward(
+        q.data_ptr<float>(),
+        k.data_ptr<float>(),
+        v.data_ptr<float>(),
+        alpha_vec.data_ptr<float>(),
+        beta_vec.data_ptr<float>(),
+        membership,
+        output.data_ptr<float>(),
+        save_row_norms ? row_norms.data_ptr<float>() : nullptr,
+        lengths_ptr,
+        causal,
+        window,
+        static_cast<int>(batch_size),
+        static_cast<int>(num_heads),
+        static_cast<int>(num_queries),
+        static_cast<int>(num_keys),
+        static_cast<int>(head_dim),
+        options.specialize_head_dim,
+        &strides,
+        at::cuda::getCurrentCUDAStream());
+  } else {
+    kernels::launch_fuzzy_attention_forward_fused(
+        q.data_ptr<float>(),
+        k.data_ptr<float>(),
+        v.data_ptr<float>(),
+        alpha_vec.data_ptr<float>(),
+        beta_vec.data_ptr<float>(),
+        membership,
+        output.data_ptr<float>(),
+        save_row_norms ? row_norms.data_ptr<float>() : nullptr,
+        lengths_ptr,
+        causal,
+        window,
+        pruning_ptr,
+        static_cast<int>(batch_size),
+        static_cast<int>(num_heads),
+        static_cast<int>(num_queries),
+        static_cast<int>(num_keys),
+        static_cast<int>(head_dim),
+        options.specialize_head_dim,
+        &strides,
+        at::cuda::getCurrentCUDAStream());
+  }
+
+  const auto err = cudaGetLastError();
+  TORCH_CHECK(err == cudaSuccess,
+              "fuzzy_attention_forward kernel launch failed: ",
+              cudaGetErrorString(err));
+
+  report_pruning();
+  return {q, k, v, alpha_vec, beta_vec, row_norms, cuda_16bit ? output.to(storage) : output, mask, layout,
+          membership};
+}
+
+// Query rows of the linearised forward handled together. A causal chunk
+// weights its own diagonal block of keys through the polynomial directly and
+// every earlier key through the running feature sums; the same chunking
+// bounds the feature maps' memory when the sums are built.
+constexpr int64_t kLinearChunk = 64;
+
+// Upper bound on the running sums and one chunk of feature maps of the
+// linearised forward. Order p needs head_dim^p * (head_dim + 1 +
+// kLinearChunk) floats per (batch, head), which at order 4 and head_dim 64
+// is already over 4 GiB for each one.
+constexpr int64_t kMaxLinearStateBytes = int64_t{1} << 30;
+
+// Order-p feature map of [..., head_dim] rows: the p-fold outer product of
+// each row with itself, flattened to [..., head_dim^p], so that
+// <features(q, p), features(k, p)> = (q . k)^p.
+torch::Tensor next_features(const torch::Tensor& features, const torch::Tensor& rows) {
+  return (features.unsqueeze(-1) * rows.unsqueeze(-2)).flatten(-2);
+}
+
+// Per-(batch, head) polynomial coefficients, [batch, heads, order + 1], fitted
+// over the Cauchy-Schwarz score range max|q| max|k| / head_dim of each head.
+torch::Tensor linear_coefficients(const torch::Tensor& q,
+                                  const torch::Tensor& k,
+                                  const torch::Tensor& alpha,
+                                  const torch::Tensor& beta,
+                                  int order) {
+  const auto head_dim = static_cast<double>(q.size(3));
+  auto radius = (std::get<0>(q.norm(2, -1).max(-1)) * std::get<0>(k.norm(2, -1).max(-1)) / head_dim)
+                    .to(torch::kCPU, torch::kFloat64)
+                    .contiguous();
+  auto alpha_host = alpha.to(torch::kCPU, torch::kFloat64).contiguous();
+  auto beta_host = beta.to(torch::kCPU, torch::kFloat64).contiguous();
+  const auto batch_size = q.size(0);
+  const auto num_heads = q.size(1);
+  auto coefficients = torch::empty({batch_size, num_heads, order + 1}, torch::kFloat64);
+  const auto* radius_ptr = radius.data_ptr<double>();
+  auto* coefficient_ptr = coefficients.data_ptr<double>();
+  for (int64_t b = 0; b < batch_size; ++b) {
+    for (int64_t h = 0; h < num_heads; ++h) {
+      const auto row = b * num_heads + h;
+      kernels::fit_membership_polynomial(alpha_host.data_ptr<double>()[h], beta_host.data_ptr<double>()[h],
+                                         radius_ptr[row], order, coefficient_ptr + row * (order + 1));
+    }
+  }
+  return coefficients.to(q.options());
+}
+
+// Linearised forward over contiguous head-major q, k and v with the same
+// heads. key_weights, when defined, is [batch, 1, num_keys, 1] with 1 for
+// visible keys and 0 for padding.
+torch::Tensor linear_forward(const torch::Tensor& q,
+                             const torch::Tensor& k,
+                             const torch::Tensor& v,
+                             const torch::Tensor& alpha,
+                             const torch::Tensor& beta,
+                             int order,
+                             const torch::Tensor& key_weights,
+                             bool causal) {
+  const auto batch_size = q.size(0);
+  const auto num_heads = q.size(1);
+  const auto num_queries = q.size(2);
+  const auto num_keys = k.size(2);
+  const auto head_dim = q.size(3);
+  int64_t state_elements = 0;
+  for (int64_t p = 0, width = 1; p <= order; ++p, width *= head_dim) {
+    state_elements += width * (head_dim + 1 + kLinearChunk);
+  }
+  const auto state_bytes = batch_size * num_heads * state_elements * static_cast<int64_t>(q.element_size());
+  TORCH_CHECK(state_bytes <= kMaxLinearStateBytes, "linear order ", order, " at head_dim ", head_dim, " needs ",
+              state_bytes >> 20, " MiB of feature sums for ", batch_size * num_heads, " heads, over the ",
+              kMaxLinearStateBytes >> 20, " MiB limit; use a lower order or fewer heads per call");
+
+  auto coefficients = linear_coefficients(q, k, alpha, beta, order);
+  auto coefficient = [&](int p) { return coefficients.select(2, p).view({batch_size, num_heads, 1, 1}); };
+  // Scaling the queries by 1 / head_dim makes their products with the keys
+  // the scores themselves.
+  auto scaled_q = q / static_cast<double>(head_dim);
+
+  // Running sums over the keys folded so far, per order p: phi_p(k)^T v as
+  // [batch, heads, head_dim^p, head_dim] and phi_p(k) as [.., head_dim^p, 1].
+  std::vector<torch::Tensor> value_sums;
+  std::vector<torch::Tensor> feature_sums;
+  int64_t width = 1;
+  for (int p = 0; p <= order; ++p, width *= head_dim) {
+    value_sums.push_back(torch::zeros({batch_size, num_heads, width, head_dim}, q.options()));
+    feature_sums.push_back(torch::zeros({batch_size, num_heads, width, 1}, q.options()));
+  }
+  int64_t folded = 0;
+  auto fold_keys = [&](int64_t end) {
+    for (; folded < end; folded += kLinearChunk) {
+      const auto rows = std::min(kLinearChunk, end - folded);
+      auto keys = k.narrow(2, folded, rows);
+      auto values = v.narrow(2, folded, rows);
+      auto features = torch::ones({batch_size, num_heads, rows, 1}, q.options());
+      if (key_weights.defined()) {
+        features = features * key_weights.narrow(2, folded, rows);
+      }
+      for (int p = 0; p <= order; ++p) {
+        if (p > 0) {
+          features = next_features(features, keys);
+        }
+        value_sums[p] += torch::matmul(features.transpose(-2, -1), values);
+        feature_sums[p] += features.sum(2).unsqueeze(-1);
+      }
+    }
+    folded = std::max(folded, end);
+  };
+
+  auto output = torch::empty_like(q);
+  if (!causal) {
+    fold_keys(num_keys);
+  }
+  for (int64_t first = 0; first < num_queries; first += kLinearChunk) {
+    const auto rows = std::min(kLinearChunk, num_queries - first);
+    auto queries = scaled_q.narrow(2, first, rows);
+    // Query i sits at position i + num_keys - num_queries, as in the exact
+    // forward; a causal chunk sees every key before its first position
+    // through the sums and its own positions directly.
+    const auto position = first + num_keys - num_queries;
+    const auto diagonal_begin = std::clamp<int64_t>(position, 0, num_keys);
+    const auto diagonal_end = std::clamp<int64_t>(position + rows, 0, num_keys);
+    if (causal) {
+      fold_keys(diagonal_begin);
+    }
+
+    auto numerator = torch::zeros({batch_size, num_heads, rows, head_dim}, q.options());
+    auto norm = torch::zeros({batch_size, num_heads, rows, 1}, q.options());
+    auto features = torch::ones({batch_size, num_heads, rows, 1}, q.options());
+    for (int p = 0; p <= order; ++p) {
+      if (p > 0) {
+        features = next_features(features, queries);
+      }
+      numerator += coefficient(p) * torch::matmul(features, value_sums[p]);
+      norm += coefficient(p) * torch::matmul(features, feature_sums[p]);
+    }
+
+    if (causal && diagonal_end > diagonal_begin) {
+      const auto keys_seen = diagonal_end - diagonal_begin;
+      auto scores = torch::matmul(queries, k.narrow(2, diagonal_begin, keys_seen).transpose(-2, -1));
+      auto membership = coefficient(order).expand_as(scores).clone();
+      for (int p = order - 1; p >= 0; --p) {
+        membership = membership * scores + coefficient(p);
+      }
+      auto query_positions = torch::arange(position, position + rows, q.options().dtype(torch::kLong)).view({-1, 1});
+      auto key_positions = torch::arange(diagonal_begin, diagonal_end, q.options().dtype(torch::kLong)).view({1, -1});
+      membership = membership * (key_positions <= query_positions).to(q.scalar_type());
+      if (key_weights.defined()) {
+        membership = membership * key_weights.narrow(2, diagonal_begin, keys_seen).transpose(-2, -1);
+      }
+      numerator += torch::matmul(membership, v.narrow(2, diagonal_begin, keys_seen));
+      norm += membership.sum(-1, true);
+    }
+
+    output.narrow(2, first, rows).copy_(torch::where(norm > 1e-6, numerator / norm, torch::zeros_like(numerator)));
+  }
+  return output;
+}
+
 }  // namespace
 
 torch::Tensor fuzzy_attention_forward(const torch::Tensor& queries,
                                       const torch::Tensor& keys,
                                       const torch::Tensor& values,
                                       const torch::Tensor& alpha,
-                                      const torch::Tensor& beta) {
-  auto q = queries.contiguous();
-  auto k = keys.contiguous();
-  auto v = values.contiguous();
+                                      const torch::Tensor& beta,
+                                      const FuzzyAttentionOptions& options,
+                                      const FuzzyAttentionMask& mask) {
+  return run_forward(queries, keys, values, alpha, beta, options, mask, false).output;
+}
 
-  check_tensor(q, "queries", torch::kFloat32);
-  check_tensor(k, "keys", torch::kFloat32);
-  check_tensor(v, "values", torch::kFloat32);
+FuzzyAttentionContext fuzzy_attention_forward_with_context(const torch::Tensor& queries,
+                                                           const torch::Tensor& keys,
+                                                           const torch::Tensor& values,
+                                                           const torch::Tensor& alpha,
+                                                           const torch::Tensor& beta,
+                                                           const FuzzyAttentionOptions& options,
+                                                           const FuzzyAttentionMask& mask) {
+  // The backward mixes the saved statistics with exact float scores.
+  TORCH_CHECK(!options.int8_scores, "int8_scores is inference only; the backward needs exact scores");
+  return run_forward(queries, keys, values, alpha, beta, options, mask, true);
+}
 
-  const auto batch_size = q.size(0);
-  const auto num_heads = q.size(1);
-  const auto seq_len = q.size(2);
-  const auto head_dim = q.size(3);
+torch::Tensor fuzzy_attention_forward_varlen(const torch::Tensor& queries,
+                                             const torch::Tensor& keys,
+                                             const torch::Tensor& values,
+                                             const torch::Tensor& cu_seqlens,
+                                             const torch::Tensor& alpha,
+                                             const torch::Tensor& beta,
+                                             bool causal,
+                                             int64_t window,
+                                             FuzzyMembership membership,
+                                             bool int8_scores) {
+  check_device(queries);
+  check_window(window, causal);
+  check_packed_tensor(queries, "queries", queries);
+  check_packed_tensor(keys, "keys", queries);
+  check_packed_tensor(values, "values", queries);
+  TORCH_CHECK(values.sizes() == keys.sizes(), "values must match keys shape");
+  TORCH_CHECK(keys.size(0) == queries.size(0) && keys.size(2) == queries.size(2),
+              "keys must match queries in total_tokens and head_dim");
 
-  TORCH_CHECK(k.sizes() == q.sizes(), "keys must match queries shape");
-  TORCH_CHECK(v.sizes() == q.sizes(), "values must match queries shape");
+  const auto total_tokens = queries.size(0);
+  const auto num_heads = queries.size(1);
+  const auto num_kv_heads = keys.size(1);
+  const auto head_dim = queries.size(2);
+  head_group(num_heads, num_kv_heads, "keys");
 
-  tensor::validate_attention_dims(batch_size, num_heads, seq_len, head_dim);
+  tensor::ensure_same_device(cu_seqlens, queries, "cu_seqlens");
+  TORCH_CHECK(!cu_seqlens.is_floating_point() && cu_seqlens.dim() == 1 && cu_seqlens.size(0) >= 2,
+              "cu_seqlens must be an integer tensor of shape [num_seqs + 1]");
+  auto offsets = cu_seqlens.to(torch::kInt32).contiguous();
+  const auto num_seqs = offsets.size(0) - 1;
+
+  // Offsets are only validated when already on the host; checking device
+  // offsets would cost a synchronisation on every call.
+  if (offsets.device().is_cpu()) {
+    const auto* offset_ptr = offsets.data_ptr<int>();
+    TORCH_CHECK(offset_ptr[0] == 0, "cu_seqlens must start at 0");
+    for (int64_t i = 0; i < num_seqs; ++i) {
+      TORCH_CHECK(offset_ptr[i + 1] >= offset_ptr[i], "cu_seqlens must be non-decreasing");
+    }
+    TORCH_CHECK(offset_ptr[num_seqs] == total_tokens, "cu_seqlens must end at total_tokens");
+  }
+  if (total_tokens == 0) {
+    return torch::empty_like(queries);
+  }
+  tensor::validate_attention_dims(num_seqs, num_heads, total_tokens, head_dim);
+  const auto window_keys = static_cast<int>(std::min(window, total_tokens));
 
   auto alpha_vec = alpha.contiguous();
   auto beta_vec = beta.contiguous();
-  check_parameter(alpha_vec, "alpha", num_heads, torch::kFloat32);
-  check_parameter(beta_vec, "beta", num_heads, torch::kFloat32);
+  check_parameter(alpha_vec, "alpha", num_heads, torch::kFloat32, queries);
+  check_parameter(beta_vec, "beta", num_heads, torch::kFloat32, queries);
 
+  // The kernels want every (sequence, head) slice contiguous, so work in
+  // head-major [heads, total_tokens, head_dim]. The transpose is linear in
+  // the token count against the quadratic attention itself.
+  auto q = queries.transpose(0, 1).contiguous();
+  auto k = keys.transpose(0, 1).contiguous();
+  auto v = values.transpose(0, 1).contiguous();
   auto output = torch::empty_like(q);
 
-  kernels::launch_fuzzy_attention_forward(
+  if (q.device().is_cpu()) {
+    auto tiles = kernels::choose_cpu_tiles(static_cast<int>(head_dim));
+    tiles.int8_scores = int8_scores;
+    kernels::fuzzy_attention_forward_varlen_cpu(q.data_ptr<float>(),
+                                                k.data_ptr<float>(),
+                                                v.data_ptr<float>(),
+                                                alpha_vec.data_ptr<float>(),
+                                                beta_vec.data_ptr<float>(),
+                                                membership,
+                                                output.data_ptr<float>(),
+                                                offsets.data_ptr<int>(),
+                                                causal,
+                                                window_keys,
+                                                static_cast<int>(num_seqs),
+                                                static_cast<int>(num_heads),
+                                                static_cast<int>(num_kv_heads),
+                                                static_cast<int>(head_dim),
+                                                tiles);
+    return output.transpose(0, 1).contiguous();
+  }
+
+  kernels::launch_fuzzy_attention_forward_varlen(
       q.data_ptr<float>(),
       k.data_ptr<float>(),
       v.data_ptr<float>(),
       alpha_vec.data_ptr<float>(),
       beta_vec.data_ptr<float>(),
+      membership,
       output.data_ptr<float>(),
-      static_cast<int>(batch_size),
+      offsets.data_ptr<int>(),
+      causal,
+      window_keys,
+      static_cast<int>(num_seqs),
+      static_cast<int>(total_tokens),
       static_cast<int>(num_heads),
-      static_cast<int>(seq_len),
+      static_cast<int>(num_kv_heads),
       static_cast<int>(head_dim),
       at::cuda::getCurrentCUDAStream());
 
   const auto err = cudaGetLastError();
   TORCH_CHECK(err == cudaSuccess,
-              "fuzzy_attention_forward kernel launch failed: ",
+              "fuzzy_attention_forward_varlen kernel launch failed: ",
               cudaGetErrorString(err));
 
+  return output.transpose(0, 1).contiguous();
+}
+
+torch::Tensor fuzzy_attention_forward_cached(const torch::Tensor& queries,
+                                             const torch::Tensor& keys,
+                                             const torch::Tensor& values,
+                                             const torch::Tensor& alpha,
+                                             const torch::Tensor& beta,
+                                             const FuzzyAttentionOptions& options,
+                                             int64_t window,
+                                             int64_t num_positions) {
+  const auto layout = options.layout;
+  const bool token_major = is_token_major(layout);
+  auto q = with_dense_rows(queries);
+  auto k = with_dense_rows(keys);
+  auto v = with_dense_rows(values);
+
+  check_device(q);
+  check_storage(q, "queries");
+  const auto storage = q.scalar_type();
+  check_tensor(q, "queries", storage, q);
+  check_tensor(k, "keys", storage, q);
+  check_tensor(v, "values", storage, q);
+
+  const auto batch_size = q.size(0);
+  const auto num_heads = q.size(token_major ? 2 : 1);
+  const auto num_queries = q.size(token_major ? 1 : 2);
+  const auto cache_rows = k.size(token_major ? 1 : 2);
+  const auto num_keys = num_positions > 0 ? num_positions : cache_rows;
+  const auto head_dim = q.size(3);
+
+  TORCH_CHECK(v.sizes() == k.sizes(), "values must match keys shape");
+  TORCH_CHECK(k.size(0) == batch_size && k.size(3) == head_dim, "keys must match queries in batch and head_dim");
+  const auto group = head_group(num_heads, k.size(token_major ? 2 : 1), "keys");
+  TORCH_CHECK(num_queries <= num_keys, "the ", num_keys, " cached keys must include the ", num_queries,
+              " new queries");
+  check_window(window, true);
+  // A ring only has to hold the positions the new queries can still see.
+  const auto keys_needed = window > 0 ? std::min(num_keys, window + num_queries - 1) : num_keys;
+  TORCH_CHECK(num_positions <= 0 || cache_rows >= keys_needed, "a ring of ", cache_rows,
+              " rows cannot hold the ", keys_needed, " positions visible to ", num_queries, " new queries");
+
+  auto alpha_vec = alpha.contiguous();
+  auto beta_vec = beta.contiguous();
+  check_parameter(alpha_vec, "alpha", num_heads, torch::kFloat32, q);
+  check_parameter(beta_vec, "beta", num_heads, torch::kFloat32, q);
+
+  // 16-bit operands are read in place, as in the forward; CUDA writes a
+  // float32 output that is rounded afterwards.
+  const bool cuda_16bit = !q.device().is_cpu() && storage != torch::kFloat32;
+  auto output = torch::empty(q.sizes(), q.options().dtype(cuda_16bit ? torch::kFloat32 : storage));
+  if (num_queries == 0) {
+    return output.to(storage);
+  }
+  tensor::validate_attention_dims(batch_size, num_heads, num_keys, head_dim);
+
+  const kernels::AttentionStrides strides{tensor_strides(q, layout), tensor_strides(k, layout, group),
+                                          tensor_strides(v, layout, group), tensor_strides(output, layout)};
+  const auto b = static_cast<int>(batch_size);
+  const auto h = static_cast<int>(num_heads);
+  const auto n = static_cast<int>(num_queries);
+  const auto s = static_cast<int>(num_keys);
+  const auto d = static_cast<int>(head_dim);
+  const auto w = static_cast<int>(std::min(window, num_keys));
+  const auto ring_rows = num_positions > 0 ? static_cast<int>(cache_rows) : 0;
+
+  if (q.device().is_cpu()) {
+    auto tiles = kernels::choose_cpu_tiles(d);
+    tiles.specialize_head_dim = options.specialize_head_dim;
+    tiles.key_splits = options.key_splits;
+    if (storage != torch::kFloat32) {
+      kernels::fuzzy_attention_forward_cached_cpu(storage_ptr(q), storage_ptr(k), storage_ptr(v),
+                                                  storage_type(storage), alpha_vec.data_ptr<float>(),
+                                                  beta_vec.data_ptr<float>(), options.membership,
+                                                  mutable_storage_ptr(output), b, h, n, s, d, w, ring_rows, tiles,
+                                                  strides);
+    } else {
+      kernels::fuzzy_attention_forward_cached_cpu(q.data_ptr<float>(), k.data_ptr<float>(), v.data_ptr<float>(),
+                                                  alpha_vec.data_ptr<float>(), beta_vec.data_ptr<float>(),
+                                                  options.membership, output.data_ptr<float>(), b, h, n, s, d, w,
+                                                  ring_rows, tiles, strides);
+    }
+    return output;
+  }
+
+  const int key_splits = cuda_key_splits(options.key_splits, batch_size * num_heads * num_queries, keys_needed);
+  auto [partial_norms, partial_output] = split_partials(key_splits, batch_size * num_heads * num_queries, head_dim, q);
+  if (cuda_16bit) {
+    kernels::launch_fuzzy_attention_forward_cached_16bit(storage_ptr(q),
+                                                         storage_ptr(k),
+                                                         storage_ptr(v),
+                                                         storage == torch::kBFloat16,
+                                                         alpha_vec.data_ptr<float>(),
+                                                         beta_vec.data_ptr<float>(),
+                                                         options.membership,
+                                                         output.data_ptr<float>(),
+                                                         data_or_null(partial_norms),
+                                                         data_or_null(partial_output),
+                                                         strides,
+                                                         b,
+                                                         h,
+                                                         n,
+                                                         s,
+                                                         d,
+                                                         w,
+                                                         ring_rows,
+                                                         key_splits,
+                                                         at::cuda::getCurrentCUDAStream());
+  } else {
+    kernels::launch_fuzzy_attention_forward_cached(q.data_ptr<float>(),
+                                                   k.data_ptr<float>(),
+                                                   v.data_ptr<float>(),
+                                                   alpha_vec.data_ptr<float>(),
+                                                   beta_vec.data_ptr<float>(),
+                                                   options.membership,
+                                                   output.data_ptr<float>(),
+                                                   data_or_null(partial_norms),
+                                                   data_or_null(partial_output),
+                                                   strides,
+                                                   b,
+                                                   h,
+                                                   n,
+                                                   s,
+                                                   d,
+                                                   w,
+                                                   ring_rows,
+                                                   key_splits,
+                                                   at::cuda::getCurrentCUDAStream());
+  }
+
+  const auto err = cudaGetLastError();
+  TORCH_CHECK(err == cudaSuccess,
+              "fuzzy_attention_forward_cached kernel launch failed: ",
+              cudaGetErrorString(err));
+  return output.to(storage);
+}
+
+torch::Tensor fuzzy_attention_forward_paged(const torch::Tensor& queries,
+                                            const torch::Tensor& key_pool,
+                                            const torch::Tensor& value_pool,
+                                            const torch::Tensor& block_tables,
+                                            const torch::Tensor& seq_lengths,
+                                            const torch::Tensor& alpha,
+                                            const torch::Tensor& beta,
+                                            const FuzzyAttentionOptions& options) {
+  const auto layout = options.layout;
+  const bool token_major = is_token_major(layout);
+  auto q = with_dense_rows(queries);
+
+  check_device(q);
+  check_storage(q, "queries");
+  const auto storage = q.scalar_type();
+  check_tensor(q, "queries", storage, q);
+  tensor::ensure_same_device(key_pool, q, "key_pool");
+  tensor::ensure_same_device(value_pool, q, "value_pool");
+  TORCH_CHECK(key_pool.scalar_type() == storage && key_pool.dim() == 4,
+              "key_pool must be a ", storage, " tensor of shape [num_blocks, heads, block_size, head_dim]");
+  TORCH_CHECK(value_pool.sizes() == key_pool.sizes(), "value_pool must match key_pool shape");
+  TORCH_CHECK(value_pool.scalar_type() == storage, "value_pool must be of type ", storage);
+  TORCH_CHECK(key_pool.is_contiguous() && value_pool.is_contiguous(), "key and value pools must be contiguous");
+
+  const auto batch_size = q.size(0);
+  const auto num_heads = q.size(token_major ? 2 : 1);
+  const auto num_queries = q.size(token_major ? 1 : 2);
+  const auto head_dim = q.size(3);
+  const auto num_blocks = key_pool.size(0);
+  const auto block_size = key_pool.size(2);
+  const auto num_kv_heads = key_pool.size(1);
+  TORCH_CHECK(key_pool.size(3) == head_dim, "key_pool must match queries in head_dim");
+  head_group(num_heads, num_kv_heads, "key_pool");
+  TORCH_CHECK(block_size > 0, "key_pool block_size must be positive");
+
+  tensor::ensure_same_device(block_tables, q, "block_tables");
+  tensor::ensure_same_device(seq_lengths, q, "seq_lengths");
+  TORCH_CHECK(!block_tables.is_floating_point() && block_tables.dim() == 2 && block_tables.size(0) == batch_size,
+              "block_tables must be an integer tensor of shape [batch, max_blocks]");
+  TORCH_CHECK(!seq_lengths.is_floating_point() && seq_lengths.dim() == 1 && seq_lengths.size(0) == batch_size,
+              "seq_lengths must be an integer tensor of shape [batch]");
+  auto tables = block_tables.to(torch::kInt32).contiguous();
+  auto lengths = seq_lengths.to(torch::kInt32).contiguous();
+  const auto max_blocks = tables.size(1);
+
+  // As for cu_seqlens, tables and lengths are only validated on the host.
+  if (tables.device().is_cpu()) {
+    const auto* table_ptr = tables.data_ptr<int>();
+    const auto* length_ptr = lengths.data_ptr<int>();
+    for (int64_t b = 0; b < batch_size; ++b) {
+      TORCH_CHECK(length_ptr[b] >= num_queries && length_ptr[b] <= max_blocks * block_size,
+                  "sequence ", b, " has length ", length_ptr[b], ", outside [", num_queries, ", ",
+                  max_blocks * block_size, "]");
+      const auto used_blocks = (length_ptr[b] + block_size - 1) / block_size;
+      for (int64_t j = 0; j < used_blocks; ++j) {
+        const auto block = table_ptr[b * max_blocks + j];
+        TORCH_CHECK(block >= 0 && block < num_blocks, "block_tables[", b, ", ", j, "] = ", block,
+                    " is not a pool block");
+      }
+    }
+  }
+
+  auto alpha_vec = alpha.contiguous();
+  auto beta_vec = beta.contiguous();
+  check_parameter(alpha_vec, "alpha", num_heads, torch::kFloat32, q);
+  check_parameter(beta_vec, "beta", num_heads, torch::kFloat32, q);
+
+  const bool cuda_16bit = !q.device().is_cpu() && storage != torch::kFloat32;
+  auto output = torch::empty(q.sizes(), q.options().dtype(cuda_16bit ? torch::kFloat32 : storage));
+  if (num_queries == 0) {
+    return output.to(storage);
+  }
+  tensor::validate_attention_dims(batch_size, num_heads, max_blocks * block_size, head_dim);
+
+  const auto query_strides = tensor_strides(q, layout);
+  const auto output_strides = tensor_strides(output, layout);
+  const auto b = static_cast<int>(batch_size);
+  const auto h = static_cast<int>(num_heads);
+  const auto kv_h = static_cast<int>(num_kv_heads);
+  const auto n = static_cast<int>(num_queries);
+  const auto d = static_cast<int>(head_dim);
+  const auto page = static_cast<int>(block_size);
+  const auto m = static_cast<int>(max_blocks);
+
+  if (q.device().is_cpu()) {
+    auto tiles = kernels::choose_cpu_tiles(d);
+    tiles.specialize_head_dim = options.specialize_head_dim;
+    tiles.key_splits = options.key_splits;
+    if (storage != torch::kFloat32) {
+      kernels::fuzzy_attention_forward_paged_cpu(storage_ptr(q), storage_ptr(key_pool), storage_ptr(value_pool),
+                                                 storage_type(storage), tables.data_ptr<int>(),
+                                                 lengths.data_ptr<int>(), alpha_vec.data_ptr<float>(),
+                                                 beta_vec.data_ptr<float>(), options.membership,
+                                                 mutable_storage_ptr(output), b, h, kv_h, n, d, page, m, tiles,
+                                                 query_strides, output_strides);
+    } else {
+      kernels::fuzzy_attention_forward_paged_cpu(q.data_ptr<float>(), key_pool.data_ptr<float>(),
+                                                 value_pool.data_ptr<float>(), tables.data_ptr<int>(),
+                                                 lengths.data_ptr<int>(), alpha_vec.data_ptr<float>(),
+                                                 beta_vec.data_ptr<float>(), options.membership,
+                                                 output.data_ptr<float>(), b, h, kv_h, n, d, page, m, tiles,
+                                                 query_strides, output_strides);
+    }
+    return output;
+  }
+
+  // Sequence lengths stay on the device, so splits are sized for the
+  // longest sequence the tables can hold.
+  const int key_splits =
+      cuda_key_splits(options.key_splits, batch_size * num_heads * num_queries, max_blocks * block_size);
+  auto [partial_norms, partial_output] = split_partials(key_splits, batch_size * num_heads * num_queries, head_dim, q);
+  if (cuda_16bit) {
+    kernels::launch_fuzzy_attention_forward_paged_16bit(storage_ptr(q),
+                                                        storage_ptr(key_pool),
+                                                        storage_ptr(value_pool),
+                                                        storage == torch::kBFloat16,
+                                                        tables.data_ptr<int>(),
+                                                        lengths.data_ptr<int>(),
+                                                        alpha_vec.data_ptr<float>(),
+                                                        beta_vec.data_ptr<float>(),
+                                                        options.membership,
+                                                        output.data_ptr<float>(),
+                                                        data_or_null(partial_norms),
+                                                        data_or_null(partial_output),
+                                                        query_strides,
+                                                        output_strides,
+                                                        b,
+                                                        h,
+                                                        kv_h,
+                                                        n,
+                                                        d,
+                                                        page,
+                                                        m,
+                                                        key_splits,
+                                                        at::cuda::getCurrentCUDAStream());
+  } else {
+    kernels::launch_fuzzy_attention_forward_paged(q.data_ptr<float>(),
+                                                  key_pool.data_ptr<float>(),
+                                                  value_pool.data_ptr<float>(),
+                                                  tables.data_ptr<int>(),
+                                                  lengths.data_ptr<int>(),
+                                                  alpha_vec.data_ptr<float>(),
+                                                  beta_vec.data_ptr<float>(),
+                                                  options.membership,
+                                                  output.data_ptr<float>(),
+                                                  data_or_null(partial_norms),
+                                                  data_or_null(partial_output),
+                                                  query_strides,
+                                                  output_strides,
+                                                  b,
+                                                  h,
+                                                  kv_h,
+                                                  n,
+                                                  d,
+                                                  page,
+                                                  m,
+                                                  key_splits,
+                                                  at::cuda::getCurrentCUDAStream());
+  }
+
+  const auto err = cudaGetLastError();
+  TORCH_CHECK(err == cudaSuccess,
+              "fuzzy_attention_forward_paged kernel launch failed: ",
+              cudaGetErrorString(err));
+  return output.to(storage);
+}
+
+torch::Tensor fuzzy_attention_forward_linear(const torch::Tensor& queries,
+                                             const torch::Tensor& keys,
+                                             const torch::Tensor& values,
+                                             const torch::Tensor& alpha,
+                                             const torch::Tensor& beta,
+                                             const std::vector<int>& orders,
+                                             const FuzzyAttentionOptions& options,
+                                             const FuzzyAttentionMask& mask) {
+  const auto layout = options.layout;
+  auto q = to_head_major(queries, layout);
+  auto k = to_head_major(keys, layout);
+  auto v = to_head_major(values, layout);
+
+  check_device(q);
+  check_tensor(q, "queries", torch::kFloat32, q);
+  check_tensor(k, "keys", torch::kFloat32, q);
+  check_tensor(v, "values", torch::kFloat32, q);
+
+  const auto batch_size = q.size(0);
+  const auto num_heads = q.size(1);
+  const auto num_keys = k.size(2);
+  const auto head_dim = q.size(3);
+  TORCH_CHECK(v.sizes() == k.sizes(), "values must match keys shape");
+  TORCH_CHECK(k.size(0) == batch_size && k.size(3) == head_dim, "keys must match queries in batch and head_dim");
+  tensor::validate_attention_dims(batch_size, num_heads, q.size(2), head_dim);
+  tensor::validate_attention_dims(batch_size, k.size(1), num_keys, head_dim);
+  const auto group = head_group(num_heads, k.size(1), "keys");
+
+  auto alpha_vec = alpha.contiguous();
+  auto beta_vec = beta.contiguous();
+  check_parameter(alpha_vec, "alpha", num_heads, torch::kFloat32, q);
+  check_parameter(beta_vec, "beta", num_heads, torch::kFloat32, q);
+  check_window(mask.window, mask.causal);
+
+  TORCH_CHECK(orders.size() == 1 || static_cast<int64_t>(orders.size()) == num_heads,
+              "orders must have one entry per head or a single entry, got ", orders.size());
+  // Heads of each order run together.
+  std::map<int, std::vector<int64_t>> heads_by_order;
+  for (int64_t h = 0; h < num_heads; ++h) {
+    const int order = orders.size() == 1 ? orders[0] : orders[h];
+    TORCH_CHECK(order >= 0 && order <= kernels::kMaxLinearOrder, "linear order must be in [0, ",
+                kernels::kMaxLinearOrder, "], got ", order);
+    TORCH_CHECK(order == 0 || mask.window == 0, "sliding windows need exact heads (order 0)");
+    TORCH_CHECK(order == 0 || options.membership == FuzzyMembership::kGaussian,
+                "linearised heads approximate the Gaussian membership; other memberships need order 0");
+    heads_by_order[order].push_back(h);
+  }
+
+  torch::Tensor key_weights;
+  if (auto key_lengths = prepare_key_lengths(mask, q); key_lengths.defined()) {
+    key_weights = (torch::arange(num_keys, key_lengths.options()).view({1, 1, -1, 1}) <
+                   key_lengths.view({-1, 1, 1, 1}))
+                      .to(q.scalar_type());
+  }
+
+  auto output = torch::empty_like(q);
+  for (const auto& [order, heads] : heads_by_order) {
+    auto head_index = torch::tensor(heads, q.options().dtype(torch::kLong));
+    auto kv_index = head_index.div(group, "floor");
+    auto head_q = q.index_select(1, head_index);
+    auto head_k = k.index_select(1, kv_index);
+    auto head_v = v.index_select(1, kv_index);
+    auto head_alpha = alpha_vec.index_select(0, head_index);
+    auto head_beta = beta_vec.index_select(0, head_index);
+
+    torch::Tensor head_output;
+    if (order == 0) {
+      auto exact_options = options;
+      exact_options.layout = FuzzyAttentionLayout::kBHSD;
+      head_output = fuzzy_attention_forward(head_q, head_k, head_v, head_alpha, head_beta, exact_options, mask);
+    } else {
+      head_output = linear_forward(head_q, head_k, head_v, head_alpha, head_beta, order, key_weights, mask.causal);
+    }
+    output.index_copy_(1, head_index, head_output);
+  }
+  return from_head_major(output, layout);
+}
+
+torch::Tensor fuzzy_attention_forward_sweep(const torch::Tensor& queries,
+                                            const torch::Tensor& keys,
+                                            const torch::Tensor& values,
+                                            const torch::Tensor& alpha,
+                                            const torch::Tensor& beta,
+                                            const FuzzyAttentionOptions& options,
+                                            const FuzzyAttentionMask& mask) {
+  const auto layout = options.layout;
+  auto q = with_dense_rows(queries);
+  auto k = with_dense_rows(keys);
+  auto v = with_dense_rows(values);
+
+  check_device(q);
+  check_tensor(q, "queries", torch::kFloat32, q);
+  check_tensor(k, "keys", torch::kFloat32, q);
+  check_tensor(v, "values", torch::kFloat32, q);
+
+  const bool token_major = is_token_major(layout);
+  const auto batch_size = q.size(0);
+  const auto num_heads = q.size(token_major ? 2 : 1);
+  const auto num_queries = q.size(token_major ? 1 : 2);
+  const auto num_keys = k.size(token_major ? 1 : 2);
+  const auto head_dim = q.size(3);
+  TORCH_CHECK(v.sizes() == k.sizes(), "values must match keys shape");
+  TORCH_CHECK(k.size(0) == batch_size && k.size(3) == head_dim, "keys must match queries in batch and head_dim");
+  tensor::validate_attention_dims(batch_size, num_heads, num_queries, head_dim);
+  tensor::validate_attention_dims(batch_size, k.size(token_major ? 2 : 1), num_keys, head_dim);
+  const auto group = head_group(num_heads, k.size(token_major ? 2 : 1), "keys");
+
+  auto alpha_grid = alpha.contiguous();
+  auto beta_grid = beta.contiguous();
+  check_parameter_grid(alpha_grid, "alpha", num_heads, q);
+  check_parameter_grid(beta_grid, "beta", num_heads, q);
+  TORCH_CHECK(beta_grid.size(0) == alpha_grid.size(0), "alpha and beta must hold the same number of candidates");
+  const auto num_params = alpha_grid.size(0);
+
+  auto key_lengths = prepare_key_lengths(mask, q);
+  check_window(mask.window, mask.causal);
+  const auto window = static_cast<int>(std::min(mask.window, num_keys));
+
+  // Candidate p's output is a contiguous tensor in the caller's layout.
+  std::vector<int64_t> sizes = {num_params};
+  sizes.insert(sizes.end(), q.sizes().begin(), q.sizes().end());
+  auto output = torch::empty(sizes, q.options());
+  const kernels::AttentionStrides strides{tensor_strides(q, layout), tensor_strides(k, layout, group),
+                                          tensor_strides(v, layout, group), tensor_strides(output[0], layout)};
+
+  if (q.device().is_cpu()) {
+    auto tiles = kernels::choose_cpu_tiles(static_cast<int>(head_dim));
+    tiles.specialize_head_dim = options.specialize_head_dim;
+    kernels::fuzzy_attention_forward_sweep_cpu(
+        q.data_ptr<float>(), k.data_ptr<float>(), v.data_ptr<float>(), alpha_grid.data_ptr<float>(),
+        beta_grid.data_ptr<float>(), static_cast<int>(num_params), options.membership, output.data_ptr<float>(),
+        output.stride(0), key_lengths_ptr(key_lengths), mask.causal, window, static_cast<int>(batch_size),
+        static_cast<int>(num_heads), static_cast<int>(num_queries), static_cast<int>(num_keys),
+        static_cast<int>(head_dim), tiles, &strides);
+    return output;
+  }
+
+  kernels::launch_fuzzy_attention_forward_sweep(
+      q.data_ptr<float>(),
+      k.data_ptr<float>(),
+      v.data_ptr<float>(),
+      alpha_grid.data_ptr<float>(),
+      beta_grid.data_ptr<float>(),
+      static_cast<int>(num_params),
+      options.membership,
+      output.data_ptr<float>(),
+      output.stride(0),
+      key_lengths_ptr(key_lengths),
+      mask.causal,
+      window,
+      static_cast<int>(batch_size),
+      static_cast<int>(num_heads),
+      static_cast<int>(num_queries),
+      static_cast<int>(num_keys),
+      static_cast<int>(head_dim),
+      strides,
+      at::cuda::getCurrentCUDAStream());
+
+  const auto err = cudaGetLastError();
+  TORCH_CHECK(err == cudaSuccess, "fuzzy_attention_forward_sweep kernel launch failed: ", cudaGetErrorString(err));
   return output;
 }
 
 std::vector<torch::Tensor> fuzzy_attention_backward(
     const torch::Tensor& grad_out,
-    const FuzzyAttentionContext& context) {
-  auto grad = grad_out.contiguous();
-  check_tensor(grad, "grad_out", torch::kFloat32);
+    const FuzzyAttentionContext& context,
+    const FuzzyAttentionOptions& options) {
+  // Gradients are accumulated in float32. The CPU backward reads 16-bit
+  // contexts in place and rounds its gradients once; the CUDA kernels are
+  // float32 only, so there 16-bit contexts are widened here and the query,
+  // key and value gradients rounded back. The saved output was rounded to 16
+  // bits, and g . out stands in for sum_j w_ij * (g . v_j) next to float32
+  // normalisers, so both statistics are dropped and rebuilt in float32.
+  const auto storage = context.queries.scalar_type();
+  const bool is_16bit = storage == torch::kHalf || storage == torch::kBFloat16;
+  if (is_16bit && !context.queries.device().is_cpu()) {
+    FuzzyAttentionContext widened = context;
+    widened.queries = context.queries.to(torch::kFloat32);
+    widened.keys = context.keys.to(torch::kFloat32);
+    widened.values = context.values.to(torch::kFloat32);
+    widened.output = torch::Tensor();
+    widened.row_norms = torch::Tensor();
+    auto grads = fuzzy_attention_backward(grad_out.to(torch::kFloat32), widened, options);
+    for (std::size_t i = 0; i < 3; ++i) {
+      grads[i] = grads[i].to(storage);
+    }
+    return grads;
+  }
 
-  auto q = context.queries.contiguous();
-  auto k = context.keys.contiguous();
-  auto v = context.values.contiguous();
+  // The backward kernels only handle contiguous head-major operands.
+  const auto layout = context.layout;
+  auto grad = to_head_major(is_16bit ? grad_out.to(storage) : grad_out, layout);
+  auto q = to_head_major(context.queries, layout);
+  auto k = to_head_major(context.keys, layout);
+  auto v = to_head_major(context.values, layout);
   auto alpha = context.alpha.contiguous();
   auto beta = context.beta.contiguous();
 
-  check_tensor(q, "context.queries", torch::kFloat32);
-  check_tensor(k, "context.keys", torch::kFloat32);
-  check_tensor(v, "context.values", torch::kFloat32);
+  check_device(q);
+  check_storage(q, "context.queries");
+  check_tensor(grad, "grad_out", storage, q);
+  check_tensor(q, "context.queries", storage, q);
+  check_tensor(k, "context.keys", storage, q);
+  check_tensor(v, "context.values", storage, q);
 
   const auto batch_size = q.size(0);
   const auto num_heads = q.size(1);
-  const auto seq_len = q.size(2);
+  const auto num_queries = q.size(2);
+  const auto num_keys = k.size(2);
+  const auto num_kv_heads = k.size(1);
   const auto head_dim = q.size(3);
 
   TORCH_CHECK(grad.sizes() == q.sizes(), "grad_out shape must match output");
+  TORCH_CHECK(v.sizes() == k.sizes(), "context.values must match context.keys shape");
+  TORCH_CHECK(k.size(0) == batch_size && k.size(3) == head_dim,
+              "context.keys must match context.queries in batch and head_dim");
+
+  check_parameter(alpha, "context.alpha", num_heads, torch::kFloat32, q);
+  check_parameter(beta, "context.beta", num_heads, torch::kFloat32, q);
+
+  tensor::validate_attention_dims(batch_size, num_heads, num_queries, head_dim);
+  tensor::validate_attention_dims(batch_size, num_kv_heads, num_keys, head_dim);
 
-  check_parameter(alpha, "context.alpha", num_heads, torch::kFloat32);
-  check_parameter(beta, "context.beta", num_heads, torch::kFloat32);
+  // The backward kernels give every query head its own K/V head, so grouped
+  // keys and values are expanded to the query heads here and their gradients
+  // summed back over each group.
+  const auto group = head_group(num_heads, num_kv_heads, "context.keys");
+  if (group > 1) {
+    k = k.repeat_interleave(group, 1);
+    v = v.repeat_interleave(group, 1);
+  }
+  auto fold_group = [&](const torch::Tensor& grad_kv) {
+    return group > 1 ? grad_kv.view({batch_size, num_kv_heads, group, num_keys, head_dim}).sum(2) : grad_kv;
+  };
 
-  tensor::validate_attention_dims(batch_size, num_heads, seq_len, head_dim);
+  // The CPU backward finds each normaliser with the memberships it scores
+  // anyway and only reads the saved output; CUDA uses the forward statistics
+  // only when both were saved.
+  const bool saves_norms = !q.device().is_cpu() && context.row_norms.defined();
+  torch::Tensor saved_norms;
+  torch::Tensor saved_output;
+  if (context.output.defined() && !is_16bit && (q.device().is_cpu() || saves_norms)) {
+    saved_output = to_head_major(context.output, layout);
+    tensor::ensure_same_device(saved_output, q, "context.output");
+    TORCH_CHECK(saved_output.scalar_type() == torch::kFloat32 && saved_output.sizes() == q.sizes(),
+                "context.output must be float32 and match the queries shape");
+  }
+  if (saves_norms && saved_output.defined()) {
+    saved_norms = context.row_norms.contiguous();
+    tensor::ensure_same_device(saved_norms, q, "context.row_norms");
+    TORCH_CHECK(saved_norms.scalar_type() == torch::kFloat32 &&
+                    saved_norms.sizes() == torch::IntArrayRef({batch_size, num_heads, num_queries}),
+                "context.row_norms must be float32 with shape [batch, heads, num_queries]");
+  }
+  const float* saved_norms_ptr = saved_norms.defined() ? saved_norms.data_ptr<float>() : nullptr;
+  const float* saved_output_ptr = saved_output.defined() ? saved_output.data_ptr<float>() : nullptr;
+
+  auto key_lengths = prepare_key_lengths(context.mask, q);
+  const int* lengths_ptr = key_lengths_ptr(key_lengths);
+  const bool causal = context.mask.causal;
+  check_window(context.mask.window, causal);
+  const auto window = static_cast<int>(std::min(context.mask.window, num_keys));
+
+  if (q.device().is_cpu() || options.backward_mode == FuzzyAttentionBackwardMode::kDeterministic) {
+    // Every gradient element is written by exactly one owner, so no zeroing.
+    auto d_queries = torch::empty_like(q);
+    auto d_keys = torch::empty_like(k);
+    auto d_values = torch::empty_like(v);
+    auto d_alpha = torch::empty_like(alpha);
+    auto d_beta = torch::empty_like(beta);
+
+    if (q.device().is_cpu()) {
+      if (is_16bit) {
+        kernels::fuzzy_attention_backward_cpu(
+            storage_ptr(grad),
+            storage_ptr(q),
+            storage_ptr(k),
+            storage_ptr(v),
+            storage_type(storage),
+            alpha.data_ptr<float>(),
+            beta.data_ptr<float>(),
+            context.membership,
+            nullptr,
+            lengths_ptr,
+            causal,
+            window,
+            mutable_storage_ptr(d_queries),
+            mutable_storage_ptr(d_keys),
+            mutable_storage_ptr(d_values),
+            d_alpha.data_ptr<float>(),
+            d_beta.data_ptr<float>(),
+            static_cast<int>(batch_size),
+            static_cast<int>(num_heads),
+            static_cast<int>(num_queries),
+            static_cast<int>(num_keys),
+            static_cast<int>(head_dim));
+      } else {
+        kernels::fuzzy_attention_backward_cpu(
+            grad.data_ptr<float>(),
+            q.data_ptr<float>(),
+            k.data_ptr<float>(),
+            v.data_ptr<float>(),
+            alpha.data_ptr<float>(),
+            beta.data_ptr<float>(),
+            context.membership,
+            saved_output_ptr,
+            lengths_ptr,
+            causal,
+            window,
+            d_queries.data_ptr<float>(),
+            d_keys.data_ptr<float>(),
+            d_values.data_ptr<float>(),
+            d_alpha.data_ptr<float>(),
+            d_beta.data_ptr<float>(),
+            static_cast<int>(batch_size),
+            static_cast<int>(num_heads),
+            static_cast<int>(num_queries),
+            static_cast<int>(num_keys),
+            static_cast<int>(head_dim));
+      }
+      return {from_head_major(d_queries, layout), from_head_major(fold_group(d_keys), layout),
+              from_head_major(fold_group(d_values), layout), d_alpha, d_beta};
+    }
+
+    auto row_norm = torch::empty({batch_size, num_heads, num_queries}, q.options());
+    auto row_sum_gw = torch::empty({batch_size, num_heads, num_queries}, q.options());
+    // The rows pass gathers sum_j c_j k_j here when it has to find the
+    // normalisers itself.
+    auto row_keys = saved_norms_ptr == nullptr ? torch::empty_like(q) : torch::Tensor();
+    auto param_partials = torch::empty({batch_size, num_heads, num_keys, 2}, q.options());
+
+    kernels::launch_fuzzy_attention_backward_deterministic(
+        grad.data_ptr<float>(),
+        q.data_ptr<float>(),
+        k.data_ptr<float>(),
+        v.data_ptr<float>(),
+        alpha.data_ptr<float>(),
+        beta.data_ptr<float>(),
+        context.membership,
+        saved_norms_ptr,
+        saved_output_ptr,
+        lengths_ptr,
+        causal,
+        window,
+        d_queries.data_ptr<float>(),
+        d_keys.data_ptr<float>(),
+        d_values.data_ptr<float>(),
+        d_alpha.data_ptr<float>(),
+        d_beta.data_ptr<float>(),
+        row_norm.data_ptr<float>(),
+        row_sum_gw.data_ptr<float>(),
+        row_keys.defined() ? row_keys.data_ptr<float>() : nullptr,
+        param_partials.data_ptr<float>(),
+        static_cast<int>(batch_size),
+        static_cast<int>(num_heads),
+        static_cast<int>(num_queries),
+        static_cast<int>(num_keys),
+        static_cast<int>(head_dim),
+        at::cuda::getCurrentCUDAStream());
+
+    const auto err = cudaGetLastError();
+    TORCH_CHECK(err == cudaSuccess,
+                "fuzzy_attention_backward kernel launch failed: ",
+                cudaGetErrorString(err));
+
+    return {from_head_major(d_queries, layout), from_head_major(fold_group(d_keys), layout),
+            from_head_major(fold_group(d_values), layout), d_alpha, d_beta};
+  }
 
-  auto options = q.options();
   auto d_queries = torch::zeros_like(q);
   auto d_keys = torch::zeros_like(k);
   auto d_values = torch::zeros_like(v);
@@ -159,6 +1699,12 @@ std::vector<torch::Tensor> fuzzy_attention_backward(
       v.data_ptr<float>(),
       alpha.data_ptr<float>(),
       beta.data_ptr<float>(),
+      context.membership,
+      saved_norms_ptr,
+      saved_output_ptr,
+      lengths_ptr,
+      causal,
+      window,
       d_queries.data_ptr<float>(),
       d_keys.data_ptr<float>(),
       d_values.data_ptr<float>(),
@@ -166,7 +1712,8 @@ std::vector<torch::Tensor> fuzzy_attention_backward(
       d_beta.data_ptr<float>(),
       static_cast<int>(batch_size),
       static_cast<int>(num_heads),
-      static_cast<int>(seq_len),
+      static_cast<int>(num_queries),
+      static_cast<int>(num_keys),
       static_cast<int>(head_dim),
       at::cuda::getCurrentCUDAStream());
 
@@ -175,7 +1722,8 @@ std::vector<torch::Tensor> fuzzy_attention_backward(
               "fuzzy_attention_backward kernel launch failed: ",
               cudaGetErrorString(err));
 
-  return {d_queries, d_keys, d_values, d_alpha, d_beta};
+  return {from_head_major(d_queries, layout), from_head_major(fold_group(d_keys), layout),
+          from_head_major(fold_group(d_values), layout), d_alpha, d_beta};
 }
 
 }  // namespace fuzzformer
@@ -188,13 +1736,82 @@ torch::Tensor fuzzy_attention_forward(const torch::Tensor&,
                                       const torch::Tensor&,
                                       const torch::Tensor&,
                                       const torch::Tensor&,
-                                      const torch::Tensor&) {
+                                      const torch::Tensor&,
+                                      const FuzzyAttentionOptions&,
+                                      const FuzzyAttentionMask&) {
+  return {};
+}
+
+FuzzyAttentionContext fuzzy_attention_forward_with_context(const torch::Tensor&,
+                                                           const torch::Tensor&,
+                                                           const torch::Tensor&,
+                                                           const torch::Tensor&,
+                                                           const torch::Tensor&,
+                                                           const FuzzyAttentionOptions&,
+                                                           const FuzzyAttentionMask&) {
+  return {};
+}
+
+torch::Tensor fuzzy_attention_forward_varlen(const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             bool,
+                                             int64_t,
+                                             FuzzyMembership,
+                                             bool) {
+  return {};
+}
+
+torch::Tensor fuzzy_attention_forward_cached(const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const FuzzyAttentionOptions&,
+                                             int64_t,
+                                             int64_t) {
+  return {};
+}
+
+torch::Tensor fuzzy_attention_forward_paged(const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const FuzzyAttentionOptions&) {
+  return {};
+}
+
+torch::Tensor fuzzy_attention_forward_linear(const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const torch::Tensor&,
+                                             const std::vector<int>&,
+                                             const FuzzyAttentionOptions&,
+                                             const FuzzyAttentionMask&) {
+  return {};
+}
+
+torch::Tensor fuzzy_attention_forward_sweep(const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const torch::Tensor&,
+                                            const FuzzyAttentionOptions&,
+                                            const FuzzyAttentionMask&) {
   return {};
 }
 
 std::vector<torch::Tensor> fuzzy_attention_backward(
     const torch::Tensor&,
-    const FuzzyAttentionContext&) {
+    const FuzzyAttentionContext&,
+    const FuzzyAttentionOptions&) {
   return {};
 }
 
@@ -1,54 +1,125 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
 #include <cuda_runtime.h>
 #include <math_constants.h>
 
+#include <cstdint>
+
+#include "fuzzformer/attentionStrides.h"
+#include "fuzzformer/keyPruning.h"
+#include "fuzzformer/membership.h"
+
 namespace fuzzformer {
 namespace kernels {
 
 constexpr float kEpsilon = 1e-6f;
 
+// Masks trim keys from the right: the query at position p of batch b sees
+// keys [0, key_lengths[b]) and, when causal, only up to p. Query i sits at
+// position i + num_keys - num_queries, so with fewer queries than keys they
+// line up with the last keys.
+__device__ __forceinline__ int visible_keys(const int* key_lengths,
+                                            bool causal,
+                                            int batch_index,
+                                            int position,
+                                            int num_keys) {
+  int end = num_keys;
+  if (key_lengths != nullptr) {
+    end = min(max(key_lengths[batch_index], 0), num_keys);
+  }
+  if (causal) {
+    end = min(end, max(position + 1, 0));
+  }
+  return end;
+}
+
+// A sliding window of window > 0 keys trims them from the left as well: the
+// query at position p sees no key before p - window + 1.
+__device__ __forceinline__ int first_visible_key(int window, int position) {
+  return window > 0 ? max(0, position - window + 1) : 0;
+}
+
+// Operand elements widened to float as they are loaded, so the fused forward
+// reads 16-bit queries, keys and values in place.
+__device__ __forceinline__ float load_element(float value) {
+  return value;
+}
+
+__device__ __forceinline__ float load_element(__half value) {
+  return __half2float(value);
+}
+
+__device__ __forceinline__ float load_element(__nv_bfloat16 value) {
+  return __bfloat162float(value);
+}
+
+template <int kHeadDim, typename Membership>
 __global__ void fuzzy_attention_forward_kernel(const float* __restrict__ queries,
                                                const float* __restrict__ keys,
                                                const float* __restrict__ values,
                                                const float* __restrict__ alpha,
                                                const float* __restrict__ beta,
                                                float* __restrict__ output,
+                                               float* __restrict__ row_norms,
+                                               const int* __restrict__ key_lengths,
+                                               bool causal,
+                                               int window,
+                                               AttentionStrides strides,
                                                int batch_size,
                                                int num_heads,
-                                               int seq_len,
-                                               int head_dim) {
+                                               int num_queries,
+                                               int num_keys,
+                                               int runtime_head_dim) {
+  const int head_dim = kHeadDim > 0 ? kHeadDim : runtime_head_dim;
   const int row = blockIdx.x * blockDim.x + threadIdx.x;
-  const int total_rows = batch_size * num_heads * seq_len;
+  const int total_rows = batch_size * num_heads * num_queries;
   if (row >= total_rows) {
     return;
   }
 
-  const int bh = row / seq_len;
-  const int query_index = row % seq_len;
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
   const int batch_index = bh / num_heads;
   const int head_index = bh % num_heads;
 
-  const int base_offset = ((batch_index * num_heads + head_index) * seq_len + query_index) * head_dim;
-  const float* q_vec = queries + base_offset;
-  float* out_vec = output + base_offset;
+  const float* q_vec = queries + strides.queries.offset(batch_index, head_index, query_index);
+  float* out_vec = output + strides.output.offset(batch_index, head_index, query_index);
+
+  const float* k_head = keys + strides.keys.offset(batch_index, head_index, 0);
+  const float* v_head = values + strides.values.offset(batch_index, head_index, 0);
+  const std::int64_t k_stride = strides.keys.token;
+  const std::int64_t v_stride = strides.values.token;
 
-  const float* k_head = keys + ((batch_index * num_heads + head_index) * seq_len * head_dim);
-  const float* v_head = values + ((batch_index * num_heads + head_index) * seq_len * head_dim);
+  const int position = query_index + num_keys - num_queries;
+  const int first_key = first_visible_key(window, position);
+  const int end_key = visible_keys(key_lengths, causal, batch_index, position, num_keys);
 
   const float alpha_h = alpha[head_index];
   const float beta_h = beta[head_index];
 
   const float scale = 1.0f / static_cast<float>(head_dim);
 
+  float q_cache[kHeadDim > 0 ? kHeadDim : 1];
+  const float* q_row = q_vec;
+  if constexpr (kHeadDim > 0) {
+#pragma unroll
+    for (int d = 0; d < kHeadDim; ++d) {
+      q_cache[d] = q_vec[d];
+    }
+    q_row = q_cache;
+  }
+
   float norm = 0.0f;
-  for (int key_index = 0; key_index < seq_len; ++key_index) {
-    const float* k_vec = k_head + key_index * head_dim;
+  for (int key_index = first_key; key_index < end_key; ++key_index) {
+    const float* k_vec = k_head + key_index * k_stride;
     float score = 0.0f;
+#pragma unroll
     for (int d = 0; d < head_dim; ++d) {
-      score += q_vec[d] * k_vec[d];
+      score += q_row[d] * k_vec[d];
     }
     score *= scale;
     const float diff = score - beta_h;
-    const float membership = __expf(-alpha_h * diff * diff);
+    const float membership = Membership::value(diff, alpha_h);
     norm += membership;
   }
 
@@ -57,65 +128,722 @@ __global__ void fuzzy_attention_forward_kernel(const float* __restrict__ queries
     inv_norm = 1.0f / norm;
   }
 
+#pragma unroll
   for (int d = 0; d < head_dim; ++d) {
     out_vec[d] = 0.0f;
   }
 
-  for (int key_index = 0; key_index < seq_len; ++key_index) {
-    const float* k_vec = k_head + key_index * head_dim;
-    const float* v_vec = v_head + key_index * head_dim;
+  for (int key_index = first_key; key_index < end_key; ++key_index) {
+    const float* k_vec = k_head + key_index * k_stride;
+    const float* v_vec = v_head + key_index * v_stride;
 
     float score = 0.0f;
+#pragma unroll
     for (int d = 0; d < head_dim; ++d) {
-      score += q_vec[d] * k_vec[d];
+      score += q_row[d] * k_vec[d];
     }
     score *= scale;
     const float diff = score - beta_h;
-    const float membership = __expf(-alpha_h * diff * diff);
+    const float membership = Membership::value(diff, alpha_h);
     const float weight = membership * inv_norm;
 
+#pragma unroll
     for (int d = 0; d < head_dim; ++d) {
       out_vec[d] += weight * v_vec[d];
     }
   }
+  if (row_norms != nullptr) {
+    row_norms[row] = norm;
+  }
+}
+
+// With pruning.centroids set, each block of kPruneBlockKeys keys is first
+// tested against its Cauchy-Schwarz bound (see KeyPruning) and skipped when
+// every membership in it is provably below pruning.epsilon. Queries, keys
+// and values are Element (float, __half or __nv_bfloat16) and widened as
+// they are read; the output and everything computed are float.
+template <int kHeadDim, typename Membership, typename Element = float>
+__global__ void fuzzy_attention_forward_fused_kernel(const Element* __restrict__ queries,
+                                                     const Element* __restrict__ keys,
+                                                     const Element* __restrict__ values,
+                                                     const float* __restrict__ alpha,
+                                                     const float* __restrict__ beta,
+                                                     float* __restrict__ output,
+                                                     float* __restrict__ row_norms,
+                                                     const int* __restrict__ key_lengths,
+                                                     bool causal,
+                                                     int window,
+                                                     AttentionStrides strides,
+                                                     KeyPruning pruning,
+                                                     int batch_size,
+                                                     int num_heads,
+                                                     int num_queries,
+                                                     int num_keys,
+                                                     int runtime_head_dim) {
+  const int head_dim = kHeadDim > 0 ? kHeadDim : runtime_head_dim;
+  const int row = blockIdx.x * blockDim.x + threadIdx.x;
+  const int total_rows = batch_size * num_heads * num_queries;
+  if (row >= total_rows) {
+    return;
+  }
+
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
+  const int batch_index = bh / num_heads;
+  const int head_index = bh % num_heads;
+
+  const Element* q_vec = queries + strides.queries.offset(batch_index, head_index, query_index);
+  float* out_vec = output + strides.output.offset(batch_index, head_index, query_index);
+
+  const Element* k_head = keys + strides.keys.offset(batch_index, head_index, 0);
+  const Element* v_head = values + strides.values.offset(batch_index, head_index, 0);
+  const std::int64_t k_stride = strides.keys.token;
+  const std::int64_t v_stride = strides.values.token;
+
+  const int position = query_index + num_keys - num_queries;
+  const int first_key = first_visible_key(window, position);
+  const int end_key = visible_keys(key_lengths, causal, batch_index, position, num_keys);
+
+  const float alpha_h = alpha[head_index];
+  const float beta_h = beta[head_index];
+
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  // Generic rows read the query in place and accumulate straight into the
+  // output; fixed ones keep the query row and the accumulator in registers.
+  float q_cache[kHeadDim > 0 ? kHeadDim : 1];
+  float acc_cache[kHeadDim > 0 ? kHeadDim : 1];
+  float* acc_row = out_vec;
+  if constexpr (kHeadDim > 0) {
+#pragma unroll
+    for (int d = 0; d < kHeadDim; ++d) {
+      q_cache[d] = load_element(q_vec[d]);
+    }
+    acc_row = acc_cache;
+  }
+  const auto query = [&](int d) {
+    if constexpr (kHeadDim > 0) {
+      return q_cache[d];
+    } else {
+      return load_element(q_vec[d]);
+    }
+  };
+
+#pragma unroll
+  for (int d = 0; d < head_dim; ++d) {
+    acc_row[d] = 0.0f;
+  }
+
+  const bool prunes = pruning.centroids != nullptr;
+  const int num_blocks = (num_keys + kPruneBlockKeys - 1) / kPruneBlockKeys;
+  const float* centroids = prunes ? pruning.centroids + bh * num_blocks * head_dim : nullptr;
+  const float* radii = prunes ? pruning.radii + bh * num_blocks : nullptr;
+  const float cutoff = prunes ? Membership::cutoff(alpha_h, pruning.epsilon) : 0.0f;
+  float q_norm = 0.0f;
+  if (prunes) {
+#pragma unroll
+    for (int d = 0; d < head_dim; ++d) {
+      q_norm += query(d) * query(d);
+    }
+    q_norm = sqrtf(q_norm);
+  }
+  unsigned long long examined_blocks = 0;
+  unsigned long long pruned_blocks = 0;
+
+  // The normaliser is a plain sum rather than a max-shifted softmax, so the
+  // unnormalised membership * v can be accumulated in the same sweep. A
+  // window that starts inside a pruning block leaves that block untested.
+  float norm = 0.0f;
+  for (int key_index = first_key; key_index < end_key; ++key_index) {
+    if (prunes && key_index % kPruneBlockKeys == 0) {
+      const int block = key_index / kPruneBlockKeys;
+      const float* c_vec = centroids + block * head_dim;
+      float center = 0.0f;
+#pragma unroll
+      for (int d = 0; d < head_dim; ++d) {
+        center += query(d) * c_vec[d];
+      }
+      center *= scale;
+      const float radius = q_norm * radii[block] * scale;
+      const float slack = kPruneRelativeSlack * (fabsf(center) + radius);
+      const float gap = fabsf(center - beta_h) - radius - slack;
+      ++examined_blocks;
+      if (gap > cutoff) {
+        ++pruned_blocks;
+        key_index += kPruneBlockKeys - 1;
+        continue;
+      }
+    }
+
+    const Element* k_vec = k_head + key_index * k_stride;
+    const Element* v_vec = v_head + key_index * v_stride;
+
+    float score = 0.0f;
+#pragma unroll
+    for (int d = 0; d < head_dim; ++d) {
+      score += query(d) * load_element(k_vec[d]);
+    }
+    score *= scale;
+    const float diff = score - beta_h;
+    const float membership = Membership::value(diff, alpha_h);
+    if (Membership::kCompactSupport && membership == 0.0f) {
+      continue;
+    }
+    norm += membership;
+
+#pragma unroll
+    for (int d = 0; d < head_dim; ++d) {
+      acc_row[d] += membership * load_element(v_vec[d]);
+    }
+  }
+
+  const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+#pragma unroll
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] = acc_row[d] * inv_norm;
+  }
+  if (row_norms != nullptr) {
+    row_norms[row] = norm;
+  }
+  if (prunes && pruning.counts != nullptr) {
+    auto* counts = reinterpret_cast<unsigned long long*>(pruning.counts);
+    atomicAdd(counts, examined_blocks);
+    atomicAdd(counts + 1, pruned_blocks);
+  }
+}
+
+// Packed variable-length forward over head-major [heads, total_tokens,
+// head_dim] buffers: one thread per (head, token) row, fused like
+// fuzzy_attention_forward_fused_kernel. The owning sequence is found by
+// binary search over cu_seqlens, and the row only sweeps that sequence's keys.
+// Keys and values have num_kv_heads heads, each shared by a group of query
+// heads.
+template <typename Membership>
+__global__ void fuzzy_attention_forward_varlen_kernel(const float* __restrict__ queries,
+                                                      const float* __restrict__ keys,
+                                                      const float* __restrict__ values,
+                                                      const float* __restrict__ alpha,
+                                                      const float* __restrict__ beta,
+                                                      float* __restrict__ output,
+                                                      const int* __restrict__ cu_seqlens,
+                                                      bool causal,
+                                                      int window,
+                                                      int num_seqs,
+                                                      int total_tokens,
+                                                      int num_heads,
+                                                      int num_kv_heads,
+                                                      int head_dim) {
+  const int row = blockIdx.x * blockDim.x + threadIdx.x;
+  if (row >= num_heads * total_tokens) {
+    return;
+  }
+  const int head_index = row / total_tokens;
+  const int token = row % total_tokens;
+
+  int low = 0;
+  int high = num_seqs - 1;
+  while (low < high) {
+    const int mid = (low + high + 1) / 2;
+    if (cu_seqlens[mid] <= token) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  const int seq_begin = cu_seqlens[low];
+  const int seq_len = cu_seqlens[low + 1] - seq_begin;
+  const int query_index = token - seq_begin;
+  const int first_key = first_visible_key(window, query_index);
+  const int num_keys = causal ? query_index + 1 : seq_len;
+
+  const float* q_vec = queries + row * head_dim;
+  float* out_vec = output + row * head_dim;
+  const int kv_head = head_index / (num_heads / num_kv_heads);
+  const int head_base = (kv_head * total_tokens + seq_begin) * head_dim;
+  const float* k_head = keys + head_base;
+  const float* v_head = values + head_base;
+
+  const float alpha_h = alpha[head_index];
+  const float beta_h = beta[head_index];
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] = 0.0f;
+  }
+
+  float norm = 0.0f;
+  for (int key_index = first_key; key_index < num_keys; ++key_index) {
+    const float* k_vec = k_head + key_index * head_dim;
+    const float* v_vec = v_head + key_index * head_dim;
+
+    float score = 0.0f;
+    for (int d = 0; d < head_dim; ++d) {
+      score += q_vec[d] * k_vec[d];
+    }
+    const float diff = score * scale - beta_h;
+    const float membership = Membership::value(diff, alpha_h);
+    if (Membership::kCompactSupport && membership == 0.0f) {
+      continue;
+    }
+    norm += membership;
+
+    for (int d = 0; d < head_dim; ++d) {
+      out_vec[d] += membership * v_vec[d];
+    }
+  }
+
+  const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] *= inv_norm;
+  }
+}
+
+// Keys whose scores a sweep thread holds at once.
+constexpr int kSweepKeys = 32;
+// Most candidates a sweep thread accumulates at once, and the shared memory
+// their accumulators may take per block (see sweep_param_tile).
+constexpr int kSweepParamTile = 8;
+constexpr int kSweepSharedBytes = 32 * 1024;
+constexpr int kSweepThreads = 32;
+
+// Candidates per tile of the sweep kernel: as many head_dim accumulators per
+// thread as fit kSweepSharedBytes for a block, at least one.
+int sweep_param_tile(int head_dim) {
+  const int fit = kSweepSharedBytes / (kSweepThreads * head_dim * static_cast<int>(sizeof(float)));
+  return max(1, min(fit, kSweepParamTile));
+}
+
+// Parameter sweep: one thread per (batch, head, query) row, fused like the
+// generic fuzzy_attention_forward_fused_kernel but for num_params candidate
+// (alpha, beta) settings ([num_params, num_heads]). Candidates go in tiles
+// of param_tile: a tile's accumulators live in shared memory, interleaved
+// across the block's threads so they hit distinct banks, and its
+// normalisers in registers, and the output rows are written once at the end
+// of the tile. Within a tile the row's scores are computed once per chunk of
+// kSweepKeys keys and kept in registers while every candidate of the tile
+// turns them into memberships, so Q.K is swept once per tile rather than
+// once per candidate. Candidate p writes its output row at
+// output + p * param_stride.
+template <typename Membership>
+__global__ void fuzzy_attention_forward_sweep_kernel(const float* __restrict__ queries,
+                                                     const float* __restrict__ keys,
+                                                     const float* __restrict__ values,
+                                                     const float* __restrict__ alpha,
+                                                     const float* __restrict__ beta,
+                                                     int num_params,
+                                                     int param_tile,
+                                                     float* __restrict__ output,
+                                                     std::int64_t param_stride,
+                                                     const int* __restrict__ key_lengths,
+                                                     bool causal,
+                                                     int window,
+                                                     AttentionStrides strides,
+                                                     int batch_size,
+                                                     int num_heads,
+                                                     int num_queries,
+                                                     int num_keys,
+                                                     int head_dim) {
+  // [param_tile, head_dim, blockDim.x]: element (t, d) of this thread's
+  // accumulators sits at acc[(t * head_dim + d) * blockDim.x].
+  extern __shared__ float sweep_acc[];
+  float* acc = sweep_acc + threadIdx.x;
+  const int acc_stride = blockDim.x;
+
+  const int row = blockIdx.x * blockDim.x + threadIdx.x;
+  const int total_rows = batch_size * num_heads * num_queries;
+  if (row >= total_rows) {
+    return;
+  }
+
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
+  const int batch_index = bh / num_heads;
+  const int head_index = bh % num_heads;
+
+  const float* q_vec = queries + strides.queries.offset(batch_index, head_index, query_index);
+  float* out_vec = output + strides.output.offset(batch_index, head_index, query_index);
+  const float* k_head = keys + strides.keys.offset(batch_index, head_index, 0);
+  const float* v_head = values + strides.values.offset(batch_index, head_index, 0);
+  const std::int64_t k_stride = strides.keys.token;
+  const std::int64_t v_stride = strides.values.token;
+
+  const int position = query_index + num_keys - num_queries;
+  const int first_key = first_visible_key(window, position);
+  const int end_key = visible_keys(key_lengths, causal, batch_index, position, num_keys);
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  for (int tile_begin = 0; tile_begin < num_params; tile_begin += param_tile) {
+    const int tile_params = min(param_tile, num_params - tile_begin);
+    float tile_alpha[kSweepParamTile];
+    float tile_beta[kSweepParamTile];
+    float norms[kSweepParamTile];
+#pragma unroll
+    for (int t = 0; t < kSweepParamTile; ++t) {
+      const int p = tile_begin + min(t, tile_params - 1);
+      tile_alpha[t] = alpha[p * num_heads + head_index];
+      tile_beta[t] = beta[p * num_heads + head_index];
+      norms[t] = 0.0f;
+    }
+    for (int i = 0; i < tile_params * head_dim; ++i) {
+      acc[i * acc_stride] = 0.0f;
+    }
+
+    float scores[kSweepKeys];
+    for (int chunk_begin = first_key; chunk_begin < end_key; chunk_begin += kSweepKeys) {
+      const int chunk_keys = min(kSweepKeys, end_key - chunk_begin);
+#pragma unroll
+      for (int j = 0; j < kSweepKeys; ++j) {
+        if (j < chunk_keys) {
+          const float* k_vec = k_head + (chunk_begin + j) * k_stride;
+          float score = 0.0f;
+          for (int d = 0; d < head_dim; ++d) {
+            score += q_vec[d] * k_vec[d];
+          }
+          scores[j] = score * scale;
+        }
+      }
+
+#pragma unroll
+      for (int t = 0; t < kSweepParamTile; ++t) {
+        if (t < tile_params) {
+          float* acc_t = acc + t * head_dim * acc_stride;
+#pragma unroll
+          for (int j = 0; j < kSweepKeys; ++j) {
+            if (j < chunk_keys) {
+              const float membership = Membership::value(scores[j] - tile_beta[t], tile_alpha[t]);
+              if (Membership::kCompactSupport && membership == 0.0f) {
+                continue;
+              }
+              norms[t] += membership;
+              const float* v_vec = v_head + (chunk_begin + j) * v_stride;
+              for (int d = 0; d < head_dim; ++d) {
+                acc_t[d * acc_stride] += membership * v_vec[d];
+              }
+            }
+          }
+        }
+      }
+    }
+
+#pragma unroll
+    for (int t = 0; t < kSweepParamTile; ++t) {
+      if (t < tile_params) {
+        const float inv_norm = norms[t] > kEpsilon ? 1.0f / norms[t] : 0.0f;
+        const float* acc_t = acc + t * head_dim * acc_stride;
+        float* out_t = out_vec + (tile_begin + t) * param_stride;
+        for (int d = 0; d < head_dim; ++d) {
+          out_t[d] = acc_t[d * acc_stride] * inv_norm;
+        }
+      }
+    }
+  }
+}
+
+// Key and value rows of one (batch, head) slice of a cache buffer, each
+// token-strided. In a ring of ring_rows > 0 rows, row j is stored as row
+// j % ring_rows.
+template <typename Element>
+struct StridedKeyRows {
+  const Element* keys;
+  const Element* values;
+  std::int64_t key_stride;
+  std::int64_t value_stride;
+  int ring_rows;
+
+  __device__ int slot(int j) const { return ring_rows > 0 ? j % ring_rows : j; }
+  __device__ const Element* key(int j) const { return keys + slot(j) * key_stride; }
+  __device__ const Element* value(int j) const { return values + slot(j) * value_stride; }
+};
+
+// Key and value rows of one (batch, head) slice of a paged pool: row j is
+// row j % block_size of pool block block_table[j / block_size].
+template <typename Element>
+struct PagedKeyRows {
+  const Element* keys;
+  const Element* values;
+  const int* block_table;
+  int block_size;
+  std::int64_t page_stride;
+  int head_dim;
+
+  __device__ std::int64_t offset(int j) const {
+    return block_table[j / block_size] * page_stride + static_cast<std::int64_t>(j % block_size) * head_dim;
+  }
+  __device__ const Element* key(int j) const { return keys + offset(j); }
+  __device__ const Element* value(int j) const { return values + offset(j); }
+};
+
+// Adds the memberships of keys [key_begin, key_end) into the returned sum
+// and the membership-weighted values into acc, which starts from zero.
+template <typename Membership, typename Element, typename KeyRows>
+__device__ float accumulate_key_chunk(const Element* q_vec,
+                                      const KeyRows& rows,
+                                      int key_begin,
+                                      int key_end,
+                                      float alpha_h,
+                                      float beta_h,
+                                      int head_dim,
+                                      float* acc) {
+  const float scale = 1.0f / static_cast<float>(head_dim);
+  for (int d = 0; d < head_dim; ++d) {
+    acc[d] = 0.0f;
+  }
+
+  float norm = 0.0f;
+  for (int key_index = key_begin; key_index < key_end; ++key_index) {
+    const Element* k_vec = rows.key(key_index);
+    const Element* v_vec = rows.value(key_index);
+
+    float score = 0.0f;
+    for (int d = 0; d < head_dim; ++d) {
+      score += load_element(q_vec[d]) * load_element(k_vec[d]);
+    }
+    const float diff = score * scale - beta_h;
+    const float membership = Membership::value(diff, alpha_h);
+    if (Membership::kCompactSupport && membership == 0.0f) {
+      continue;
+    }
+    norm += membership;
+
+    for (int d = 0; d < head_dim; ++d) {
+      acc[d] += membership * load_element(v_vec[d]);
+    }
+  }
+  return norm;
+}
+
+// One decode row over keys [first_key, visible). Unsplit, the row is
+// normalised straight into out_vec. With key_splits > 1 this thread only
+// handles chunk task % key_splits of the keys and leaves its partial sums in
+// partial_norms[task] and partial_output[task * head_dim], which
+// fuzzy_attention_merge_splits_kernel adds up.
+template <typename Membership, typename Element, typename KeyRows>
+__device__ void decode_row(const Element* q_vec,
+                           const KeyRows& rows,
+                           int first_key,
+                           int visible,
+                           float alpha_h,
+                           float beta_h,
+                           int head_dim,
+                           int key_splits,
+                           int task,
+                           float* out_vec,
+                           float* partial_norms,
+                           float* partial_output) {
+  if (key_splits == 1) {
+    const float norm =
+        accumulate_key_chunk<Membership>(q_vec, rows, first_key, visible, alpha_h, beta_h, head_dim, out_vec);
+    const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+    for (int d = 0; d < head_dim; ++d) {
+      out_vec[d] *= inv_norm;
+    }
+    return;
+  }
+  const int chunk = (max(0, visible - first_key) + key_splits - 1) / key_splits;
+  const int key_begin = min(visible, first_key + (task % key_splits) * chunk);
+  const int key_end = min(visible, key_begin + chunk);
+  partial_norms[task] = accumulate_key_chunk<Membership>(q_vec, rows, key_begin, key_end, alpha_h, beta_h, head_dim,
+                                                         partial_output + static_cast<std::int64_t>(task) * head_dim);
+}
+
+// Incremental-decode forward: one thread per (batch, head, new query) row,
+// or per (row, key chunk) with split-K, fused like
+// fuzzy_attention_forward_fused_kernel. Query i sits at position
+// num_keys - num_queries + i of the cached key sequence and sees keys up to
+// and including it, only the last window of them when window > 0. With
+// ring_rows > 0 the cache buffers are rings (see StridedKeyRows). Queries,
+// keys and values are Element, widened as they are loaded; the output is
+// float32.
+template <typename Membership, typename Element = float>
+__global__ void fuzzy_attention_forward_cached_kernel(const Element* __restrict__ queries,
+                                                      const Element* __restrict__ keys,
+                                                      const Element* __restrict__ values,
+                                                      const float* __restrict__ alpha,
+                                                      const float* __restrict__ beta,
+                                                      float* __restrict__ output,
+                                                      float* __restrict__ partial_norms,
+                                                      float* __restrict__ partial_output,
+                                                      AttentionStrides strides,
+                                                      int batch_size,
+                                                      int num_heads,
+                                                      int num_queries,
+                                                      int num_keys,
+                                                      int head_dim,
+                                                      int window,
+                                                      int ring_rows,
+                                                      int key_splits) {
+  const int task = blockIdx.x * blockDim.x + threadIdx.x;
+  if (task >= batch_size * num_heads * num_queries * key_splits) {
+    return;
+  }
+  const int row = task / key_splits;
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
+  const int batch_index = bh / num_heads;
+  const int head_index = bh % num_heads;
+
+  const StridedKeyRows<Element> rows{keys + strides.keys.offset(batch_index, head_index, 0),
+                                     values + strides.values.offset(batch_index, head_index, 0),
+                                     strides.keys.token,
+                                     strides.values.token,
+                                     ring_rows};
+  const int position = num_keys - num_queries + query_index;
+  decode_row<Membership>(queries + strides.queries.offset(batch_index, head_index, query_index),
+                         rows,
+                         first_visible_key(window, position),
+                         position + 1,
+                         alpha[head_index],
+                         beta[head_index],
+                         head_dim,
+                         key_splits,
+                         task,
+                         output + strides.output.offset(batch_index, head_index, query_index),
+                         partial_norms,
+                         partial_output);
+}
+
+// Incremental-decode forward over a paged KV cache: as
+// fuzzy_attention_forward_cached_kernel, but key j of sequence b is read
+// through PagedKeyRows from the block table row of b, and every sequence has
+// its own length.
+template <typename Membership, typename Element = float>
+__global__ void fuzzy_attention_forward_paged_kernel(const Element* __restrict__ queries,
+                                                     const Element* __restrict__ key_pool,
+                                                     const Element* __restrict__ value_pool,
+                                                     const int* __restrict__ block_tables,
+                                                     const int* __restrict__ seq_lengths,
+                                                     const float* __restrict__ alpha,
+                                                     const float* __restrict__ beta,
+                                                     float* __restrict__ output,
+                                                     float* __restrict__ partial_norms,
+                                                     float* __restrict__ partial_output,
+                                                     TensorStrides query_strides,
+                                                     TensorStrides output_strides,
+                                                     int batch_size,
+                                                     int num_heads,
+                                                     int num_kv_heads,
+                                                     int num_queries,
+                                                     int head_dim,
+                                                     int block_size,
+                                                     int max_blocks,
+                                                     int key_splits) {
+  const int task = blockIdx.x * blockDim.x + threadIdx.x;
+  if (task >= batch_size * num_heads * num_queries * key_splits) {
+    return;
+  }
+  const int row = task / key_splits;
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
+  const int batch_index = bh / num_heads;
+  const int head_index = bh % num_heads;
+
+  const int kv_head = head_index / (num_heads / num_kv_heads);
+  const std::int64_t head_offset = static_cast<std::int64_t>(kv_head) * block_size * head_dim;
+  const PagedKeyRows<Element> rows{key_pool + head_offset,
+                                   value_pool + head_offset,
+                                   block_tables + batch_index * max_blocks,
+                                   block_size,
+                                   static_cast<std::int64_t>(num_kv_heads) * block_size * head_dim,
+                                   head_dim};
+  decode_row<Membership>(queries + query_strides.offset(batch_index, head_index, query_index),
+                         rows,
+                         0,
+                         seq_lengths[batch_index] - num_queries + query_index + 1,
+                         alpha[head_index],
+                         beta[head_index],
+                         head_dim,
+                         key_splits,
+                         task,
+                         output + output_strides.offset(batch_index, head_index, query_index),
+                         partial_norms,
+                         partial_output);
 }
 
+// Second pass of split-K decode: one thread per row adds up its key_splits
+// partial sums in chunk order and normalises once.
+__global__ void fuzzy_attention_merge_splits_kernel(const float* __restrict__ partial_norms,
+                                                    const float* __restrict__ partial_output,
+                                                    float* __restrict__ output,
+                                                    TensorStrides output_strides,
+                                                    int batch_size,
+                                                    int num_heads,
+                                                    int num_queries,
+                                                    int head_dim,
+                                                    int key_splits) {
+  const int row = blockIdx.x * blockDim.x + threadIdx.x;
+  if (row >= batch_size * num_heads * num_queries) {
+    return;
+  }
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
+  float* out_vec = output + output_strides.offset(bh / num_heads, bh % num_heads, query_index);
+
+  float norm = 0.0f;
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] = 0.0f;
+  }
+  for (int split = 0; split < key_splits; ++split) {
+    const std::int64_t task = static_cast<std::int64_t>(row) * key_splits + split;
+    norm += partial_norms[task];
+    const float* partial = partial_output + task * head_dim;
+    for (int d = 0; d < head_dim; ++d) {
+      out_vec[d] += partial[d];
+    }
+  }
+
+  const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] *= inv_norm;
+  }
+}
+
+template <typename Membership>
 __global__ void fuzzy_attention_backward_kernel(const float* __restrict__ grad_out,
                                                 const float* __restrict__ queries,
                                                 const float* __restrict__ keys,
                                                 const float* __restrict__ values,
                                                 const float* __restrict__ alpha,
                                                 const float* __restrict__ beta,
+                                                const float* __restrict__ saved_norms,
+                                                const float* __restrict__ saved_output,
                                                 float* __restrict__ d_queries,
                                                 float* __restrict__ d_keys,
                                                 float* __restrict__ d_values,
                                                 float* __restrict__ d_alpha,
                                                 float* __restrict__ d_beta,
+                                                const int* __restrict__ key_lengths,
+                                                bool causal,
+                                                int window,
                                                 int batch_size,
                                                 int num_heads,
-                                                int seq_len,
+                                                int num_queries,
+                                                int num_keys,
                                                 int head_dim) {
   const int row = blockIdx.x * blockDim.x + threadIdx.x;
-  const int total_rows = batch_size * num_heads * seq_len;
+  const int total_rows = batch_size * num_heads * num_queries;
   if (row >= total_rows) {
     return;
   }
-  const int bh = row / seq_len;
-  const int query_index = row % seq_len;
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
   const int batch_index = bh / num_heads;
   const int head_index = bh % num_heads;
 
-  const int row_offset = ((batch_index * num_heads + head_index) * seq_len + query_index) * head_dim;
+  const int row_offset = row * head_dim;
   const float* q_vec = queries + row_offset;
   const float* grad_vec = grad_out + row_offset;
   float* dq_vec = d_queries + row_offset;
 
-  const int head_base = (batch_index * num_heads + head_index) * seq_len * head_dim;
+  const int head_base = bh * num_keys * head_dim;
   const float* k_head = keys + head_base;
   const float* v_head = values + head_base;
   float* dk_head = d_keys + head_base;
   float* dv_head = d_values + head_base;
 
+  const int position = query_index + num_keys - num_queries;
+  const int first_key = first_visible_key(window, position);
+  const int end_key = visible_keys(key_lengths, causal, batch_index, position, num_keys);
+
   const float alpha_h = alpha[head_index];
   const float beta_h = beta[head_index];
 
@@ -127,79 +855,111 @@ __global__ void fuzzy_attention_backward_kernel(const float* __restrict__ grad_o
   // For large seq_len, we'll recompute rather than use excessive stack space
   const float scale = 1.0f / static_cast<float>(head_dim);
   constexpr int MAX_CACHE_SIZE = 256;
-  const bool use_cache = seq_len <= MAX_CACHE_SIZE;
+  const bool use_saved = saved_norms != nullptr && saved_output != nullptr;
+  // Cached scores are indexed from the row's first visible key.
+  const bool use_cache = !use_saved && end_key - first_key <= MAX_CACHE_SIZE;
   
   float scores[MAX_CACHE_SIZE];
   float memberships[MAX_CACHE_SIZE];
   float weights[MAX_CACHE_SIZE];
   
-  // First pass: compute norm
   float norm = 0.0f;
-  for (int key_index = 0; key_index < seq_len; ++key_index) {
-    const float* k_vec = k_head + key_index * head_dim;
-    float score = 0.0f;
+  float sum_gw_w = 0.0f;
+  if (use_saved) {
+    // The forward already produced the normaliser, and
+    // sum_j w_ij * (g_i . v_j) == g_i . out_i, so the first two passes
+    // collapse into one dot product.
+    norm = saved_norms[row];
+    const float* out_vec = saved_output + row_offset;
     for (int d = 0; d < head_dim; ++d) {
-      score += q_vec[d] * k_vec[d];
+      sum_gw_w += grad_vec[d] * out_vec[d];
+    }
+  } else {
+    // First pass: compute norm
+    for (int key_index = first_key; key_index < end_key; ++key_index) {
+      const float* k_vec = k_head + key_index * head_dim;
+      float score = 0.0f;
+      for (int d = 0; d < head_dim; ++d) {
+        score += q_vec[d] * k_vec[d];
+      }
+      score *= scale;
+      const float diff = score - beta_h;
+      const float membership = Membership::value(diff, alpha_h);
+      if (use_cache) {
+        scores[key_index - first_key] = score;
+        memberships[key_index - first_key] = membership;
+      }
+      norm += membership;
     }
-    score *= scale;
-    scores[key_index] = score;
-    const float diff = score - beta_h;
-    const float membership = __expf(-alpha_h * diff * diff);
-    memberships[key_index] = membership;
-    norm += membership;
   }
   const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
   
   // Second pass: compute weights and accumulate gradients
-  float sum_gw_w = 0.0f;
-  for (int key_index = 0; key_index < seq_len; ++key_index) {
-    const float* v_vec = v_head + key_index * head_dim;
-    const float weight = memberships[key_index] * inv_norm;
-    weights[key_index] = weight;
+  if (!use_saved) {
+    for (int key_index = first_key; key_index < end_key; ++key_index) {
+      const float* k_vec = k_head + key_index * head_dim;
+      const float* v_vec = v_head + key_index * head_dim;
+      float membership;
+      if (use_cache) {
+        membership = memberships[key_index - first_key];
+      } else {
+        float score = 0.0f;
+        for (int d = 0; d < head_dim; ++d) {
+          score += q_vec[d] * k_vec[d];
+        }
+        const float diff = score * scale - beta_h;
+        membership = Membership::value(diff, alpha_h);
+      }
+      const float weight = membership * inv_norm;
+      if (use_cache) {
+        weights[key_index - first_key] = weight;
+      }
 
-    float gw = 0.0f;
-    for (int d = 0; d < head_dim; ++d) {
-      gw += grad_vec[d] * v_vec[d];
-      atomicAdd(dv_head + key_index * head_dim + d, weight * grad_vec[d]);
+      float gw = 0.0f;
+      for (int d = 0; d < head_dim; ++d) {
+        gw += grad_vec[d] * v_vec[d];
+      }
+      sum_gw_w += gw * weight;
     }
-    sum_gw_w += gw * weight;
   }
   
   // Third pass: compute parameter gradients using cached values (or recompute if too large)
   float grad_alpha_accum = 0.0f;
   float grad_beta_accum = 0.0f;
-  for (int key_index = 0; key_index < seq_len; ++key_index) {
+  for (int key_index = first_key; key_index < end_key; ++key_index) {
     const float* k_vec = k_head + key_index * head_dim;
     const float* v_vec = v_head + key_index * head_dim;
     float* dk_vec = dk_head + key_index * head_dim;
     
     float score, membership, weight, diff;
     if (use_cache) {
-      score = scores[key_index];
-      membership = memberships[key_index];
-      weight = weights[key_index];
+      score = scores[key_index - first_key];
+      membership = memberships[key_index - first_key];
+      weight = weights[key_index - first_key];
       diff = score - beta_h;
     } else {
-      // Recompute for large sequences
+      // Recompute for large sequences or when the forward statistics were saved
       score = 0.0f;
       for (int d = 0; d < head_dim; ++d) {
         score += q_vec[d] * k_vec[d];
       }
       score *= scale;
       diff = score - beta_h;
-      membership = __expf(-alpha_h * diff * diff);
+      membership = Membership::value(diff, alpha_h);
       weight = membership * inv_norm;
     }
     
     float gw = 0.0f;
     for (int d = 0; d < head_dim; ++d) {
       gw += grad_vec[d] * v_vec[d];
+      atomicAdd(dv_head + key_index * head_dim + d, weight * grad_vec[d]);
     }
     const float g_m = inv_norm > 0.0f ? (gw - sum_gw_w) * inv_norm : 0.0f;
-    const float g_s = -2.0f * alpha_h * diff * membership * g_m;
+    const float d_score = Membership::d_diff(diff, alpha_h, membership);
+    const float g_s = d_score * g_m;
 
-    grad_alpha_accum += g_m * (-diff * diff * membership);
-    grad_beta_accum += g_m * (2.0f * alpha_h * diff * membership);
+    grad_alpha_accum += g_m * Membership::d_alpha(diff, alpha_h, membership);
+    grad_beta_accum -= g_m * d_score;
 
     for (int d = 0; d < head_dim; ++d) {
       const float k_val = k_vec[d];
@@ -212,31 +972,771 @@ __global__ void fuzzy_attention_backward_kernel(const float* __restrict__ grad_o
   atomicAdd(d_beta + head_index, grad_beta_accum);
 }
 
+// Deterministic backward, pass 1: one thread per query row, which owns its
+// dQ row outright, in a single sweep over the keys. With the forward's saved
+// normalisers and output, sum_j w_ij * (g_i . v_j) == g_i . out_i is known up
+// front and the sweep accumulates dQ directly. Without them, writing
+// c_j = d_diff_j and gw_j = g_i . v_j,
+//   dQ_i = scale / norm_i * (sum_j c_j gw_j k_j - sum_gw_i * sum_j c_j k_j),
+// so the sweep gathers both key sums (the second in row_keys) next to the
+// normaliser and sum_j m_j gw_j and combines them at the end.
+template <typename Membership>
+__global__ void fuzzy_attention_backward_rows_kernel(const float* __restrict__ grad_out,
+                                                     const float* __restrict__ queries,
+                                                     const float* __restrict__ keys,
+                                                     const float* __restrict__ values,
+                                                     const float* __restrict__ alpha,
+                                                     const float* __restrict__ beta,
+                                                     const float* __restrict__ saved_norms,
+                                                     const float* __restrict__ saved_output,
+                                                     float* __restrict__ d_queries,
+                                                     float* __restrict__ row_norm,
+                                                     float* __restrict__ row_sum_gw,
+                                                     float* __restrict__ row_keys,
+                                                     const int* __restrict__ key_lengths,
+                                                     bool causal,
+                                                     int window,
+                                                     int batch_size,
+                                                     int num_heads,
+                                                     int num_queries,
+                                                     int num_keys,
+                                                     int head_dim) {
+  const int row = blockIdx.x * blockDim.x + threadIdx.x;
+  const int total_rows = batch_size * num_heads * num_queries;
+  if (row >= total_rows) {
+    return;
+  }
+  const int bh = row / num_queries;
+  const int query_index = row % num_queries;
+  const int batch_index = bh / num_heads;
+  const int head_index = bh % num_heads;
+
+  const int row_offset = row * head_dim;
+  const float* q_vec = queries + row_offset;
+  const float* grad_vec = grad_out + row_offset;
+  float* dq_vec = d_queries + row_offset;
+
+  const int head_base = bh * num_keys * head_dim;
+  const float* k_head = keys + head_base;
+  const float* v_head = values + head_base;
+
+  const int position = query_index + num_keys - num_queries;
+  const int first_key = first_visible_key(window, position);
+  const int end_key = visible_keys(key_lengths, causal, batch_index, position, num_keys);
+
+  const float alpha_h = alpha[head_index];
+  const float beta_h = beta[head_index];
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  for (int d = 0; d < head_dim; ++d) {
+    dq_vec[d] = 0.0f;
+  }
+
+  float norm = 0.0f;
+  float sum_gw_w = 0.0f;
+  if (saved_norms != nullptr && saved_output != nullptr) {
+    norm = saved_norms[row];
+    const float* out_vec = saved_output + row_offset;
+    for (int d = 0; d < head_dim; ++d) {
+      sum_gw_w += grad_vec[d] * out_vec[d];
+    }
+    const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+    for (int key_index = first_key; key_index < end_key; ++key_index) {
+      const float* k_vec = k_head + key_index * head_dim;
+      const float* v_vec = v_head + key_index * head_dim;
+      float score = 0.0f;
+      float gw = 0.0f;
+      for (int d = 0; d < head_dim; ++d) {
+        score += q_vec[d] * k_vec[d];
+        gw += grad_vec[d] * v_vec[d];
+      }
+      const float diff = score * scale - beta_h;
+      const float membership = Membership::value(diff, alpha_h);
+      const float g_m = (gw - sum_gw_w) * inv_norm;
+      const float g_s = Membership::d_diff(diff, alpha_h, membership) * g_m;
+      for (int d = 0; d < head_dim; ++d) {
+        dq_vec[d] += g_s * k_vec[d] * scale;
+      }
+    }
+  } else {
+    float* keys_vec = row_keys + row_offset;
+    for (int d = 0; d < head_dim; ++d) {
+      keys_vec[d] = 0.0f;
+    }
+    float sum_m_gw = 0.0f;
+    for (int key_index = first_key; key_index < end_key; ++key_index) {
+      const float* k_vec = k_head + key_index * head_dim;
+      const float* v_vec = v_head + key_index * head_dim;
+      float score = 0.0f;
+      float gw = 0.0f;
+      for (int d = 0; d < head_dim; ++d) {
+        score += q_vec[d] * k_vec[d];
+        gw += grad_vec[d] * v_vec[d];
+      }
+      const float diff = score * scale - beta_h;
+      const float membership = Membership::value(diff, alpha_h);
+      const float d_score = Membership::d_diff(diff, alpha_h, membership);
+      norm += membership;
+      sum_m_gw += membership * gw;
+      for (int d = 0; d < head_dim; ++d) {
+        dq_vec[d] += d_score * gw * k_vec[d];
+        keys_vec[d] += d_score * k_vec[d];
+      }
+    }
+    sum_gw_w = norm > kEpsilon ? sum_m_gw / norm : 0.0f;
+    const float dq_scale = norm > kEpsilon ? scale / norm : 0.0f;
+    for (int d = 0; d < head_dim; ++d) {
+      dq_vec[d] = (dq_vec[d] - sum_gw_w * keys_vec[d]) * dq_scale;
+    }
+  }
+
+  row_norm[row] = norm;
+  row_sum_gw[row] = sum_gw_w;
+}
+
+// Deterministic backward, pass 2: one thread per key row, sweeping the
+// queries of its (batch, head). dK and dV rows are owned by the thread, and
+// the key's d_alpha/d_beta contributions go to param_partials for a
+// fixed-order reduction.
+template <typename Membership>
+__global__ void fuzzy_attention_backward_keys_kernel(const float* __restrict__ grad_out,
+                                                     const float* __restrict__ queries,
+                                                     const float* __restrict__ keys,
+                                                     const float* __restrict__ values,
+                                                     const float* __restrict__ alpha,
+                                                     const float* __restrict__ beta,
+                                                     const float* __restrict__ row_norm,
+                                                     const float* __restrict__ row_sum_gw,
+                                                     float* __restrict__ d_keys,
+                                                     float* __restrict__ d_values,
+                                                     float* __restrict__ param_partials,
+                                                     const int* __restrict__ key_lengths,
+                                                     bool causal,
+                                                     int window,
+                                                     int batch_size,
+                                                     int num_heads,
+                                                     int num_queries,
+                                                     int num_keys,
+                                                     int head_dim) {
+  const int key_row = blockIdx.x * blockDim.x + threadIdx.x;
+  const int total_rows = batch_size * num_heads * num_keys;
+  if (key_row >= total_rows) {
+    return;
+  }
+  const int bh = key_row / num_keys;
+  const int key_index = key_row % num_keys;
+  const int batch_index = bh / num_heads;
+  const int head_index = bh % num_heads;
+
+  const int key_offset = key_row * head_dim;
+  const float* k_vec = keys + key_offset;
+  const float* v_vec = values + key_offset;
+  float* dk_vec = d_keys + key_offset;
+  float* dv_vec = d_values + key_offset;
+
+  const int head_base = bh * num_queries * head_dim;
+  const float* q_head = queries + head_base;
+  const float* grad_head = grad_out + head_base;
+  const float* norm_head = row_norm + bh * num_queries;
+  const float* sum_gw_head = row_sum_gw + bh * num_queries;
+
+  const float alpha_h = alpha[head_index];
+  const float beta_h = beta[head_index];
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  for (int d = 0; d < head_dim; ++d) {
+    dk_vec[d] = 0.0f;
+    dv_vec[d] = 0.0f;
+  }
+
+  // A padded key is seen by no query; under the causal mask key j is seen
+  // by the queries at positions j and later only, and with a window by the
+  // next window positions only. Query i sits at position i + offset.
+  const int offset = num_keys - num_queries;
+  const bool key_visible = key_lengths == nullptr || key_index < key_lengths[batch_index];
+  const int first_query = key_visible ? (causal ? min(max(key_index - offset, 0), num_queries) : 0) : num_queries;
+  const int last_query = window > 0 ? min(max(key_index + window - offset, 0), num_queries) : num_queries;
+
+  float grad_alpha_accum = 0.0f;
+  float grad_beta_accum = 0.0f;
+  for (int query_index = first_query; query_index < last_query; ++query_index) {
+    const float* q_vec = q_head + query_index * head_dim;
+    const float* grad_vec = grad_head + query_index * head_dim;
+    float score = 0.0f;
+    float gw = 0.0f;
+    for (int d = 0; d < head_dim; ++d) {
+      score += q_vec[d] * k_vec[d];
+      gw += grad_vec[d] * v_vec[d];
+    }
+    const float norm = norm_head[query_index];
+    const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+    const float diff = score * scale - beta_h;
+    const float membership = Membership::value(diff, alpha_h);
+    const float weight = membership * inv_norm;
+    const float g_m = (gw - sum_gw_head[query_index]) * inv_norm;
+    const float d_score = Membership::d_diff(diff, alpha_h, membership);
+    const float g_s = d_score * g_m;
+
+    grad_alpha_accum += g_m * Membership::d_alpha(diff, alpha_h, membership);
+    grad_beta_accum -= g_m * d_score;
+
+    for (int d = 0; d < head_dim; ++d) {
+      dv_vec[d] += weight * grad_vec[d];
+      dk_vec[d] += g_s * q_vec[d] * scale;
+    }
+  }
+
+  param_partials[2 * key_row] = grad_alpha_accum;
+  param_partials[2 * key_row + 1] = grad_beta_accum;
+}
+
+constexpr int kReduceThreads = 128;
+
+// One block per head. Each thread strides over that head's (batch, key)
+// contributions, then a fixed shared-memory tree combines the threads.
+__global__ void fuzzy_attention_reduce_params_kernel(const float* __restrict__ param_partials,
+                                                     float* __restrict__ d_alpha,
+                                                     float* __restrict__ d_beta,
+                                                     int batch_size,
+                                                     int num_heads,
+                                                     int num_keys) {
+  __shared__ float alpha_sums[kReduceThreads];
+  __shared__ float beta_sums[kReduceThreads];
+
+  const int head_index = blockIdx.x;
+  const int items = batch_size * num_keys;
+  float alpha_sum = 0.0f;
+  float beta_sum = 0.0f;
+  for (int item = threadIdx.x; item < items; item += kReduceThreads) {
+    const int batch_index = item / num_keys;
+    const int key_index = item % num_keys;
+    const int key_row = (batch_index * num_heads + head_index) * num_keys + key_index;
+    alpha_sum += param_partials[2 * key_row];
+    beta_sum += param_partials[2 * key_row + 1];
+  }
+  alpha_sums[threadIdx.x] = alpha_sum;
+  beta_sums[threadIdx.x] = beta_sum;
+  __syncthreads();
+
+  for (int stride = kReduceThreads / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      alpha_sums[threadIdx.x] += alpha_sums[threadIdx.x + stride];
+      beta_sums[threadIdx.x] += beta_sums[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+
+  if (threadIdx.x == 0) {
+    d_alpha[head_index] = alpha_sums[0];
+    d_beta[head_index] = beta_sums[0];
+  }
+}
+
+// Forward kernels instantiated for one head_dim and membership; head_dim 0
+// is the generic build that reads head_dim at run time.
+template <typename Membership>
+struct ForwardKernels {
+  int head_dim;
+  decltype(&fuzzy_attention_forward_kernel<0, Membership>) two_pass;
+  decltype(&fuzzy_attention_forward_fused_kernel<0, Membership>) fused;
+};
+
+template <int kHeadDim, typename Membership>
+constexpr ForwardKernels<Membership> forward_kernels_for() {
+  return {kHeadDim,
+          fuzzy_attention_forward_kernel<kHeadDim, Membership>,
+          fuzzy_attention_forward_fused_kernel<kHeadDim, Membership>};
+}
+
+// The fixed fused rows hold 2 * head_dim floats (query and accumulator) per
+// thread on top of the loop state, so past head_dim 64 they outgrow the 255
+// registers a thread can address and spill to local memory. Only 32 and 64
+// of the CPU's kSpecializedHeadDims are therefore built here; the generic
+// entry comes first and catches everything else.
+template <typename Membership>
+const ForwardKernels<Membership>& select_forward_kernels(int head_dim, bool specialize_head_dim) {
+  static const ForwardKernels<Membership> kForwardKernels[] = {
+      forward_kernels_for<0, Membership>(),
+      forward_kernels_for<32, Membership>(),
+      forward_kernels_for<64, Membership>(),
+  };
+  if (specialize_head_dim) {
+    for (const auto& entry : kForwardKernels) {
+      if (entry.head_dim == head_dim) {
+        return entry;
+      }
+    }
+  }
+  return kForwardKernels[0];
+}
+
 void launch_fuzzy_attention_forward(const float* queries,
                                     const float* keys,
                                     const float* values,
                                     const float* alpha,
                                     const float* beta,
+                                    FuzzyMembership membership,
                                     float* output,
+                                    float* row_norms,
+                                    const int* key_lengths,
+                                    bool causal,
+                                    int window,
                                     int batch_size,
                                     int num_heads,
-                                    int seq_len,
+                                    int num_queries,
+                                    int num_keys,
                                     int head_dim,
+                                    bool specialize_head_dim,
+                                    const AttentionStrides* strides,
                                     cudaStream_t stream) {
-  const int total_rows = batch_size * num_heads * seq_len;
+  const int total_rows = batch_size * num_heads * num_queries;
   const int threads = 128;
   const int blocks = (total_rows + threads - 1) / threads;
-  fuzzy_attention_forward_kernel<<<blocks, threads, 0, stream>>>(
-      queries,
-      keys,
-      values,
-      alpha,
-      beta,
-      output,
-      batch_size,
-      num_heads,
-      seq_len,
-      head_dim);
+  with_membership(membership, [&](auto kind) {
+    const auto kernel = select_forward_kernels<decltype(kind)>(head_dim, specialize_head_dim).two_pass;
+    kernel<<<blocks, threads, 0, stream>>>(
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        output,
+        row_norms,
+        key_lengths,
+        causal,
+        window,
+        strides != nullptr ? *strides : contiguous_strides(num_heads, num_queries, num_keys, head_dim),
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim);
+  });
+}
+
+void launch_fuzzy_attention_forward_fused(const float* queries,
+                                          const float* keys,
+                                          const float* values,
+                                          const float* alpha,
+                                          const float* beta,
+                                          FuzzyMembership membership,
+                                          float* output,
+                                          float* row_norms,
+                                          const int* key_lengths,
+                                          bool causal,
+                                          int window,
+                                          const KeyPruning* pruning,
+                                          int batch_size,
+                                          int num_heads,
+                                          int num_queries,
+                                          int num_keys,
+                                          int head_dim,
+                                          bool specialize_head_dim,
+                                          const AttentionStrides* strides,
+                                          cudaStream_t stream) {
+  const int total_rows = batch_size * num_heads * num_queries;
+  const int threads = 128;
+  const int blocks = (total_rows + threads - 1) / threads;
+  with_membership(membership, [&](auto kind) {
+    const auto kernel = select_forward_kernels<decltype(kind)>(head_dim, specialize_head_dim).fused;
+    kernel<<<blocks, threads, 0, stream>>>(
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        output,
+        row_norms,
+        key_lengths,
+        causal,
+        window,
+        strides != nullptr ? *strides : contiguous_strides(num_heads, num_queries, num_keys, head_dim),
+        pruning != nullptr ? *pruning : KeyPruning{},
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim);
+  });
+}
+
+void launch_fuzzy_attention_forward_fused_16bit(const std::uint16_t* queries,
+                                                const std::uint16_t* keys,
+                                                const std::uint16_t* values,
+                                                bool bfloat16,
+                                                const float* alpha,
+                                                const float* beta,
+                                                FuzzyMembership membership,
+                                                float* output,
+                                                float* row_norms,
+                                                const int* key_lengths,
+                                                bool causal,
+                                                int window,
+                                                const KeyPruning* pruning,
+                                                int batch_size,
+                                                int num_heads,
+                                                int num_queries,
+                                                int num_keys,
+                                                int head_dim,
+                                                bool specialize_head_dim,
+                                                const AttentionStrides* strides,
+                                                cudaStream_t stream) {
+  const int total_rows = batch_size * num_heads * num_queries;
+  const int threads = 128;
+  const int blocks = (total_rows + threads - 1) / threads;
+  const auto launch = [&](auto kind, auto element) {
+    using Membership = decltype(kind);
+    using Element = decltype(element);
+    // The head dims select_forward_kernels instantiates.
+    auto kernel = fuzzy_attention_forward_fused_kernel<0, Membership, Element>;
+    if (specialize_head_dim && head_dim == 32) {
+      kernel = fuzzy_attention_forward_fused_kernel<32, Membership, Element>;
+    } else if (specialize_head_dim && head_dim == 64) {
+      kernel = fuzzy_attention_forward_fused_kernel<64, Membership, Element>;
+    }
+    kernel<<<blocks, threads, 0, stream>>>(
+        reinterpret_cast<const Element*>(queries),
+        reinterpret_cast<const Element*>(keys),
+        reinterpret_cast<const Element*>(values),
+        alpha,
+        beta,
+        output,
+        row_norms,
+        key_lengths,
+        causal,
+        window,
+        strides != nullptr ? *strides : contiguous_strides(num_heads, num_queries, num_keys, head_dim),
+        pruning != nullptr ? *pruning : KeyPruning{},
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim);
+  };
+  with_membership(membership, [&](auto kind) {
+    if (bfloat16) {
+      launch(kind, __nv_bfloat16{});
+    } else {
+      launch(kind, __half{});
+    }
+  });
+}
+
+void launch_fuzzy_attention_forward_sweep(const float* queries,
+                                          const float* keys,
+                                          const float* values,
+                                          const float* alpha,
+                                          const float* beta,
+                                          int num_params,
+                                          FuzzyMembership membership,
+                                          float* output,
+                                          std::int64_t param_stride,
+                                          const int* key_lengths,
+                                          bool causal,
+                                          int window,
+                                          int batch_size,
+                                          int num_heads,
+                                          int num_queries,
+                                          int num_keys,
+                                          int head_dim,
+                                          const AttentionStrides& strides,
+                                          cudaStream_t stream) {
+  const int total_rows = batch_size * num_heads * num_queries;
+  const int blocks = (total_rows + kSweepThreads - 1) / kSweepThreads;
+  const int param_tile = sweep_param_tile(head_dim);
+  const std::size_t shared_bytes = static_cast<std::size_t>(param_tile) * head_dim * kSweepThreads * sizeof(float);
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    fuzzy_attention_forward_sweep_kernel<Membership><<<blocks, kSweepThreads, shared_bytes, stream>>>(
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        num_params,
+        param_tile,
+        output,
+        param_stride,
+        key_lengths,
+        causal,
+        window,
+        strides,
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim);
+  });
+}
+
+void launch_fuzzy_attention_forward_varlen(const float* queries,
+                                           const float* keys,
+                                           const float* values,
+                                           const float* alpha,
+                                           const float* beta,
+                                           FuzzyMembership membership,
+                                           float* output,
+                                           const int* cu_seqlens,
+                                           bool causal,
+                                           int window,
+                                           int num_seqs,
+                                           int total_tokens,
+                                           int num_heads,
+                                           int num_kv_heads,
+                                           int head_dim,
+                                           cudaStream_t stream) {
+  const int total_rows = num_heads * total_tokens;
+  const int threads = 128;
+  const int blocks = (total_rows + threads - 1) / threads;
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    fuzzy_attention_forward_varlen_kernel<Membership><<<blocks, threads, 0, stream>>>(
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        output,
+        cu_seqlens,
+        causal,
+        window,
+        num_seqs,
+        total_tokens,
+        num_heads,
+        num_kv_heads,
+        head_dim);
+  });
+}
+
+// Shared by the float32 and 16-bit entry points below.
+template <typename Element>
+void launch_forward_cached(const Element* queries,
+                           const Element* keys,
+                           const Element* values,
+                           const float* alpha,
+                           const float* beta,
+                           FuzzyMembership membership,
+                           float* output,
+                           float* partial_norms,
+                           float* partial_output,
+                           const AttentionStrides& strides,
+                           int batch_size,
+                           int num_heads,
+                           int num_queries,
+                           int num_keys,
+                           int head_dim,
+                           int window,
+                           int ring_rows,
+                           int key_splits,
+                           cudaStream_t stream) {
+  const int total_rows = batch_size * num_heads * num_queries;
+  const int threads = 128;
+  const int blocks = (total_rows * key_splits + threads - 1) / threads;
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    fuzzy_attention_forward_cached_kernel<Membership, Element><<<blocks, threads, 0, stream>>>(
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        output,
+        partial_norms,
+        partial_output,
+        strides,
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim,
+        window,
+        ring_rows,
+        key_splits);
+  });
+  if (key_splits > 1) {
+    fuzzy_attention_merge_splits_kernel<<<(total_rows + threads - 1) / threads, threads, 0, stream>>>(
+        partial_norms, partial_output, output, strides.output, batch_size, num_heads, num_queries, head_dim,
+        key_splits);
+  }
+}
+
+template <typename Element>
+void launch_forward_paged(const Element* queries,
+                          const Element* key_pool,
+                          const Element* value_pool,
+                          const int* block_tables,
+                          const int* seq_lengths,
+                          const float* alpha,
+                          const float* beta,
+                          FuzzyMembership membership,
+                          float* output,
+                          float* partial_norms,
+                          float* partial_output,
+                          const TensorStrides& query_strides,
+                          const TensorStrides& output_strides,
+                          int batch_size,
+                          int num_heads,
+                          int num_kv_heads,
+                          int num_queries,
+                          int head_dim,
+                          int block_size,
+                          int max_blocks,
+                          int key_splits,
+                          cudaStream_t stream) {
+  const int total_rows = batch_size * num_heads * num_queries;
+  const int threads = 128;
+  const int blocks = (total_rows * key_splits + threads - 1) / threads;
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    fuzzy_attention_forward_paged_kernel<Membership, Element><<<blocks, threads, 0, stream>>>(
+        queries,
+        key_pool,
+        value_pool,
+        block_tables,
+        seq_lengths,
+        alpha,
+        beta,
+        output,
+        partial_norms,
+        partial_output,
+        query_strides,
+        output_strides,
+        batch_size,
+        num_heads,
+        num_kv_heads,
+        num_queries,
+        head_dim,
+        block_size,
+        max_blocks,
+        key_splits);
+  });
+  if (key_splits > 1) {
+    fuzzy_attention_merge_splits_kernel<<<(total_rows + threads - 1) / threads, threads, 0, stream>>>(
+        partial_norms, partial_output, output, output_strides, batch_size, num_heads, num_queries, head_dim,
+        key_splits);
+  }
+}
+
+void launch_fuzzy_attention_forward_cached(const float* queries,
+                                           const float* keys,
+                                           const float* values,
+                                           const float* alpha,
+                                           const float* beta,
+                                           FuzzyMembership membership,
+                                           float* output,
+                                           float* partial_norms,
+                                           float* partial_output,
+                                           const AttentionStrides& strides,
+                                           int batch_size,
+                                           int num_heads,
+                                           int num_queries,
+                                           int num_keys,
+                                           int head_dim,
+                                           int window,
+                                           int ring_rows,
+                                           int key_splits,
+                                           cudaStream_t stream) {
+  launch_forward_cached(queries, keys, values, alpha, beta, membership, output, partial_norms, partial_output, strides,
+                        batch_size, num_heads, num_queries, num_keys, head_dim, window, ring_rows, key_splits, stream);
+}
+
+void launch_fuzzy_attention_forward_cached_16bit(const std::uint16_t* queries,
+                                                 const std::uint16_t* keys,
+                                                 const std::uint16_t* values,
+                                                 bool bfloat16,
+                                                 const float* alpha,
+                                                 const float* beta,
+                                                 FuzzyMembership membership,
+                                                 float* output,
+                                                 float* partial_norms,
+                                                 float* partial_output,
+                                                 const AttentionStrides& strides,
+                                                 int batch_size,
+                                                 int num_heads,
+                                                 int num_queries,
+                                                 int num_keys,
+                                                 int head_dim,
+                                                 int window,
+                                                 int ring_rows,
+                                                 int key_splits,
+                                                 cudaStream_t stream) {
+  const auto launch = [&](auto element) {
+    using Element = decltype(element);
+    launch_forward_cached(reinterpret_cast<const Element*>(queries), reinterpret_cast<const Element*>(keys),
+                          reinterpret_cast<const Element*>(values), alpha, beta, membership, output, partial_norms,
+                          partial_output, strides, batch_size, num_heads, num_queries, num_keys, head_dim, window,
+                          ring_rows, key_splits, stream);
+  };
+  if (bfloat16) {
+    launch(__nv_bfloat16{});
+  } else {
+    launch(__half{});
+  }
+}
+
+void launch_fuzzy_attention_forward_paged(const float* queries,
+                                          const float* key_pool,
+                                          const float* value_pool,
+                                          const int* block_tables,
+                                          const int* seq_lengths,
+                                          const float* alpha,
+                                          const float* beta,
+                                          FuzzyMembership membership,
+                                          float* output,
+                                          float* partial_norms,
+                                          float* partial_output,
+                                          const TensorStrides& query_strides,
+                                          const TensorStrides& output_strides,
+                                          int batch_size,
+                                          int num_heads,
+                                          int num_kv_heads,
+                                          int num_queries,
+                                          int head_dim,
+                                          int block_size,
+                                          int max_blocks,
+                                          int key_splits,
+                                          cudaStream_t stream) {
+  launch_forward_paged(queries, key_pool, value_pool, block_tables, seq_lengths, alpha, beta, membership, output,
+                       partial_norms, partial_output, query_strides, output_strides, batch_size, num_heads,
+                       num_kv_heads, num_queries, head_dim, block_size, max_blocks, key_splits, stream);
+}
+
+void launch_fuzzy_attention_forward_paged_16bit(const std::uint16_t* queries,
+                                                const std::uint16_t* key_pool,
+                                                const std::uint16_t* value_pool,
+                                                bool bfloat16,
+                                                const int* block_tables,
+                                                const int* seq_lengths,
+                                                const float* alpha,
+                                                const float* beta,
+                                                FuzzyMembership membership,
+                                                float* output,
+                                                float* partial_norms,
+                                                float* partial_output,
+                                                const TensorStrides& query_strides,
+                                                const TensorStrides& output_strides,
+                                                int batch_size,
+                                                int num_heads,
+                                                int num_kv_heads,
+                                                int num_queries,
+                                                int head_dim,
+                                                int block_size,
+                                                int max_blocks,
+                                                int key_splits,
+                                                cudaStream_t stream) {
+  const auto launch = [&](auto element) {
+    using Element = decltype(element);
+    launch_forward_paged(reinterpret_cast<const Element*>(queries), reinterpret_cast<const Element*>(key_pool),
+                         reinterpret_cast<const Element*>(value_pool), block_tables, seq_lengths, alpha, beta,
+                         membership, output, partial_norms, partial_output, query_strides, output_strides,
+                         batch_size, num_heads, num_kv_heads, num_queries, head_dim, block_size, max_blocks,
+                         key_splits, stream);
+  };
+  if (bfloat16) {
+    launch(__nv_bfloat16{});
+  } else {
+    launch(__half{});
+  }
 }
 
 void launch_fuzzy_attention_backward(const float* grad_out,
@@ -245,36 +1745,136 @@ void launch_fuzzy_attention_backward(const float* grad_out,
                                      const float* values,
                                      const float* alpha,
                                      const float* beta,
+                                     FuzzyMembership membership,
+                                     const float* saved_norms,
+                                     const float* saved_output,
                                      float* d_queries,
                                      float* d_keys,
                                      float* d_values,
                                      float* d_alpha,
                                      float* d_beta,
+                                     const int* key_lengths,
+                                     bool causal,
+                                     int window,
                                      int batch_size,
                                      int num_heads,
-                                     int seq_len,
+                                     int num_queries,
+                                     int num_keys,
                                      int head_dim,
                                      cudaStream_t stream) {
-  const int total_rows = batch_size * num_heads * seq_len;
+  const int total_rows = batch_size * num_heads * num_queries;
   const int threads = 128;
   const int blocks = (total_rows + threads - 1) / threads;
-  fuzzy_attention_backward_kernel<<<blocks, threads, 0, stream>>>(
-      grad_out,
-      queries,
-      keys,
-      values,
-      alpha,
-      beta,
-      d_queries,
-      d_keys,
-      d_values,
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    fuzzy_attention_backward_kernel<Membership><<<blocks, threads, 0, stream>>>(
+        grad_out,
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        saved_norms,
+        saved_output,
+        d_queries,
+        d_keys,
+        d_values,
+        d_alpha,
+        d_beta,
+        key_lengths,
+        causal,
+        window,
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim);
+  });
+}
+
+void launch_fuzzy_attention_backward_deterministic(const float* grad_out,
+                                                   const float* queries,
+                                                   const float* keys,
+                                                   const float* values,
+                                                   const float* alpha,
+                                                   const float* beta,
+                                                   FuzzyMembership membership,
+                                                   const float* saved_norms,
+                                                   const float* saved_output,
+                                                   float* d_queries,
+                                                   float* d_keys,
+                                                   float* d_values,
+                                                   float* d_alpha,
+                                                   float* d_beta,
+                                                   float* row_norm,
+                                                   float* row_sum_gw,
+                                                   float* row_keys,
+                                                   float* param_partials,
+                                                   const int* key_lengths,
+                                                   bool causal,
+                                                   int window,
+                                                   int batch_size,
+                                                   int num_heads,
+                                                   int num_queries,
+                                                   int num_keys,
+                                                   int head_dim,
+                                                   cudaStream_t stream) {
+  const int total_rows = batch_size * num_heads * num_queries;
+  const int threads = 128;
+  const int blocks = (total_rows + threads - 1) / threads;
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    fuzzy_attention_backward_rows_kernel<Membership><<<blocks, threads, 0, stream>>>(
+        grad_out,
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        saved_norms,
+        saved_output,
+        d_queries,
+        row_norm,
+        row_sum_gw,
+        row_keys,
+        key_lengths,
+        causal,
+        window,
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim);
+    const int key_blocks = (batch_size * num_heads * num_keys + threads - 1) / threads;
+    fuzzy_attention_backward_keys_kernel<Membership><<<key_blocks, threads, 0, stream>>>(
+        grad_out,
+        queries,
+        keys,
+        values,
+        alpha,
+        beta,
+        row_norm,
+        row_sum_gw,
+        d_keys,
+        d_values,
+        param_partials,
+        key_lengths,
+        causal,
+        window,
+        batch_size,
+        num_heads,
+        num_queries,
+        num_keys,
+        head_dim);
+  });
+  fuzzy_attention_reduce_params_kernel<<<num_heads, kReduceThreads, 0, stream>>>(
+      param_partials,
       d_alpha,
       d_beta,
       batch_size,
       num_heads,
-      seq_len,
-      head_dim);
+      num_keys);
 }
 
 } 
-} 
+}
@@ -0,0 +1,1800 @@
+#include "fuzzformer/fuzzyAttentionCpu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__)
+#include <unistd.h>
+#endif
+
+#include "fuzzformer/cpuKernels.h"
+#include "fuzzformer/threadPool.h"
+
+namespace fuzzformer {
+namespace kernels {
+
+namespace {
+
+constexpr float kEpsilon = 1e-6f;
+
+// Rows handed to a worker at a time; small enough to balance short
+// sequences, large enough to amortise scheduling.
+constexpr std::int64_t kRowGrain = 16;
+
+// Shortest key chunk worth a split-K task of its own.
+constexpr int kCpuMinSplitKeys = 256;
+
+// Upper bound on the backward's private dK/dV partials. Each query chunk
+// past the first of a (batch, head) needs two [num_keys, head_dim] buffers,
+// so few heads on a large pool would otherwise allocate gigabytes.
+constexpr std::int64_t kMaxBackwardScratchBytes = std::int64_t{256} << 20;
+
+constexpr long kDefaultL1Bytes = 32 * 1024;
+constexpr long kDefaultL2Bytes = 1024 * 1024;
+
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+long sysconf_bytes(int name, long fallback) {
+  const long reported = sysconf(name);
+  return reported > 0 ? reported : fallback;
+}
+
+long l1_cache_bytes() {
+  static const long bytes = sysconf_bytes(_SC_LEVEL1_DCACHE_SIZE, kDefaultL1Bytes);
+  return bytes;
+}
+
+long l2_cache_bytes() {
+  static const long bytes = sysconf_bytes(_SC_LEVEL2_CACHE_SIZE, kDefaultL2Bytes);
+  return bytes;
+}
+#else
+long l1_cache_bytes() {
+  return kDefaultL1Bytes;
+}
+
+long l2_cache_bytes() {
+  return kDefaultL2Bytes;
+}
+#endif
+
+int round_down(long value, int multiple) {
+  return static_cast<int>(std::max<long>(multiple, value / multiple * multiple));
+}
+
+// Padding and causal masks hide a suffix of the keys and a sliding window a
+// prefix, so a row only ever visits keys [key_begin, key_end). Masks are
+// taken at the query's position, which with fewer queries than keys is
+// query_index + num_keys - num_queries: the queries are the last tokens.
+int key_begin(int window, int position) {
+  return window > 0 ? std::max(0, position - window + 1) : 0;
+}
+
+int key_end(const int* key_lengths, bool causal, int batch_index, int position, int num_keys) {
+  int end = num_keys;
+  if (key_lengths != nullptr) {
+    end = std::clamp(key_lengths[batch_index], 0, num_keys);
+  }
+  if (causal) {
+    end = std::clamp(position + 1, 0, end);
+  }
+  return end;
+}
+
+float dot(const float* a, const float* b, int head_dim) {
+  float sum = 0.0f;
+  for (int d = 0; d < head_dim; ++d) {
+    sum += a[d] * b[d];
+  }
+  return sum;
+}
+
+template <typename Membership>
+float forward_row(const float* q_vec,
+                  const float* k_head,
+                  const float* v_head,
+                  std::int64_t key_stride,
+                  std::int64_t value_stride,
+                  float alpha_h,
+                  float beta_h,
+                  float* out_vec,
+                  int num_keys,
+                  int head_dim) {
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  float norm = 0.0f;
+  for (int key_index = 0; key_index < num_keys; ++key_index) {
+    const float score = dot(q_vec, k_head + key_index * key_stride, head_dim) * scale;
+    norm += Membership::value(score - beta_h, alpha_h);
+  }
+
+  float inv_norm = 0.0f;
+  if (norm > kEpsilon) {
+    inv_norm = 1.0f / norm;
+  }
+
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] = 0.0f;
+  }
+
+  for (int key_index = 0; key_index < num_keys; ++key_index) {
+    const float* v_vec = v_head + key_index * value_stride;
+    const float score = dot(q_vec, k_head + key_index * key_stride, head_dim) * scale;
+    const float weight = Membership::value(score - beta_h, alpha_h) * inv_norm;
+    if (Membership::kCompactSupport && weight == 0.0f) {
+      continue;
+    }
+    for (int d = 0; d < head_dim; ++d) {
+      out_vec[d] += weight * v_vec[d];
+    }
+  }
+  return norm;
+}
+
+template <typename Membership>
+float forward_row_fused(const float* q_vec,
+                        const float* k_head,
+                        const float* v_head,
+                        std::int64_t key_stride,
+                        std::int64_t value_stride,
+                        float alpha_h,
+                        float beta_h,
+                        float* out_vec,
+                        int num_keys,
+                        int head_dim) {
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] = 0.0f;
+  }
+
+  // The normaliser is a plain sum, so membership * V can be accumulated
+  // unnormalised and scaled once the sweep is done.
+  float norm = 0.0f;
+  for (int key_index = 0; key_index < num_keys; ++key_index) {
+    const float* v_vec = v_head + key_index * value_stride;
+    const float score = dot(q_vec, k_head + key_index * key_stride, head_dim) * scale;
+    const float membership = Membership::value(score - beta_h, alpha_h);
+    // Keys outside a compact support add nothing to either sum.
+    if (Membership::kCompactSupport && membership == 0.0f) {
+      continue;
+    }
+    norm += membership;
+    for (int d = 0; d < head_dim; ++d) {
+      out_vec[d] += membership * v_vec[d];
+    }
+  }
+
+  const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+  for (int d = 0; d < head_dim; ++d) {
+    out_vec[d] *= inv_norm;
+  }
+  return norm;
+}
+
+// Row kernels write the output row and return its membership sum. Key and
+// value rows are key_stride and value_stride elements apart.
+using RowKernel =
+    float (*)(const float*, const float*, const float*, std::int64_t, std::int64_t, float, float, float*, int, int);
+
+void for_each_row(RowKernel row_kernel,
+                  const float* queries,
+                  const float* keys,
+                  const float* values,
+                  const float* alpha,
+                  const float* beta,
+                  float* output,
+                  float* row_norms,
+                  const int* key_lengths,
+                  bool causal,
+                  int window,
+                  int batch_size,
+                  int num_heads,
+                  int num_queries,
+                  int num_keys,
+                  int head_dim,
+                  const AttentionStrides* strides) {
+  const std::int64_t total_rows = static_cast<std::int64_t>(batch_size) * num_heads * num_queries;
+  const AttentionStrides layout =
+      strides != nullptr ? *strides : contiguous_strides(num_heads, num_queries, num_keys, head_dim);
+
+  runtime::parallel_for(0, total_rows, kRowGrain, [&](std::int64_t row_begin, std::int64_t row_end) {
+    for (std::int64_t row = row_begin; row < row_end; ++row) {
+      const std::int64_t bh = row / num_queries;
+      const int batch_index = static_cast<int>(bh / num_heads);
+      const int head_index = static_cast<int>(bh % num_heads);
+      const int query_index = static_cast<int>(row % num_queries);
+      const int position = query_index + num_keys - num_queries;
+      const int first_key = key_begin(window, position);
+      const int keys_visible = std::max(0, key_end(key_lengths, causal, batch_index, position, num_keys) - first_key);
+
+      const float norm = row_kernel(queries + layout.queries.offset(batch_index, head_index, query_index),
+                                    keys + layout.keys.offset(batch_index, head_index, first_key),
+                                    values + layout.values.offset(batch_index, head_index, first_key),
+                                    layout.keys.token,
+                                    layout.values.token,
+                                    alpha[head_index],
+                                    beta[head_index],
+                                    output + layout.output.offset(batch_index, head_index, query_index),
+                                    keys_visible,
+                                    head_dim);
+      if (row_norms != nullptr) {
+        row_norms[row] = norm;
+      }
+    }
+  });
+}
+
+struct TileScratch {
+  TileScratch(int query_block, int key_block)
+      : norms(query_block),
+        query_norms(query_block),
+        scores(key_block),
+        memberships(key_block),
+        query_scales(query_block) {}
+
+  std::vector<float> norms;
+  std::vector<float> query_norms;
+  std::vector<float> scores;
+  std::vector<float> memberships;
+  // int8 copy of the query block and its row scales, times the score scale;
+  // int8 scoring only.
+  std::vector<std::int8_t> quantized_queries;
+  std::vector<float> query_scales;
+  // Dense copies of the query block, its output accumulators and the
+  // current K and V tiles, only used when their rows are not head_dim apart.
+  std::vector<float> packed_queries;
+  std::vector<float> packed_output;
+  std::vector<float> packed_keys;
+  std::vector<float> packed_values;
+};
+
+// Element `offset` of a buffer of `storage` elements.
+const void* element_at(const void* base, StorageType storage, std::int64_t offset) {
+  return static_cast<const char*>(base) + offset * storage_bytes(storage);
+}
+
+void* element_at(void* base, StorageType storage, std::int64_t offset) {
+  return static_cast<char*>(base) + offset * storage_bytes(storage);
+}
+
+// out[i] = in[i] as float for n elements of `storage`.
+void widen(const CpuKernelTable& simd, StorageType storage, const void* in, int n, float* out) {
+  switch (storage) {
+    case StorageType::kFloat16:
+      simd.widen_half(static_cast<const std::uint16_t*>(in), n, out);
+      break;
+    case StorageType::kBFloat16:
+      simd.widen_bfloat16(static_cast<const std::uint16_t*>(in), n, out);
+      break;
+    case StorageType::kFloat32:
+      std::copy(static_cast<const float*>(in), static_cast<const float*>(in) + n, out);
+      break;
+  }
+}
+
+// Rounds n floats to `storage` elements at out.
+void narrow(const CpuKernelTable& simd, StorageType storage, const float* in, int n, void* out) {
+  switch (storage) {
+    case StorageType::kFloat16:
+      simd.narrow_half(in, n, static_cast<std::uint16_t*>(out));
+      break;
+    case StorageType::kBFloat16:
+      simd.narrow_bfloat16(in, n, static_cast<std::uint16_t*>(out));
+      break;
+    case StorageType::kFloat32:
+      std::copy(in, in + n, static_cast<float*>(out));
+      break;
+  }
+}
+
+// Copies num_rows rows of head_dim `storage` elements, row_stride apart,
+// into a dense float buffer. Rows spaced a large power-of-two multiple apart,
+// such as the slices of a fused QKV projection, share a handful of cache
+// sets, so a strided tile can stop fitting in cache long before its size
+// says so.
+const float* pack_rows(const CpuKernelTable& simd, const void* rows, StorageType storage, std::int64_t row_stride,
+                       int num_rows, int head_dim, std::vector<float>& packed) {
+  packed.resize(static_cast<std::size_t>(num_rows) * head_dim);
+  for (int r = 0; r < num_rows; ++r) {
+    widen(simd, storage, element_at(rows, storage, r * row_stride), head_dim,
+          packed.data() + static_cast<std::int64_t>(r) * head_dim);
+  }
+  return packed.data();
+}
+
+// Key and value rows of one (batch, head) slice. Logical row j sits at
+// keys + j * key_stride, or, with a block table, at row j % page_rows of
+// physical page block_table[j / page_rows], pages being page_stride
+// elements apart in both pools. In a ring of ring_rows rows, logical row j
+// is stored as row j % ring_rows. Offsets and strides count elements of
+// `storage`.
+struct KeyValueRows {
+  const void* keys;
+  const void* values;
+  std::int64_t key_stride;
+  std::int64_t value_stride;
+  const int* block_table = nullptr;
+  int page_rows = 0;
+  std::int64_t page_stride = 0;
+  int ring_rows = 0;
+  StorageType storage = StorageType::kFloat32;
+  // int8 copies of the keys for int8 scoring, logical row j at
+  // quantized_keys + j * head_dim with its scale and sum from
+  // CpuKernelTable::quantize_int8; unpaged and unwrapped only.
+  const std::int8_t* quantized_keys = nullptr;
+  const float* key_scales = nullptr;
+  const std::int32_t* key_sums = nullptr;
+
+  std::int64_t offset(int row, std::int64_t row_stride) const {
+    if (ring_rows > 0) {
+      row %= ring_rows;
+    }
+    if (block_table == nullptr) {
+      return row * row_stride;
+    }
+    return block_table[row / page_rows] * page_stride + (row % page_rows) * row_stride;
+  }
+};
+
+// Rows [begin, end) of one KeyValueRows pool as a dense [end - begin,
+// head_dim] float buffer: read in place when they are float32, contiguous,
+// on a single page and do not wrap around a ring, otherwise gathered into
+// packed. 16-bit rows are widened there, in one pass when contiguous.
+const float* dense_rows(const CpuKernelTable& simd,
+                        const KeyValueRows& rows,
+                        const void* base,
+                        std::int64_t row_stride,
+                        int begin,
+                        int end,
+                        int head_dim,
+                        std::vector<float>& packed) {
+  const bool one_page = rows.block_table == nullptr || begin / rows.page_rows == (end - 1) / rows.page_rows;
+  const bool unwrapped = rows.ring_rows == 0 || begin / rows.ring_rows == (end - 1) / rows.ring_rows;
+  const bool contiguous = row_stride == head_dim && one_page && unwrapped;
+  if (contiguous && rows.storage == StorageType::kFloat32) {
+    return static_cast<const float*>(base) + rows.offset(begin, row_stride);
+  }
+  packed.resize(static_cast<std::size_t>(end - begin) * head_dim);
+  if (contiguous) {
+    widen(simd, rows.storage, element_at(base, rows.storage, rows.offset(begin, row_stride)), (end - begin) * head_dim,
+          packed.data());
+    return packed.data();
+  }
+  for (int j = begin; j < end; ++j) {
+    widen(simd, rows.storage, element_at(base, rows.storage, rows.offset(j, row_stride)), head_dim,
+          packed.data() + static_cast<std::int64_t>(j - begin) * head_dim);
+  }
+  return packed.data();
+}
+
+// int8 copies of every key row for int8 scoring (CpuTileConfig::int8_scores),
+// made once per forward so that all query blocks share them.
+struct QuantizedKeys {
+  std::vector<std::int8_t> rows;
+  std::vector<float> scales;
+  std::vector<std::int32_t> sums;
+
+  // Points kv's logical row 0 at quantised row first_row.
+  void attach(KeyValueRows& kv, std::int64_t first_row, int head_dim) const {
+    kv.quantized_keys = rows.data() + first_row * head_dim;
+    kv.key_scales = scales.data() + first_row;
+    kv.key_sums = sums.data() + first_row;
+  }
+};
+
+// Quantises num_slices slices of num_keys key rows: slice s starts at
+// element slice_offset(s) of keys, its rows token_stride elements apart, and
+// its row j becomes quantised row s * num_keys + j.
+template <typename SliceOffset>
+QuantizedKeys quantize_keys(const CpuKernelTable& simd,
+                            const void* keys,
+                            StorageType storage,
+                            std::int64_t num_slices,
+                            int num_keys,
+                            std::int64_t token_stride,
+                            int head_dim,
+                            const SliceOffset& slice_offset) {
+  const std::int64_t total_rows = num_slices * num_keys;
+  QuantizedKeys quantized;
+  quantized.rows.resize(static_cast<std::size_t>(total_rows * head_dim));
+  quantized.scales.resize(static_cast<std::size_t>(total_rows));
+  quantized.sums.resize(static_cast<std::size_t>(total_rows));
+  runtime::parallel_for(0, total_rows, 256, [&](std::int64_t row_begin, std::int64_t row_end) {
+    std::vector<float> widened(head_dim);
+    for (std::int64_t row = row_begin; row < row_end; ++row) {
+      const void* key = element_at(keys, storage, slice_offset(row / num_keys) + row % num_keys * token_stride);
+      const float* key_row = static_cast<const float*>(key);
+      if (storage != StorageType::kFloat32) {
+        widen(simd, storage, key, head_dim, widened.data());
+        key_row = widened.data();
+      }
+      quantized.scales[row] =
+          simd.quantize_int8(key_row, head_dim, quantized.rows.data() + row * head_dim, &quantized.sums[row]);
+    }
+  });
+  return quantized;
+}
+
+// Pruning bounds of one (batch, head) slice, see KeyPruning.
+struct HeadPruning {
+  const float* centroids;
+  const float* radii;
+  // Largest |centroid| - radius over the slice's blocks. A block's gap is at
+  // most scale |q| (|c| - r) + |beta|, so a row whose bound from this stays
+  // within the cutoff has no block to skip.
+  float block_reach;
+  // Membership cutoff of the head for the pruning epsilon: a block is skipped
+  // when its gap exceeds it.
+  float cutoff;
+};
+
+// Centroid and radius of every kPruneBlockKeys block of num_slices slices of
+// num_keys key rows, addressed as in quantize_keys, plus each slice's
+// HeadPruning::block_reach. Each block is widened once and stays in L1 while
+// it is averaged and measured.
+struct KeyBlockBounds {
+  std::vector<float> centroids;
+  std::vector<float> radii;
+  std::vector<float> block_reaches;
+};
+
+template <typename SliceOffset>
+KeyBlockBounds key_block_bounds(const CpuKernelTable& simd,
+                                const void* keys,
+                                StorageType storage,
+                                std::int64_t num_slices,
+                                int num_keys,
+                                std::int64_t token_stride,
+                                int head_dim,
+                                const SliceOffset& slice_offset) {
+  const std::int64_t num_blocks = (num_keys + kPruneBlockKeys - 1) / kPruneBlockKeys;
+  const std::int64_t total_blocks = num_slices * num_blocks;
+  KeyBlockBounds bounds;
+  bounds.centroids.assign(static_cast<std::size_t>(total_blocks * head_dim), 0.0f);
+  bounds.radii.resize(static_cast<std::size_t>(total_blocks));
+  std::vector<float> reaches(static_cast<std::size_t>(total_blocks));
+  runtime::parallel_for(0, total_blocks, 16, [&](std::int64_t block_begin, std::int64_t block_end) {
+    std::vector<float> packed;
+    std::vector<float> offset(head_dim);
+    for (std::int64_t block = block_begin; block < block_end; ++block) {
+      const std::int64_t first_key = block % num_blocks * kPruneBlockKeys;
+      const int count = static_cast<int>(std::min<std::int64_t>(kPruneBlockKeys, num_keys - first_key));
+      const void* first_row = element_at(keys, storage, slice_offset(block / num_blocks) + first_key * token_stride);
+      const float* rows = pack_rows(simd, first_row, storage, token_stride, count, head_dim, packed);
+      float* centroid = bounds.centroids.data() + block * head_dim;
+      for (int j = 0; j < count; ++j) {
+        simd.axpy(1.0f / static_cast<float>(count), rows + static_cast<std::int64_t>(j) * head_dim, centroid,
+                  head_dim);
+      }
+      float radius_sq = 0.0f;
+      for (int j = 0; j < count; ++j) {
+        for (int d = 0; d < head_dim; ++d) {
+          offset[d] = rows[static_cast<std::int64_t>(j) * head_dim + d] - centroid[d];
+        }
+        radius_sq = std::max(radius_sq, simd.dot(offset.data(), offset.data(), head_dim));
+      }
+      bounds.radii[block] = std::sqrt(radius_sq);
+      reaches[block] = std::sqrt(simd.dot(centroid, centroid, head_dim)) - bounds.radii[block];
+    }
+  });
+  bounds.block_reaches.resize(static_cast<std::size_t>(num_slices));
+  for (std::int64_t slice = 0; slice < num_slices; ++slice) {
+    const auto first = reaches.begin() + slice * num_blocks;
+    bounds.block_reaches[slice] = *std::max_element(first, first + num_blocks);
+  }
+  return bounds;
+}
+
+struct PruneCounts {
+  std::int64_t examined = 0;
+  std::int64_t pruned = 0;
+};
+
+// True when every membership of key block `block` is provably below the
+// pruning epsilon for a query with the given norm.
+bool prune_key_block(const CpuKernelTable& simd,
+                     const HeadPruning& pruning,
+                     const float* q_vec,
+                     float q_norm,
+                     int block,
+                     float beta_h,
+                     int head_dim,
+                     float scale) {
+  const float* centroid = pruning.centroids + static_cast<std::int64_t>(block) * head_dim;
+  const float center = simd.dot(q_vec, centroid, head_dim) * scale;
+  const float radius = q_norm * pruning.radii[block] * scale;
+  const float slack = kPruneRelativeSlack * (std::fabs(center) + radius);
+  const float gap = std::fabs(center - beta_h) - radius - slack;
+  return gap > pruning.cutoff;
+}
+
+// Writes the memberships of count scores to out and returns their sum,
+// through the instruction-set table's entry for Membership.
+template <typename Membership>
+float score_memberships(const CpuKernelTable& simd, const float* scores, int count, float alpha, float beta,
+                        float* out) {
+  if constexpr (std::is_same_v<Membership, GaussianMembership>) {
+    return simd.membership(scores, count, alpha, beta, out);
+  } else if constexpr (std::is_same_v<Membership, GaussianTableMembership>) {
+    return simd.membership_lookup(scores, count, alpha, beta, out);
+  } else if constexpr (std::is_same_v<Membership, TriangularMembership>) {
+    return simd.membership_triangular(scores, count, alpha, beta, out);
+  } else {
+    static_assert(std::is_same_v<Membership, TrapezoidalMembership>);
+    return simd.membership_trapezoidal(scores, count, alpha, beta, out);
+  }
+}
+
+// Adds the memberships of keys [key_begin, key_end) for the dense query rows
+// of q_tile into scratch.norms, and the membership-weighted values into the
+// dense accumulator rows of acc_tile. Row r is the query at position
+// first_query + r; when causal its keys are further cut at that position, and
+// with a window at first_query + r - window. Key tiles stay aligned to multiples of
+// key_block counted from key_begin. With pruning, each key tile is split at
+// kPruneBlockKeys boundaries and blocks are tested per row. When kv has
+// quantised keys, the query rows are quantised too and the scores come from
+// CpuKernelTable::quantized_scores.
+template <typename Membership>
+void accumulate_key_range(const CpuKernelTable& simd,
+                          const CpuTileKernels& tile_kernels,
+                          const float* q_tile,
+                          const KeyValueRows& kv,
+                          float* acc_tile,
+                          int first_query,
+                          int rows,
+                          int key_begin,
+                          int key_end,
+                          bool causal,
+                          int window,
+                          float alpha_h,
+                          float beta_h,
+                          int head_dim,
+                          int key_block,
+                          const HeadPruning* pruning,
+                          PruneCounts& counts,
+                          TileScratch& scratch) {
+  const float scale = 1.0f / static_cast<float>(head_dim);
+  const bool int8_scores = kv.quantized_keys != nullptr;
+  auto row_key_begin = [&](int r) { return std::max(key_begin, kernels::key_begin(window, first_query + r)); };
+  auto row_key_end = [&](int r) { return causal ? std::min(key_end, first_query + r + 1) : key_end; };
+
+  if (pruning != nullptr) {
+    for (int r = 0; r < rows; ++r) {
+      const float* q_vec = q_tile + static_cast<std::int64_t>(r) * head_dim;
+      scratch.query_norms[r] = std::sqrt(simd.dot(q_vec, q_vec, head_dim));
+    }
+  }
+  if (int8_scores) {
+    scratch.quantized_queries.resize(static_cast<std::size_t>(rows) * head_dim);
+    for (int r = 0; r < rows; ++r) {
+      const std::int64_t row_offset = static_cast<std::int64_t>(r) * head_dim;
+      std::int32_t unused_sum = 0;
+      scratch.query_scales[r] = simd.quantize_int8(q_tile + row_offset, head_dim,
+                                                   scratch.quantized_queries.data() + row_offset, &unused_sum) *
+                                scale;
+    }
+  }
+
+  // Rows later in the block see keys further right, so tiles before the
+  // first row's window and past the last row's end are skipped outright.
+  const int block_key_end = row_key_end(rows - 1);
+  const int block_key_begin = key_begin + (row_key_begin(0) - key_begin) / key_block * key_block;
+
+  for (int tile_begin = block_key_begin; tile_begin < block_key_end; tile_begin += key_block) {
+    const int tile_end = std::min(block_key_end, tile_begin + key_block);
+    // int8 scoring reads only the quantised keys.
+    const float* k_tile =
+        int8_scores ? nullptr
+                    : dense_rows(simd, kv, kv.keys, kv.key_stride, tile_begin, tile_end, head_dim, scratch.packed_keys);
+    const float* v_tile =
+        dense_rows(simd, kv, kv.values, kv.value_stride, tile_begin, tile_end, head_dim, scratch.packed_values);
+
+    for (int r = 0; r < rows; ++r) {
+      const int tile_keys = std::min(tile_end, row_key_end(r)) - tile_begin;
+      const int row_begin = std::max(0, row_key_begin(r) - tile_begin);
+      if (tile_keys <= row_begin) {
+        continue;
+      }
+      const float* q_vec = q_tile + static_cast<std::int64_t>(r) * head_dim;
+      float* out_vec = acc_tile + static_cast<std::int64_t>(r) * head_dim;
+      const bool row_prunes =
+          pruning != nullptr &&
+          scale * scratch.query_norms[r] * pruning->block_reach + std::fabs(beta_h) > pruning->cutoff;
+
+      // Without pruning the row's part of the tile is a single segment.
+      for (int segment_begin = row_begin; segment_begin < tile_keys;) {
+        int segment_end = tile_keys;
+        if (row_prunes) {
+          const int block = (tile_begin + segment_begin) / kPruneBlockKeys;
+          segment_end = std::min(tile_keys, (block + 1) * kPruneBlockKeys - tile_begin);
+          ++counts.examined;
+          if (prune_key_block(simd, *pruning, q_vec, scratch.query_norms[r], block, beta_h, head_dim, scale)) {
+            ++counts.pruned;
+            segment_begin = segment_end;
+            continue;
+          }
+        }
+
+        const int segment_keys = segment_end - segment_begin;
+        const std::int64_t segment_offset = static_cast<std::int64_t>(segment_begin) * head_dim;
+        float* scores = scratch.scores.data() + segment_begin;
+        float* memberships = scratch.memberships.data() + segment_begin;
+        if (int8_scores) {
+          const int first_key = tile_begin + segment_begin;
+          simd.quantized_scores(scratch.quantized_queries.data() + static_cast<std::int64_t>(r) * head_dim,
+                                scratch.query_scales[r],
+                                kv.quantized_keys + static_cast<std::int64_t>(first_key) * head_dim,
+                                kv.key_scales + first_key,
+                                kv.key_sums + first_key,
+                                segment_keys,
+                                head_dim,
+                                scores);
+        } else {
+          tile_kernels.scores(q_vec, k_tile + segment_offset, segment_keys, head_dim, scale, scores);
+        }
+        scratch.norms[r] += score_memberships<Membership>(simd, scores, segment_keys, alpha_h, beta_h, memberships);
+        tile_kernels.accumulate(memberships, v_tile + segment_offset, segment_keys, head_dim, out_vec);
+        segment_begin = segment_end;
+      }
+    }
+  }
+}
+
+// One query block of the tiled forward. Query and output rows are q_stride
+// and out_stride elements apart and stored like the keys and values, in
+// kv.storage, and K/V rows are addressed through kv; anything not already
+// dense float32 is packed into scratch, so the tile kernels always see
+// contiguous float rows. Block row r is the query at position
+// first_query + r and sees keys [0, num_keys), cut at that position when
+// causal and to the last window keys when window > 0. Row normalisers are left in scratch.norms.
+template <typename Membership>
+void tiled_query_block(const CpuKernelTable& simd,
+                       const CpuTileKernels& tile_kernels,
+                       const void* q_tile,
+                       std::int64_t q_stride,
+                       const KeyValueRows& kv,
+                       void* out_tile,
+                       std::int64_t out_stride,
+                       int first_query,
+                       int rows,
+                       int num_keys,
+                       bool causal,
+                       int window,
+                       float alpha_h,
+                       float beta_h,
+                       int head_dim,
+                       int key_block,
+                       const HeadPruning* pruning,
+                       PruneCounts& counts,
+                       TileScratch& scratch) {
+  const StorageType storage = kv.storage;
+  const bool float_storage = storage == StorageType::kFloat32;
+  const float* q_rows = static_cast<const float*>(q_tile);
+  if (!float_storage || q_stride != head_dim) {
+    q_rows = pack_rows(simd, q_tile, storage, q_stride, rows, head_dim, scratch.packed_queries);
+  }
+  // Rows are accumulated densely and scattered to the output at the end.
+  float* acc_tile = static_cast<float*>(out_tile);
+  if (!float_storage || out_stride != head_dim) {
+    scratch.packed_output.resize(static_cast<std::size_t>(rows) * head_dim);
+    acc_tile = scratch.packed_output.data();
+  }
+
+  std::fill(scratch.norms.begin(), scratch.norms.begin() + rows, 0.0f);
+  std::fill(acc_tile, acc_tile + static_cast<std::int64_t>(rows) * head_dim, 0.0f);
+  accumulate_key_range<Membership>(simd, tile_kernels, q_rows, kv, acc_tile, first_query, rows, 0, num_keys, causal,
+                                   window, alpha_h, beta_h, head_dim, key_block, pruning, counts, scratch);
+
+  for (int r = 0; r < rows; ++r) {
+    const float inv_norm = scratch.norms[r] > kEpsilon ? 1.0f / scratch.norms[r] : 0.0f;
+    float* acc_vec = acc_tile + static_cast<std::int64_t>(r) * head_dim;
+    for (int d = 0; d < head_dim; ++d) {
+      acc_vec[d] *= inv_norm;
+    }
+    if (acc_tile != out_tile) {
+      narrow(simd, storage, acc_vec, head_dim, element_at(out_tile, storage, r * out_stride));
+    }
+  }
+}
+
+// Sweep counterpart of accumulate_key_range over keys [0, num_keys) for a
+// dense query block, without pruning. Each row's scores against a key tile
+// are computed once and then turned into memberships for every one of the
+// num_params (alphas[p], betas[p]) candidates, whose normalisers and
+// accumulators are norms[p * rows + r] and acc[(p * rows + r) * head_dim],
+// both starting from zero.
+template <typename Membership>
+void sweep_key_range(const CpuKernelTable& simd,
+                     const CpuTileKernels& tile_kernels,
+                     const float* q_tile,
+                     const KeyValueRows& kv,
+                     int first_query,
+                     int rows,
+                     int num_keys,
+                     bool causal,
+                     int window,
+                     const float* alphas,
+                     const float* betas,
+                     int num_params,
+                     int head_dim,
+                     int key_block,
+                     TileScratch& scratch,
+                     float* norms,
+                     float* acc) {
+  const float scale = 1.0f / static_cast<float>(head_dim);
+  auto row_key_begin = [&](int r) { return kernels::key_begin(window, first_query + r); };
+  auto row_key_end = [&](int r) { return causal ? std::min(num_keys, first_query + r + 1) : num_keys; };
+
+  const int block_key_end = row_key_end(rows - 1);
+  const int block_key_begin = row_key_begin(0) / key_block * key_block;
+
+  for (int tile_begin = block_key_begin; tile_begin < block_key_end; tile_begin += key_block) {
+    const int tile_end = std::min(block_key_end, tile_begin + key_block);
+    const float* k_tile =
+        dense_rows(simd, kv, kv.keys, kv.key_stride, tile_begin, tile_end, head_dim, scratch.packed_keys);
+    const float* v_tile =
+        dense_rows(simd, kv, kv.values, kv.value_stride, tile_begin, tile_end, head_dim, scratch.packed_values);
+
+    for (int r = 0; r < rows; ++r) {
+      const int tile_keys = std::min(tile_end, row_key_end(r)) - tile_begin;
+      const int row_begin = std::max(0, row_key_begin(r) - tile_begin);
+      if (tile_keys <= row_begin) {
+        continue;
+      }
+      const int count = tile_keys - row_begin;
+      const std::int64_t row_offset = static_cast<std::int64_t>(row_begin) * head_dim;
+      float* scores = scratch.scores.data();
+      float* memberships = scratch.memberships.data();
+      tile_kernels.scores(q_tile + static_cast<std::int64_t>(r) * head_dim, k_tile + row_offset, count, head_dim,
+                          scale, scores);
+      // The scores stay in L1 while every candidate reads them.
+      for (int p = 0; p < num_params; ++p) {
+        const std::int64_t acc_row = static_cast<std::int64_t>(p) * rows + r;
+        norms[acc_row] += score_memberships<Membership>(simd, scores, count, alphas[p], betas[p], memberships);
+        tile_kernels.accumulate(memberships, v_tile + row_offset, count, head_dim, acc + acc_row * head_dim);
+      }
+    }
+  }
+}
+
+// One (batch, head, query block) of a decode forward: rows queries starting
+// at position first_query, attending causally over num_keys keys. Queries
+// and output are stored like the keys and values, in kv.storage.
+struct DecodeBlock {
+  const void* queries;
+  std::int64_t query_stride;
+  KeyValueRows kv;
+  void* output;
+  std::int64_t output_stride;
+  int first_query;
+  int rows;
+  int num_keys;
+  float alpha;
+  float beta;
+};
+
+// Runs the num_blocks decode blocks returned by describe(block), each over
+// the last window keys of its queries when window > 0. Decode has few query
+// rows, so when the blocks alone cannot occupy the thread pool the keys a
+// block sees (at most max_keys of them) are cut into key_splits chunks
+// (chosen by choose_key_splits when 0) that run as separate tasks. The
+// normaliser and the weighted sum of values are plain sums over keys, so
+// each chunk's partials are added up in chunk order and divided once: the
+// split changes nothing but the float summation order. Chunks are whole
+// multiples of key_block from a key_block boundary, keeping paged tiles on a
+// single page.
+template <typename Membership, typename Describe>
+void decode_forward(const CpuKernelTable& simd,
+                    const CpuTileKernels& tile_kernels,
+                    std::int64_t num_blocks,
+                    int query_block,
+                    int key_block,
+                    int head_dim,
+                    int max_keys,
+                    int window,
+                    int key_splits,
+                    const Describe& describe) {
+  if (key_splits == 0) {
+    key_splits = choose_key_splits(num_blocks, max_keys,
+                                   static_cast<std::int64_t>(runtime::ThreadPool::global().size()),
+                                   kCpuMinSplitKeys);
+  }
+  // A window rarely starts on a key_block boundary, which costs one more tile.
+  const int span_tiles = (max_keys + key_block - 1) / key_block + (window > 0 ? 1 : 0);
+  key_splits = std::clamp(key_splits, 1, std::max(1, span_tiles));
+
+  if (key_splits == 1) {
+    runtime::parallel_for(0, num_blocks, 1, [&](std::int64_t block_begin, std::int64_t block_end) {
+      TileScratch scratch(query_block, key_block);
+      PruneCounts counts;
+      for (std::int64_t block = block_begin; block < block_end; ++block) {
+        const DecodeBlock item = describe(block);
+        tiled_query_block<Membership>(simd, tile_kernels, item.queries, item.query_stride, item.kv, item.output,
+                                      item.output_stride, item.first_query, item.rows, item.num_keys, true, window,
+                                      item.alpha, item.beta, head_dim, key_block, nullptr, counts, scratch);
+      }
+    });
+    return;
+  }
+
+  const int chunk_tiles = (span_tiles + key_splits - 1) / key_splits;
+  const int chunk_keys = chunk_tiles * key_block;
+  const std::int64_t block_rows = static_cast<std::int64_t>(key_splits) * query_block;
+  std::vector<float> partial_norms(static_cast<std::size_t>(num_blocks * block_rows));
+  std::vector<float> partial_output(static_cast<std::size_t>(num_blocks * block_rows * head_dim));
+
+  runtime::parallel_for(0, num_blocks * key_splits, 1, [&](std::int64_t task_begin, std::int64_t task_end) {
+    TileScratch scratch(query_block, key_block);
+    PruneCounts counts;
+    for (std::int64_t task = task_begin; task < task_end; ++task) {
+      const std::int64_t block = task / key_splits;
+      const int split = static_cast<int>(task % key_splits);
+      const DecodeBlock item = describe(block);
+      const std::int64_t row_offset = block * block_rows + static_cast<std::int64_t>(split) * query_block;
+      float* acc_tile = partial_output.data() + row_offset * head_dim;
+      std::fill(scratch.norms.begin(), scratch.norms.begin() + item.rows, 0.0f);
+      std::fill(acc_tile, acc_tile + static_cast<std::int64_t>(item.rows) * head_dim, 0.0f);
+
+      const int span_begin = kernels::key_begin(window, item.first_query) / key_block * key_block;
+      const int key_begin = span_begin + split * chunk_keys;
+      const int key_end = std::min(item.num_keys, key_begin + chunk_keys);
+      if (key_begin < key_end) {
+        const float* q_tile = static_cast<const float*>(item.queries);
+        if (item.kv.storage != StorageType::kFloat32 || item.query_stride != head_dim) {
+          q_tile = pack_rows(simd, item.queries, item.kv.storage, item.query_stride, item.rows, head_dim,
+                             scratch.packed_queries);
+        }
+        accumulate_key_range<Membership>(simd, tile_kernels, q_tile, item.kv, acc_tile, item.first_query, item.rows,
+                                         key_begin, key_end, true, window, item.alpha, item.beta, head_dim, key_block,
+                                         nullptr, counts, scratch);
+      }
+      std::copy(scratch.norms.begin(), scratch.norms.begin() + item.rows, partial_norms.begin() + row_offset);
+    }
+  });
+
+  runtime::parallel_for(0, num_blocks, 1, [&](std::int64_t block_begin, std::int64_t block_end) {
+    std::vector<float> merged(head_dim);
+    for (std::int64_t block = block_begin; block < block_end; ++block) {
+      const DecodeBlock item = describe(block);
+      const StorageType storage = item.kv.storage;
+      for (int r = 0; r < item.rows; ++r) {
+        float norm = 0.0f;
+        void* out_row = element_at(item.output, storage, r * item.output_stride);
+        float* out_vec = storage == StorageType::kFloat32 ? static_cast<float*>(out_row) : merged.data();
+        std::fill(out_vec, out_vec + head_dim, 0.0f);
+        for (int split = 0; split < key_splits; ++split) {
+          const std::int64_t row = block * block_rows + static_cast<std::int64_t>(split) * query_block + r;
+          norm += partial_norms[static_cast<std::size_t>(row)];
+          simd.axpy(1.0f, partial_output.data() + row * head_dim, out_vec, head_dim);
+        }
+        const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+        for (int d = 0; d < head_dim; ++d) {
+          out_vec[d] *= inv_norm;
+        }
+        if (out_vec != out_row) {
+          narrow(simd, storage, out_vec, head_dim, out_row);
+        }
+      }
+    }
+  });
+}
+
+// fuzzy_attention_forward_tiled_cpu over queries, keys, values and output
+// stored as `storage`.
+void tiled_forward(const void* queries,
+                   const void* keys,
+                   const void* values,
+                   StorageType storage,
+                   const float* alpha,
+                   const float* beta,
+                   FuzzyMembership membership,
+                   void* output,
+                   float* row_norms,
+                   const int* key_lengths,
+                   bool causal,
+                   int window,
+                   int batch_size,
+                   int num_heads,
+                   int num_queries,
+                   int num_keys,
+                   int head_dim,
+                   const CpuTileConfig& tiles,
+                   const KeyPruning* pruning,
+                   const AttentionStrides* strides) {
+  const int query_block = std::max(1, tiles.query_block);
+  const int key_block = std::max(1, tiles.key_block);
+  const std::int64_t query_blocks = (num_queries + query_block - 1) / query_block;
+  const std::int64_t total_blocks = static_cast<std::int64_t>(batch_size) * num_heads * query_blocks;
+  const AttentionStrides layout =
+      strides != nullptr ? *strides : contiguous_strides(num_heads, num_queries, num_keys, head_dim);
+  const std::int64_t prune_blocks = (num_keys + kPruneBlockKeys - 1) / kPruneBlockKeys;
+
+  const auto& simd = active_cpu_kernels();
+  const auto& tile_kernels = tiles.specialize_head_dim ? select_tile_kernels(simd, head_dim) : simd.generic_tiles;
+
+  std::atomic<std::int64_t> examined_blocks{0};
+  std::atomic<std::int64_t> pruned_blocks{0};
+
+  // One quantised slice, and one set of pruning bounds, per stored K head.
+  const std::int64_t num_kv_heads = num_heads / layout.keys.head_group;
+  auto kv_slice_offset = [&](std::int64_t slice) {
+    return slice / num_kv_heads * layout.keys.batch + slice % num_kv_heads * layout.keys.head;
+  };
+  QuantizedKeys quantized_keys;
+  if (tiles.int8_scores) {
+    quantized_keys = quantize_keys(simd, keys, storage, batch_size * num_kv_heads, num_keys, layout.keys.token,
+                                   head_dim, kv_slice_offset);
+  }
+  KeyBlockBounds bounds;
+  if (pruning != nullptr) {
+    bounds = key_block_bounds(simd, keys, storage, batch_size * num_kv_heads, num_keys, layout.keys.token, head_dim,
+                              kv_slice_offset);
+  }
+
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    runtime::parallel_for(0, total_blocks, 1, [&](std::int64_t block_begin, std::int64_t block_end) {
+      TileScratch scratch(query_block, key_block);
+      PruneCounts counts;
+
+      for (std::int64_t block = block_begin; block < block_end; ++block) {
+        const std::int64_t bh = block / query_blocks;
+        const int batch_index = static_cast<int>(bh / num_heads);
+        const int head_index = static_cast<int>(bh % num_heads);
+        const int query_begin = static_cast<int>(block % query_blocks) * query_block;
+        const int rows = std::min(num_queries, query_begin + query_block) - query_begin;
+        const int keys_valid = key_lengths != nullptr ? std::clamp(key_lengths[batch_index], 0, num_keys) : num_keys;
+
+        const std::int64_t kv_slice = batch_index * num_kv_heads + head_index / layout.keys.head_group;
+        HeadPruning head_pruning{};
+        if (pruning != nullptr) {
+          head_pruning = {bounds.centroids.data() + kv_slice * prune_blocks * head_dim,
+                          bounds.radii.data() + kv_slice * prune_blocks, bounds.block_reaches[kv_slice],
+                          Membership::cutoff(alpha[head_index], pruning->epsilon)};
+        }
+
+        KeyValueRows kv{element_at(keys, storage, layout.keys.offset(batch_index, head_index, 0)),
+                        element_at(values, storage, layout.values.offset(batch_index, head_index, 0)),
+                        layout.keys.token, layout.values.token};
+        kv.storage = storage;
+        if (tiles.int8_scores) {
+          quantized_keys.attach(kv, kv_slice * num_keys, head_dim);
+        }
+        tiled_query_block<Membership>(simd,
+                                      tile_kernels,
+                                      element_at(queries, storage, layout.queries.offset(batch_index, head_index,
+                                                                                         query_begin)),
+                                      layout.queries.token,
+                                      kv,
+                                      element_at(output, storage, layout.output.offset(batch_index, head_index,
+                                                                                       query_begin)),
+                                      layout.output.token,
+                                      query_begin + num_keys - num_queries,
+                                      rows,
+                                      keys_valid,
+                                      causal,
+                                      window,
+                                      alpha[head_index],
+                                      beta[head_index],
+                                      head_dim,
+                                      key_block,
+                                      pruning != nullptr ? &head_pruning : nullptr,
+                                      counts,
+                                      scratch);
+
+        if (row_norms != nullptr) {
+          std::copy(scratch.norms.begin(), scratch.norms.begin() + rows, row_norms + bh * num_queries + query_begin);
+        }
+      }
+      examined_blocks += counts.examined;
+      pruned_blocks += counts.pruned;
+    });
+  });
+
+  if (pruning != nullptr && pruning->counts != nullptr) {
+    pruning->counts[0] += examined_blocks.load();
+    pruning->counts[1] += pruned_blocks.load();
+  }
+}
+
+// fuzzy_attention_forward_cached_cpu over queries, keys, values and output
+// stored as `storage`.
+void cached_forward(const void* queries,
+                    const void* keys,
+                    const void* values,
+                    StorageType storage,
+                    const float* alpha,
+                    const float* beta,
+                    FuzzyMembership membership,
+                    void* output,
+                    int batch_size,
+                    int num_heads,
+                    int num_queries,
+                    int num_keys,
+                    int head_dim,
+                    int window,
+                    int ring_rows,
+                    const CpuTileConfig& tiles,
+                    const AttentionStrides& strides) {
+  const int query_block = std::max(1, tiles.query_block);
+  const int key_block = std::max(1, tiles.key_block);
+  const std::int64_t query_blocks = (num_queries + query_block - 1) / query_block;
+  const std::int64_t total_blocks = static_cast<std::int64_t>(batch_size) * num_heads * query_blocks;
+  const int first_position = num_keys - num_queries;
+  const int max_keys = window > 0 ? std::min(num_keys, window + std::min(query_block, num_queries) - 1) : num_keys;
+
+  const auto& simd = active_cpu_kernels();
+  const auto& tile_kernels = tiles.specialize_head_dim ? select_tile_kernels(simd, head_dim) : simd.generic_tiles;
+
+  // The causal and window cuts in the tiled loop are by absolute position, so
+  // each block's first query is placed at its position in the key sequence.
+  auto describe = [&](std::int64_t block) {
+    const std::int64_t bh = block / query_blocks;
+    const int batch_index = static_cast<int>(bh / num_heads);
+    const int head_index = static_cast<int>(bh % num_heads);
+    const int query_begin = static_cast<int>(block % query_blocks) * query_block;
+    KeyValueRows kv{element_at(keys, storage, strides.keys.offset(batch_index, head_index, 0)),
+                    element_at(values, storage, strides.values.offset(batch_index, head_index, 0)),
+                    strides.keys.token, strides.values.token};
+    kv.ring_rows = ring_rows;
+    kv.storage = storage;
+    return DecodeBlock{element_at(queries, storage, strides.queries.offset(batch_index, head_index, query_begin)),
+                       strides.queries.token,
+                       kv,
+                       element_at(output, storage, strides.output.offset(batch_index, head_index, query_begin)),
+                       strides.output.token,
+                       first_position + query_begin,
+                       std::min(num_queries, query_begin + query_block) - query_begin,
+                       num_keys,
+                       alpha[head_index],
+                       beta[head_index]};
+  };
+  with_membership(membership, [&](auto kind) {
+    decode_forward<decltype(kind)>(simd, tile_kernels, total_blocks, query_block, key_block, head_dim, max_keys,
+                                   window, tiles.key_splits, describe);
+  });
+}
+
+// fuzzy_attention_forward_paged_cpu over queries, pools and output stored as
+// `storage`.
+void paged_forward(const void* queries,
+                   const void* key_pool,
+                   const void* value_pool,
+                   StorageType storage,
+                   const int* block_tables,
+                   const int* seq_lengths,
+                   const float* alpha,
+                   const float* beta,
+                   FuzzyMembership membership,
+                   void* output,
+                   int batch_size,
+                   int num_heads,
+                   int num_kv_heads,
+                   int num_queries,
+                   int head_dim,
+                   int block_size,
+                   int max_blocks,
+                   const CpuTileConfig& tiles,
+                   const TensorStrides& query_strides,
+                   const TensorStrides& output_strides) {
+  const int query_block = std::max(1, tiles.query_block);
+  const std::int64_t query_blocks = (num_queries + query_block - 1) / query_block;
+  const std::int64_t total_blocks = static_cast<std::int64_t>(batch_size) * num_heads * query_blocks;
+  const int head_group = num_heads / num_kv_heads;
+  const std::int64_t page_stride = static_cast<std::int64_t>(num_kv_heads) * block_size * head_dim;
+  const int max_keys = *std::max_element(seq_lengths, seq_lengths + batch_size);
+
+  const auto& simd = active_cpu_kernels();
+  const auto& tile_kernels = tiles.specialize_head_dim ? select_tile_kernels(simd, head_dim) : simd.generic_tiles;
+
+  // Key tiles are whole pool blocks, so every tile is read in place.
+  auto describe = [&](std::int64_t block) {
+    const std::int64_t bh = block / query_blocks;
+    const int batch_index = static_cast<int>(bh / num_heads);
+    const int head_index = static_cast<int>(bh % num_heads);
+    const int query_begin = static_cast<int>(block % query_blocks) * query_block;
+    const int num_keys = seq_lengths[batch_index];
+    const std::int64_t head_offset = static_cast<std::int64_t>(head_index / head_group) * block_size * head_dim;
+
+    KeyValueRows kv{element_at(key_pool, storage, head_offset), element_at(value_pool, storage, head_offset),
+                    head_dim, head_dim};
+    kv.block_table = block_tables + static_cast<std::int64_t>(batch_index) * max_blocks;
+    kv.page_rows = block_size;
+    kv.page_stride = page_stride;
+    kv.storage = storage;
+    return DecodeBlock{element_at(queries, storage, query_strides.offset(batch_index, head_index, query_begin)),
+                       query_strides.token,
+                       kv,
+                       element_at(output, storage, output_strides.offset(batch_index, head_index, query_begin)),
+                       output_strides.token,
+                       num_keys - num_queries + query_begin,
+                       std::min(num_queries, query_begin + query_block) - query_begin,
+                       num_keys,
+                       alpha[head_index],
+                       beta[head_index]};
+  };
+  with_membership(membership, [&](auto kind) {
+    decode_forward<decltype(kind)>(simd, tile_kernels, total_blocks, query_block, block_size, head_dim, max_keys, 0,
+                                   tiles.key_splits, describe);
+  });
+}
+
+// fuzzy_attention_backward_cpu over a gradient, operands, saved output and
+// query, key and value gradients stored as `storage`. 16-bit K/V heads are
+// widened once per work item and other rows as they are read; dK and dV are
+// summed in float32 and every gradient element is rounded once.
+void backward(const void* grad_out,
+              const void* queries,
+              const void* keys,
+              const void* values,
+              StorageType storage,
+              const float* alpha,
+              const float* beta,
+              FuzzyMembership membership,
+              const void* saved_output,
+              const int* key_lengths,
+              bool causal,
+              int window,
+              void* d_queries,
+              void* d_keys,
+              void* d_values,
+              float* d_alpha,
+              float* d_beta,
+              int batch_size,
+              int num_heads,
+              int num_queries,
+              int num_keys,
+              int head_dim) {
+  auto& pool = runtime::ThreadPool::global();
+  const std::int64_t num_bh = static_cast<std::int64_t>(batch_size) * num_heads;
+  const std::int64_t query_head_stride = static_cast<std::int64_t>(num_queries) * head_dim;
+  const std::int64_t head_stride = static_cast<std::int64_t>(num_keys) * head_dim;
+  const float scale = 1.0f / static_cast<float>(head_dim);
+
+  // Split each (batch, head) into enough query chunks to occupy the pool, as
+  // far as the partials fit in kMaxBackwardScratchBytes.
+  const std::int64_t pool_size = static_cast<std::int64_t>(pool.size());
+  const std::int64_t partial_bytes = std::max<std::int64_t>(1, num_bh * 2 * head_stride * sizeof(float));
+  const std::int64_t max_chunks = 1 + kMaxBackwardScratchBytes / partial_bytes;
+  const int chunks_per_head = static_cast<int>(std::clamp<std::int64_t>(
+      (pool_size + num_bh - 1) / num_bh, 1, std::min<std::int64_t>(max_chunks, std::max(1, num_queries))));
+  const int chunk_rows = (num_queries + chunks_per_head - 1) / chunks_per_head;
+  const std::int64_t num_items = num_bh * chunks_per_head;
+
+  // Chunk 0 of every head accumulates straight into d_keys/d_values; the
+  // others get private partial buffers that are folded in afterwards.
+  std::vector<float> partial_kv;
+  if (chunks_per_head > 1) {
+    partial_kv.assign(static_cast<std::size_t>(num_bh) * (chunks_per_head - 1) * 2 * head_stride, 0.0f);
+  }
+  const bool float_storage = storage == StorageType::kFloat32;
+  std::vector<float> wide_kv;
+  if (!float_storage) {
+    wide_kv.resize(static_cast<std::size_t>(num_bh) * 2 * head_stride);
+  }
+  float* dk_base = float_storage ? static_cast<float*>(d_keys) : wide_kv.data();
+  float* dv_base = float_storage ? static_cast<float*>(d_values) : wide_kv.data() + num_bh * head_stride;
+  std::fill(dk_base, dk_base + num_bh * head_stride, 0.0f);
+  std::fill(dv_base, dv_base + num_bh * head_stride, 0.0f);
+  std::vector<float> partial_alpha(num_items, 0.0f);
+  std::vector<float> partial_beta(num_items, 0.0f);
+
+  auto partial_dk = [&](std::int64_t bh, int chunk) -> float* {
+    if (chunk == 0) {
+      return dk_base + bh * head_stride;
+    }
+    return partial_kv.data() + ((bh * (chunks_per_head - 1) + (chunk - 1)) * 2) * head_stride;
+  };
+  auto partial_dv = [&](std::int64_t bh, int chunk) -> float* {
+    if (chunk == 0) {
+      return dv_base + bh * head_stride;
+    }
+    return partial_kv.data() + ((bh * (chunks_per_head - 1) + (chunk - 1)) * 2 + 1) * head_stride;
+  };
+
+  const auto& simd = active_cpu_kernels();
+  const bool use_saved = saved_output != nullptr;
+
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    pool.run(static_cast<std::size_t>(num_items), [&](std::size_t item) {
+      const std::int64_t bh = static_cast<std::int64_t>(item) / chunks_per_head;
+      const int chunk = static_cast<int>(static_cast<std::int64_t>(item) % chunks_per_head);
+      const int head_index = static_cast<int>(bh % num_heads);
+      const int query_begin = chunk * chunk_rows;
+      const int query_end = std::min(num_queries, query_begin + chunk_rows);
+
+      std::vector<float> wide_keys;
+      std::vector<float> wide_values;
+      const float* k_head = static_cast<const float*>(keys) + bh * head_stride;
+      const float* v_head = static_cast<const float*>(values) + bh * head_stride;
+      if (!float_storage) {
+        k_head = pack_rows(simd, element_at(keys, storage, bh * head_stride), storage, head_dim, num_keys, head_dim,
+                           wide_keys);
+        v_head = pack_rows(simd, element_at(values, storage, bh * head_stride), storage, head_dim, num_keys,
+                           head_dim, wide_values);
+      }
+      float* dk_head = partial_dk(bh, chunk);
+      float* dv_head = partial_dv(bh, chunk);
+      const float alpha_h = alpha[head_index];
+      const float beta_h = beta[head_index];
+
+      std::vector<float> scores(num_keys);
+      std::vector<float> memberships(num_keys);
+      std::vector<float> grad_dots(use_saved ? 0 : num_keys);
+      // Widened query, gradient and saved output rows and the dQ row.
+      std::vector<float> wide_rows(float_storage ? 0 : 4 * head_dim);
+      float grad_alpha_accum = 0.0f;
+      float grad_beta_accum = 0.0f;
+
+      for (int query_index = query_begin; query_index < query_end; ++query_index) {
+        const std::int64_t row_offset = bh * query_head_stride + static_cast<std::int64_t>(query_index) * head_dim;
+        auto load_row = [&](const void* base, int slot) {
+          if (float_storage) {
+            return static_cast<const float*>(base) + row_offset;
+          }
+          float* row = wide_rows.data() + slot * head_dim;
+          widen(simd, storage, element_at(base, storage, row_offset), head_dim, row);
+          return static_cast<const float*>(row);
+        };
+        const float* q_vec = load_row(queries, 0);
+        const float* grad_vec = load_row(grad_out, 1);
+        float* dq_vec = float_storage ? static_cast<float*>(d_queries) + row_offset : wide_rows.data() + 3 * head_dim;
+        const int position = query_index + num_keys - num_queries;
+        const int first_key = key_begin(window, position);
+        const int keys_visible =
+            std::max(first_key, key_end(key_lengths, causal, static_cast<int>(bh / num_heads), position, num_keys));
+
+        for (int key_index = first_key; key_index < keys_visible; ++key_index) {
+          const float* k_vec = k_head + static_cast<std::int64_t>(key_index) * head_dim;
+          scores[key_index] = simd.dot(q_vec, k_vec, head_dim) * scale;
+        }
+        // The memberships are needed for the gradients anyway, and the row
+        // normaliser comes with them.
+        const float norm = score_memberships<Membership>(simd, scores.data() + first_key,
+                                                         std::max(0, keys_visible - first_key), alpha_h, beta_h,
+                                                         memberships.data() + first_key);
+        float sum_gw_w = 0.0f;
+        if (use_saved) {
+          // sum_j w_ij * (g_i . v_j) == g_i . out_i, so g . v is only needed
+          // inside the gradient sweep below.
+          sum_gw_w = simd.dot(grad_vec, load_row(saved_output, 2), head_dim);
+        }
+        const float inv_norm = norm > kEpsilon ? 1.0f / norm : 0.0f;
+
+        if (!use_saved) {
+          for (int key_index = first_key; key_index < keys_visible; ++key_index) {
+            if (Membership::kCompactSupport && memberships[key_index] == 0.0f) {
+              continue;
+            }
+            const float* v_vec = v_head + static_cast<std::int64_t>(key_index) * head_dim;
+            grad_dots[key_index] = simd.dot(grad_vec, v_vec, head_dim);
+            sum_gw_w += grad_dots[key_index] * memberships[key_index] * inv_norm;
+          }
+        }
+
+        std::fill(dq_vec, dq_vec + head_dim, 0.0f);
+        for (int key_index = first_key; key_index < keys_visible; ++key_index) {
+          const std::int64_t key_offset = static_cast<std::int64_t>(key_index) * head_dim;
+          const float membership = memberships[key_index];
+          // Outside a compact support the membership and both its partials
+          // vanish, so the key contributes nothing to any gradient.
+          if (Membership::kCompactSupport && membership == 0.0f) {
+            continue;
+          }
+          const float weight = membership * inv_norm;
+          const float diff = scores[key_index] - beta_h;
+          const float gw = use_saved ? simd.dot(grad_vec, v_head + key_offset, head_dim) : grad_dots[key_index];
+          const float g_m = (gw - sum_gw_w) * inv_norm;
+          const float d_score = Membership::d_diff(diff, alpha_h, membership);
+          const float g_s = d_score * g_m;
+
+          grad_alpha_accum += g_m * Membership::d_alpha(diff, alpha_h, membership);
+          grad_beta_accum -= g_m * d_score;
+
+          simd.axpy(weight, grad_vec, dv_head + key_offset, head_dim);
+          simd.axpy(g_s * scale, k_head + key_offset, dq_vec, head_dim);
+          simd.axpy(g_s * scale, q_vec, dk_head + key_offset, head_dim);
+        }
+        if (!float_storage) {
+          narrow(simd, storage, dq_vec, head_dim, element_at(d_queries, storage, row_offset));
+        }
+      }
+
+      partial_alpha[item] = grad_alpha_accum;
+      partial_beta[item] = grad_beta_accum;
+    });
+  });
+
+  // Pairwise tree over the chunks of each head: at every level chunk c
+  // absorbs chunk c + stride, so the summation order never changes.
+  for (int stride = 1; stride < chunks_per_head; stride *= 2) {
+    const int pairs_per_head = (chunks_per_head + 2 * stride - 1) / (2 * stride);
+    pool.run(static_cast<std::size_t>(num_bh * pairs_per_head), [&](std::size_t task) {
+      const std::int64_t bh = static_cast<std::int64_t>(task) / pairs_per_head;
+      const int target = static_cast<int>(static_cast<std::int64_t>(task) % pairs_per_head) * 2 * stride;
+      const int source = target + stride;
+      if (source >= chunks_per_head) {
+        return;
+      }
+      float* dk_target = partial_dk(bh, target);
+      float* dv_target = partial_dv(bh, target);
+      const float* dk_source = partial_dk(bh, source);
+      const float* dv_source = partial_dv(bh, source);
+      for (std::int64_t i = 0; i < head_stride; ++i) {
+        dk_target[i] += dk_source[i];
+        dv_target[i] += dv_source[i];
+      }
+    });
+  }
+
+  if (!float_storage) {
+    pool.run(static_cast<std::size_t>(num_bh), [&](std::size_t bh) {
+      const std::int64_t offset = static_cast<std::int64_t>(bh) * head_stride;
+      narrow(simd, storage, dk_base + offset, static_cast<int>(head_stride), element_at(d_keys, storage, offset));
+      narrow(simd, storage, dv_base + offset, static_cast<int>(head_stride), element_at(d_values, storage, offset));
+    });
+  }
+
+  for (int head_index = 0; head_index < num_heads; ++head_index) {
+    float alpha_sum = 0.0f;
+    float beta_sum = 0.0f;
+    for (int batch_index = 0; batch_index < batch_size; ++batch_index) {
+      const std::int64_t bh = static_cast<std::int64_t>(batch_index) * num_heads + head_index;
+      for (int chunk = 0; chunk < chunks_per_head; ++chunk) {
+        alpha_sum += partial_alpha[bh * chunks_per_head + chunk];
+        beta_sum += partial_beta[bh * chunks_per_head + chunk];
+      }
+    }
+    d_alpha[head_index] = alpha_sum;
+    d_beta[head_index] = beta_sum;
+  }
+}
+
+}  // namespace
+
+CpuTileConfig choose_cpu_tiles(int head_dim) {
+  const long row_bytes = static_cast<long>(head_dim) * sizeof(float);
+
+  // Half of L2 for the K and V rows of one tile, leaving room for the queries
+  // and whatever else the core is touching.
+  const long key_budget = l2_cache_bytes() / 2;
+  const int key_block = std::clamp(round_down(key_budget / (2 * row_bytes), 16), 16, 1024);
+
+  // Half of L1 for the query rows plus their output accumulators.
+  const long query_budget = l1_cache_bytes() / 2;
+  const int query_block = std::clamp(round_down(query_budget / (2 * row_bytes + sizeof(float)), 4), 4, 64);
+
+  return {query_block, key_block};
+}
+
+void fuzzy_attention_forward_cpu(const float* queries,
+                                 const float* keys,
+                                 const float* values,
+                                 const float* alpha,
+                                 const float* beta,
+                                 FuzzyMembership membership,
+                                 float* output,
+                                 float* row_norms,
+                                 const int* key_lengths,
+                                 bool causal,
+                                 int window,
+                                 int batch_size,
+                                 int num_heads,
+                                 int num_queries,
+                                 int num_keys,
+                                 int head_dim,
+                                 const AttentionStrides* strides) {
+  const RowKernel row_kernel =
+      with_membership(membership, [](auto kind) -> RowKernel { return forward_row<decltype(kind)>; });
+  for_each_row(row_kernel, queries, keys, values, alpha, beta, output, row_norms,
+               key_lengths, causal, window, batch_size, num_heads, num_queries, num_keys, head_dim, strides);
+}
+
+void fuzzy_attention_forward_fused_cpu(const float* queries,
+                                       const float* keys,
+                                       const float* values,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       float* row_norms,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const AttentionStrides* strides) {
+  const RowKernel row_kernel =
+      with_membership(membership, [](auto kind) -> RowKernel { return forward_row_fused<decltype(kind)>; });
+  for_each_row(row_kernel, queries, keys, values, alpha, beta, output, row_norms,
+               key_lengths, causal, window, batch_size, num_heads, num_queries, num_keys, head_dim, strides);
+}
+
+void fuzzy_attention_forward_tiled_cpu(const float* queries,
+                                       const float* keys,
+                                       const float* values,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       float* row_norms,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const CpuTileConfig& tiles,
+                                       const KeyPruning* pruning,
+                                       const AttentionStrides* strides) {
+  tiled_forward(queries, keys, values, StorageType::kFloat32, alpha, beta, membership, output, row_norms, key_lengths,
+                causal, window, batch_size, num_heads, num_queries, num_keys, head_dim, tiles, pruning, strides);
+}
+
+void fuzzy_attention_forward_tiled_cpu(const std::uint16_t* queries,
+                                       const std::uint16_t* keys,
+                                       const std::uint16_t* values,
+                                       StorageType storage,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       std::uint16_t* output,
+                                       float* row_norms,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const CpuTileConfig& tiles,
+                                       const KeyPruning* pruning,
+                                       const AttentionStrides* strides) {
+  tiled_forward(queries, keys, values, storage, alpha, beta, membership, output, row_norms, key_lengths, causal,
+                window, batch_size, num_heads, num_queries, num_keys, head_dim, tiles, pruning, strides);
+}
+
+void fuzzy_attention_forward_sweep_cpu(const float* queries,
+                                       const float* keys,
+                                       const float* values,
+                                       const float* alpha,
+                                       const float* beta,
+                                       int num_params,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       std::int64_t param_stride,
+                                       const int* key_lengths,
+                                       bool causal,
+                                       int window,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_queries,
+                                       int num_keys,
+                                       int head_dim,
+                                       const CpuTileConfig& tiles,
+                                       const AttentionStrides* strides) {
+  // The accumulators of all candidates share the L1 budget of one query
+  // block, so the block shrinks as the sweep widens.
+  const int query_block = std::max(1, tiles.query_block / std::max(1, num_params));
+  const int key_block = std::max(1, tiles.key_block);
+  const std::int64_t query_blocks = (num_queries + query_block - 1) / query_block;
+  const std::int64_t total_blocks = static_cast<std::int64_t>(batch_size) * num_heads * query_blocks;
+  const AttentionStrides layout =
+      strides != nullptr ? *strides : contiguous_strides(num_heads, num_queries, num_keys, head_dim);
+
+  const auto& simd = active_cpu_kernels();
+  const auto& tile_kernels = tiles.specialize_head_dim ? select_tile_kernels(simd, head_dim) : simd.generic_tiles;
+
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    runtime::parallel_for(0, total_blocks, 1, [&](std::int64_t block_begin, std::int64_t block_end) {
+      TileScratch scratch(query_block, key_block);
+      std::vector<float> alphas(num_params);
+      std::vector<float> betas(num_params);
+      std::vector<float> norms(static_cast<std::size_t>(num_params) * query_block);
+      std::vector<float> acc(norms.size() * head_dim);
+
+      for (std::int64_t block = block_begin; block < block_end; ++block) {
+        const std::int64_t bh = block / query_blocks;
+        const int batch_index = static_cast<int>(bh / num_heads);
+        const int head_index = static_cast<int>(bh % num_heads);
+        const int query_begin = static_cast<int>(block % query_blocks) * query_block;
+        const int rows = std::min(num_queries, query_begin + query_block) - query_begin;
+        const int keys_valid = key_lengths != nullptr ? std::clamp(key_lengths[batch_index], 0, num_keys) : num_keys;
+        for (int p = 0; p < num_params; ++p) {
+          alphas[p] = alpha[static_cast<std::int64_t>(p) * num_heads + head_index];
+          betas[p] = beta[static_cast<std::int64_t>(p) * num_heads + head_index];
+        }
+
+        const float* q_tile = queries + layout.queries.offset(batch_index, head_index, query_begin);
+        if (layout.queries.token != head_dim) {
+          q_tile = pack_rows(simd, q_tile, StorageType::kFloat32, layout.queries.token, rows, head_dim,
+                             scratch.packed_queries);
+        }
+        std::fill(norms.begin(), norms.end(), 0.0f);
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        sweep_key_range<Membership>(simd, tile_kernels, q_tile,
+                                    {keys + layout.keys.offset(batch_index, head_index, 0),
+                                     values + layout.values.offset(batch_index, head_index, 0), layout.keys.token,
+                                     layout.values.token},
+                                    query_begin + num_keys - num_queries, rows, keys_valid, causal, window,
+                                    alphas.data(), betas.data(), num_params, head_dim, key_block, scratch,
+                                    norms.data(), acc.data());
+
+        const std::int64_t out_offset = layout.output.offset(batch_index, head_index, query_begin);
+        for (int p = 0; p < num_params; ++p) {
+          for (int r = 0; r < rows; ++r) {
+            const std::int64_t acc_row = static_cast<std::int64_t>(p) * rows + r;
+            const float inv_norm = norms[acc_row] > kEpsilon ? 1.0f / norms[acc_row] : 0.0f;
+            const float* acc_vec = acc.data() + acc_row * head_dim;
+            float* out_vec = output + p * param_stride + out_offset + r * layout.output.token;
+            for (int d = 0; d < head_dim; ++d) {
+              out_vec[d] = acc_vec[d] * inv_norm;
+            }
+          }
+        }
+      }
+    });
+  });
+}
+
+void fuzzy_attention_forward_varlen_cpu(const float* queries,
+                                        const float* keys,
+                                        const float* values,
+                                        const float* alpha,
+                                        const float* beta,
+                                        FuzzyMembership membership,
+                                        float* output,
+                                        const int* cu_seqlens,
+                                        bool causal,
+                                        int window,
+                                        int num_seqs,
+                                        int num_heads,
+                                        int num_kv_heads,
+                                        int head_dim,
+                                        const CpuTileConfig& tiles) {
+  const int query_block = std::max(1, tiles.query_block);
+  const int key_block = std::max(1, tiles.key_block);
+  const int head_group = num_heads / num_kv_heads;
+  const std::int64_t head_stride = static_cast<std::int64_t>(cu_seqlens[num_seqs]) * head_dim;
+
+  // One item per (sequence, head, query block). Items differ in cost by up
+  // to the ratio of the longest to the shortest sequence, so they are handed
+  // out dynamically, most expensive first.
+  struct WorkItem {
+    std::int64_t cost;
+    int seq_index;
+    int head_index;
+    int query_begin;
+  };
+  std::vector<WorkItem> items;
+  for (int seq_index = 0; seq_index < num_seqs; ++seq_index) {
+    const int seq_len = cu_seqlens[seq_index + 1] - cu_seqlens[seq_index];
+    for (int query_begin = 0; query_begin < seq_len; query_begin += query_block) {
+      const int rows = std::min(seq_len, query_begin + query_block) - query_begin;
+      int keys_seen = causal ? query_begin + rows : seq_len;
+      if (window > 0) {
+        keys_seen = std::min(keys_seen, rows + window - 1);
+      }
+      for (int head_index = 0; head_index < num_heads; ++head_index) {
+        items.push_back({static_cast<std::int64_t>(rows) * keys_seen, seq_index, head_index, query_begin});
+      }
+    }
+  }
+  std::stable_sort(items.begin(), items.end(),
+                   [](const WorkItem& a, const WorkItem& b) { return a.cost > b.cost; });
+
+  const auto& simd = active_cpu_kernels();
+  const auto& tile_kernels = tiles.specialize_head_dim ? select_tile_kernels(simd, head_dim) : simd.generic_tiles;
+  auto& pool = runtime::ThreadPool::global();
+
+  const std::int64_t total_tokens = cu_seqlens[num_seqs];
+  QuantizedKeys quantized_keys;
+  if (tiles.int8_scores) {
+    quantized_keys = quantize_keys(simd, keys, StorageType::kFloat32, num_kv_heads, static_cast<int>(total_tokens),
+                                   head_dim, head_dim, [&](std::int64_t slice) { return slice * head_stride; });
+  }
+
+  // Scratch is per worker slot rather than per item, so it is allocated
+  // once per call and reused across items.
+  const std::size_t num_slots = std::min(items.size(), pool.size());
+  std::atomic<std::size_t> next_item{0};
+  with_membership(membership, [&](auto kind) {
+    using Membership = decltype(kind);
+    pool.run(num_slots, [&](std::size_t) {
+      TileScratch scratch(query_block, key_block);
+      PruneCounts counts;
+      for (std::size_t i = next_item.fetch_add(1); i < items.size(); i = next_item.fetch_add(1)) {
+        const auto& item = items[i];
+        const int seq_begin = cu_seqlens[item.seq_index];
+        const int seq_len = cu_seqlens[item.seq_index + 1] - seq_begin;
+        const int rows = std::min(seq_len, item.query_begin + query_block) - item.query_begin;
+        const std::int64_t seq_offset = static_cast<std::int64_t>(seq_begin) * head_dim;
+        const std::int64_t key_offset = item.head_index / head_group * head_stride + seq_offset;
+        const std::int64_t query_offset =
+            item.head_index * head_stride + seq_offset + static_cast<std::int64_t>(item.query_begin) * head_dim;
+
+        KeyValueRows kv{keys + key_offset, values + key_offset, head_dim, head_dim};
+        if (tiles.int8_scores) {
+          quantized_keys.attach(kv, item.head_index / head_group * total_tokens + seq_begin, head_dim);
+        }
+        tiled_query_block<Membership>(simd,
+                                      tile_kernels,
+                                      queries + query_offset,
+                                      head_dim,
+                                      kv,
+                                      output + query_offset,
+                                      head_dim,
+                                      item.query_begin,
+                                      rows,
+                                      seq_len,
+                                      causal,
+                                      window,
+                                      alpha[item.head_index],
+                                      beta[item.head_index],
+                                      head_dim,
+                                      key_block,
+                                      nullptr,
+                                      counts,
+                                      scratch);
+      }
+    });
+  });
+}
+
+void fuzzy_attention_forward_cached_cpu(const float* queries,
+                                        const float* keys,
+                                        const float* values,
+                                        const float* alpha,
+                                        const float* beta,
+                                        FuzzyMembership membership,
+                                        float* output,
+                                        int batch_size,
+                                        int num_heads,
+                                        int num_queries,
+                                        int num_keys,
+                                        int head_dim,
+                                        int window,
+                                        int ring_rows,
+                                        const CpuTileConfig& tiles,
+                                        const AttentionStrides& strides) {
+  cached_forward(queries, keys, values, StorageType::kFloat32, alpha, beta, membership, output, batch_size, num_heads,
+                 num_queries, num_keys, head_dim, window, ring_rows, tiles, strides);
+}
+
+void fuzzy_attention_forward_cached_cpu(const std::uint16_t* queries,
+                                        const std::uint16_t* keys,
+                                        const std::uint16_t* values,
+                                        StorageType storage,
+                                        const float* alpha,
+                                        const float* beta,
+                                        FuzzyMembership membership,
+                                        std::uint16_t* output,
+                                        int batch_size,
+                                        int num_heads,
+                                        int num_queries,
+                                        int num_keys,
+                                        int head_dim,
+                                        int window,
+                                        int ring_rows,
+                                        const CpuTileConfig& tiles,
+                                        const AttentionStrides& strides) {
+  cached_forward(queries, keys, values, storage, alpha, beta, membership, output, batch_size, num_heads, num_queries,
+                 num_keys, head_dim, window, ring_rows, tiles, strides);
+}
+
+void fuzzy_attention_forward_paged_cpu(const float* queries,
+                                       const float* key_pool,
+                                       const float* value_pool,
+                                       const int* block_tables,
+                                       const int* seq_lengths,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       float* output,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_kv_heads,
+                                       int num_queries,
+                                       int head_dim,
+                                       int block_size,
+                                       int max_blocks,
+                                       const CpuTileConfig& tiles,
+                                       const TensorStrides& query_strides,
+                                       const TensorStrides& output_strides) {
+  paged_forward(queries, key_pool, value_pool, StorageType::kFloat32, block_tables, seq_lengths, alpha, beta,
+                membership, output, batch_size, num_heads, num_kv_heads, num_queries, head_dim, block_size, max_blocks,
+                tiles, query_strides, output_strides);
+}
+
+void fuzzy_attention_forward_paged_cpu(const std::uint16_t* queries,
+                                       const std::uint16_t* key_pool,
+                                       const std::uint16_t* value_pool,
+                                       StorageType storage,
+                                       const int* block_tables,
+                                       const int* seq_lengths,
+                                       const float* alpha,
+                                       const float* beta,
+                                       FuzzyMembership membership,
+                                       std::uint16_t* output,
+                                       int batch_size,
+                                       int num_heads,
+                                       int num_kv_heads,
+                                       int num_queries,
+                                       int head_dim,
+                                       int block_size,
+                                       int max_blocks,
+                                       const CpuTileConfig& tiles,
+                                       const TensorStrides& query_strides,
+                                       const TensorStrides& output_strides) {
+  paged_forward(queries, key_pool, value_pool, storage, block_tables, seq_lengths, alpha, beta, membership, output,
+                batch_size, num_heads, num_kv_heads, num_queries, head_dim, block_size, max_blocks, tiles,
+                query_strides, output_strides);
+}
+
+void fuzzy_attention_backward_cpu(const float* grad_out,
+                                  const float* queries,
+                                  const float* keys,
+                                  const float* values,
+                                  const float* alpha,
+                                  const float* beta,
+                                  FuzzyMembership membership,
+                                  const float* saved_output,
+                                  const int* key_lengths,
+                                  bool causal,
+                                  int window,
+                                  float* d_queries,
+                                  float* d_keys,
+                                  float* d_values,
+                                  float* d_alpha,
+                                  float* d_beta,
+                                  int batch_size,
+                                  int num_heads,
+                                  int num_queries,
+                                  int num_keys,
+                                  int head_dim) {
+  backward(grad_out, queries, keys, values, StorageType::kFloat32, alpha, beta, membership, saved_output, key_lengths,
+           causal, window, d_queries, d_keys, d_values, d_alpha, d_beta, batch_size, num_heads, num_queries, num_keys,
+           head_dim);
+}
+
+void fuzzy_attention_backward_cpu(const std::uint16_t* grad_out,
+                                  const std::uint16_t* queries,
+                                  const std::uint16_t* keys,
+                                  const std::uint16_t* values,
+                                  StorageType storage,
+                                  const float* alpha,
+                                  const float* beta,
+                                  FuzzyMembership membership,
+                                  const std::uint16_t* saved_output,
+                                  const int* key_lengths,
+                                  bool causal,
+                                  int window,
+                                  std::uint16_t* d_queries,
+                                  std::uint16_t* d_keys,
+                                  std::uint16_t* d_values,
+                                  float* d_alpha,
+                                  float* d_beta,
+                                  int batch_size,
+                                  int num_heads,
+                                  int num_queries,
+                                  int num_keys,
+                                  int head_dim) {
+  backward(grad_out, queries, keys, values, storage, alpha, beta, membership, saved_output, key_lengths, causal,
+           window, d_queries, d_keys, d_values, d_alpha, d_beta, batch_size, num_heads, num_queries, num_keys,
+           head_dim);
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
@@ -0,0 +1,125 @@
+#include "fuzzformer/kvCache.h"
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include <algorithm>
+
+namespace fuzzformer {
+
+namespace {
+
+// Ring rows of positions [begin, end), as an index tensor for dim 2.
+torch::Tensor ring_rows(std::int64_t begin, std::int64_t end, std::int64_t rows, const torch::Tensor& buffer) {
+  return torch::arange(begin, end, buffer.options().dtype(torch::kLong)).remainder(rows);
+}
+
+// Replaces buffer, a ring holding positions [0, length) of a window-W layer,
+// by one of `rows` rows holding the W - 1 of them the next query looks back
+// at, each moved to its row in the new ring.
+void resize_ring(torch::Tensor& buffer, std::int64_t length, std::int64_t window, std::int64_t rows) {
+  auto resized = torch::zeros({buffer.size(0), buffer.size(1), rows, buffer.size(3)}, buffer.options());
+  const auto live_begin = std::max<std::int64_t>(0, length - (window - 1));
+  if (live_begin < length) {
+    resized.index_copy_(2, ring_rows(live_begin, length, rows, buffer),
+                        buffer.index_select(2, ring_rows(live_begin, length, buffer.size(2), buffer)));
+  }
+  buffer = resized;
+}
+
+}  // namespace
+
+KVCache::KVCache(const ModelConfig& config,
+                 std::int64_t batch_size,
+                 std::int64_t capacity,
+                 const torch::TensorOptions& options)
+    : batch_size_(batch_size), capacity_(capacity) {
+  TORCH_CHECK(batch_size > 0, "KVCache batch_size must be positive");
+  TORCH_CHECK(capacity > 0, "KVCache capacity must be positive");
+  TORCH_CHECK(config.num_heads > 0 && config.model_dim % config.num_heads == 0,
+              "model_dim must be divisible by num_heads");
+  TORCH_CHECK(config.num_heads % config.kv_heads() == 0, "num_kv_heads must divide num_heads");
+
+  const auto num_kv_heads = static_cast<std::int64_t>(config.kv_heads());
+  const auto head_dim = static_cast<std::int64_t>(config.model_dim / config.num_heads);
+  windows_.reserve(config.num_layers);
+  keys_.reserve(config.num_layers);
+  values_.reserve(config.num_layers);
+  for (std::size_t layer = 0; layer < config.num_layers; ++layer) {
+    const auto window = static_cast<std::int64_t>(config.attention_window(layer));
+    const auto rows = window > 0 ? window : capacity;
+    bounded_ = bounded_ || window == 0;
+    windows_.push_back(window);
+    keys_.push_back(torch::zeros({batch_size, num_kv_heads, rows, head_dim}, options));
+    values_.push_back(torch::zeros({batch_size, num_kv_heads, rows, head_dim}, options));
+  }
+}
+
+std::int64_t KVCache::window(std::size_t layer) const {
+  TORCH_CHECK(layer < windows_.size(), "KVCache has no layer ", layer);
+  return windows_[layer];
+}
+
+torch::Tensor KVCache::keys(std::size_t layer) const {
+  TORCH_CHECK(layer < keys_.size(), "KVCache has no layer ", layer);
+  return windows_[layer] > 0 ? keys_[layer] : keys_[layer].narrow(2, 0, length_);
+}
+
+torch::Tensor KVCache::values(std::size_t layer) const {
+  TORCH_CHECK(layer < values_.size(), "KVCache has no layer ", layer);
+  return windows_[layer] > 0 ? values_[layer] : values_[layer].narrow(2, 0, length_);
+}
+
+std::pair<torch::Tensor, torch::Tensor> KVCache::append(std::size_t layer,
+                                                        const torch::Tensor& keys,
+                                                        const torch::Tensor& values) {
+  TORCH_CHECK(layer < keys_.size(), "KVCache has no layer ", layer);
+  auto& key_buffer = keys_[layer];
+  auto& value_buffer = values_[layer];
+  TORCH_CHECK(keys.dim() == 4 && keys.size(0) == batch_size_ && keys.size(1) == key_buffer.size(1) &&
+                  keys.size(3) == key_buffer.size(3),
+              "KVCache::append expects keys of shape [",
+              batch_size_, ", ", key_buffer.size(1), ", n, ", key_buffer.size(3), "], got ", keys.sizes());
+  TORCH_CHECK(values.sizes() == keys.sizes(), "KVCache::append values must match keys shape");
+
+  const auto num_tokens = keys.size(2);
+  const auto window = windows_[layer];
+  if (window == 0) {
+    TORCH_CHECK(length_ + num_tokens <= capacity_,
+                "KVCache capacity ", capacity_, " exceeded: ", length_, " cached + ", num_tokens, " new tokens");
+    key_buffer.narrow(2, length_, num_tokens).copy_(keys);
+    value_buffer.narrow(2, length_, num_tokens).copy_(values);
+    return {key_buffer.narrow(2, 0, length_ + num_tokens), value_buffer.narrow(2, 0, length_ + num_tokens)};
+  }
+
+  // The first new query looks back window - 1 positions, and the new tokens
+  // must not overwrite those, so the ring needs window + n - 1 rows until
+  // advance() shrinks it back.
+  const auto needed = window + num_tokens - 1;
+  if (key_buffer.size(2) < needed) {
+    resize_ring(key_buffer, length_, window, needed);
+    resize_ring(value_buffer, length_, window, needed);
+  }
+
+  const auto slots = ring_rows(length_, length_ + num_tokens, key_buffer.size(2), key_buffer);
+  key_buffer.index_copy_(2, slots, keys);
+  value_buffer.index_copy_(2, slots, values);
+  return {key_buffer, value_buffer};
+}
+
+void KVCache::advance(std::int64_t num_tokens) {
+  TORCH_CHECK(num_tokens >= 0 && (!bounded_ || length_ + num_tokens <= capacity_),
+              "KVCache::advance by ", num_tokens, " leaves [0, ", capacity_, ")");
+  length_ += num_tokens;
+  // A multi-token append grew some rings past their window; one decoded
+  // token at a time only needs window rows again.
+  for (std::size_t layer = 0; layer < windows_.size(); ++layer) {
+    if (windows_[layer] > 0 && keys_[layer].size(2) > windows_[layer]) {
+      resize_ring(keys_[layer], length_, windows_[layer], windows_[layer]);
+      resize_ring(values_[layer], length_, windows_[layer], windows_[layer]);
+    }
+  }
+}
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
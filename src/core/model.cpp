@@ -19,17 +19,84 @@ FuzzFormerImpl::FuzzFormerImpl(ModelConfig config)
     : config_(std::move(config)),
       output_head_(register_module("output_head", make_linear(config_.model_dim, config_.model_dim))) {
   for (std::size_t i = 0; i < config_.num_layers; ++i) {
-    auto block = TransformerBlock(config_);
+    auto block = TransformerBlock(config_, i);
     blocks_.push_back(register_module("block_" + std::to_string(i), block));
   }
 }
 
-torch::Tensor FuzzFormerImpl::forward(const torch::Tensor& input) {
+torch::Tensor FuzzFormerImpl::forward(const torch::Tensor& input, const FuzzyAttentionMask& mask) {
   auto hidden = input;
   for (auto& block : blocks_) {
-    hidden = block->forward(hidden);
+    hidden = block->forward(hidden, mask);
   }
-  return output_head_(hidden);
+  return project_output(hidden);
+}
+
+torch::Tensor FuzzFormerImpl::forward_varlen(const torch::Tensor& input, const torch::Tensor& cu_seqlens, bool causal) {
+  auto hidden = input;
+  for (auto& block : blocks_) {
+    hidden = block->forward_varlen(hidden, cu_seqlens, causal);
+  }
+  return project_output(hidden);
+}
+
+torch::Tensor FuzzFormerImpl::step(const torch::Tensor& new_tokens, KVCache& cache) {
+  TORCH_CHECK(new_tokens.dim() == 3, "FuzzFormer::step expects new_tokens of shape [batch, n, model_dim]");
+  TORCH_CHECK(cache.num_layers() == blocks_.size(),
+              "KVCache has ", cache.num_layers(), " layers, model has ", blocks_.size());
+
+  auto hidden = new_tokens;
+  for (std::size_t layer = 0; layer < blocks_.size(); ++layer) {
+    hidden = blocks_[layer]->step(hidden, cache, layer);
+  }
+  cache.advance(new_tokens.size(1));
+  return project_output(hidden);
+}
+
+torch::Tensor FuzzFormerImpl::step(const torch::Tensor& new_tokens,
+                                   PagedKVCache& cache,
+                                   const std::vector<std::int64_t>& sequences) {
+  TORCH_CHECK(new_tokens.dim() == 3, "FuzzFormer::step expects new_tokens of shape [batch, n, model_dim]");
+  TORCH_CHECK(new_tokens.size(0) == static_cast<int64_t>(sequences.size()),
+              "FuzzFormer::step got ", new_tokens.size(0), " rows for ", sequences.size(), " sequences");
+  TORCH_CHECK(cache.num_layers() == blocks_.size(),
+              "PagedKVCache has ", cache.num_layers(), " layers, model has ", blocks_.size());
+
+  auto hidden = new_tokens;
+  for (std::size_t layer = 0; layer < blocks_.size(); ++layer) {
+    hidden = blocks_[layer]->step(hidden, cache, layer, sequences);
+  }
+  cache.advance(sequences, new_tokens.size(1));
+  return project_output(hidden);
+}
+
+void FuzzFormerImpl::quantize_weights() {
+  TORCH_CHECK(!output_head_int8_, "FuzzFormer weights are already quantized");
+  for (auto& block : blocks_) {
+    block->quantize_weights();
+  }
+  output_head_int8_ = replace_module("output_head", QuantizedLinear(output_head_));
+  output_head_ = nullptr;
+}
+
+torch::Tensor FuzzFormerImpl::project_output(const torch::Tensor& hidden) {
+  return output_head_int8_ ? output_head_int8_->forward(hidden) : output_head_->forward(hidden);
+}
+
+void save_quantized_checkpoint(const ModelConfig& config, const ParameterDict& parameters, const std::string& path) {
+  auto model = FuzzFormer(config);
+  load_parameters(*model, parameters);
+  model->quantize_weights();
+  torch::save(model, path);
+}
+
+FuzzFormer load_quantized_checkpoint(const ModelConfig& config, const std::string& path) {
+  // Converting the freshly initialised weights gives the layers and buffer
+  // shapes the file holds; torch::load then overwrites every buffer.
+  auto model = FuzzFormer(config);
+  model->quantize_weights();
+  torch::load(model, path);
+  return model;
 }
 
 }  // namespace fuzzformer
@@ -40,7 +107,11 @@ namespace fuzzformer {
 
 FuzzFormerImpl::FuzzFormerImpl(ModelConfig config) : config_(std::move(config)), output_head_() {}
 
-torch::Tensor FuzzFormerImpl::forward(const torch::Tensor& input) {
+torch::Tensor FuzzFormerImpl::forward(const torch::Tensor& input, const FuzzyAttentionMask&) {
+  return input;
+}
+
+torch::Tensor FuzzFormerImpl::forward_varlen(const torch::Tensor& input, const torch::Tensor&, bool) {
   return input;
 }
 
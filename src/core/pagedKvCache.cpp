@@ -0,0 +1,186 @@
+#include "fuzzformer/pagedKvCache.h"
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include <algorithm>
+
+namespace fuzzformer {
+
+PagedKVCache::PagedKVCache(const ModelConfig& config,
+                           std::int64_t num_blocks,
+                           std::int64_t block_size,
+                           const torch::TensorOptions& options)
+    : num_blocks_(num_blocks), block_size_(block_size) {
+  TORCH_CHECK(num_blocks > 0, "PagedKVCache num_blocks must be positive");
+  TORCH_CHECK(block_size > 0, "PagedKVCache block_size must be positive");
+  TORCH_CHECK(config.num_heads > 0 && config.model_dim % config.num_heads == 0,
+              "model_dim must be divisible by num_heads");
+  TORCH_CHECK(config.num_heads % config.kv_heads() == 0, "num_kv_heads must divide num_heads");
+
+  const auto num_kv_heads = static_cast<std::int64_t>(config.kv_heads());
+  const auto head_dim = static_cast<std::int64_t>(config.model_dim / config.num_heads);
+  key_pools_.reserve(config.num_layers);
+  value_pools_.reserve(config.num_layers);
+  for (std::size_t layer = 0; layer < config.num_layers; ++layer) {
+    key_pools_.push_back(torch::zeros({num_blocks, num_kv_heads, block_size, head_dim}, options));
+    value_pools_.push_back(torch::zeros({num_blocks, num_kv_heads, block_size, head_dim}, options));
+  }
+
+  // Popped from the back, so blocks are handed out in ascending order.
+  free_blocks_.resize(static_cast<std::size_t>(num_blocks));
+  for (std::int64_t block = 0; block < num_blocks; ++block) {
+    free_blocks_[static_cast<std::size_t>(block)] = static_cast<int>(num_blocks - 1 - block);
+  }
+}
+
+PagedKVCache::Sequence& PagedKVCache::sequence(std::int64_t id) {
+  auto it = sequences_.find(id);
+  TORCH_CHECK(it != sequences_.end(), "PagedKVCache has no sequence ", id);
+  return it->second;
+}
+
+const PagedKVCache::Sequence& PagedKVCache::sequence(std::int64_t id) const {
+  auto it = sequences_.find(id);
+  TORCH_CHECK(it != sequences_.end(), "PagedKVCache has no sequence ", id);
+  return it->second;
+}
+
+std::int64_t PagedKVCache::add_sequence() {
+  const auto id = next_sequence_++;
+  sequences_.emplace(id, Sequence{});
+  return id;
+}
+
+void PagedKVCache::remove_sequence(std::int64_t id) {
+  auto& blocks = sequence(id).blocks;
+  free_blocks_.insert(free_blocks_.end(), blocks.rbegin(), blocks.rend());
+  sequences_.erase(id);
+}
+
+std::int64_t PagedKVCache::length(std::int64_t id) const {
+  return sequence(id).length;
+}
+
+void PagedKVCache::append(std::size_t layer,
+                          const std::vector<std::int64_t>& sequences,
+                          const torch::Tensor& keys,
+                          const torch::Tensor& values) {
+  TORCH_CHECK(layer < key_pools_.size(), "PagedKVCache has no layer ", layer);
+  auto& key_pool = key_pools_[layer];
+  auto& value_pool = value_pools_[layer];
+  const auto batch = static_cast<std::int64_t>(sequences.size());
+  TORCH_CHECK(keys.dim() == 4 && keys.size(0) == batch && keys.size(1) == key_pool.size(1) &&
+                  keys.size(3) == key_pool.size(3),
+              "PagedKVCache::append expects keys of shape [",
+              batch, ", ", key_pool.size(1), ", n, ", key_pool.size(3), "], got ", keys.sizes());
+  TORCH_CHECK(values.sizes() == keys.sizes(), "PagedKVCache::append values must match keys shape");
+
+  const auto num_tokens = keys.size(2);
+  if (batch == 0 || num_tokens == 0) {
+    return;
+  }
+
+  // Blocks are taken by whichever layer appends first; the others find them
+  // already in place.
+  std::int64_t needed = 0;
+  for (const auto id : sequences) {
+    const auto& seq = sequence(id);
+    const auto blocks = (seq.length + num_tokens + block_size_ - 1) / block_size_;
+    needed += std::max<std::int64_t>(0, blocks - static_cast<std::int64_t>(seq.blocks.size()));
+  }
+  TORCH_CHECK(needed <= free_blocks(), "PagedKVCache pool exhausted: ", needed, " blocks needed, ",
+              free_blocks(), " free");
+
+  auto block_index = torch::empty({batch * num_tokens}, torch::kLong);
+  auto row_index = torch::empty({batch * num_tokens}, torch::kLong);
+  auto* block_ptr = block_index.data_ptr<std::int64_t>();
+  auto* row_ptr = row_index.data_ptr<std::int64_t>();
+  for (std::int64_t b = 0; b < batch; ++b) {
+    auto& seq = sequence(sequences[static_cast<std::size_t>(b)]);
+    const auto end = seq.length + num_tokens;
+    while (static_cast<std::int64_t>(seq.blocks.size()) * block_size_ < end) {
+      seq.blocks.push_back(free_blocks_.back());
+      free_blocks_.pop_back();
+    }
+    for (std::int64_t t = 0; t < num_tokens; ++t) {
+      const auto position = seq.length + t;
+      block_ptr[b * num_tokens + t] = seq.blocks[static_cast<std::size_t>(position / block_size_)];
+      row_ptr[b * num_tokens + t] = position % block_size_;
+    }
+  }
+
+  // pool[block, :, row] for every (sequence, token): [batch * n, heads, head_dim].
+  block_index = block_index.to(key_pool.device());
+  row_index = row_index.to(key_pool.device());
+  const auto heads = key_pool.size(1);
+  const auto head_dim = key_pool.size(3);
+  using torch::indexing::Slice;
+  key_pool.index_put_({block_index, Slice(), row_index},
+                      keys.transpose(1, 2).reshape({batch * num_tokens, heads, head_dim}));
+  value_pool.index_put_({block_index, Slice(), row_index},
+                        values.transpose(1, 2).reshape({batch * num_tokens, heads, head_dim}));
+}
+
+void PagedKVCache::advance(const std::vector<std::int64_t>& sequences, std::int64_t num_tokens) {
+  for (const auto id : sequences) {
+    auto& seq = sequence(id);
+    TORCH_CHECK(num_tokens >= 0 &&
+                    seq.length + num_tokens <= static_cast<std::int64_t>(seq.blocks.size()) * block_size_,
+                "PagedKVCache::advance by ", num_tokens, " past the blocks appended for sequence ", id);
+    seq.length += num_tokens;
+  }
+}
+
+std::pair<torch::Tensor, torch::Tensor> PagedKVCache::block_tables(const std::vector<std::int64_t>& sequences,
+                                                                   std::int64_t num_pending) const {
+  const auto batch = static_cast<std::int64_t>(sequences.size());
+  std::int64_t max_blocks = 1;
+  for (const auto id : sequences) {
+    max_blocks = std::max<std::int64_t>(max_blocks, static_cast<std::int64_t>(sequence(id).blocks.size()));
+  }
+
+  auto tables = torch::zeros({batch, max_blocks}, torch::kInt32);
+  auto lengths = torch::empty({batch}, torch::kInt32);
+  auto* table_ptr = tables.data_ptr<int>();
+  auto* length_ptr = lengths.data_ptr<int>();
+  for (std::int64_t b = 0; b < batch; ++b) {
+    const auto& seq = sequence(sequences[static_cast<std::size_t>(b)]);
+    std::copy(seq.blocks.begin(), seq.blocks.end(), table_ptr + b * max_blocks);
+    length_ptr[b] = static_cast<int>(seq.length + num_pending);
+  }
+  const auto device = key_pools_.empty() ? torch::Device(torch::kCPU) : key_pools_.front().device();
+  return {tables.to(device), lengths.to(device)};
+}
+
+const torch::Tensor& PagedKVCache::key_pool(std::size_t layer) const {
+  TORCH_CHECK(layer < key_pools_.size(), "PagedKVCache has no layer ", layer);
+  return key_pools_[layer];
+}
+
+const torch::Tensor& PagedKVCache::value_pool(std::size_t layer) const {
+  TORCH_CHECK(layer < value_pools_.size(), "PagedKVCache has no layer ", layer);
+  return value_pools_[layer];
+}
+
+void PagedKVCache::report_metrics(metrics::MetricsCollector& collector) const {
+  const auto used_blocks = num_blocks_ - free_blocks();
+  std::int64_t tokens = 0;
+  for (const auto& item : sequences_) {
+    tokens += item.second.length;
+  }
+  const auto used_positions = used_blocks * block_size_;
+
+  collector.set_gauge("kv_pool.blocks_total", static_cast<double>(num_blocks_));
+  collector.set_gauge("kv_pool.blocks_used", static_cast<double>(used_blocks));
+  collector.set_gauge("kv_pool.tokens", static_cast<double>(tokens));
+  collector.set_gauge("kv_pool.occupancy_percent",
+                      100.0 * static_cast<double>(used_blocks) / static_cast<double>(num_blocks_));
+  collector.set_gauge("kv_pool.fragmentation_percent",
+                      used_positions == 0 ? 0.0
+                                          : 100.0 * static_cast<double>(used_positions - tokens) /
+                                                static_cast<double>(used_positions));
+}
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
@@ -0,0 +1,85 @@
+#include "fuzzformer/quantizedLinear.h"
+
+#ifdef FUZZFORMER_HAS_TORCH
+
+#include "fuzzformer/quantizedLinearCpu.h"
+
+namespace fuzzformer {
+
+namespace {
+
+// Input rows up to which int8_linear_forward_cpu runs. It reads each weight
+// byte once but computes one dot product per (row, channel), so beyond a
+// decode-sized batch a float GEMM over the cached dequantised weights is
+// faster. 16 is a placeholder, not yet measured against libtorch's GEMM;
+// tune it with the decode and prefill benchmarks before relying on it.
+constexpr int64_t kMaxInt8KernelRows = 16;
+
+}  // namespace
+
+QuantizedLinearImpl::QuantizedLinearImpl(const torch::nn::Linear& linear) {
+  // Quantised on the host whatever the Linear's device, then moved there.
+  const auto weight = linear->weight.detach().to(torch::kCPU, torch::kFloat32).contiguous();
+  const auto out_features = weight.size(0);
+  const auto in_features = weight.size(1);
+  auto quantized = torch::empty({out_features, in_features}, torch::TensorOptions().dtype(torch::kInt8));
+  auto scale = torch::empty({out_features}, torch::TensorOptions().dtype(torch::kFloat32));
+  kernels::quantize_linear_weights_cpu(weight.data_ptr<float>(), static_cast<int>(out_features),
+                                       static_cast<int>(in_features), quantized.data_ptr<int8_t>(),
+                                       scale.data_ptr<float>());
+
+  const auto device = linear->weight.device();
+  weight_ = register_buffer("weight", quantized.to(device));
+  scale_ = register_buffer("scale", scale.to(device));
+  if (linear->bias.defined()) {
+    bias_ = register_buffer("bias", linear->bias.detach().to(torch::kFloat32).clone());
+  }
+}
+
+torch::Tensor QuantizedLinearImpl::forward(const torch::Tensor& input) {
+  TORCH_CHECK(input.dim() >= 1 && input.size(-1) == in_features(),
+              "QuantizedLinear expects ",
+              in_features(),
+              " input features, got ",
+              input.sizes());
+
+  if (!input.device().is_cpu() || input.scalar_type() != torch::kFloat32 ||
+      input.numel() > kMaxInt8KernelRows * in_features()) {
+    const auto type = input.scalar_type();
+    return torch::nn::functional::linear(input, fallback_weight(input),
+                                         bias_.defined() ? bias_.to(type) : bias_);
+  }
+
+  auto rows = input.reshape({-1, in_features()}).contiguous();
+  auto output = torch::empty({rows.size(0), out_features()}, rows.options());
+  kernels::int8_linear_forward_cpu(rows.data_ptr<float>(),
+                                   weight_.data_ptr<int8_t>(),
+                                   scale_.data_ptr<float>(),
+                                   bias_.defined() ? bias_.data_ptr<float>() : nullptr,
+                                   output.data_ptr<float>(),
+                                   rows.size(0),
+                                   static_cast<int>(in_features()),
+                                   static_cast<int>(out_features()));
+  auto sizes = input.sizes().vec();
+  sizes.back() = out_features();
+  return output.view(sizes);
+}
+
+torch::Tensor QuantizedLinearImpl::dequantized_weight() const {
+  return weight_.to(torch::kFloat32) * scale_.unsqueeze(1);
+}
+
+const torch::Tensor& QuantizedLinearImpl::fallback_weight(const torch::Tensor& input) {
+  if (!fallback_weight_.defined() || fallback_weight_.scalar_type() != input.scalar_type() ||
+      fallback_weight_.device() != weight_.device() || fallback_weight_version_ != weight_._version() ||
+      fallback_scale_version_ != scale_._version()) {
+    fallback_weight_ = dequantized_weight().to(input.scalar_type());
+    fallback_weight_version_ = weight_._version();
+    fallback_scale_version_ = scale_._version();
+  }
+  return fallback_weight_;
+}
+
+}  // namespace fuzzformer
+
+#endif  // FUZZFORMER_HAS_TORCH
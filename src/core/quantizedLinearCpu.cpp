@@ -0,0 +1,74 @@
+#include "fuzzformer/quantizedLinearCpu.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "fuzzformer/cpuKernels.h"
+#include "fuzzformer/threadPool.h"
+
+namespace fuzzformer {
+namespace kernels {
+
+namespace {
+
+// Dequantised weights per channel block: half of a typical L1, leaving the
+// rest for the input row.
+constexpr std::int64_t kDequantizedBlockBytes = 16 * 1024;
+
+// Weight rows handed to quantize_linear_weights_cpu workers at a time.
+constexpr std::int64_t kQuantizeGrain = 64;
+
+}  // namespace
+
+void quantize_linear_weights_cpu(const float* weights,
+                                 int out_features,
+                                 int in_features,
+                                 std::int8_t* quantized,
+                                 float* scales) {
+  const auto& simd = active_cpu_kernels();
+  runtime::parallel_for(0, out_features, kQuantizeGrain, [&](std::int64_t row_begin, std::int64_t row_end) {
+    for (std::int64_t row = row_begin; row < row_end; ++row) {
+      std::int32_t sum = 0;
+      scales[row] = simd.quantize_int8(weights + row * in_features, in_features, quantized + row * in_features, &sum);
+    }
+  });
+}
+
+void int8_linear_forward_cpu(const float* input,
+                             const std::int8_t* weights,
+                             const float* scales,
+                             const float* bias,
+                             float* output,
+                             std::int64_t rows,
+                             int in_features,
+                             int out_features) {
+  const auto& simd = active_cpu_kernels();
+  const int block_channels = static_cast<int>(std::clamp<std::int64_t>(
+      kDequantizedBlockBytes / (static_cast<std::int64_t>(in_features) * sizeof(float)), 1, out_features));
+  const std::int64_t num_blocks = (out_features + block_channels - 1) / block_channels;
+
+  runtime::parallel_for(0, num_blocks, 1, [&](std::int64_t block_begin, std::int64_t block_end) {
+    std::vector<float> dequantized(static_cast<std::size_t>(block_channels) * in_features);
+    for (std::int64_t block = block_begin; block < block_end; ++block) {
+      const int first_channel = static_cast<int>(block * block_channels);
+      const int channels = std::min(block_channels, out_features - first_channel);
+      for (int c = 0; c < channels; ++c) {
+        const std::int64_t channel = first_channel + c;
+        simd.dequantize_int8(weights + channel * in_features, in_features, scales[channel],
+                             dequantized.data() + static_cast<std::int64_t>(c) * in_features);
+      }
+      for (std::int64_t row = 0; row < rows; ++row) {
+        const float* x = input + row * in_features;
+        float* y = output + row * out_features + first_channel;
+        for (int c = 0; c < channels; ++c) {
+          y[c] = simd.dot(x, dequantized.data() + static_cast<std::int64_t>(c) * in_features, in_features) +
+                 (bias != nullptr ? bias[first_channel + c] : 0.0f);
+        }
+      }
+    }
+  });
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
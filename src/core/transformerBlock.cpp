@@ -1,6 +1,7 @@
 #include "fuzzformer/transformerBlock.h"
 
 #include <cmath>
+#include <tuple>
 
 namespace fuzzformer {
 
@@ -13,66 +14,209 @@ torch::nn::Linear make_linear(std::size_t in, std::size_t out) {
   return torch::nn::Linear(options);
 }
 
-torch::Tensor reshape_heads(const torch::Tensor& tensor,
-                            int64_t batch,
-                            int64_t seq_len,
-                            int64_t num_heads,
-                            int64_t head_dim) {
-  return tensor.view({batch, seq_len, num_heads, head_dim})
-      .permute({0, 2, 1, 3})
-      .contiguous();
+// Width of the fused projection: num_heads query heads plus kv_heads() key
+// and value heads each.
+std::size_t qkv_features(const ModelConfig& config) {
+  TORCH_CHECK(config.num_heads > 0 && config.model_dim % config.num_heads == 0,
+              "model_dim must be divisible by num_heads");
+  TORCH_CHECK(config.num_heads % config.kv_heads() == 0, "num_kv_heads must divide num_heads");
+  return (config.num_heads + 2 * config.kv_heads()) * (config.model_dim / config.num_heads);
+}
+
+// Splits fused projections [..., qkv_features] into strided q
+// [..., heads, head_dim] and k, v [..., kv_heads, head_dim] views.
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> split_qkv(const torch::Tensor& qkv,
+                                                                  int64_t num_heads,
+                                                                  int64_t num_kv_heads,
+                                                                  int64_t head_dim) {
+  auto sizes = qkv.sizes().vec();
+  sizes.back() = num_heads + 2 * num_kv_heads;
+  sizes.push_back(head_dim);
+  auto heads = qkv.view(sizes);
+  const auto dim = heads.dim() - 2;
+  return {heads.narrow(dim, 0, num_heads), heads.narrow(dim, num_heads, num_kv_heads),
+          heads.narrow(dim, num_heads + num_kv_heads, num_kv_heads)};
+}
+
+// Checks the input's last dim against the config and returns head_dim.
+int64_t checked_head_dim(const ModelConfig& config, int64_t model_dim) {
+  TORCH_CHECK(model_dim == static_cast<int64_t>(config.model_dim),
+              "Input dim mismatch: expected ",
+              config.model_dim,
+              " got ",
+              model_dim);
+  TORCH_CHECK(config.num_heads > 0, "num_heads must be positive");
+  TORCH_CHECK(model_dim % static_cast<int64_t>(config.num_heads) == 0,
+              "model_dim must be divisible by num_heads");
+  return model_dim / static_cast<int64_t>(config.num_heads);
 }
 
 }  // namespace
 
-TransformerBlockImpl::TransformerBlockImpl(ModelConfig config)
+TransformerBlockImpl::TransformerBlockImpl(ModelConfig config, std::size_t layer)
     : config_(std::move(config)),
-      q_proj_(register_module("q_proj", make_linear(config_.model_dim, config_.model_dim))),
-      k_proj_(register_module("k_proj", make_linear(config_.model_dim, config_.model_dim))),
-      v_proj_(register_module("v_proj", make_linear(config_.model_dim, config_.model_dim))),
+      window_(config_.attention_window(layer)),
+      qkv_proj_(register_module("qkv_proj", make_linear(config_.model_dim, qkv_features(config_)))),
       out_proj_(register_module("out_proj", make_linear(config_.model_dim, config_.model_dim))) {}
 
-torch::Tensor TransformerBlockImpl::forward(const torch::Tensor& input) {
+torch::Tensor TransformerBlockImpl::forward(const torch::Tensor& input, const FuzzyAttentionMask& mask) {
   TORCH_CHECK(input.dim() == 3, "TransformerBlock expects input of shape [batch, seq_len, model_dim]");
 
   const auto batch = input.size(0);
   const auto seq_len = input.size(1);
   const auto model_dim = input.size(2);
 
-  TORCH_CHECK(model_dim == static_cast<int64_t>(config_.model_dim),
-              "Input dim mismatch: expected ",
-              config_.model_dim,
-              " got ",
-              model_dim);
-  TORCH_CHECK(config_.num_heads > 0, "num_heads must be positive");
-  TORCH_CHECK(model_dim % static_cast<int64_t>(config_.num_heads) == 0,
-              "model_dim must be divisible by num_heads");
+  const auto head_dim = checked_head_dim(config_, model_dim);
+  const auto num_heads = static_cast<int64_t>(config_.num_heads);
+  const auto num_kv_heads = static_cast<int64_t>(config_.kv_heads());
+
+  // One GEMM reads the activations once for all three projections. Its
+  // [batch, seq_len, heads + 2 * kv_heads, head_dim] output is read in place
+  // as strided token-major q, k and v, and the attention output comes back
+  // contiguous [batch, seq_len, heads, head_dim], which is already the merged
+  // layout. With fewer K/V heads, each serves a group of query heads.
+  auto [q_heads, k_heads, v_heads] = split_qkv(project_qkv(input), num_heads, num_kv_heads, head_dim);
+
+  auto alpha = torch::ones({num_heads}, q_heads.options());
+  auto beta = torch::zeros({num_heads}, q_heads.options());
+
+  FuzzyAttentionOptions options;
+  options.layout = FuzzyAttentionLayout::kBSHD;
+  options.membership = config_.membership;
+  options.int8_scores = config_.int8_scores;
+  auto block_mask = mask;
+  if (window_ > 0) {
+    block_mask.causal = true;
+    block_mask.window = static_cast<int64_t>(window_);
+  }
+  auto attn = fuzzy_attention_forward(q_heads, k_heads, v_heads, alpha, beta, options, block_mask);
+  auto merged = attn.view({batch, seq_len, model_dim});
+
+  auto output = project_out(merged);
+  return output + input;
+}
 
-  const auto head_dim = model_dim / static_cast<int64_t>(config_.num_heads);
+torch::Tensor TransformerBlockImpl::forward_varlen(const torch::Tensor& input,
+                                                   const torch::Tensor& cu_seqlens,
+                                                   bool causal) {
+  TORCH_CHECK(input.dim() == 2, "TransformerBlock expects packed input of shape [total_tokens, model_dim]");
 
-  auto q_proj = q_proj_(input);
-  auto k_proj = k_proj_(input);
-  auto v_proj = v_proj_(input);
+  const auto total_tokens = input.size(0);
+  const auto model_dim = input.size(1);
 
-  auto q_heads = reshape_heads(q_proj, batch, seq_len, config_.num_heads, head_dim);
-  auto k_heads = reshape_heads(k_proj, batch, seq_len, config_.num_heads, head_dim);
-  auto v_heads = reshape_heads(v_proj, batch, seq_len, config_.num_heads, head_dim);
+  const auto head_dim = checked_head_dim(config_, model_dim);
+  const auto num_heads = static_cast<int64_t>(config_.num_heads);
+  const auto num_kv_heads = static_cast<int64_t>(config_.kv_heads());
 
-  auto alpha = torch::ones({static_cast<int64_t>(config_.num_heads)}, q_heads.options());
-  auto beta = torch::zeros({static_cast<int64_t>(config_.num_heads)}, q_heads.options());
+  // Each token's fused projection row is [heads + 2 * kv_heads, head_dim],
+  // so q is a strided [total_tokens, heads, head_dim] view and k and v are
+  // [total_tokens, kv_heads, head_dim] views, none of them copied.
+  auto [q_heads, k_heads, v_heads] = split_qkv(project_qkv(input), num_heads, num_kv_heads, head_dim);
 
-  auto attn = fuzzy_attention_forward(q_heads, k_heads, v_heads, alpha, beta);
-  auto merged = attn.permute({0, 2, 1, 3}).contiguous().view({batch, seq_len, model_dim});
+  auto alpha = torch::ones({num_heads}, q_heads.options());
+  auto beta = torch::zeros({num_heads}, q_heads.options());
 
-  auto output = out_proj_(merged);
+  auto attn = fuzzy_attention_forward_varlen(q_heads, k_heads, v_heads, cu_seqlens, alpha, beta,
+                                             causal || window_ > 0, static_cast<int64_t>(window_), config_.membership,
+                                             config_.int8_scores);
+  auto output = project_out(attn.view({total_tokens, model_dim}));
   return output + input;
 }
 
+torch::Tensor TransformerBlockImpl::step(const torch::Tensor& input, KVCache& cache, std::size_t layer) {
+  TORCH_CHECK(input.dim() == 3, "TransformerBlock::step expects input of shape [batch, new_tokens, model_dim]");
+
+  const auto batch = input.size(0);
+  const auto num_tokens = input.size(1);
+  const auto model_dim = input.size(2);
+
+  const auto head_dim = checked_head_dim(config_, model_dim);
+  const auto num_heads = static_cast<int64_t>(config_.num_heads);
+  const auto num_kv_heads = static_cast<int64_t>(config_.kv_heads());
+
+  const auto window = static_cast<int64_t>(window_);
+  TORCH_CHECK(cache.window(layer) == window, "KVCache layer ", layer, " has window ", cache.window(layer),
+              ", block has ", window);
+
+  // Only the new tokens are projected. Their keys and values are copied into
+  // the head-major cache, and attention reads the cache in place; a windowed
+  // layer's cache is a ring addressed by absolute position.
+  auto [q_heads, k_heads, v_heads] = split_qkv(project_qkv(input), num_heads, num_kv_heads, head_dim);
+  auto [keys, values] = cache.append(layer, k_heads.transpose(1, 2), v_heads.transpose(1, 2));
+
+  auto alpha = torch::ones({num_heads}, q_heads.options());
+  auto beta = torch::zeros({num_heads}, q_heads.options());
+
+  FuzzyAttentionOptions options;
+  options.layout = FuzzyAttentionLayout::kBSHD;
+  options.membership = config_.membership;
+  auto attn = fuzzy_attention_forward_cached(q_heads, keys.transpose(1, 2), values.transpose(1, 2), alpha,
+                                             beta, options, window, window > 0 ? cache.length() + num_tokens : 0);
+
+  auto output = project_out(attn.view({batch, num_tokens, model_dim}));
+  return output + input;
+}
+
+torch::Tensor TransformerBlockImpl::step(const torch::Tensor& input,
+                                         PagedKVCache& cache,
+                                         std::size_t layer,
+                                         const std::vector<std::int64_t>& sequences) {
+  TORCH_CHECK(input.dim() == 3, "TransformerBlock::step expects input of shape [batch, new_tokens, model_dim]");
+
+  const auto batch = input.size(0);
+  const auto num_tokens = input.size(1);
+  const auto model_dim = input.size(2);
+
+  const auto head_dim = checked_head_dim(config_, model_dim);
+
+  TORCH_CHECK(window_ == 0, "PagedKVCache does not support windowed layers");
+
+  const auto num_heads = static_cast<int64_t>(config_.num_heads);
+  const auto num_kv_heads = static_cast<int64_t>(config_.kv_heads());
+
+  auto [q_heads, k_heads, v_heads] = split_qkv(project_qkv(input), num_heads, num_kv_heads, head_dim);
+  cache.append(layer, sequences, k_heads.transpose(1, 2), v_heads.transpose(1, 2));
+  auto [tables, lengths] = cache.block_tables(sequences, num_tokens);
+
+  auto alpha = torch::ones({num_heads}, q_heads.options());
+  auto beta = torch::zeros({num_heads}, q_heads.options());
+
+  FuzzyAttentionOptions options;
+  options.layout = FuzzyAttentionLayout::kBSHD;
+  options.membership = config_.membership;
+  auto attn = fuzzy_attention_forward_paged(q_heads, cache.key_pool(layer), cache.value_pool(layer), tables,
+                                            lengths, alpha, beta, options);
+
+  auto output = project_out(attn.view({batch, num_tokens, model_dim}));
+  return output + input;
+}
+
+torch::Tensor TransformerBlockImpl::project_qkv(const torch::Tensor& input) {
+  return qkv_proj_int8_ ? qkv_proj_int8_->forward(input) : qkv_proj_->forward(input);
+}
+
+torch::Tensor TransformerBlockImpl::project_out(const torch::Tensor& attention) {
+  return out_proj_int8_ ? out_proj_int8_->forward(attention) : out_proj_->forward(attention);
+}
+
+void TransformerBlockImpl::quantize_weights() {
+  TORCH_CHECK(!qkv_proj_int8_, "TransformerBlock weights are already quantized");
+  qkv_proj_int8_ = replace_module("qkv_proj", QuantizedLinear(qkv_proj_));
+  out_proj_int8_ = replace_module("out_proj", QuantizedLinear(out_proj_));
+  qkv_proj_ = nullptr;
+  out_proj_ = nullptr;
+}
+
 #else  // FUZZFORMER_HAS_TORCH
 
-TransformerBlockImpl::TransformerBlockImpl(ModelConfig config) : config_(std::move(config)) {}
+TransformerBlockImpl::TransformerBlockImpl(ModelConfig config, std::size_t layer)
+    : config_(std::move(config)), window_(config_.attention_window(layer)) {}
+
+torch::Tensor TransformerBlockImpl::forward(const torch::Tensor& input, const FuzzyAttentionMask&) {
+  return input;
+}
 
-torch::Tensor TransformerBlockImpl::forward(const torch::Tensor& input) {
+torch::Tensor TransformerBlockImpl::forward_varlen(const torch::Tensor& input, const torch::Tensor&, bool) {
   return input;
 }
 
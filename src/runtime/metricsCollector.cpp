@@ -97,6 +97,36 @@ KernelMetrics MetricsCollector::get_metrics(const std::string& kernel_name) cons
   return KernelMetrics{};
 }
 
+void MetricsCollector::add_counter(const std::string& name, uint64_t delta) {
+  counters_[name] += delta;
+}
+
+uint64_t MetricsCollector::get_counter(const std::string& name) const {
+  auto it = counters_.find(name);
+  return it != counters_.end() ? it->second : 0;
+}
+
+double MetricsCollector::counter_percent(const std::string& part, const std::string& whole) const {
+  const uint64_t total = get_counter(whole);
+  if (total == 0) {
+    return 0.0;
+  }
+  return 100.0 * static_cast<double>(get_counter(part)) / static_cast<double>(total);
+}
+
+void MetricsCollector::reset_counters() {
+  counters_.clear();
+}
+
+void MetricsCollector::set_gauge(const std::string& name, double value) {
+  gauges_[name] = value;
+}
+
+double MetricsCollector::get_gauge(const std::string& name) const {
+  auto it = gauges_.find(name);
+  return it != gauges_.end() ? it->second : 0.0;
+}
+
 void MetricsCollector::render_throughput_card(const KernelMetrics& metrics) const {
   std::cout << "\n";
   std::cout << "─────────────────────────────────────────────────────\n";
@@ -0,0 +1,212 @@
+#include "fuzzformer/threadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fuzzformer {
+namespace runtime {
+
+namespace {
+
+thread_local bool t_inside_pool_task = false;
+
+std::size_t default_thread_count() {
+  if (const char* env = std::getenv("FUZZFORMER_NUM_THREADS")) {
+    try {
+      const auto requested = std::stol(env);
+      if (requested > 0) {
+        return static_cast<std::size_t>(requested);
+      }
+    } catch (const std::exception&) {
+      // Fall through to the hardware default on malformed values.
+    }
+  }
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+}  // namespace
+
+class ThreadPool::Impl {
+ public:
+  explicit Impl(std::size_t num_threads) : size_(std::max<std::size_t>(1, num_threads)) {
+    workers_.reserve(size_ - 1);
+    for (std::size_t i = 0; i + 1 < size_; ++i) {
+      workers_.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  ~Impl() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  std::size_t size() const { return size_; }
+
+  void run(std::size_t num_tasks, const std::function<void(std::size_t)>& task) {
+    if (num_tasks == 0) {
+      return;
+    }
+    if (num_tasks == 1 || size_ == 1 || t_inside_pool_task) {
+      for (std::size_t i = 0; i < num_tasks; ++i) {
+        task(i);
+      }
+      return;
+    }
+
+    std::lock_guard<std::mutex> submit_lock(submit_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      num_tasks_ = num_tasks;
+      next_task_.store(0, std::memory_order_relaxed);
+      pending_tasks_ = num_tasks;
+      error_ = nullptr;
+      ++generation_;
+    }
+    wake_.notify_all();
+
+    drain(&task, num_tasks);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return pending_tasks_ == 0 && active_workers_ == 0; });
+    task_ = nullptr;
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+ private:
+  void worker_loop() {
+    std::uint64_t seen_generation = 0;
+    while (true) {
+      const std::function<void(std::size_t)>* task = nullptr;
+      std::size_t num_tasks = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+        if (stopping_) {
+          return;
+        }
+        seen_generation = generation_;
+        if (task_ == nullptr) {
+          // The job finished before this worker woke up.
+          continue;
+        }
+        task = task_;
+        num_tasks = num_tasks_;
+        ++active_workers_;
+      }
+      drain(task, num_tasks);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --active_workers_;
+      }
+      done_.notify_all();
+    }
+  }
+
+  void drain(const std::function<void(std::size_t)>* task, std::size_t num_tasks) {
+    t_inside_pool_task = true;
+    std::size_t completed = 0;
+    while (true) {
+      const auto index = next_task_.fetch_add(1, std::memory_order_relaxed);
+      if (index >= num_tasks) {
+        break;
+      }
+      try {
+        (*task)(index);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+      }
+      ++completed;
+    }
+    t_inside_pool_task = false;
+    if (completed > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_tasks_ -= completed;
+    }
+  }
+
+  const std::size_t size_;
+  std::vector<std::thread> workers_;
+
+  std::mutex submit_mutex_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+
+  const std::function<void(std::size_t)>* task_ = nullptr;
+  std::size_t num_tasks_ = 0;
+  std::atomic<std::size_t> next_task_{0};
+  std::size_t pending_tasks_ = 0;
+  std::size_t active_workers_ = 0;
+  std::uint64_t generation_ = 0;
+  bool stopping_ = false;
+  std::exception_ptr error_;
+};
+
+ThreadPool::ThreadPool(std::size_t num_threads)
+    : impl_(std::make_unique<Impl>(num_threads == 0 ? default_thread_count() : num_threads)) {}
+
+ThreadPool::~ThreadPool() = default;
+
+std::size_t ThreadPool::size() const {
+  return impl_->size();
+}
+
+void ThreadPool::run(std::size_t num_tasks, const std::function<void(std::size_t)>& task) {
+  impl_->run(num_tasks, task);
+}
+
+void ThreadPool::parallel_for(std::int64_t begin,
+                              std::int64_t end,
+                              std::int64_t grain_size,
+                              const std::function<void(std::int64_t, std::int64_t)>& body) {
+  if (end <= begin) {
+    return;
+  }
+  const auto range = end - begin;
+  const auto grain = std::max<std::int64_t>(1, grain_size);
+  const auto max_chunks = (range + grain - 1) / grain;
+  const auto num_chunks = std::min<std::int64_t>(max_chunks, static_cast<std::int64_t>(size()));
+  const auto chunk_size = (range + num_chunks - 1) / num_chunks;
+
+  run(static_cast<std::size_t>(num_chunks), [&](std::size_t chunk) {
+    const auto chunk_begin = begin + static_cast<std::int64_t>(chunk) * chunk_size;
+    const auto chunk_end = std::min(end, chunk_begin + chunk_size);
+    if (chunk_begin < chunk_end) {
+      body(chunk_begin, chunk_end);
+    }
+  });
+}
+
+ThreadPool& ThreadPool::global() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void parallel_for(std::int64_t begin,
+                  std::int64_t end,
+                  std::int64_t grain_size,
+                  const std::function<void(std::int64_t, std::int64_t)>& body) {
+  ThreadPool::global().parallel_for(begin, end, grain_size, body);
+}
+
+}  // namespace runtime
+}  // namespace fuzzformer
@@ -16,6 +16,20 @@ void ensure_cuda(const torch::Tensor& tensor, std::string_view name) {
 #endif
 }
 
+void ensure_same_device(const torch::Tensor& tensor,
+                        const torch::Tensor& reference,
+                        std::string_view name) {
+#ifdef FUZZFORMER_HAS_TORCH
+  if (tensor.device() != reference.device()) {
+    throw std::invalid_argument(std::string(name) + " must reside on the same device as queries");
+  }
+#else
+  (void)tensor;
+  (void)reference;
+  (void)name;
+#endif
+}
+
 void ensure_contiguous(torch::Tensor& tensor) {
 #ifdef FUZZFORMER_HAS_TORCH
   if (!tensor.is_contiguous()) {
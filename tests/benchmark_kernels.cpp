@@ -1,13 +1,23 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
 #include <iostream>
+#include <random>
 #include <vector>
 
+#include "fuzzformer/cpuKernels.h"
 #include "fuzzformer/fuzzyAttention.h"
+#include "fuzzformer/fuzzyAttentionCpu.h"
+#include "fuzzformer/kvCache.h"
 #include "fuzzformer/metricsCollector.h"
 #include "fuzzformer/model.h"
 #include "fuzzformer/modelConfig.h"
+#include "fuzzformer/threadPool.h"
 #include "fuzzformer/timer.h"
 
 #ifdef FUZZFORMER_HAS_TORCH
@@ -46,7 +56,7 @@ TEST_F(KernelBenchmark, FuzzyAttentionForwardThroughput) {
 
   torch::cuda::synchronize();
   Timer timer;
-  timer.start();
+  timer.reset();
 
   for (int i = 0; i < num_iterations; ++i) {
     auto output = fuzzy_attention_forward(q, k, v, alpha, beta);
@@ -54,7 +64,7 @@ TEST_F(KernelBenchmark, FuzzyAttentionForwardThroughput) {
   }
 
   auto elapsed = timer.elapsed();
-  double avg_time_us = elapsed.count() / num_iterations;
+  double avg_time_us = elapsed.count() * 1e6 / num_iterations;
   double throughput_gflops = (2.0 * batch_size * num_heads * seq_len * seq_len * head_dim) / (avg_time_us * 1e3);
 
   std::cout << "\nFuzzy Attention Forward Benchmark:\n";
@@ -79,7 +89,7 @@ TEST_F(KernelBenchmark, ModelInferenceLatency) {
   const int num_iterations = 50;
   torch::cuda::synchronize();
   Timer timer;
-  timer.start();
+  timer.reset();
 
   for (int i = 0; i < num_iterations; ++i) {
     auto output = model->forward(input);
@@ -87,7 +97,7 @@ TEST_F(KernelBenchmark, ModelInferenceLatency) {
   }
 
   auto elapsed = timer.elapsed();
-  double avg_time_ms = elapsed.count() / num_iterations / 1000.0;
+  double avg_time_ms = elapsed.count() * 1e3 / num_iterations;
 
   std::cout << "\nModel Inference Benchmark:\n";
   std::cout << "  Layers: " << config.num_layers << ", Dim: " << config.model_dim
@@ -97,6 +107,66 @@ TEST_F(KernelBenchmark, ModelInferenceLatency) {
   EXPECT_GT(avg_time_ms, 0.0);
 }
 
+TEST_F(KernelBenchmark, DeterministicBackward) {
+  const int batch_size = 2;
+  const int num_heads = 8;
+  const int seq_len = 1024;
+  const int head_dim = 64;
+  const int num_iterations = 20;
+
+  auto options = torch::TensorOptions().dtype(torch::kFloat32).device(torch::kCUDA);
+  auto q = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto k = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto v = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto alpha = torch::full({num_heads}, 0.1f, options);
+  auto beta = torch::zeros({num_heads}, options);
+  auto grad_out = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+
+  auto saved = fuzzy_attention_forward_with_context(q, k, v, alpha, beta);
+  // Same inputs without the forward statistics: the backward has to find the
+  // row normalisers itself.
+  auto unsaved = saved;
+  unsaved.row_norms = torch::Tensor();
+  unsaved.output = torch::Tensor();
+
+  // One warm-up call, then the mean over num_iterations, in milliseconds.
+  auto time_backward = [&](const FuzzyAttentionContext& context, FuzzyAttentionBackwardMode mode) {
+    FuzzyAttentionOptions backward_options;
+    backward_options.backward_mode = mode;
+    fuzzy_attention_backward(grad_out, context, backward_options);
+    torch::cuda::synchronize();
+    Timer timer;
+    timer.reset();
+    for (int i = 0; i < num_iterations; ++i) {
+      fuzzy_attention_backward(grad_out, context, backward_options);
+    }
+    torch::cuda::synchronize();
+    return timer.elapsed().count() * 1e3 / num_iterations;
+  };
+
+  const double atomic_saved_ms = time_backward(saved, FuzzyAttentionBackwardMode::kAtomic);
+  const double deterministic_saved_ms = time_backward(saved, FuzzyAttentionBackwardMode::kDeterministic);
+  const double atomic_unsaved_ms = time_backward(unsaved, FuzzyAttentionBackwardMode::kAtomic);
+  const double deterministic_unsaved_ms = time_backward(unsaved, FuzzyAttentionBackwardMode::kDeterministic);
+
+  std::cout << "\nFuzzy Attention Backward Benchmark:\n";
+  std::cout << "  Batch: " << batch_size << ", Heads: " << num_heads
+            << ", SeqLen: " << seq_len << ", HeadDim: " << head_dim << "\n";
+  std::cout << "  Saved stats:   atomic " << atomic_saved_ms << " ms, deterministic "
+            << deterministic_saved_ms << " ms\n";
+  std::cout << "  Unsaved stats: atomic " << atomic_unsaved_ms << " ms, deterministic "
+            << deterministic_unsaved_ms << " ms\n";
+
+  FuzzyAttentionOptions deterministic_options;
+  deterministic_options.backward_mode = FuzzyAttentionBackwardMode::kDeterministic;
+  const auto atomic = fuzzy_attention_backward(grad_out, unsaved);
+  const auto deterministic = fuzzy_attention_backward(grad_out, unsaved, deterministic_options);
+  for (size_t i = 0; i < atomic.size(); ++i) {
+    EXPECT_TRUE(torch::allclose(atomic[i], deterministic[i], 1e-3, 1e-4));
+  }
+  EXPECT_GT(deterministic_unsaved_ms, 0.0);
+}
+
 TEST_F(KernelBenchmark, MemoryBandwidthEstimate) {
   const int batch_size = 2;
   const int num_heads = 4;
@@ -119,7 +189,7 @@ TEST_F(KernelBenchmark, MemoryBandwidthEstimate) {
 
   torch::cuda::synchronize();
   Timer timer;
-  timer.start();
+  timer.reset();
 
   for (int i = 0; i < num_iterations; ++i) {
     auto output = fuzzy_attention_forward(q, k, v, alpha, beta);
@@ -127,7 +197,7 @@ TEST_F(KernelBenchmark, MemoryBandwidthEstimate) {
   }
 
   auto elapsed = timer.elapsed();
-  double elapsed_seconds = elapsed.count() / 1e6;
+  double elapsed_seconds = elapsed.count();
   double bandwidth_gbps = (total_bytes / elapsed_seconds) / 1e9;
 
   std::cout << "\nMemory Bandwidth Estimate:\n";
@@ -136,11 +206,601 @@ TEST_F(KernelBenchmark, MemoryBandwidthEstimate) {
 
   EXPECT_GT(bandwidth_gbps, 0.0);
 }
+
+namespace {
+
+struct AttentionShape {
+  int batch_size;
+  int num_heads;
+  int seq_len;
+  int head_dim;
+};
+
+// MemoryBandwidthEstimate's shape plus long sequences. Shapes past 4k take
+// minutes on small hosts, so they are opt-in via FUZZFORMER_BENCH_LONG.
+std::vector<AttentionShape> cpu_benchmark_shapes() {
+  std::vector<AttentionShape> shapes = {{2, 4, 512, 128}, {1, 2, 4096, 64}};
+  if (std::getenv("FUZZFORMER_BENCH_LONG") != nullptr) {
+    shapes.push_back({1, 1, 8192, 64});
+    shapes.push_back({1, 1, 16384, 64});
+    shapes.push_back({1, 1, 32768, 64});
+  }
+  return shapes;
+}
+
+// Mean seconds per call of fn over num_iterations, after one untimed
+// warm-up call that pays for first-touch allocation and pool start-up.
+template <typename Fn>
+double time_average(int num_iterations, Fn&& fn) {
+  fn();
+  Timer timer;
+  for (int i = 0; i < num_iterations; ++i) {
+    fn();
+  }
+  return timer.elapsed().count() / num_iterations;
+}
+
+double time_cpu_forward(const AttentionShape& shape,
+                        const FuzzyAttentionOptions& options,
+                        int num_iterations) {
+  auto tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto q = torch::randn({shape.batch_size, shape.num_heads, shape.seq_len, shape.head_dim}, tensor_options);
+  auto k = torch::randn({shape.batch_size, shape.num_heads, shape.seq_len, shape.head_dim}, tensor_options);
+  auto v = torch::randn({shape.batch_size, shape.num_heads, shape.seq_len, shape.head_dim}, tensor_options);
+  auto alpha = torch::ones({shape.num_heads}, tensor_options);
+  auto beta = torch::zeros({shape.num_heads}, tensor_options);
+
+  return time_average(num_iterations, [&] { fuzzy_attention_forward(q, k, v, alpha, beta, options); });
+}
+
+}  // namespace
+
+TEST(CpuKernelBenchmark, TiledForwardSpeedup) {
+  FuzzyAttentionOptions fused;
+  fused.forward_mode = FuzzyAttentionForwardMode::kFused;
+  FuzzyAttentionOptions tiled;
+  tiled.forward_mode = FuzzyAttentionForwardMode::kTiled;
+
+  std::cout << "\nCPU Fuzzy Attention Tiling Benchmark:\n";
+  for (const auto& shape : cpu_benchmark_shapes()) {
+    const int num_iterations = shape.seq_len <= 1024 ? 5 : 1;
+    const double fused_s = time_cpu_forward(shape, fused, num_iterations);
+    const double tiled_s = time_cpu_forward(shape, tiled, num_iterations);
+    const auto tiles = kernels::choose_cpu_tiles(shape.head_dim);
+
+    std::cout << "  Batch: " << shape.batch_size << ", Heads: " << shape.num_heads
+              << ", SeqLen: " << shape.seq_len << ", HeadDim: " << shape.head_dim
+              << ", Tiles: " << tiles.query_block << "x" << tiles.key_block << "\n";
+    std::cout << std::fixed << std::setprecision(2)
+              << "    Fused: " << fused_s * 1e3 << " ms, Tiled: " << tiled_s * 1e3
+              << " ms, Speedup: " << fused_s / tiled_s << "x\n";
+
+    EXPECT_GT(tiled_s, 0.0);
+  }
+}
+
+TEST(CpuKernelBenchmark, VarlenVersusPadded) {
+  // Mixed traffic: one 2000-token request for every three 20-token ones.
+  constexpr int kNumHeads = 4;
+  constexpr int kHeadDim = 64;
+  std::vector<int> lengths;
+  for (int i = 0; i < 16; ++i) {
+    lengths.push_back(i % 4 == 0 ? 2000 : 20);
+  }
+  const int max_len = *std::max_element(lengths.begin(), lengths.end());
+  const auto num_seqs = static_cast<int64_t>(lengths.size());
+
+  std::vector<int> offsets = {0};
+  for (int length : lengths) {
+    offsets.push_back(offsets.back() + length);
+  }
+
+  auto tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto packed_q = torch::randn({offsets.back(), kNumHeads, kHeadDim}, tensor_options);
+  auto packed_k = torch::randn({offsets.back(), kNumHeads, kHeadDim}, tensor_options);
+  auto packed_v = torch::randn({offsets.back(), kNumHeads, kHeadDim}, tensor_options);
+  auto cu_seqlens = torch::tensor(offsets, torch::TensorOptions().dtype(torch::kInt32));
+  auto padded_q = torch::randn({num_seqs, kNumHeads, max_len, kHeadDim}, tensor_options);
+  auto padded_k = torch::randn({num_seqs, kNumHeads, max_len, kHeadDim}, tensor_options);
+  auto padded_v = torch::randn({num_seqs, kNumHeads, max_len, kHeadDim}, tensor_options);
+  auto alpha = torch::ones({kNumHeads}, tensor_options);
+  auto beta = torch::zeros({kNumHeads}, tensor_options);
+
+  const int num_iterations = 3;
+  const double varlen_s = time_average(num_iterations, [&] {
+    fuzzy_attention_forward_varlen(packed_q, packed_k, packed_v, cu_seqlens, alpha, beta);
+  });
+  const double padded_s = time_average(num_iterations, [&] {
+    fuzzy_attention_forward(padded_q, padded_k, padded_v, alpha, beta);
+  });
+
+  std::cout << "\nCPU Varlen Benchmark (" << num_seqs << " sequences, " << offsets.back() << " tokens):\n";
+  std::cout << std::fixed << std::setprecision(2) << "  Padded to " << max_len << ": " << padded_s * 1e3
+            << " ms, Packed: " << varlen_s * 1e3 << " ms, Speedup: " << padded_s / varlen_s << "x\n";
+
+  EXPECT_GT(varlen_s, 0.0);
+}
+
+TEST(CpuKernelBenchmark, KeyPruningSkipRate) {
+  // Every other key block is clustered around a direction the queries share,
+  // putting its scores far from beta; the rest are unstructured.
+  constexpr int kBatch = 2;
+  constexpr int kNumHeads = 4;
+  constexpr int kSeqLen = 2048;
+  constexpr int kHeadDim = 64;
+
+  auto tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto u = torch::randn({kHeadDim}, tensor_options);
+  u = u / u.norm();
+  const double scale = std::sqrt(static_cast<double>(kHeadDim));
+  auto far = (torch::arange(kSeqLen).div(kernels::kPruneBlockKeys, "floor") % 2 == 1)
+                 .to(torch::kFloat32)
+                 .view({1, 1, -1, 1});
+  auto q = torch::randn({kBatch, kNumHeads, kSeqLen, kHeadDim}, tensor_options) * 0.3 + u * scale;
+  auto k = torch::randn({kBatch, kNumHeads, kSeqLen, kHeadDim}, tensor_options) * 0.3 + far * u * (3.0 * scale);
+  auto v = torch::randn({kBatch, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+  auto alpha = torch::full({kNumHeads}, 4.0f, tensor_options);
+  auto beta = torch::zeros({kNumHeads}, tensor_options);
+
+  metrics::MetricsCollector collector;
+  FuzzyAttentionOptions pruned;
+  pruned.prune_epsilon = 1e-6f;
+  pruned.metrics = &collector;
+
+  const int num_iterations = 3;
+  torch::Tensor expected;
+  torch::Tensor actual;
+  const double dense_s =
+      time_average(num_iterations, [&] { expected = fuzzy_attention_forward(q, k, v, alpha, beta); });
+  const double pruned_s =
+      time_average(num_iterations, [&] { actual = fuzzy_attention_forward(q, k, v, alpha, beta, pruned); });
+
+  const double skip_percent =
+      collector.counter_percent("fuzzy_attention.pruned_key_blocks", "fuzzy_attention.key_blocks");
+  std::cout << "\nCPU Key Pruning Benchmark (" << kBatch << "x" << kNumHeads << "x" << kSeqLen << "x" << kHeadDim
+            << ", epsilon " << pruned.prune_epsilon << "):\n";
+  std::cout << std::fixed << std::setprecision(2) << "  Dense: " << dense_s * 1e3 << " ms, Pruned: " << pruned_s * 1e3
+            << " ms, Skipped: " << skip_percent << "% of key blocks, Speedup: " << dense_s / pruned_s << "x\n";
+
+  EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5));
+  EXPECT_GT(skip_percent, 0.0);
+}
+
+TEST(CpuKernelBenchmark, HeadDimSpecialization) {
+  constexpr int kNumHeads = 4;
+  constexpr int kSeqLen = 2048;
+  constexpr int kNumIterations = 3;
+
+  FuzzyAttentionOptions generic;
+  generic.specialize_head_dim = false;
+  const FuzzyAttentionOptions specialized;
+
+  std::cout << "\nCPU Head Dim Specialization Benchmark (" << kernels::active_cpu_kernels().name << ", 1x"
+            << kNumHeads << "x" << kSeqLen << "):\n";
+  for (int head_dim : kernels::kSpecializedHeadDims) {
+    const AttentionShape shape = {1, kNumHeads, kSeqLen, head_dim};
+    const double generic_s = time_cpu_forward(shape, generic, kNumIterations);
+    const double specialized_s = time_cpu_forward(shape, specialized, kNumIterations);
+
+    std::cout << std::fixed << std::setprecision(2) << "  head_dim " << std::setw(3) << head_dim
+              << ": Generic: " << generic_s * 1e3 << " ms, Specialized: " << specialized_s * 1e3
+              << " ms, Speedup: " << generic_s / specialized_s << "x\n";
+    EXPECT_GT(specialized_s, 0.0);
+  }
+}
+
+TEST(CpuKernelBenchmark, IncrementalDecode) {
+  constexpr int64_t kPromptLen = 192;
+  constexpr int64_t kDecodeLen = 64;
+
+  ModelConfig config;
+  config.num_layers = 2;
+  auto model = FuzzFormer(config);
+  model->eval();
+  torch::NoGradGuard no_grad;
+  auto tokens = torch::randn({1, kPromptLen + kDecodeLen, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask causal;
+  causal.causal = true;
+
+  // Without a cache every new token reruns the model over its whole prefix.
+  Timer timer;
+  torch::Tensor recomputed;
+  for (int64_t length = kPromptLen + 1; length <= kPromptLen + kDecodeLen; ++length) {
+    recomputed = model->forward(tokens.slice(1, 0, length), causal).slice(1, length - 1);
+  }
+  const double recompute_s = timer.elapsed().count();
+
+  KVCache cache(config, 1, kPromptLen + kDecodeLen);
+  model->step(tokens.slice(1, 0, kPromptLen), cache);
+  timer.reset();
+  torch::Tensor stepped;
+  for (int64_t position = kPromptLen; position < kPromptLen + kDecodeLen; ++position) {
+    stepped = model->step(tokens.slice(1, position, position + 1), cache);
+  }
+  const double step_s = timer.elapsed().count();
+
+  std::cout << "\nIncremental Decode Benchmark (" << kDecodeLen << " tokens after a " << kPromptLen
+            << "-token prompt):\n";
+  std::cout << std::fixed << std::setprecision(2) << "  Recompute: " << recompute_s * 1e3 / kDecodeLen
+            << " ms/token, KV cache step: " << step_s * 1e3 / kDecodeLen
+            << " ms/token, Speedup: " << recompute_s / step_s << "x\n";
+  EXPECT_TRUE(torch::allclose(stepped, recomputed, 1e-4, 1e-5));
+}
+
+TEST(CpuKernelBenchmark, SplitKDecode) {
+  constexpr int kRepeats = 20;
+
+  // One new token for 8 heads of a single sequence: 8 row tasks.
+  auto q = torch::randn({1, 8, 1, 64});
+  auto alpha = torch::ones({8});
+  auto beta = torch::zeros({8});
+
+  std::cout << "\nSplit-K Decode Benchmark (1 query x 8 heads, " << runtime::ThreadPool::global().size()
+            << " threads):\n";
+  for (int64_t num_keys : {1024, 16384}) {
+    auto k = torch::randn({1, 8, num_keys, 64});
+    auto v = torch::randn({1, 8, num_keys, 64});
+    FuzzyAttentionOptions unsplit;
+    unsplit.key_splits = 1;
+    FuzzyAttentionOptions automatic;
+
+    torch::Tensor expected;
+    torch::Tensor actual;
+    Timer timer;
+    for (int i = 0; i < kRepeats; ++i) {
+      expected = fuzzy_attention_forward_cached(q, k, v, alpha, beta, unsplit);
+    }
+    const double unsplit_ms = timer.elapsed().count() * 1e3 / kRepeats;
+    timer.reset();
+    for (int i = 0; i < kRepeats; ++i) {
+      actual = fuzzy_attention_forward_cached(q, k, v, alpha, beta, automatic);
+    }
+    const double split_ms = timer.elapsed().count() * 1e3 / kRepeats;
+
+    std::cout << std::fixed << std::setprecision(3) << "  keys=" << num_keys << ": rows " << unsplit_ms
+              << " ms, split-K " << split_ms << " ms, Speedup: " << unsplit_ms / split_ms << "x\n";
+    EXPECT_TRUE(torch::allclose(actual, expected, 1e-5, 1e-6));
+  }
+}
+
+TEST(CpuKernelBenchmark, LinearApproximationError) {
+  // Error and speed of the polynomial forward against the exact kernel as the
+  // context grows; the linear cost overtakes the quadratic one once the
+  // sequence is longer than about head_dim^order.
+  constexpr int kNumHeads = 2;
+  constexpr int kHeadDim = 16;
+  constexpr int kNumIterations = 3;
+  auto tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto alpha = torch::ones({kNumHeads}, tensor_options);
+  auto beta = torch::zeros({kNumHeads}, tensor_options);
+  FuzzyAttentionMask causal;
+  causal.causal = true;
+
+  std::cout << "\nCPU Linearised Fuzzy Attention Benchmark (causal, " << kNumHeads << " heads, head_dim "
+            << kHeadDim << "):\n";
+  for (int64_t seq_len : {2048, 8192}) {
+    auto q = torch::randn({1, kNumHeads, seq_len, kHeadDim}, tensor_options);
+    auto k = torch::randn({1, kNumHeads, seq_len, kHeadDim}, tensor_options);
+    auto v = torch::randn({1, kNumHeads, seq_len, kHeadDim}, tensor_options);
+
+    torch::Tensor expected;
+    const double exact_s = time_average(
+        kNumIterations, [&] { expected = fuzzy_attention_forward(q, k, v, alpha, beta, {}, causal); });
+    std::cout << "  seq_len " << seq_len << std::fixed << std::setprecision(2) << ": Exact: " << exact_s * 1e3
+              << " ms\n";
+
+    for (int order = 1; order <= 3; ++order) {
+      torch::Tensor actual;
+      const double linear_s = time_average(kNumIterations, [&] {
+        actual = fuzzy_attention_forward_linear(q, k, v, alpha, beta, {order}, {}, causal);
+      });
+      auto error = (actual - expected).abs();
+      const double max_error = error.max().item<double>();
+      const double mean_error = error.mean().item<double>();
+
+      std::cout << std::fixed << std::setprecision(2) << "    order " << order << ": " << linear_s * 1e3
+                << " ms, Speedup: " << exact_s / linear_s << "x, " << std::scientific << std::setprecision(2)
+                << "max |err| " << max_error << ", mean |err| " << mean_error << "\n";
+      EXPECT_TRUE(std::isfinite(max_error));
+      EXPECT_LT(mean_error, 0.1);
+    }
+  }
+}
+
+TEST(CpuKernelBenchmark, MembershipThroughput) {
+  // Forward and backward time of each membership at the same sharpness. The
+  // compact ones trade the exp for a clamp or a table read and skip keys,
+  // and whole key blocks, outside their support.
+  constexpr int kNumHeads = 4;
+  constexpr int kSeqLen = 1024;
+  constexpr int kHeadDim = 64;
+  constexpr int kNumIterations = 3;
+  auto tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto q = torch::randn({1, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+  auto k = torch::randn({1, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+  auto v = torch::randn({1, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+  auto grad_out = torch::randn({1, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+  auto alpha = torch::full({kNumHeads}, 4.0f, tensor_options);
+  auto beta = torch::zeros({kNumHeads}, tensor_options);
+
+  std::cout << "\nCPU Membership Benchmark (1x" << kNumHeads << "x" << kSeqLen << "x" << kHeadDim
+            << ", alpha 4):\n";
+  double gaussian_forward_s = 0.0;
+  double gaussian_backward_s = 0.0;
+  for (const auto membership : {FuzzyMembership::kGaussian, FuzzyMembership::kTriangular,
+                                FuzzyMembership::kTrapezoidal, FuzzyMembership::kGaussianTable}) {
+    metrics::MetricsCollector collector;
+    FuzzyAttentionOptions options;
+    options.membership = membership;
+    options.metrics = &collector;
+
+    FuzzyAttentionContext context;
+    std::vector<torch::Tensor> grads;
+    const double forward_s = time_average(kNumIterations, [&] {
+      context = fuzzy_attention_forward_with_context(q, k, v, alpha, beta, options);
+    });
+    const double backward_s =
+        time_average(kNumIterations, [&] { grads = fuzzy_attention_backward(grad_out, context, options); });
+    if (membership == FuzzyMembership::kGaussian) {
+      gaussian_forward_s = forward_s;
+      gaussian_backward_s = backward_s;
+    }
+
+    static const char* const kNames[] = {"gaussian", "triangular", "trapezoidal", "table"};
+    std::cout << std::fixed << std::setprecision(2) << "  " << std::setw(11) << kNames[static_cast<int>(membership)]
+              << ": forward " << forward_s * 1e3 << " ms (" << gaussian_forward_s / forward_s << "x), backward "
+              << backward_s * 1e3 << " ms (" << gaussian_backward_s / backward_s << "x), pruned blocks "
+              << collector.counter_percent("fuzzy_attention.pruned_key_blocks", "fuzzy_attention.key_blocks")
+              << "%\n";
+    EXPECT_TRUE(torch::isfinite(context.output).all().item<bool>());
+    EXPECT_TRUE(torch::isfinite(grads[0]).all().item<bool>());
+  }
+}
+
+TEST(CpuKernelBenchmark, ParameterSweep) {
+  // P candidate (alpha, beta) settings as P separate forwards and as one
+  // sweep, which computes the scores once for all of them.
+  constexpr int kNumHeads = 8;
+  constexpr int kSeqLen = 1024;
+  constexpr int kHeadDim = 64;
+  constexpr int kNumIterations = 3;
+  auto tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto q = torch::randn({1, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+  auto k = torch::randn({1, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+  auto v = torch::randn({1, kNumHeads, kSeqLen, kHeadDim}, tensor_options);
+
+  std::cout << "\nCPU Parameter Sweep Benchmark (1x" << kNumHeads << "x" << kSeqLen << "x" << kHeadDim << "):\n";
+  for (int64_t num_params : {4, 16}) {
+    auto alpha = torch::rand({num_params, kNumHeads}, tensor_options) + 0.5;
+    auto beta = torch::randn({num_params, kNumHeads}, tensor_options) * 0.1;
+
+    std::vector<torch::Tensor> separate;
+    const double separate_s = time_average(kNumIterations, [&] {
+      separate.clear();
+      for (int64_t p = 0; p < num_params; ++p) {
+        separate.push_back(fuzzy_attention_forward(q, k, v, alpha[p], beta[p]));
+      }
+    });
+    torch::Tensor swept;
+    const double sweep_s =
+        time_average(kNumIterations, [&] { swept = fuzzy_attention_forward_sweep(q, k, v, alpha, beta); });
+
+    std::cout << std::fixed << std::setprecision(2) << "  P=" << std::setw(2) << num_params
+              << ": Separate: " << separate_s * 1e3 << " ms, Sweep: " << sweep_s * 1e3
+              << " ms, Speedup: " << separate_s / sweep_s << "x\n";
+    EXPECT_TRUE(torch::allclose(swept, torch::stack(separate), 1e-5, 1e-6));
+  }
+}
+
+TEST(CpuKernelBenchmark, HalfStorage) {
+  // Tiled forward over float32, float16 and bfloat16 operands. The 16-bit
+  // ones halve the bytes read per key tile; the arithmetic is float32 in all
+  // three, so the gain shows once the K/V stream outgrows the caches.
+  constexpr int kNumHeads = 8;
+  constexpr int kHeadDim = 64;
+  auto tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto alpha = torch::full({kNumHeads}, 0.5f, tensor_options);
+  auto beta = torch::zeros({kNumHeads}, tensor_options);
+  FuzzyAttentionMask causal;
+  causal.causal = true;
+
+  std::cout << "\nCPU Half Storage Benchmark (causal, " << kNumHeads << " heads, head_dim " << kHeadDim << "):\n";
+  for (int64_t seq_len : {2048, 4096}) {
+    auto q = torch::randn({1, kNumHeads, seq_len, kHeadDim}, tensor_options);
+    auto k = torch::randn({1, kNumHeads, seq_len, kHeadDim}, tensor_options);
+    auto v = torch::randn({1, kNumHeads, seq_len, kHeadDim}, tensor_options);
+
+    Timer timer;
+    auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, {}, causal);
+    const double float_s = timer.elapsed().count();
+    std::cout << std::fixed << std::setprecision(2) << "  T=" << seq_len << ": float32 " << float_s * 1e3 << " ms";
+    for (const auto dtype : {torch::kHalf, torch::kBFloat16}) {
+      auto q16 = q.to(dtype);
+      auto k16 = k.to(dtype);
+      auto v16 = v.to(dtype);
+      timer.reset();
+      auto output = fuzzy_attention_forward(q16, k16, v16, alpha, beta, {}, causal);
+      const double half_s = timer.elapsed().count();
+      const double max_error = (output.to(torch::kFloat32) - expected).abs().max().item<double>();
+      std::cout << ", " << (dtype == torch::kHalf ? "float16 " : "bfloat16 ") << half_s * 1e3 << " ms ("
+                << float_s / half_s << "x, max |err| " << std::scientific << std::setprecision(1) << max_error
+                << std::fixed << std::setprecision(2) << ")";
+      EXPECT_LT(max_error, dtype == torch::kHalf ? 0.05 : 0.2);
+    }
+    std::cout << "\n";
+  }
+}
+
+TEST(CpuKernelBenchmark, Int8WeightDecode) {
+  // Batch-1 decode of a float model and of its int8-weight conversion. Each
+  // step reads every projection weight once, so the converted model streams
+  // a quarter of the weight bytes. A prefill, which hands its projections to
+  // a float GEMM over dequantised weights, is timed alongside. Both models
+  // are warmed up before they are timed.
+  constexpr int64_t kPromptLen = 32;
+  constexpr int64_t kDecodeLen = 32;
+  constexpr int64_t kPrefillLen = 256;
+  constexpr int kNumIterations = 3;
+
+  ModelConfig config;
+  config.model_dim = 1024;
+  config.num_heads = 16;
+  config.num_layers = 4;
+  auto model = FuzzFormer(config);
+  model->eval();
+  torch::NoGradGuard no_grad;
+  auto tokens = torch::randn({1, kPromptLen + kDecodeLen, static_cast<long>(config.model_dim)});
+  auto prompt = torch::randn({1, kPrefillLen, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask causal;
+  causal.causal = true;
+
+  auto weight_bytes = [&] {
+    int64_t bytes = 0;
+    for (const auto& tensor : model->parameters()) {
+      bytes += static_cast<int64_t>(tensor.nbytes());
+    }
+    for (const auto& tensor : model->buffers()) {
+      bytes += static_cast<int64_t>(tensor.nbytes());
+    }
+    return bytes;
+  };
+  // Decodes kDecodeLen tokens after the prompt, timing only the steps.
+  auto decode = [&](double& seconds) {
+    KVCache cache(config, 1, kPromptLen + kDecodeLen);
+    model->step(tokens.slice(1, 0, kPromptLen), cache);
+    std::vector<torch::Tensor> outputs;
+    Timer timer;
+    for (int64_t position = kPromptLen; position < kPromptLen + kDecodeLen; ++position) {
+      outputs.push_back(model->step(tokens.slice(1, position, position + 1), cache));
+    }
+    seconds = timer.elapsed().count();
+    return torch::cat(outputs, 1);
+  };
+  struct Measurement {
+    torch::Tensor output;
+    double decode_s = 0.0;
+    double prefill_s = 0.0;
+  };
+  auto measure = [&] {
+    Measurement result;
+    double seconds = 0.0;
+    result.output = decode(seconds);
+    for (int i = 0; i < kNumIterations; ++i) {
+      decode(seconds);
+      result.decode_s += seconds / kNumIterations;
+    }
+    result.prefill_s = time_average(kNumIterations, [&] { model->forward(prompt, causal); });
+    return result;
+  };
+
+  const auto float_bytes = weight_bytes();
+  const auto expected = measure();
+  model->quantize_weights();
+  const auto int8_bytes = weight_bytes();
+  const auto quantized = measure();
+  const double error = ((quantized.output - expected.output).norm() / expected.output.norm()).item<double>();
+
+  std::cout << "\nInt8 Weight Decode Benchmark (model_dim " << config.model_dim << ", " << config.num_layers
+            << " layers, " << kDecodeLen << " decode tokens, " << kPrefillLen << " prefill tokens):\n";
+  std::cout << std::fixed << std::setprecision(2) << "  float32: " << float_bytes / 1e6 << " MB, "
+            << expected.decode_s * 1e3 / kDecodeLen << " ms/token, prefill " << expected.prefill_s * 1e3
+            << " ms\n  int8:    " << int8_bytes / 1e6 << " MB, " << quantized.decode_s * 1e3 / kDecodeLen
+            << " ms/token (" << expected.decode_s / quantized.decode_s << "x), prefill "
+            << quantized.prefill_s * 1e3 << " ms (" << expected.prefill_s / quantized.prefill_s
+            << "x), relative error " << std::scientific << std::setprecision(1) << error << std::fixed << "\n";
+  EXPECT_LT(error, 5e-2);
+}
 #else
 TEST_F(KernelBenchmark, Placeholder) {
   GTEST_SKIP() << "libtorch not available for benchmarking";
 }
 #endif
 
+TEST(CpuKernelBenchmark, SimdMicrokernels) {
+  constexpr int kKeys = 256;
+  constexpr int kRepeats = 2000;
+
+  std::mt19937 rng(42);
+  std::normal_distribution<float> dist;
+
+  std::cout << "\nCPU Microkernel Benchmark (" << kKeys << " keys per call):\n";
+  for (const auto isa : {kernels::CpuIsa::kScalar, kernels::CpuIsa::kAvx2, kernels::CpuIsa::kAvx512,
+                         kernels::CpuIsa::kAvx512Vnni, kernels::CpuIsa::kAvx512Bf16}) {
+    const auto* table = kernels::cpu_kernel_table(isa);
+    if (table == nullptr) {
+      std::cout << "  " << kernels::to_string(isa) << ": unavailable\n";
+      continue;
+    }
+
+    for (int head_dim : {64, 128}) {
+      std::vector<float> q(head_dim);
+      std::vector<float> keys(static_cast<std::size_t>(kKeys) * head_dim);
+      std::vector<float> scores(kKeys);
+      std::vector<float> memberships(kKeys);
+      std::vector<float> out(head_dim, 0.0f);
+      for (auto& x : q) x = dist(rng);
+      for (auto& x : keys) x = dist(rng);
+
+      float sink = 0.0f;
+      Timer timer;
+      for (int r = 0; r < kRepeats; ++r) {
+        for (int j = 0; j < kKeys; ++j) {
+          scores[j] = table->dot(q.data(), keys.data() + j * head_dim, head_dim);
+        }
+      }
+      const double dot_s = timer.elapsed().count();
+
+      timer.reset();
+      for (int r = 0; r < kRepeats; ++r) {
+        sink += table->membership(scores.data(), kKeys, 0.5f, 0.1f, memberships.data());
+      }
+      const double membership_s = timer.elapsed().count();
+
+      timer.reset();
+      for (int r = 0; r < kRepeats; ++r) {
+        sink += table->membership_lookup(scores.data(), kKeys, 0.5f, 0.1f, memberships.data());
+      }
+      const double lookup_s = timer.elapsed().count();
+
+      timer.reset();
+      for (int r = 0; r < kRepeats; ++r) {
+        for (int j = 0; j < kKeys; ++j) {
+          table->axpy(1e-6f, keys.data() + j * head_dim, out.data(), head_dim);
+        }
+      }
+      const double axpy_s = timer.elapsed().count();
+
+      std::vector<std::int8_t> q8(head_dim);
+      std::vector<std::int8_t> keys8(keys.size());
+      std::vector<float> key_scales(kKeys);
+      std::vector<std::int32_t> key_sums(kKeys);
+      std::int32_t q_sum = 0;
+      const float q_scale = table->quantize_int8(q.data(), head_dim, q8.data(), &q_sum);
+      for (int j = 0; j < kKeys; ++j) {
+        key_scales[j] = table->quantize_int8(keys.data() + j * head_dim, head_dim, keys8.data() + j * head_dim,
+                                             &key_sums[j]);
+      }
+      timer.reset();
+      for (int r = 0; r < kRepeats; ++r) {
+        table->quantized_scores(q8.data(), q_scale, keys8.data(), key_scales.data(), key_sums.data(), kKeys,
+                                head_dim, scores.data());
+        sink += scores[r % kKeys];
+      }
+      const double int8_s = timer.elapsed().count();
+
+      const double calls = static_cast<double>(kRepeats) * kKeys;
+      const double flops = 2.0 * calls * head_dim;
+      std::cout << "  " << std::setw(10) << table->name << " d=" << std::setw(3) << head_dim
+                << std::fixed << std::setprecision(2)
+                << "  dot: " << flops / dot_s / 1e9 << " GFLOP/s"
+                << "  membership: " << calls / membership_s / 1e6 << " Mkeys/s"
+                << "  lookup: " << calls / lookup_s / 1e6 << " Mkeys/s (" << membership_s / lookup_s << "x)"
+                << "  axpy: " << flops / axpy_s / 1e9 << " GFLOP/s"
+                << "  int8 scores: " << calls / int8_s / 1e6 << " Mkeys/s\n";
+      EXPECT_GT(sink + out[0], -1e30f);
+    }
+  }
+}
+
 }  // namespace fuzzformer
 
@@ -2,10 +2,14 @@
 
 #include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <stdexcept>
 #include <thread>
+#include <vector>
 
 #include "fuzzformer/asyncScheduler.h"
 #include "fuzzformer/eventLoop.h"
+#include "fuzzformer/threadPool.h"
 
 namespace fuzzformer {
 namespace runtime {
@@ -53,6 +57,42 @@ TEST(AsyncSchedulerTest, HandlesMultipleTasks) {
   EXPECT_EQ(counter.load(), 5);
 }
 
+TEST(ThreadPoolTest, ParallelForCoversRangeOnce) {
+  ThreadPool pool(4);
+  std::vector<std::atomic<int>> hits(1000);
+
+  pool.parallel_for(0, 1000, 7, [&hits](std::int64_t begin, std::int64_t end) {
+    for (auto i = begin; i < end; ++i) {
+      hits[i]++;
+    }
+  });
+
+  for (const auto& hit : hits) {
+    EXPECT_EQ(hit.load(), 1);
+  }
+}
+
+TEST(ThreadPoolTest, NestedCallsRunInline) {
+  ThreadPool pool(3);
+  std::atomic<int> counter{0};
+
+  pool.run(4, [&](std::size_t) {
+    pool.run(5, [&counter](std::size_t) { counter++; });
+  });
+
+  EXPECT_EQ(counter.load(), 20);
+}
+
+TEST(ThreadPoolTest, PropagatesTaskExceptions) {
+  ThreadPool pool(2);
+  EXPECT_THROW(pool.run(8, [](std::size_t i) {
+    if (i == 5) {
+      throw std::runtime_error("task failed");
+    }
+  }),
+               std::runtime_error);
+}
+
 }  // namespace runtime
 }  // namespace fuzzformer
 
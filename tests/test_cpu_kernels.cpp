@@ -0,0 +1,378 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "fuzzformer/cpuKernels.h"
+#include "fuzzformer/membership.h"
+#include "fuzzformer/quantizedLinearCpu.h"
+#include "fuzzformer/storageType.h"
+
+namespace fuzzformer {
+namespace kernels {
+
+namespace {
+
+std::vector<const CpuKernelTable*> available_tables() {
+  std::vector<const CpuKernelTable*> tables;
+  for (const auto isa : {CpuIsa::kScalar, CpuIsa::kAvx2, CpuIsa::kAvx512, CpuIsa::kAvx512Vnni, CpuIsa::kAvx512Bf16}) {
+    if (const auto* table = cpu_kernel_table(isa)) {
+      tables.push_back(table);
+    }
+  }
+  return tables;
+}
+
+std::vector<float> random_vector(int size, std::mt19937& rng, float scale = 1.0f) {
+  std::normal_distribution<float> dist(0.0f, scale);
+  std::vector<float> values(size);
+  for (auto& value : values) {
+    value = dist(rng);
+  }
+  return values;
+}
+
+}  // namespace
+
+TEST(CpuKernelsTest, ScalarTableAlwaysAvailable) {
+  ASSERT_NE(cpu_kernel_table(CpuIsa::kScalar), nullptr);
+  EXPECT_NE(cpu_kernel_table(detect_cpu_isa()), nullptr);
+  EXPECT_TRUE(set_cpu_isa(CpuIsa::kScalar));
+  EXPECT_EQ(active_cpu_kernels().isa, CpuIsa::kScalar);
+  EXPECT_TRUE(set_cpu_isa(detect_cpu_isa()));
+}
+
+TEST(CpuKernelsTest, DotMatchesScalarForAllLengths) {
+  std::mt19937 rng(7);
+  for (const auto* table : available_tables()) {
+    for (int n : {1, 7, 8, 15, 16, 31, 32, 33, 64, 96, 127, 128, 256}) {
+      const auto a = random_vector(n, rng);
+      const auto b = random_vector(n, rng);
+      double expected = 0.0;
+      for (int i = 0; i < n; ++i) {
+        expected += static_cast<double>(a[i]) * b[i];
+      }
+      EXPECT_NEAR(table->dot(a.data(), b.data(), n), expected, 1e-4 * std::sqrt(n))
+          << table->name << " n=" << n;
+    }
+  }
+}
+
+TEST(CpuKernelsTest, MembershipMatchesExp) {
+  std::mt19937 rng(11);
+  for (const auto* table : available_tables()) {
+    for (int count : {1, 5, 8, 13, 16, 17, 64, 100}) {
+      const auto scores = random_vector(count, rng, 4.0f);
+      std::vector<float> out(count, -1.0f);
+      const float alpha = 1.7f;
+      const float beta = 0.25f;
+
+      const float sum = table->membership(scores.data(), count, alpha, beta, out.data());
+
+      double expected_sum = 0.0;
+      for (int i = 0; i < count; ++i) {
+        const double diff = scores[i] - beta;
+        const double exponent = -alpha * diff * diff;
+        const double expected = std::exp(exponent);
+        // Float rounding of the exponent itself is amplified by |exponent|.
+        const double tolerance = expected * (2e-6 + 2e-7 * std::abs(exponent)) + 1e-37;
+        EXPECT_NEAR(out[i], expected, tolerance) << table->name << " i=" << i;
+        expected_sum += expected;
+      }
+      EXPECT_NEAR(sum, expected_sum, 1e-5 * expected_sum) << table->name << " count=" << count;
+    }
+  }
+}
+
+TEST(CpuKernelsTest, MembershipUnderflowsToZero) {
+  for (const auto* table : available_tables()) {
+    const std::vector<float> scores = {100.0f, -100.0f, 0.0f};
+    std::vector<float> out(scores.size());
+    table->membership(scores.data(), static_cast<int>(scores.size()), 50.0f, 0.0f, out.data());
+    EXPECT_EQ(out[0], 0.0f) << table->name;
+    EXPECT_EQ(out[1], 0.0f) << table->name;
+    EXPECT_FLOAT_EQ(out[2], 1.0f) << table->name;
+  }
+}
+
+TEST(CpuKernelsTest, CompactMembershipsMatchFunctors) {
+  std::mt19937 rng(13);
+  for (const auto* table : available_tables()) {
+    for (int count : {1, 5, 8, 13, 16, 17, 64, 100}) {
+      const auto scores = random_vector(count, rng, 2.0f);
+      std::vector<float> triangle(count, -1.0f);
+      std::vector<float> trapezoid(count, -1.0f);
+      const float alpha = 0.8f;
+      const float beta = 0.25f;
+
+      const float triangle_sum = table->membership_triangular(scores.data(), count, alpha, beta, triangle.data());
+      const float trapezoid_sum = table->membership_trapezoidal(scores.data(), count, alpha, beta, trapezoid.data());
+
+      double expected_triangle_sum = 0.0;
+      double expected_trapezoid_sum = 0.0;
+      for (int i = 0; i < count; ++i) {
+        const float expected_triangle = TriangularMembership::value(scores[i] - beta, alpha);
+        const float expected_trapezoid = TrapezoidalMembership::value(scores[i] - beta, alpha);
+        EXPECT_NEAR(triangle[i], expected_triangle, 1e-6f) << table->name << " i=" << i;
+        EXPECT_NEAR(trapezoid[i], expected_trapezoid, 1e-6f) << table->name << " i=" << i;
+        // Outside the support both are exactly zero.
+        if (expected_triangle == 0.0f) {
+          EXPECT_EQ(triangle[i], 0.0f) << table->name << " i=" << i;
+        }
+        expected_triangle_sum += expected_triangle;
+        expected_trapezoid_sum += expected_trapezoid;
+      }
+      EXPECT_NEAR(triangle_sum, expected_triangle_sum, 1e-5 * count) << table->name << " count=" << count;
+      EXPECT_NEAR(trapezoid_sum, expected_trapezoid_sum, 1e-5 * count) << table->name << " count=" << count;
+    }
+  }
+}
+
+TEST(CpuKernelsTest, AxpyMatchesScalar) {
+  std::mt19937 rng(3);
+  for (const auto* table : available_tables()) {
+    for (int n : {1, 9, 16, 24, 33, 128}) {
+      const auto x = random_vector(n, rng);
+      auto y = random_vector(n, rng);
+      auto expected = y;
+      for (int i = 0; i < n; ++i) {
+        expected[i] += 0.75f * x[i];
+      }
+      table->axpy(0.75f, x.data(), y.data(), n);
+      for (int i = 0; i < n; ++i) {
+        EXPECT_NEAR(y[i], expected[i], 1e-6f) << table->name << " n=" << n;
+      }
+    }
+  }
+}
+
+TEST(CpuKernelsTest, SpecializedTileKernelsMatchGeneric) {
+  std::mt19937 rng(5);
+  for (const auto* table : available_tables()) {
+    EXPECT_EQ(&select_tile_kernels(*table, 48), &table->generic_tiles) << table->name;
+    for (int head_dim : kSpecializedHeadDims) {
+      const auto& specialized = select_tile_kernels(*table, head_dim);
+      ASSERT_EQ(specialized.head_dim, head_dim) << table->name;
+      // Key counts around the eight-key blocking of the SIMD score kernels.
+      for (int num_keys : {1, 7, 8, 9, 23, 64}) {
+        const auto q = random_vector(head_dim, rng);
+        const auto keys = random_vector(num_keys * head_dim, rng);
+        const auto values = random_vector(num_keys * head_dim, rng);
+        const auto weights = random_vector(num_keys, rng);
+        std::vector<float> expected_scores(num_keys);
+        std::vector<float> actual_scores(num_keys);
+        auto expected_out = random_vector(head_dim, rng);
+        auto actual_out = expected_out;
+
+        table->generic_tiles.scores(q.data(), keys.data(), num_keys, head_dim, 0.5f, expected_scores.data());
+        specialized.scores(q.data(), keys.data(), num_keys, head_dim, 0.5f, actual_scores.data());
+        table->generic_tiles.accumulate(weights.data(), values.data(), num_keys, head_dim, expected_out.data());
+        specialized.accumulate(weights.data(), values.data(), num_keys, head_dim, actual_out.data());
+
+        for (int j = 0; j < num_keys; ++j) {
+          EXPECT_NEAR(actual_scores[j], expected_scores[j], 1e-4f * std::sqrt(head_dim))
+              << table->name << " head_dim=" << head_dim << " j=" << j;
+        }
+        for (int d = 0; d < head_dim; ++d) {
+          EXPECT_NEAR(actual_out[d], expected_out[d], 1e-5f)
+              << table->name << " head_dim=" << head_dim << " d=" << d;
+        }
+      }
+    }
+  }
+}
+
+TEST(CpuKernelsTest, StorageConversionsRoundToNearestEven) {
+  EXPECT_EQ(float_to_half(1.0f), 0x3c00);
+  EXPECT_EQ(float_to_half(-2.5f), 0xc100);
+  EXPECT_EQ(float_to_half(65504.0f), 0x7bff);
+  EXPECT_EQ(float_to_half(65520.0f), 0x7c00);
+  EXPECT_EQ(float_to_half(std::ldexp(1.0f, -24)), 0x0001);
+  EXPECT_EQ(float_to_half(std::ldexp(1.0f, -26)), 0x0000);
+  EXPECT_EQ(float_to_bfloat16(1.0f), 0x3f80);
+  EXPECT_EQ(float_to_bfloat16(std::bit_cast<float>(0x3f808000u)), 0x3f80);
+  EXPECT_EQ(float_to_bfloat16(std::bit_cast<float>(0x3f818000u)), 0x3f82);
+  EXPECT_TRUE(std::isnan(half_to_float(float_to_half(std::nanf("")))));
+  EXPECT_TRUE(std::isnan(bfloat16_to_float(float_to_bfloat16(std::nanf("")))));
+}
+
+TEST(CpuKernelsTest, StorageConversionsMatchScalar) {
+  std::vector<std::uint16_t> patterns(1 << 16);
+  for (std::size_t i = 0; i < patterns.size(); ++i) {
+    patterns[i] = static_cast<std::uint16_t>(i);
+  }
+  // Every exponent the 16-bit types reach, and some past the half range.
+  std::mt19937 rng(13);
+  std::uniform_int_distribution<int> exponent(-30, 20);
+  auto floats = random_vector(4099, rng);
+  for (auto& value : floats) {
+    value = std::ldexp(value, exponent(rng));
+  }
+  // Zeros, float subnormals (bfloat16 keeps them) and non-finite values.
+  for (const float special : {0.0f, -0.0f, 1e-39f, -3e-41f, 1.1754942e-38f, INFINITY, -INFINITY, NAN}) {
+    floats[rng() % floats.size()] = special;
+  }
+
+  for (const auto* table : available_tables()) {
+    std::vector<float> wide(patterns.size());
+    table->widen_half(patterns.data(), static_cast<int>(patterns.size()), wide.data());
+    for (std::size_t i = 0; i < patterns.size(); ++i) {
+      ASSERT_EQ(std::bit_cast<std::uint32_t>(wide[i]), std::bit_cast<std::uint32_t>(half_to_float(patterns[i])))
+          << table->name << " half " << i;
+    }
+    table->widen_bfloat16(patterns.data(), static_cast<int>(patterns.size()), wide.data());
+    for (std::size_t i = 0; i < patterns.size(); ++i) {
+      ASSERT_EQ(std::bit_cast<std::uint32_t>(wide[i]), std::bit_cast<std::uint32_t>(bfloat16_to_float(patterns[i])))
+          << table->name << " bfloat16 " << i;
+    }
+
+    std::vector<std::uint16_t> narrow(floats.size());
+    table->narrow_half(floats.data(), static_cast<int>(floats.size()), narrow.data());
+    for (std::size_t i = 0; i < floats.size(); ++i) {
+      ASSERT_EQ(narrow[i], float_to_half(floats[i])) << table->name << " " << floats[i];
+    }
+    table->narrow_bfloat16(floats.data(), static_cast<int>(floats.size()), narrow.data());
+    for (std::size_t i = 0; i < floats.size(); ++i) {
+      ASSERT_EQ(narrow[i], float_to_bfloat16(floats[i])) << table->name << " " << floats[i];
+    }
+  }
+}
+
+TEST(CpuKernelsTest, QuantizeInt8MatchesScalar) {
+  std::mt19937 rng(17);
+  const auto& scalar = *cpu_kernel_table(CpuIsa::kScalar);
+  for (const auto* table : available_tables()) {
+    for (int n : {1, 7, 8, 16, 17, 33, 64, 100, 128}) {
+      const auto row = random_vector(n, rng, 3.0f);
+      std::vector<std::int8_t> expected(n);
+      std::vector<std::int8_t> actual(n);
+      std::int32_t expected_sum = 0;
+      std::int32_t actual_sum = 0;
+      const float expected_scale = scalar.quantize_int8(row.data(), n, expected.data(), &expected_sum);
+      const float scale = table->quantize_int8(row.data(), n, actual.data(), &actual_sum);
+
+      EXPECT_EQ(scale, expected_scale) << table->name << " n=" << n;
+      EXPECT_EQ(actual, expected) << table->name << " n=" << n;
+      EXPECT_EQ(actual_sum, expected_sum) << table->name << " n=" << n;
+      std::int32_t sum = 0;
+      for (int i = 0; i < n; ++i) {
+        EXPECT_NEAR(actual[i] * scale, row[i], 0.5f * scale * (1.0f + 1e-5f)) << table->name << " i=" << i;
+        sum += actual[i];
+      }
+      EXPECT_EQ(actual_sum, sum) << table->name << " n=" << n;
+    }
+
+    const std::vector<float> zeros(19, 0.0f);
+    std::vector<std::int8_t> out(zeros.size(), 1);
+    std::int32_t sum = 1;
+    EXPECT_EQ(table->quantize_int8(zeros.data(), static_cast<int>(zeros.size()), out.data(), &sum), 0.0f);
+    EXPECT_EQ(sum, 0) << table->name;
+    EXPECT_TRUE(std::all_of(out.begin(), out.end(), [](std::int8_t x) { return x == 0; })) << table->name;
+  }
+}
+
+TEST(CpuKernelsTest, QuantizedScoresAreExact) {
+  std::mt19937 rng(19);
+  std::uniform_int_distribution<int> byte(-127, 127);
+  for (const auto* table : available_tables()) {
+    // Head dims around the 16- and 64-byte steps of the SIMD loops, and key
+    // counts around their four-key blocking.
+    for (int head_dim : {5, 16, 31, 64, 80, 128}) {
+      for (int num_keys : {1, 3, 4, 9}) {
+        std::vector<std::int8_t> q(head_dim);
+        std::vector<std::int8_t> keys(static_cast<std::size_t>(num_keys) * head_dim);
+        for (auto& x : q) {
+          x = static_cast<std::int8_t>(byte(rng));
+        }
+        for (auto& x : keys) {
+          x = static_cast<std::int8_t>(byte(rng));
+        }
+        const auto key_scales = random_vector(num_keys, rng);
+        std::vector<std::int32_t> key_sums(num_keys, 0);
+        std::vector<std::int32_t> dots(num_keys, 0);
+        for (int j = 0; j < num_keys; ++j) {
+          for (int d = 0; d < head_dim; ++d) {
+            key_sums[j] += keys[j * head_dim + d];
+            dots[j] += q[d] * keys[j * head_dim + d];
+          }
+        }
+
+        std::vector<float> scores(num_keys);
+        table->quantized_scores(q.data(), 0.25f, keys.data(), key_scales.data(), key_sums.data(), num_keys, head_dim,
+                                scores.data());
+        for (int j = 0; j < num_keys; ++j) {
+          EXPECT_EQ(scores[j], static_cast<float>(dots[j]) * 0.25f * key_scales[j])
+              << table->name << " head_dim=" << head_dim << " j=" << j;
+        }
+      }
+    }
+  }
+}
+
+TEST(CpuKernelsTest, DequantizeInt8MatchesScalar) {
+  std::mt19937 rng(29);
+  std::uniform_int_distribution<int> byte(-127, 127);
+  const auto* scalar = cpu_kernel_table(CpuIsa::kScalar);
+  for (int n : {1, 7, 8, 15, 16, 17, 33, 128, 130}) {
+    std::vector<std::int8_t> in(n);
+    for (auto& value : in) {
+      value = static_cast<std::int8_t>(byte(rng));
+    }
+    std::vector<float> expected(n);
+    scalar->dequantize_int8(in.data(), n, 0.0173f, expected.data());
+    for (const auto* table : available_tables()) {
+      std::vector<float> out(n);
+      table->dequantize_int8(in.data(), n, 0.0173f, out.data());
+      for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(out[i], expected[i]) << table->name << " n=" << n << " i=" << i;
+      }
+    }
+  }
+}
+
+TEST(CpuKernelsTest, Int8LinearMatchesDequantizedWeights) {
+  std::mt19937 rng(31);
+  for (const auto* table : available_tables()) {
+    ASSERT_TRUE(set_cpu_isa(table->isa));
+    // in_features 257 splits the channels into blocks of 15.
+    for (int in_features : {16, 100, 257}) {
+      for (int out_features : {1, 40, 300}) {
+        const auto weights = random_vector(out_features * in_features, rng, 0.1f);
+        std::vector<std::int8_t> quantized(weights.size());
+        std::vector<float> scales(out_features);
+        quantize_linear_weights_cpu(weights.data(), out_features, in_features, quantized.data(), scales.data());
+        for (std::size_t i = 0; i < weights.size(); ++i) {
+          const float dequantized = static_cast<float>(quantized[i]) * scales[i / in_features];
+          ASSERT_LE(std::fabs(dequantized - weights[i]), 0.5001f * scales[i / in_features]);
+        }
+
+        const auto bias = random_vector(out_features, rng);
+        for (int rows : {1, 3, 17}) {
+          const auto input = random_vector(rows * in_features, rng);
+          std::vector<float> output(static_cast<std::size_t>(rows) * out_features);
+          int8_linear_forward_cpu(input.data(), quantized.data(), scales.data(), bias.data(), output.data(), rows,
+                                  in_features, out_features);
+          for (int r = 0; r < rows; ++r) {
+            for (int o = 0; o < out_features; ++o) {
+              double expected = bias[o];
+              for (int d = 0; d < in_features; ++d) {
+                expected += static_cast<double>(input[r * in_features + d]) *
+                            (static_cast<float>(quantized[o * in_features + d]) * scales[o]);
+              }
+              EXPECT_NEAR(output[r * out_features + o], expected, 1e-5 * std::sqrt(in_features))
+                  << table->name << " in=" << in_features << " out=" << out_features << " row " << r;
+            }
+          }
+        }
+      }
+    }
+  }
+  EXPECT_TRUE(set_cpu_isa(detect_cpu_isa()));
+}
+
+}  // namespace kernels
+}  // namespace fuzzformer
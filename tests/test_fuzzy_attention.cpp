@@ -1,7 +1,21 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "fuzzformer/cpuKernels.h"
 #include "fuzzformer/fuzzyAttention.h"
+#include "fuzzformer/fuzzyAttentionCpu.h"
+#include "fuzzformer/membershipPolynomial.h"
+#include "fuzzformer/membershipTable.h"
+#include "fuzzformer/metricsCollector.h"
 #include "fuzzformer/modelConfig.h"
+#include "fuzzformer/storageType.h"
 
 #ifdef FUZZFORMER_HAS_TORCH
 #include <torch/torch.h>
@@ -9,6 +23,90 @@
 
 namespace fuzzformer {
 
+#ifdef FUZZFORMER_HAS_TORCH
+namespace {
+
+// Masks [batch, heads, num_queries, num_keys] memberships and averages v
+// with them, rows without visible keys giving zeros.
+torch::Tensor masked_average(torch::Tensor membership,
+                             const torch::Tensor& q,
+                             const torch::Tensor& v,
+                             const FuzzyAttentionMask& mask) {
+  // Queries line up with the last keys when there are fewer of them.
+  const auto num_queries = q.size(2);
+  const auto num_keys = v.size(2);
+  auto key_positions = torch::arange(num_keys, torch::TensorOptions().device(q.device())).view({1, 1, 1, -1});
+  auto query_positions =
+      torch::arange(num_keys - num_queries, num_keys, torch::TensorOptions().device(q.device())).view({1, 1, -1, 1});
+  auto visible = torch::ones({q.size(0), 1, num_queries, num_keys},
+                             torch::TensorOptions().dtype(torch::kBool).device(q.device()));
+  if (mask.causal) {
+    visible = visible & (key_positions <= query_positions);
+  }
+  if (mask.key_lengths.defined()) {
+    visible = visible & (key_positions < mask.key_lengths.view({-1, 1, 1, 1}));
+  }
+  if (mask.window > 0) {
+    visible = visible & (key_positions > query_positions - mask.window);
+  }
+  membership = membership * visible.to(membership.scalar_type());
+  auto norm = membership.sum(-1, true);
+  auto weights = torch::where(norm > 1e-6, membership / norm, torch::zeros_like(membership));
+  return torch::matmul(weights, v);
+}
+
+torch::Tensor reference_forward(const torch::Tensor& q,
+                                const torch::Tensor& k,
+                                const torch::Tensor& v,
+                                const torch::Tensor& alpha,
+                                const torch::Tensor& beta,
+                                const FuzzyAttentionMask& mask = {},
+                                FuzzyMembership membership = FuzzyMembership::kGaussian) {
+  const auto head_dim = static_cast<double>(q.size(3));
+  auto scores = torch::matmul(q, k.transpose(-2, -1)) / head_dim;
+  auto diff = scores - beta.view({1, -1, 1, 1});
+  auto a = alpha.view({1, -1, 1, 1});
+  switch (membership) {
+    case FuzzyMembership::kTriangular:
+      return masked_average(torch::clamp_min(1.0 - a * diff.abs(), 0.0), q, v, mask);
+    case FuzzyMembership::kTrapezoidal:
+      return masked_average(torch::clamp(2.0 - 2.0 * a * diff.abs(), 0.0, 1.0), q, v, mask);
+    default:
+      return masked_average(torch::exp(-a * diff * diff), q, v, mask);
+  }
+}
+
+// reference_forward with each (batch, head) membership replaced by the
+// polynomial fuzzy_attention_forward_linear fits to it.
+torch::Tensor polynomial_reference(const torch::Tensor& q,
+                                   const torch::Tensor& k,
+                                   const torch::Tensor& v,
+                                   const torch::Tensor& alpha,
+                                   const torch::Tensor& beta,
+                                   int order,
+                                   const FuzzyAttentionMask& mask = {}) {
+  const auto head_dim = static_cast<double>(q.size(3));
+  auto scores = (torch::matmul(q, k.transpose(-2, -1)) / head_dim).to(torch::kFloat64);
+  auto radius = (std::get<0>(q.norm(2, -1).max(-1)) * std::get<0>(k.norm(2, -1).max(-1)) / head_dim).cpu();
+  auto coefficients = torch::empty({q.size(0), q.size(1), order + 1}, torch::kFloat64);
+  for (int64_t b = 0; b < q.size(0); ++b) {
+    for (int64_t h = 0; h < q.size(1); ++h) {
+      kernels::fit_membership_polynomial(alpha[h].item<double>(), beta[h].item<double>(),
+                                         radius[b][h].item<double>(), order,
+                                         coefficients[b][h].data_ptr<double>());
+    }
+  }
+  coefficients = coefficients.to(scores.device());
+  auto membership = torch::zeros_like(scores);
+  for (int p = order; p >= 0; --p) {
+    membership = membership * scores + coefficients.select(2, p).view({q.size(0), q.size(1), 1, 1});
+  }
+  return masked_average(membership, q, v.to(torch::kFloat64), mask).to(q.scalar_type());
+}
+
+}  // namespace
+#endif
+
 TEST(FuzzyAttentionTest, ForwardProducesCorrectShape) {
 #ifdef FUZZFORMER_HAS_TORCH
   const int batch_size = 2;
@@ -32,6 +130,106 @@ TEST(FuzzyAttentionTest, ForwardProducesCorrectShape) {
 #endif
 }
 
+TEST(FuzzyAttentionTest, CpuForwardMatchesReference) {
+#ifdef FUZZFORMER_HAS_TORCH
+  const int batch_size = 2;
+  const int num_heads = 3;
+  const int seq_len = 37;
+  const int head_dim = 16;
+
+  auto options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto q = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto k = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto v = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto alpha = torch::rand({num_heads}, options) + 0.5;
+  auto beta = torch::randn({num_heads}, options) * 0.1;
+
+  auto output = fuzzy_attention_forward(q, k, v, alpha, beta);
+  ASSERT_EQ(output.sizes(), q.sizes());
+  EXPECT_TRUE(torch::allclose(output, reference_forward(q, k, v, alpha, beta), 1e-4, 1e-5));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, FusedForwardMatchesTwoPass) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 4, 65, 32}, options);
+    auto k = torch::randn({2, 4, 65, 32}, options);
+    auto v = torch::randn({2, 4, 65, 32}, options);
+    auto alpha = torch::rand({4}, options) + 0.5;
+    auto beta = torch::randn({4}, options) * 0.1;
+
+    FuzzyAttentionOptions two_pass;
+    two_pass.forward_mode = FuzzyAttentionForwardMode::kTwoPass;
+    FuzzyAttentionOptions fused;
+    fused.forward_mode = FuzzyAttentionForwardMode::kFused;
+
+    auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, two_pass);
+    auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, fused);
+    EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5)) << "device " << device;
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, TiledCpuForwardMatchesFused) {
+#ifdef FUZZFORMER_HAS_TORCH
+  const int batch_size = 2;
+  const int num_heads = 3;
+  const int seq_len = 67;
+  const int head_dim = 24;
+
+  auto options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto q = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto k = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto v = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto alpha = torch::rand({num_heads}, options) + 0.5;
+  auto beta = torch::randn({num_heads}, options) * 0.1;
+
+  FuzzyAttentionOptions fused;
+  fused.forward_mode = FuzzyAttentionForwardMode::kFused;
+  auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, fused);
+
+  // Tile sizes that do not divide seq_len exercise the ragged edges.
+  for (const auto& tiles : {kernels::CpuTileConfig{5, 16}, kernels::CpuTileConfig{64, 7},
+                            kernels::choose_cpu_tiles(head_dim)}) {
+    auto actual = torch::empty_like(q);
+    kernels::fuzzy_attention_forward_tiled_cpu(q.data_ptr<float>(), k.data_ptr<float>(), v.data_ptr<float>(),
+                                               alpha.data_ptr<float>(), beta.data_ptr<float>(),
+                                               actual.data_ptr<float>(), nullptr, nullptr, false, 0, batch_size, num_heads, seq_len, seq_len,
+                                               head_dim, tiles, nullptr, nullptr);
+    EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5))
+        << "tiles " << tiles.query_block << "x" << tiles.key_block;
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, RejectsMixedDevices) {
+#ifdef FUZZFORMER_HAS_TORCH
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available";
+  }
+  auto q = torch::randn({1, 1, 4, 8});
+  auto k = torch::randn({1, 1, 4, 8}, torch::TensorOptions().device(torch::kCUDA));
+  auto alpha = torch::ones({1});
+  auto beta = torch::zeros({1});
+  EXPECT_THROW(fuzzy_attention_forward(q, k, q, alpha, beta), std::invalid_argument);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
 TEST(FuzzyAttentionTest, BackwardProducesGradients) {
 #ifdef FUZZFORMER_HAS_TORCH
   const int batch_size = 1;
@@ -62,5 +260,1825 @@ TEST(FuzzyAttentionTest, BackwardProducesGradients) {
 #endif
 }
 
-}  // namespace fuzzformer
+TEST(FuzzyAttentionTest, CpuBackwardMatchesAutograd) {
+#ifdef FUZZFORMER_HAS_TORCH
+  const int batch_size = 2;
+  const int num_heads = 3;
+  const int seq_len = 29;
+  const int head_dim = 16;
+
+  auto options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto q = torch::randn({batch_size, num_heads, seq_len, head_dim}, options).requires_grad_(true);
+  auto k = torch::randn({batch_size, num_heads, seq_len, head_dim}, options).requires_grad_(true);
+  auto v = torch::randn({batch_size, num_heads, seq_len, head_dim}, options).requires_grad_(true);
+  auto alpha = (torch::rand({num_heads}, options) + 0.5).requires_grad_(true);
+  auto beta = (torch::randn({num_heads}, options) * 0.1).requires_grad_(true);
+  auto grad_out = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+
+  reference_forward(q, k, v, alpha, beta).backward(grad_out);
+
+  FuzzyAttentionContext context{q.detach(), k.detach(), v.detach(), alpha.detach(), beta.detach()};
+  auto grads = fuzzy_attention_backward(grad_out, context);
+  ASSERT_EQ(grads.size(), 5);
+  EXPECT_TRUE(torch::allclose(grads[0], q.grad(), 1e-3, 1e-4));
+  EXPECT_TRUE(torch::allclose(grads[1], k.grad(), 1e-3, 1e-4));
+  EXPECT_TRUE(torch::allclose(grads[2], v.grad(), 1e-3, 1e-4));
+  EXPECT_TRUE(torch::allclose(grads[3], alpha.grad(), 1e-3, 1e-3));
+  EXPECT_TRUE(torch::allclose(grads[4], beta.grad(), 1e-3, 1e-3));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, DeterministicBackwardIsBitwiseReproducible) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 4, 129, 32}, options);
+    auto k = torch::randn({2, 4, 129, 32}, options);
+    auto v = torch::randn({2, 4, 129, 32}, options);
+    auto alpha = torch::rand({4}, options) + 0.5;
+    auto beta = torch::randn({4}, options) * 0.1;
+    auto grad_out = torch::randn({2, 4, 129, 32}, options);
+
+    FuzzyAttentionContext context{q, k, v, alpha, beta};
+    FuzzyAttentionOptions deterministic;
+    deterministic.backward_mode = FuzzyAttentionBackwardMode::kDeterministic;
+    auto first = fuzzy_attention_backward(grad_out, context, deterministic);
+    auto second = fuzzy_attention_backward(grad_out, context, deterministic);
+    for (std::size_t i = 0; i < first.size(); ++i) {
+      EXPECT_TRUE(torch::equal(first[i], second[i])) << "device " << device << " gradient " << i;
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, CudaDeterministicBackwardMatchesAtomic) {
+#ifdef FUZZFORMER_HAS_TORCH
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available";
+  }
+  auto options = torch::TensorOptions().dtype(torch::kFloat32).device(torch::kCUDA);
+  auto q = torch::randn({2, 4, 65, 32}, options);
+  auto k = torch::randn({2, 4, 65, 32}, options);
+  auto v = torch::randn({2, 4, 65, 32}, options);
+  auto alpha = torch::rand({4}, options) + 0.5;
+  auto beta = torch::randn({4}, options) * 0.1;
+  auto grad_out = torch::randn({2, 4, 65, 32}, options);
+
+  FuzzyAttentionContext context{q, k, v, alpha, beta};
+  FuzzyAttentionOptions deterministic;
+  deterministic.backward_mode = FuzzyAttentionBackwardMode::kDeterministic;
+  auto expected = fuzzy_attention_backward(grad_out, context);
+  auto actual = fuzzy_attention_backward(grad_out, context, deterministic);
+
+  FuzzyAttentionContext cpu_context{q.cpu(), k.cpu(), v.cpu(), alpha.cpu(), beta.cpu()};
+  auto cpu = fuzzy_attention_backward(grad_out.cpu(), cpu_context);
+  for (std::size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_TRUE(torch::allclose(actual[i], expected[i], 1e-3, 1e-4)) << "gradient " << i;
+    EXPECT_TRUE(torch::allclose(actual[i].cpu(), cpu[i], 1e-3, 1e-4)) << "gradient " << i;
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, BackwardWithSavedStatisticsMatchesRecompute) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    // Longer than the atomic kernel's 256-entry per-thread cache.
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({1, 2, 300, 16}, options);
+    auto k = torch::randn({1, 2, 300, 16}, options);
+    auto v = torch::randn({1, 2, 300, 16}, options);
+    auto alpha = torch::rand({2}, options) + 0.5;
+    auto beta = torch::randn({2}, options) * 0.1;
+    auto grad_out = torch::randn({1, 2, 300, 16}, options);
+
+    auto saved = fuzzy_attention_forward_with_context(q, k, v, alpha, beta);
+    ASSERT_TRUE(saved.row_norms.defined());
+    ASSERT_EQ(saved.row_norms.sizes(), torch::IntArrayRef({1, 2, 300}));
+    EXPECT_TRUE(torch::allclose(saved.output, fuzzy_attention_forward(q, k, v, alpha, beta), 1e-5, 1e-6));
+
+    std::vector<FuzzyAttentionBackwardMode> modes = {FuzzyAttentionBackwardMode::kDeterministic};
+    if (device.is_cuda()) {
+      modes.push_back(FuzzyAttentionBackwardMode::kAtomic);
+    }
+    for (const auto mode : modes) {
+      FuzzyAttentionOptions backward_options;
+      backward_options.backward_mode = mode;
+      auto expected = fuzzy_attention_backward(grad_out, FuzzyAttentionContext{q, k, v, alpha, beta},
+                                               backward_options);
+      auto actual = fuzzy_attention_backward(grad_out, saved, backward_options);
+      for (std::size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_TRUE(torch::allclose(actual[i], expected[i], 1e-3, 1e-4)) << "device " << device << " gradient " << i;
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, MaskedForwardMatchesReference) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({3, 2, 41, 16}, options);
+    auto k = torch::randn({3, 2, 41, 16}, options);
+    auto v = torch::randn({3, 2, 41, 16}, options);
+    auto alpha = torch::rand({2}, options) + 0.5;
+    auto beta = torch::randn({2}, options) * 0.1;
+
+    FuzzyAttentionMask padded;
+    padded.key_lengths = torch::tensor({41, 17, 0}, torch::TensorOptions().dtype(torch::kInt64).device(device));
+    FuzzyAttentionMask causal;
+    causal.causal = true;
+    FuzzyAttentionMask both = padded;
+    both.causal = true;
+    FuzzyAttentionMask windowed = both;
+    windowed.window = 6;
+
+    for (const auto& mask : {padded, causal, both, windowed}) {
+      auto expected = reference_forward(q, k, v, alpha, beta, mask);
+      for (const auto mode : {FuzzyAttentionForwardMode::kTwoPass, FuzzyAttentionForwardMode::kFused,
+                              FuzzyAttentionForwardMode::kTiled}) {
+        FuzzyAttentionOptions forward_options;
+        forward_options.forward_mode = mode;
+        auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, forward_options, mask);
+        EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5))
+            << "device " << device << " causal " << mask.causal << " window " << mask.window << " mode "
+            << static_cast<int>(mode);
+      }
+    }
+    FuzzyAttentionMask window_only;
+    window_only.window = 6;
+    EXPECT_THROW(fuzzy_attention_forward(q, k, v, alpha, beta, {}, window_only), c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, MaskedBackwardMatchesAutograd) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 2, 23, 16}, options).requires_grad_(true);
+    auto k = torch::randn({2, 2, 23, 16}, options).requires_grad_(true);
+    auto v = torch::randn({2, 2, 23, 16}, options).requires_grad_(true);
+    auto alpha = (torch::rand({2}, options) + 0.5).requires_grad_(true);
+    auto beta = (torch::randn({2}, options) * 0.1).requires_grad_(true);
+    auto grad_out = torch::randn({2, 2, 23, 16}, options);
+
+    FuzzyAttentionMask mask;
+    mask.causal = true;
+    mask.key_lengths = torch::tensor({23, 9}, torch::TensorOptions().dtype(torch::kInt32).device(device));
+
+    reference_forward(q, k, v, alpha, beta, mask).backward(grad_out);
+
+    std::vector<FuzzyAttentionBackwardMode> modes = {FuzzyAttentionBackwardMode::kDeterministic};
+    if (device.is_cuda()) {
+      modes.push_back(FuzzyAttentionBackwardMode::kAtomic);
+    }
+    auto saved = fuzzy_attention_forward_with_context(q.detach(), k.detach(), v.detach(), alpha.detach(),
+                                                      beta.detach(), {}, mask);
+    for (const auto mode : modes) {
+      FuzzyAttentionOptions backward_options;
+      backward_options.backward_mode = mode;
+      auto grads = fuzzy_attention_backward(grad_out, saved, backward_options);
+      std::vector<torch::Tensor> expected = {q.grad(), k.grad(), v.grad(), alpha.grad(), beta.grad()};
+      for (std::size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_TRUE(torch::allclose(grads[i], expected[i], 1e-3, 1e-3)) << "device " << device << " gradient " << i;
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, WindowedBackwardMatchesAutograd) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 2, 29, 16}, options).requires_grad_(true);
+    auto k = torch::randn({2, 2, 29, 16}, options).requires_grad_(true);
+    auto v = torch::randn({2, 2, 29, 16}, options).requires_grad_(true);
+    auto alpha = (torch::rand({2}, options) + 0.5).requires_grad_(true);
+    auto beta = (torch::randn({2}, options) * 0.1).requires_grad_(true);
+    auto grad_out = torch::randn({2, 2, 29, 16}, options);
+
+    FuzzyAttentionMask mask;
+    mask.causal = true;
+    mask.window = 5;
+
+    reference_forward(q, k, v, alpha, beta, mask).backward(grad_out);
+    std::vector<torch::Tensor> expected = {q.grad(), k.grad(), v.grad(), alpha.grad(), beta.grad()};
+
+    std::vector<FuzzyAttentionBackwardMode> modes = {FuzzyAttentionBackwardMode::kDeterministic};
+    if (device.is_cuda()) {
+      modes.push_back(FuzzyAttentionBackwardMode::kAtomic);
+    }
+    // With and without the forward's saved statistics.
+    auto saved = fuzzy_attention_forward_with_context(q.detach(), k.detach(), v.detach(), alpha.detach(),
+                                                      beta.detach(), {}, mask);
+    FuzzyAttentionContext unsaved = saved;
+    unsaved.row_norms = {};
+    for (const auto mode : modes) {
+      FuzzyAttentionOptions backward_options;
+      backward_options.backward_mode = mode;
+      for (const auto& context : {saved, unsaved}) {
+        auto grads = fuzzy_attention_backward(grad_out, context, backward_options);
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+          EXPECT_TRUE(torch::allclose(grads[i], expected[i], 1e-3, 1e-3))
+              << "device " << device << " gradient " << i;
+        }
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, CrossAttentionForwardMatchesReference) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto alpha = torch::rand({3}, options) + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+
+    // A few queries over a long memory, and more queries than keys, where the
+    // first causal rows see nothing.
+    for (const auto& [num_queries, num_keys] : {std::pair<int, int>{5, 70}, std::pair<int, int>{40, 13}}) {
+      auto q = torch::randn({2, 3, num_queries, 16}, options);
+      auto k = torch::randn({2, 3, num_keys, 16}, options);
+      auto v = torch::randn({2, 3, num_keys, 16}, options);
+
+      FuzzyAttentionMask padded;
+      padded.key_lengths =
+          torch::tensor({num_keys, num_keys / 2}, torch::TensorOptions().dtype(torch::kInt64).device(device));
+      FuzzyAttentionMask causal;
+      causal.causal = true;
+      FuzzyAttentionMask windowed = causal;
+      windowed.window = 9;
+
+      for (const auto& mask : {FuzzyAttentionMask{}, padded, causal, windowed}) {
+        auto expected = reference_forward(q, k, v, alpha, beta, mask);
+        for (const auto mode : {FuzzyAttentionForwardMode::kTwoPass, FuzzyAttentionForwardMode::kFused,
+                                FuzzyAttentionForwardMode::kTiled}) {
+          FuzzyAttentionOptions forward_options;
+          forward_options.forward_mode = mode;
+          auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, forward_options, mask);
+          ASSERT_EQ(actual.sizes(), q.sizes());
+          EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5))
+              << "device " << device << " queries " << num_queries << " keys " << num_keys << " causal "
+              << mask.causal << " window " << mask.window << " mode " << static_cast<int>(mode);
+
+          forward_options.layout = FuzzyAttentionLayout::kBSHD;
+          auto token_major = fuzzy_attention_forward(q.transpose(1, 2), k.transpose(1, 2), v.transpose(1, 2), alpha,
+                                                     beta, forward_options, mask);
+          EXPECT_TRUE(torch::allclose(token_major.transpose(1, 2), expected, 1e-4, 1e-5))
+              << "device " << device << " token-major mode " << static_cast<int>(mode);
+        }
+      }
+    }
+
+    auto q = torch::randn({2, 3, 5, 16}, options);
+    auto k = torch::randn({2, 3, 70, 16}, options);
+    EXPECT_THROW(fuzzy_attention_forward(q, k, k.narrow(2, 0, 69), alpha, beta), c10::Error);
+    EXPECT_THROW(fuzzy_attention_forward(q, k.narrow(3, 0, 8), k.narrow(3, 0, 8), alpha, beta), c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, CrossAttentionBackwardMatchesAutograd) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    FuzzyAttentionMask padded;
+    padded.key_lengths = torch::tensor({45, 20}, torch::TensorOptions().dtype(torch::kInt32).device(device));
+    FuzzyAttentionMask windowed = padded;
+    windowed.causal = true;
+    windowed.window = 11;
+
+    for (const auto& mask : {padded, windowed}) {
+      auto q = torch::randn({2, 2, 7, 16}, options).requires_grad_(true);
+      auto k = torch::randn({2, 2, 45, 16}, options).requires_grad_(true);
+      auto v = torch::randn({2, 2, 45, 16}, options).requires_grad_(true);
+      auto alpha = (torch::rand({2}, options) + 0.5).requires_grad_(true);
+      auto beta = (torch::randn({2}, options) * 0.1).requires_grad_(true);
+      auto grad_out = torch::randn({2, 2, 7, 16}, options);
+
+      reference_forward(q, k, v, alpha, beta, mask).backward(grad_out);
+      std::vector<torch::Tensor> expected = {q.grad(), k.grad(), v.grad(), alpha.grad(), beta.grad()};
+
+      std::vector<FuzzyAttentionBackwardMode> modes = {FuzzyAttentionBackwardMode::kDeterministic};
+      if (device.is_cuda()) {
+        modes.push_back(FuzzyAttentionBackwardMode::kAtomic);
+      }
+      auto saved = fuzzy_attention_forward_with_context(q.detach(), k.detach(), v.detach(), alpha.detach(),
+                                                        beta.detach(), {}, mask);
+      FuzzyAttentionContext unsaved = saved;
+      unsaved.row_norms = {};
+      for (const auto mode : modes) {
+        FuzzyAttentionOptions backward_options;
+        backward_options.backward_mode = mode;
+        for (const auto& context : {saved, unsaved}) {
+          auto grads = fuzzy_attention_backward(grad_out, context, backward_options);
+          ASSERT_EQ(grads[1].sizes(), k.sizes());
+          for (std::size_t i = 0; i < expected.size(); ++i) {
+            EXPECT_TRUE(torch::allclose(grads[i], expected[i], 1e-3, 1e-3))
+                << "device " << device << " causal " << mask.causal << " gradient " << i;
+          }
+        }
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, GroupedQueryForwardMatchesExpandedHeads) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto alpha = torch::rand({4}, options) + 0.5;
+    auto beta = torch::randn({4}, options) * 0.1;
+
+    // Two query heads per K/V head, and multi-query attention.
+    for (const int64_t num_kv_heads : {2, 1}) {
+      const auto group = 4 / num_kv_heads;
+      auto q = torch::randn({2, 4, 9, 32}, options);
+      auto k = torch::randn({2, num_kv_heads, 40, 32}, options);
+      auto v = torch::randn({2, num_kv_heads, 40, 32}, options);
+      auto expanded_k = k.repeat_interleave(group, 1);
+      auto expanded_v = v.repeat_interleave(group, 1);
+
+      FuzzyAttentionMask causal;
+      causal.causal = true;
+      FuzzyAttentionMask windowed = causal;
+      windowed.window = 7;
+      for (const auto& mask : {FuzzyAttentionMask{}, causal, windowed}) {
+        auto expected = reference_forward(q, expanded_k, expanded_v, alpha, beta, mask);
+        for (const auto mode : {FuzzyAttentionForwardMode::kTwoPass, FuzzyAttentionForwardMode::kFused,
+                                FuzzyAttentionForwardMode::kTiled}) {
+          FuzzyAttentionOptions forward_options;
+          forward_options.forward_mode = mode;
+          forward_options.prune_epsilon = 1e-7f;
+          auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, forward_options, mask);
+          EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5))
+              << "device " << device << " kv_heads " << num_kv_heads << " causal " << mask.causal << " window "
+              << mask.window << " mode " << static_cast<int>(mode);
+
+          forward_options.layout = FuzzyAttentionLayout::kBSHD;
+          auto token_major = fuzzy_attention_forward(q.transpose(1, 2), k.transpose(1, 2), v.transpose(1, 2), alpha,
+                                                     beta, forward_options, mask);
+          EXPECT_TRUE(torch::allclose(token_major.transpose(1, 2), expected, 1e-4, 1e-5))
+              << "device " << device << " token-major mode " << static_cast<int>(mode);
+        }
+      }
+
+      auto cached = fuzzy_attention_forward_cached(q, k, v, alpha, beta, {}, 7);
+      EXPECT_TRUE(torch::allclose(cached, reference_forward(q, expanded_k, expanded_v, alpha, beta, windowed), 1e-4,
+                                  1e-5))
+          << "device " << device << " cached kv_heads " << num_kv_heads;
+
+      // Packed batch of the two sequences, keys truncated to the query length.
+      auto pack = [](const torch::Tensor& t) { return t.narrow(2, 0, 9).transpose(1, 2).reshape({18, -1, 32}); };
+      auto cu_seqlens = torch::tensor({0, 9, 18}, torch::TensorOptions().dtype(torch::kInt32).device(device));
+      auto packed = fuzzy_attention_forward_varlen(pack(q), pack(k), pack(v), cu_seqlens, alpha, beta, true);
+      auto expected_packed = fuzzy_attention_forward_varlen(pack(q), pack(expanded_k), pack(expanded_v), cu_seqlens,
+                                                            alpha, beta, true);
+      EXPECT_TRUE(torch::allclose(packed, expected_packed, 1e-4, 1e-5))
+          << "device " << device << " varlen kv_heads " << num_kv_heads;
+
+      // Paged pools of 8-row blocks, sequence b in blocks [5b, 5b + 5).
+      auto pool = [](const torch::Tensor& t) {
+        return t.view({2, t.size(1), 5, 8, 32}).permute({0, 2, 1, 3, 4}).reshape({10, t.size(1), 8, 32});
+      };
+      auto tables = torch::arange(10, torch::TensorOptions().dtype(torch::kInt32)).view({2, 5}).to(device);
+      auto lengths = torch::tensor({40, 40}, torch::TensorOptions().dtype(torch::kInt32).device(device));
+      auto paged = fuzzy_attention_forward_paged(q, pool(k), pool(v), tables, lengths, alpha, beta);
+      EXPECT_TRUE(torch::allclose(paged, reference_forward(q, expanded_k, expanded_v, alpha, beta, causal), 1e-4,
+                                  1e-5))
+          << "device " << device << " paged kv_heads " << num_kv_heads;
+    }
+
+    auto q = torch::randn({2, 4, 9, 32}, options);
+    auto k = torch::randn({2, 3, 40, 32}, options);
+    EXPECT_THROW(fuzzy_attention_forward(q, k, k, alpha, beta), c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, GroupedQueryBackwardMatchesAutograd) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    FuzzyAttentionMask causal;
+    causal.causal = true;
+
+    for (const auto layout : {FuzzyAttentionLayout::kBHSD, FuzzyAttentionLayout::kBSHD}) {
+      auto q = torch::randn({2, 4, 12, 16}, options).requires_grad_(true);
+      auto k = torch::randn({2, 2, 12, 16}, options).requires_grad_(true);
+      auto v = torch::randn({2, 2, 12, 16}, options).requires_grad_(true);
+      auto alpha = (torch::rand({4}, options) + 0.5).requires_grad_(true);
+      auto beta = (torch::randn({4}, options) * 0.1).requires_grad_(true);
+      auto grad_out = torch::randn({2, 4, 12, 16}, options);
+
+      reference_forward(q, k.repeat_interleave(2, 1), v.repeat_interleave(2, 1), alpha, beta, causal)
+          .backward(grad_out);
+      std::vector<torch::Tensor> expected = {q.grad(), k.grad(), v.grad(), alpha.grad(), beta.grad()};
+
+      const bool token_major = layout == FuzzyAttentionLayout::kBSHD;
+      auto in_layout = [&](const torch::Tensor& t) { return token_major ? t.detach().transpose(1, 2) : t.detach(); };
+      FuzzyAttentionOptions forward_options;
+      forward_options.layout = layout;
+      auto context = fuzzy_attention_forward_with_context(in_layout(q), in_layout(k), in_layout(v), alpha.detach(),
+                                                          beta.detach(), forward_options, causal);
+      auto grads = fuzzy_attention_backward(in_layout(grad_out), context);
+      for (std::size_t i = 0; i < 3; ++i) {
+        grads[i] = token_major ? grads[i].transpose(1, 2) : grads[i];
+      }
+      for (std::size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQ(grads[i].sizes(), expected[i].sizes()) << "gradient " << i;
+        EXPECT_TRUE(torch::allclose(grads[i], expected[i], 1e-3, 1e-3))
+            << "device " << device << " token-major " << token_major << " gradient " << i;
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, VarlenMatchesPerSequenceForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  const std::vector<int64_t> lengths = {20, 1, 0, 157, 64};
+  std::vector<int64_t> offsets = {0};
+  for (const auto length : lengths) {
+    offsets.push_back(offsets.back() + length);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({offsets.back(), 3, 16}, options);
+    auto k = torch::randn({offsets.back(), 3, 16}, options);
+    auto v = torch::randn({offsets.back(), 3, 16}, options);
+    auto alpha = torch::rand({3}, options) + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+    auto cu_seqlens = torch::tensor(offsets, torch::TensorOptions().dtype(torch::kInt64).device(device));
+
+    for (const bool causal : {false, true}) {
+      auto packed = fuzzy_attention_forward_varlen(q, k, v, cu_seqlens, alpha, beta, causal);
+      ASSERT_EQ(packed.sizes(), q.sizes());
+
+      FuzzyAttentionMask mask;
+      mask.causal = causal;
+      for (std::size_t i = 0; i < lengths.size(); ++i) {
+        if (lengths[i] == 0) {
+          continue;
+        }
+        // [tokens, heads, head_dim] -> [1, heads, tokens, head_dim]
+        auto slice = [&](const torch::Tensor& t) {
+          return t.slice(0, offsets[i], offsets[i + 1]).transpose(0, 1).unsqueeze(0);
+        };
+        auto expected = fuzzy_attention_forward(slice(q), slice(k), slice(v), alpha, beta, {}, mask);
+        EXPECT_TRUE(torch::allclose(slice(packed), expected, 1e-4, 1e-5))
+            << "device " << device << " causal " << causal << " sequence " << i;
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, VarlenRejectsBadOffsets) {
+#ifdef FUZZFORMER_HAS_TORCH
+  auto q = torch::randn({10, 2, 8});
+  auto alpha = torch::ones({2});
+  auto beta = torch::zeros({2});
+  EXPECT_ANY_THROW(fuzzy_attention_forward_varlen(q, q, q, torch::tensor({0, 4, 9}), alpha, beta));
+  EXPECT_ANY_THROW(fuzzy_attention_forward_varlen(q, q, q, torch::tensor({0, 6, 4, 10}), alpha, beta));
+  EXPECT_ANY_THROW(fuzzy_attention_forward_varlen(q, q, q, torch::tensor({1, 10}), alpha, beta));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, PrunedForwardMatchesUnpruned) {
+#ifdef FUZZFORMER_HAS_TORCH
+  const int batch_size = 2;
+  const int num_heads = 2;
+  const int seq_len = 200;
+  const int head_dim = 32;
+
+  // Queries share a direction u with every key of the odd key blocks, whose
+  // scores sit near 3 and far from beta = 0, so those blocks are prunable.
+  auto options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto u = torch::nn::functional::normalize(torch::randn({head_dim}, options),
+                                            torch::nn::functional::NormalizeFuncOptions().dim(0));
+  const double scale = std::sqrt(static_cast<double>(head_dim));
+  auto far = (torch::arange(seq_len).div(kernels::kPruneBlockKeys, "floor") % 2 == 1).to(torch::kFloat32).view({1, 1, -1, 1});
+  auto q = torch::randn({batch_size, num_heads, seq_len, head_dim}, options) * 0.3 + u * scale;
+  auto k = torch::randn({batch_size, num_heads, seq_len, head_dim}, options) * 0.3 + far * u * (3.0 * scale);
+  auto v = torch::randn({batch_size, num_heads, seq_len, head_dim}, options);
+  auto alpha = torch::full({num_heads}, 4.0f, options);
+  auto beta = torch::zeros({num_heads}, options);
+
+  for (const bool causal : {false, true}) {
+    FuzzyAttentionMask mask;
+    mask.causal = causal;
+    auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, {}, mask);
+
+    metrics::MetricsCollector collector;
+    FuzzyAttentionOptions pruned;
+    pruned.prune_epsilon = 1e-6f;
+    pruned.metrics = &collector;
+    auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, pruned, mask);
+
+    EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5)) << "causal " << causal;
+    const auto examined = collector.get_counter("fuzzy_attention.key_blocks");
+    const auto skipped = collector.get_counter("fuzzy_attention.pruned_key_blocks");
+    EXPECT_GT(skipped, 0u);
+    EXPECT_LE(skipped, examined);
+    EXPECT_GT(collector.counter_percent("fuzzy_attention.pruned_key_blocks", "fuzzy_attention.key_blocks"), 25.0);
+  }
+
+  // Unstructured keys keep every score near beta, so nothing is pruned; the
+  // CPU forward sees that from the block bounds and tests no block at all.
+  metrics::MetricsCollector collector;
+  FuzzyAttentionOptions pruned;
+  pruned.prune_epsilon = 1e-6f;
+  pruned.metrics = &collector;
+  auto random_k = torch::randn_like(k);
+  auto actual = fuzzy_attention_forward(q, random_k, v, alpha, beta, pruned);
+  EXPECT_TRUE(torch::allclose(actual, fuzzy_attention_forward(q, random_k, v, alpha, beta), 1e-4, 1e-5));
+  EXPECT_EQ(collector.get_counter("fuzzy_attention.pruned_key_blocks"), 0u);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
 
+TEST(FuzzyAttentionTest, RejectsInvalidPruneEpsilon) {
+#ifdef FUZZFORMER_HAS_TORCH
+  auto q = torch::randn({1, 1, 4, 8});
+  auto alpha = torch::ones({1});
+  auto beta = torch::zeros({1});
+  FuzzyAttentionOptions options;
+  options.prune_epsilon = 1.0f;
+  EXPECT_ANY_THROW(fuzzy_attention_forward(q, q, q, alpha, beta, options));
+  options.prune_epsilon = -0.5f;
+  EXPECT_ANY_THROW(fuzzy_attention_forward(q, q, q, alpha, beta, options));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, SpecializedHeadDimsMatchGeneric) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.push_back(torch::kCUDA);
+  }
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    for (int head_dim : kernels::kSpecializedHeadDims) {
+      auto q = torch::randn({1, 2, 45, head_dim}, options);
+      auto k = torch::randn({1, 2, 45, head_dim}, options);
+      auto v = torch::randn({1, 2, 45, head_dim}, options);
+      auto alpha = torch::rand({2}, options) + 0.5;
+      auto beta = torch::randn({2}, options) * 0.1;
+
+      for (const auto mode : {FuzzyAttentionForwardMode::kAuto, FuzzyAttentionForwardMode::kTwoPass}) {
+        FuzzyAttentionOptions generic;
+        generic.forward_mode = mode;
+        generic.specialize_head_dim = false;
+        FuzzyAttentionOptions specialized;
+        specialized.forward_mode = mode;
+        auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, generic);
+        auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, specialized);
+        EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5)) << device << " head_dim " << head_dim;
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, TokenMajorStridedForwardMatchesHeadMajor) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.push_back(torch::kCUDA);
+  }
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    // Slices of a fused [batch, seq_len, 3, heads, head_dim] projection.
+    auto qkv = torch::randn({2, 37, 3, 4, 32}, options);
+    auto q = qkv.select(2, 0);
+    auto k = qkv.select(2, 1);
+    auto v = qkv.select(2, 2);
+    auto alpha = torch::rand({4}, options) + 0.5;
+    auto beta = torch::randn({4}, options) * 0.1;
+    FuzzyAttentionMask mask;
+    mask.causal = true;
+    mask.key_lengths = torch::tensor({37, 20}, options.dtype(torch::kInt32));
+
+    for (const auto mode : {FuzzyAttentionForwardMode::kAuto, FuzzyAttentionForwardMode::kTwoPass,
+                            FuzzyAttentionForwardMode::kFused}) {
+      FuzzyAttentionOptions head_major;
+      head_major.forward_mode = mode;
+      FuzzyAttentionOptions token_major = head_major;
+      token_major.layout = FuzzyAttentionLayout::kBSHD;
+
+      auto expected = fuzzy_attention_forward(q.transpose(1, 2).contiguous(), k.transpose(1, 2).contiguous(),
+                                              v.transpose(1, 2).contiguous(), alpha, beta, head_major, mask);
+      auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, token_major, mask);
+      ASSERT_EQ(actual.sizes(), q.sizes());
+      EXPECT_TRUE(actual.is_contiguous());
+      EXPECT_TRUE(torch::allclose(actual, expected.transpose(1, 2), 1e-5, 1e-6)) << device;
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, TokenMajorBackwardMatchesHeadMajor) {
+#ifdef FUZZFORMER_HAS_TORCH
+  auto qkv = torch::randn({1, 29, 3, 2, 16});
+  auto q = qkv.select(2, 0);
+  auto k = qkv.select(2, 1);
+  auto v = qkv.select(2, 2);
+  auto alpha = torch::rand({2}) + 0.5;
+  auto beta = torch::randn({2}) * 0.1;
+  auto grad_out = torch::randn({1, 29, 2, 16});
+
+  FuzzyAttentionOptions token_major;
+  token_major.layout = FuzzyAttentionLayout::kBSHD;
+  auto context = fuzzy_attention_forward_with_context(q, k, v, alpha, beta, token_major);
+  EXPECT_EQ(context.layout, FuzzyAttentionLayout::kBSHD);
+  auto actual = fuzzy_attention_backward(grad_out, context);
+
+  auto expected = fuzzy_attention_backward(
+      grad_out.transpose(1, 2).contiguous(),
+      fuzzy_attention_forward_with_context(q.transpose(1, 2).contiguous(), k.transpose(1, 2).contiguous(),
+                                           v.transpose(1, 2).contiguous(), alpha, beta));
+  ASSERT_EQ(actual.size(), expected.size());
+  for (std::size_t i = 0; i < 3; ++i) {
+    ASSERT_EQ(actual[i].sizes(), q.sizes()) << "gradient " << i;
+    EXPECT_TRUE(torch::allclose(actual[i], expected[i].transpose(1, 2), 1e-4, 1e-5)) << "gradient " << i;
+  }
+  for (std::size_t i = 3; i < expected.size(); ++i) {
+    EXPECT_TRUE(torch::allclose(actual[i], expected[i], 1e-4, 1e-5)) << "gradient " << i;
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, CachedForwardMatchesCausalRows) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.push_back(torch::kCUDA);
+  }
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 3, 41, 32}, options);
+    auto k = torch::randn({2, 3, 41, 32}, options);
+    auto v = torch::randn({2, 3, 41, 32}, options);
+    auto alpha = torch::rand({3}, options) + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+    FuzzyAttentionMask causal;
+    causal.causal = true;
+    auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, {}, causal);
+
+    // Keys and values as the valid prefix of a larger cache buffer.
+    auto key_cache = torch::zeros({2, 3, 64, 32}, options);
+    auto value_cache = torch::zeros({2, 3, 64, 32}, options);
+    key_cache.narrow(2, 0, 41).copy_(k);
+    value_cache.narrow(2, 0, 41).copy_(v);
+    for (int64_t num_queries : {1, 7, 41}) {
+      auto new_queries = q.narrow(2, 41 - num_queries, num_queries);
+      auto actual = fuzzy_attention_forward_cached(new_queries, key_cache.narrow(2, 0, 41),
+                                                   value_cache.narrow(2, 0, 41), alpha, beta);
+      EXPECT_TRUE(torch::allclose(actual, expected.narrow(2, 41 - num_queries, num_queries), 1e-5, 1e-6))
+          << device << " queries " << num_queries;
+
+      FuzzyAttentionOptions token_major;
+      token_major.layout = FuzzyAttentionLayout::kBSHD;
+      auto actual_bshd = fuzzy_attention_forward_cached(new_queries.transpose(1, 2),
+                                                        key_cache.narrow(2, 0, 41).transpose(1, 2),
+                                                        value_cache.narrow(2, 0, 41).transpose(1, 2), alpha, beta,
+                                                        token_major);
+      EXPECT_TRUE(torch::allclose(actual_bshd.transpose(1, 2), actual, 1e-6, 1e-7)) << device;
+    }
+    EXPECT_THROW(fuzzy_attention_forward_cached(q, k.narrow(2, 0, 40), v.narrow(2, 0, 40), alpha, beta),
+                 c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, WindowedCachedForwardReadsRing) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.push_back(torch::kCUDA);
+  }
+  constexpr int64_t kTokens = 300;
+  constexpr int64_t kWindow = 37;
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 3, kTokens, 32}, options);
+    auto k = torch::randn({2, 3, kTokens, 32}, options);
+    auto v = torch::randn({2, 3, kTokens, 32}, options);
+    auto alpha = torch::rand({3}, options) + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+    FuzzyAttentionMask mask;
+    mask.causal = true;
+    mask.window = kWindow;
+    auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, {}, mask);
+
+    for (int64_t num_queries : {1, 6}) {
+      // The smallest ring that holds every visible position, so the visible
+      // keys wrap around its end.
+      const int64_t rows = kWindow + num_queries - 1;
+      auto slots = torch::arange(kTokens - rows, kTokens, options.dtype(torch::kLong)).remainder(rows);
+      auto key_ring = torch::zeros({2, 3, rows, 32}, options);
+      auto value_ring = torch::zeros({2, 3, rows, 32}, options);
+      key_ring.index_copy_(2, slots, k.narrow(2, kTokens - rows, rows));
+      value_ring.index_copy_(2, slots, v.narrow(2, kTokens - rows, rows));
+
+      auto new_queries = q.narrow(2, kTokens - num_queries, num_queries);
+      for (int key_splits : {1, 3}) {
+        FuzzyAttentionOptions decode;
+        decode.key_splits = key_splits;
+        auto actual = fuzzy_attention_forward_cached(new_queries, key_ring, value_ring, alpha, beta, decode, kWindow,
+                                                     kTokens);
+        EXPECT_TRUE(torch::allclose(actual, expected.narrow(2, kTokens - num_queries, num_queries), 1e-5, 1e-6))
+            << device << " queries " << num_queries << " splits " << key_splits;
+      }
+      EXPECT_THROW(fuzzy_attention_forward_cached(new_queries, key_ring.narrow(2, 0, rows - 1),
+                                                  value_ring.narrow(2, 0, rows - 1), alpha, beta, {}, kWindow,
+                                                  kTokens),
+                   c10::Error);
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, PagedForwardMatchesCachedForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.push_back(torch::kCUDA);
+  }
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    const std::vector<int64_t> lengths = {41, 16, 3};
+    const int64_t block_size = 8;
+    const int64_t max_blocks = 6;
+    const int64_t num_queries = 3;
+    auto key_pool = torch::randn({20, 2, block_size, 32}, options);
+    auto value_pool = torch::randn({20, 2, block_size, 32}, options);
+    auto alpha = torch::rand({2}, options) + 0.5;
+    auto beta = torch::randn({2}, options) * 0.1;
+    auto queries = torch::randn({3, 2, num_queries, 32}, options);
+
+    // Scattered, out-of-order blocks per sequence.
+    auto order = torch::randperm(20, torch::kInt32);
+    auto tables = torch::zeros({3, max_blocks}, torch::kInt32);
+    int64_t next = 0;
+    for (int64_t b = 0; b < 3; ++b) {
+      for (int64_t j = 0; j < (lengths[b] + block_size - 1) / block_size; ++j) {
+        tables[b][j] = order[next++];
+      }
+    }
+    auto seq_lengths = torch::tensor(std::vector<int>(lengths.begin(), lengths.end()), torch::kInt32);
+    auto actual = fuzzy_attention_forward_paged(queries, key_pool, value_pool, tables.to(device),
+                                                seq_lengths.to(device), alpha, beta);
+
+    for (int64_t b = 0; b < 3; ++b) {
+      auto blocks = tables[b].narrow(0, 0, (lengths[b] + block_size - 1) / block_size).to(torch::kLong).to(device);
+      auto keys = key_pool.index_select(0, blocks).transpose(0, 1).reshape({2, -1, 32}).narrow(1, 0, lengths[b]);
+      auto values =
+          value_pool.index_select(0, blocks).transpose(0, 1).reshape({2, -1, 32}).narrow(1, 0, lengths[b]);
+      auto expected = fuzzy_attention_forward_cached(queries.narrow(0, b, 1), keys.unsqueeze(0),
+                                                     values.unsqueeze(0), alpha, beta);
+      EXPECT_TRUE(torch::allclose(actual.narrow(0, b, 1), expected, 1e-5, 1e-6)) << device << " sequence " << b;
+    }
+
+    auto too_short = seq_lengths.clone();
+    too_short[2] = 2;
+    EXPECT_THROW(fuzzy_attention_forward_paged(queries.cpu(), key_pool.cpu(), value_pool.cpu(), tables, too_short,
+                                               alpha.cpu(), beta.cpu()),
+                 c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, ChoosesKeySplitsOnlyForFewLongRows) {
+  // Enough rows to fill the hardware, or keys too short to cut: no split.
+  EXPECT_EQ(kernels::choose_key_splits(64, 8192, 16, 256), 1);
+  EXPECT_EQ(kernels::choose_key_splits(2, 300, 16, 256), 1);
+  // Two rows on 16 threads want 8 chunks, 4096 keys allow 16.
+  EXPECT_EQ(kernels::choose_key_splits(2, 4096, 16, 256), 8);
+  // 1024 keys only allow 4 chunks of 256.
+  EXPECT_EQ(kernels::choose_key_splits(2, 1024, 16, 256), 4);
+  EXPECT_EQ(kernels::choose_key_splits(1, 1 << 20, 1 << 16, 64), kernels::kMaxKeySplits);
+}
+
+TEST(FuzzyAttentionTest, SplitKDecodeMatchesUnsplit) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.push_back(torch::kCUDA);
+  }
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 3, 2, 32}, options);
+    auto k = torch::randn({2, 3, 1500, 32}, options);
+    auto v = torch::randn({2, 3, 1500, 32}, options);
+    auto alpha = torch::rand({3}, options) + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+
+    FuzzyAttentionOptions unsplit;
+    unsplit.key_splits = 1;
+    auto expected = fuzzy_attention_forward_cached(q, k, v, alpha, beta, unsplit);
+    for (int key_splits : {0, 3, 7}) {
+      FuzzyAttentionOptions split;
+      split.key_splits = key_splits;
+      auto actual = fuzzy_attention_forward_cached(q, k, v, alpha, beta, split);
+      EXPECT_TRUE(torch::allclose(actual, expected, 1e-5, 1e-6)) << device << " splits " << key_splits;
+    }
+
+    // The same keys as a pool of 20-token blocks, sequence b owning blocks
+    // [75 b, 75 b + 75).
+    auto key_pool = k.view({2, 3, 75, 20, 32}).permute({0, 2, 1, 3, 4}).reshape({150, 3, 20, 32});
+    auto value_pool = v.view({2, 3, 75, 20, 32}).permute({0, 2, 1, 3, 4}).reshape({150, 3, 20, 32});
+    auto tables = torch::arange(150, options.dtype(torch::kInt32)).view({2, 75});
+    auto lengths = torch::full({2}, 1500, options.dtype(torch::kInt32));
+    for (int key_splits : {1, 0, 6}) {
+      FuzzyAttentionOptions split;
+      split.key_splits = key_splits;
+      auto actual = fuzzy_attention_forward_paged(q, key_pool, value_pool, tables, lengths, alpha, beta, split);
+      EXPECT_TRUE(torch::allclose(actual, expected, 1e-5, 1e-6)) << device << " paged splits " << key_splits;
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, MembershipPolynomialErrorShrinksWithOrder) {
+  // Uniform error of the fit over [-1, 1] for a broad membership.
+  const double alpha = 0.5;
+  const double beta = 0.1;
+  double previous = 1.0;
+  for (int order = 1; order <= kernels::kMaxLinearOrder; ++order) {
+    double coefficients[kernels::kMaxLinearOrder + 1];
+    kernels::fit_membership_polynomial(alpha, beta, 1.0, order, coefficients);
+    double error = 0.0;
+    for (int i = 0; i <= 200; ++i) {
+      const double s = -1.0 + i / 100.0;
+      double value = 0.0;
+      for (int p = order; p >= 0; --p) {
+        value = value * s + coefficients[p];
+      }
+      error = std::max(error, std::fabs(value - std::exp(-alpha * (s - beta) * (s - beta))));
+    }
+    EXPECT_LT(error, previous) << "order " << order;
+    previous = error;
+  }
+  EXPECT_LT(previous, 2e-3);
+}
+
+TEST(FuzzyAttentionTest, LinearForwardMatchesPolynomialReference) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto alpha = torch::rand({2}, options) + 0.5;
+    auto beta = torch::randn({2}, options) * 0.1;
+
+    FuzzyAttentionMask padded;
+    padded.key_lengths = torch::tensor({150, 70}, torch::TensorOptions().dtype(torch::kInt32).device(device));
+    FuzzyAttentionMask causal;
+    causal.causal = true;
+    FuzzyAttentionMask padded_causal = padded;
+    padded_causal.causal = true;
+
+    // Longer than one chunk of queries, and a few queries over many keys.
+    for (const auto& [num_queries, num_keys] : {std::pair<int, int>{150, 150}, std::pair<int, int>{5, 150}}) {
+      auto q = torch::randn({2, 2, num_queries, 8}, options);
+      auto k = torch::randn({2, 2, num_keys, 8}, options);
+      auto v = torch::randn({2, 2, num_keys, 8}, options);
+      for (const auto& mask : {FuzzyAttentionMask{}, padded, causal, padded_causal}) {
+        for (int order = 1; order <= 3; ++order) {
+          auto actual = fuzzy_attention_forward_linear(q, k, v, alpha, beta, {order}, {}, mask);
+          EXPECT_TRUE(torch::allclose(actual, polynomial_reference(q, k, v, alpha, beta, order, mask), 1e-3, 1e-3))
+              << "device " << device << " queries " << num_queries << " causal " << mask.causal << " order "
+              << order;
+        }
+      }
+    }
+
+    // Token-major grouped heads, one exact and one linear.
+    auto q = torch::randn({1, 40, 2, 8}, options);
+    auto k = torch::randn({1, 40, 1, 8}, options);
+    auto v = torch::randn({1, 40, 1, 8}, options);
+    FuzzyAttentionOptions token_major;
+    token_major.layout = FuzzyAttentionLayout::kBSHD;
+    auto mixed = fuzzy_attention_forward_linear(q, k, v, alpha, beta, {0, 2}, token_major, causal).transpose(1, 2);
+    auto head_major = [](const torch::Tensor& t) { return t.transpose(1, 2).expand({1, 2, 40, 8}); };
+    auto exact = reference_forward(q.transpose(1, 2), head_major(k), head_major(v), alpha, beta, causal);
+    auto linear = polynomial_reference(q.transpose(1, 2), head_major(k), head_major(v), alpha, beta, 2, causal);
+    EXPECT_TRUE(torch::allclose(mixed.select(1, 0), exact.select(1, 0), 1e-4, 1e-5)) << device;
+    EXPECT_TRUE(torch::allclose(mixed.select(1, 1), linear.select(1, 1), 1e-3, 1e-3)) << device;
+
+    FuzzyAttentionMask windowed = causal;
+    windowed.window = 8;
+    EXPECT_THROW(fuzzy_attention_forward_linear(q, k, v, alpha, beta, {2}, token_major, windowed), c10::Error);
+    EXPECT_THROW(fuzzy_attention_forward_linear(q, k, v, alpha, beta, {1, 2, 3}, token_major), c10::Error);
+    EXPECT_THROW(fuzzy_attention_forward_linear(q, k, v, alpha, beta, {kernels::kMaxLinearOrder + 1}, token_major),
+                 c10::Error);
+    // Order 4 at head_dim 64 would need gigabytes of feature sums per head.
+    auto wide = torch::randn({1, 2, 4, 64}, options);
+    EXPECT_THROW(fuzzy_attention_forward_linear(wide, wide, wide, alpha, beta, {kernels::kMaxLinearOrder}),
+                 c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, MembershipFunctorsMatchDefinitions) {
+  auto check = [](auto functor, FuzzyMembership membership) {
+    using Membership = decltype(functor);
+    EXPECT_EQ(Membership::kCompactSupport, has_compact_support(membership));
+    const float alpha = 2.5f;
+    // Away from the kinks at 0, 1 / (2 alpha) and 1 / alpha.
+    for (const float diff : {-0.55f, -0.3f, -0.1f, 0.05f, 0.25f, 0.33f, 0.6f}) {
+      const float value = Membership::value(diff, alpha);
+      const double h = 1e-3;
+      const double by_diff = (Membership::value(diff + h, alpha) - Membership::value(diff - h, alpha)) / (2 * h);
+      const double by_alpha = (Membership::value(diff, alpha + h) - Membership::value(diff, alpha - h)) / (2 * h);
+      EXPECT_NEAR(Membership::d_diff(diff, alpha, value), by_diff, 2e-2) << "diff " << diff;
+      EXPECT_NEAR(Membership::d_alpha(diff, alpha, value), by_alpha, 2e-2) << "diff " << diff;
+    }
+    for (const float epsilon : {1e-6f, 1e-3f, 0.1f}) {
+      const float cutoff = Membership::cutoff(alpha, epsilon);
+      EXPECT_LE(Membership::value(cutoff * 1.001f, alpha), epsilon);
+      EXPECT_LE(Membership::value(-cutoff * 1.001f, alpha), epsilon);
+    }
+    if (Membership::kCompactSupport) {
+      EXPECT_FLOAT_EQ(Membership::cutoff(alpha, 0.0f), 1.0f / alpha);
+      EXPECT_EQ(Membership::value(1.01f / alpha, alpha), 0.0f);
+      EXPECT_EQ(Membership::value(-1.5f / alpha, alpha), 0.0f);
+    } else {
+      EXPECT_TRUE(std::isinf(Membership::cutoff(alpha, 0.0f)));
+    }
+  };
+  check(kernels::GaussianMembership{}, FuzzyMembership::kGaussian);
+  check(kernels::TriangularMembership{}, FuzzyMembership::kTriangular);
+  check(kernels::TrapezoidalMembership{}, FuzzyMembership::kTrapezoidal);
+
+  EXPECT_EQ(kernels::TrapezoidalMembership::value(0.1f, 2.5f), 1.0f);
+  EXPECT_FLOAT_EQ(kernels::TrapezoidalMembership::value(0.3f, 2.5f), 0.5f);
+  EXPECT_FLOAT_EQ(kernels::TriangularMembership::value(0.2f, 2.5f), 0.5f);
+}
+
+TEST(FuzzyAttentionTest, CompactMembershipForwardMatchesReference) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    // Sharp heads, so a good share of the keys falls outside the support.
+    auto q = torch::randn({2, 3, 45, 16}, options);
+    auto k = torch::randn({2, 3, 45, 16}, options);
+    auto v = torch::randn({2, 3, 45, 16}, options);
+    auto alpha = torch::rand({3}, options) + 3.0;
+    auto beta = torch::randn({3}, options) * 0.1;
+
+    FuzzyAttentionMask padded;
+    padded.key_lengths = torch::tensor({45, 30}, torch::TensorOptions().dtype(torch::kInt32).device(device));
+    FuzzyAttentionMask windowed;
+    windowed.causal = true;
+    windowed.window = 9;
+
+    for (const auto membership : {FuzzyMembership::kTriangular, FuzzyMembership::kTrapezoidal}) {
+      for (const auto mode : {FuzzyAttentionForwardMode::kTwoPass, FuzzyAttentionForwardMode::kFused,
+                              FuzzyAttentionForwardMode::kTiled}) {
+        FuzzyAttentionOptions attention;
+        attention.forward_mode = mode;
+        attention.membership = membership;
+        for (const auto& mask : {FuzzyAttentionMask{}, padded, windowed}) {
+          auto expected = reference_forward(q, k, v, alpha, beta, mask, membership);
+          auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, attention, mask);
+          EXPECT_TRUE(torch::allclose(actual, expected, 1e-4, 1e-5))
+              << "device " << device << " membership " << static_cast<int>(membership) << " mode "
+              << static_cast<int>(mode) << " window " << mask.window;
+        }
+      }
+
+      FuzzyAttentionOptions attention;
+      attention.membership = membership;
+      FuzzyAttentionMask causal;
+      causal.causal = true;
+      auto expected = reference_forward(q, k, v, alpha, beta, causal, membership);
+      for (const int key_splits : {1, 3}) {
+        attention.key_splits = key_splits;
+        auto cached = fuzzy_attention_forward_cached(q.narrow(2, 40, 5), k, v, alpha, beta, attention);
+        EXPECT_TRUE(torch::allclose(cached, expected.narrow(2, 40, 5), 1e-4, 1e-5))
+            << "device " << device << " key_splits " << key_splits;
+      }
+
+      // [1, heads, tokens, head_dim] -> [tokens, heads, head_dim]
+      auto packed = [](const torch::Tensor& t) { return t.select(0, 0).transpose(0, 1).contiguous(); };
+      auto cu_seqlens = torch::tensor({0, 45}, torch::TensorOptions().dtype(torch::kInt64).device(device));
+      auto varlen = fuzzy_attention_forward_varlen(packed(q.narrow(0, 0, 1)), packed(k.narrow(0, 0, 1)),
+                                                   packed(v.narrow(0, 0, 1)), cu_seqlens, alpha, beta, true, 0,
+                                                   membership);
+      EXPECT_TRUE(torch::allclose(varlen, packed(expected.narrow(0, 0, 1)), 1e-4, 1e-5)) << device;
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, CompactMembershipBackwardMatchesAutograd) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    for (const auto membership : {FuzzyMembership::kTriangular, FuzzyMembership::kTrapezoidal}) {
+      auto q = torch::randn({2, 3, 29, 16}, options).requires_grad_(true);
+      auto k = torch::randn({2, 3, 29, 16}, options).requires_grad_(true);
+      auto v = torch::randn({2, 3, 29, 16}, options).requires_grad_(true);
+      auto alpha = (torch::rand({3}, options) + 2.0).requires_grad_(true);
+      auto beta = (torch::randn({3}, options) * 0.1).requires_grad_(true);
+      auto grad_out = torch::randn({2, 3, 29, 16}, options);
+      FuzzyAttentionMask causal;
+      causal.causal = true;
+
+      reference_forward(q, k, v, alpha, beta, causal, membership).backward(grad_out);
+
+      FuzzyAttentionOptions attention;
+      attention.membership = membership;
+      auto context =
+          fuzzy_attention_forward_with_context(q.detach(), k.detach(), v.detach(), alpha.detach(), beta.detach(),
+                                               attention, causal);
+      EXPECT_EQ(context.membership, membership);
+      const std::vector<torch::Tensor> expected = {q.grad(), k.grad(), v.grad(), alpha.grad(), beta.grad()};
+      for (const auto mode : {FuzzyAttentionBackwardMode::kDeterministic, FuzzyAttentionBackwardMode::kAtomic}) {
+        attention.backward_mode = mode;
+        auto grads = fuzzy_attention_backward(grad_out, context, attention);
+        ASSERT_EQ(grads.size(), 5);
+        for (std::size_t i = 0; i < grads.size(); ++i) {
+          EXPECT_TRUE(torch::allclose(grads[i], expected[i], 1e-3, 1e-3))
+              << "device " << device << " membership " << static_cast<int>(membership) << " gradient " << i;
+        }
+      }
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, CompactMembershipPrunesOutsideSupport) {
+#ifdef FUZZFORMER_HAS_TORCH
+  const int seq_len = 200;
+  const int head_dim = 32;
+
+  // As in PrunedForwardMatchesUnpruned: the odd key blocks score near 3,
+  // far outside a support of half-width 1 / alpha = 0.25 around beta = 0.
+  auto options = torch::TensorOptions().dtype(torch::kFloat32);
+  auto u = torch::nn::functional::normalize(torch::randn({head_dim}, options),
+                                            torch::nn::functional::NormalizeFuncOptions().dim(0));
+  const double scale = std::sqrt(static_cast<double>(head_dim));
+  auto far = (torch::arange(seq_len).div(kernels::kPruneBlockKeys, "floor") % 2 == 1)
+                 .to(torch::kFloat32)
+                 .view({1, 1, -1, 1});
+  auto q = torch::randn({2, 2, seq_len, head_dim}, options) * 0.3 + u * scale;
+  auto k = torch::randn({2, 2, seq_len, head_dim}, options) * 0.3 + far * u * (3.0 * scale);
+  auto v = torch::randn({2, 2, seq_len, head_dim}, options);
+  auto alpha = torch::full({2}, 4.0f, options);
+  auto beta = torch::zeros({2}, options);
+
+  for (const auto membership : {FuzzyMembership::kTriangular, FuzzyMembership::kTrapezoidal}) {
+    // Skipping blocks outside the support changes nothing, so epsilon 0
+    // already prunes.
+    metrics::MetricsCollector collector;
+    FuzzyAttentionOptions attention;
+    attention.membership = membership;
+    attention.metrics = &collector;
+    auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, attention);
+    EXPECT_TRUE(torch::allclose(actual, reference_forward(q, k, v, alpha, beta, {}, membership), 1e-4, 1e-5));
+    EXPECT_GT(collector.counter_percent("fuzzy_attention.pruned_key_blocks", "fuzzy_attention.key_blocks"), 25.0);
+
+    // The fused CPU forward never prunes.
+    attention.forward_mode = FuzzyAttentionForwardMode::kFused;
+    EXPECT_TRUE(torch::allclose(actual, fuzzy_attention_forward(q, k, v, alpha, beta, attention), 1e-5, 1e-6));
+  }
+
+  // The Gaussian is never exactly zero, so it only prunes with an epsilon.
+  metrics::MetricsCollector collector;
+  FuzzyAttentionOptions gaussian;
+  gaussian.metrics = &collector;
+  fuzzy_attention_forward(q, k, v, alpha, beta, gaussian);
+  EXPECT_EQ(collector.get_counter("fuzzy_attention.pruned_key_blocks"), 0u);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, LinearForwardRejectsCompactMemberships) {
+#ifdef FUZZFORMER_HAS_TORCH
+  auto q = torch::randn({1, 2, 16, 8});
+  auto alpha = torch::ones({2});
+  auto beta = torch::zeros({2});
+  FuzzyAttentionOptions triangular;
+  triangular.membership = FuzzyMembership::kTriangular;
+  EXPECT_THROW(fuzzy_attention_forward_linear(q, q, q, alpha, beta, {2}, triangular), c10::Error);
+  EXPECT_TRUE(torch::allclose(fuzzy_attention_forward_linear(q, q, q, alpha, beta, {0}, triangular),
+                              fuzzy_attention_forward(q, q, q, alpha, beta, triangular), 1e-5, 1e-6));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, SweepMatchesPerCandidateForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto alpha = torch::rand({5, 4}, options) + 0.5;
+    auto beta = torch::randn({5, 4}, options) * 0.1;
+
+    FuzzyAttentionMask padded_causal;
+    padded_causal.causal = true;
+    padded_causal.key_lengths = torch::tensor({70, 41}, torch::TensorOptions().dtype(torch::kInt32).device(device));
+    FuzzyAttentionMask windowed;
+    windowed.causal = true;
+    windowed.window = 13;
+
+    // Self-attention, and a few queries over grouped keys, token-major.
+    auto q = torch::randn({2, 4, 70, 32}, options);
+    auto k = torch::randn({2, 4, 70, 32}, options);
+    auto v = torch::randn({2, 4, 70, 32}, options);
+    auto q_cross = torch::randn({2, 6, 4, 16}, options);
+    auto k_cross = torch::randn({2, 90, 2, 16}, options);
+    auto v_cross = torch::randn({2, 90, 2, 16}, options);
+    FuzzyAttentionOptions token_major;
+    token_major.layout = FuzzyAttentionLayout::kBSHD;
+
+    for (const auto membership : {FuzzyMembership::kGaussian, FuzzyMembership::kTrapezoidal}) {
+      FuzzyAttentionOptions head_major;
+      head_major.membership = membership;
+      token_major.membership = membership;
+      for (const auto& mask : {FuzzyAttentionMask{}, padded_causal, windowed}) {
+        auto swept = fuzzy_attention_forward_sweep(q, k, v, alpha, beta, head_major, mask);
+        ASSERT_EQ(swept.sizes(), torch::IntArrayRef({5, 2, 4, 70, 32}));
+        auto cross = fuzzy_attention_forward_sweep(q_cross, k_cross, v_cross, alpha, beta, token_major, mask);
+        ASSERT_EQ(cross.sizes(), torch::IntArrayRef({5, 2, 6, 4, 16}));
+        for (int64_t p = 0; p < 5; ++p) {
+          auto expected = fuzzy_attention_forward(q, k, v, alpha[p], beta[p], head_major, mask);
+          EXPECT_TRUE(torch::allclose(swept[p], expected, 1e-5, 1e-6))
+              << "device " << device << " membership " << static_cast<int>(membership) << " candidate " << p
+              << " window " << mask.window;
+          auto expected_cross =
+              fuzzy_attention_forward(q_cross, k_cross, v_cross, alpha[p], beta[p], token_major, mask);
+          EXPECT_TRUE(torch::allclose(cross[p], expected_cross, 1e-5, 1e-6)) << device << " candidate " << p;
+        }
+      }
+    }
+
+    EXPECT_THROW(fuzzy_attention_forward_sweep(q, k, v, alpha[0], beta[0]), c10::Error);
+    EXPECT_THROW(fuzzy_attention_forward_sweep(q, k, v, alpha, beta.narrow(0, 0, 3)), c10::Error);
+    EXPECT_THROW(fuzzy_attention_forward_sweep(q, k, v, alpha.narrow(1, 0, 3), beta.narrow(1, 0, 3)), c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, MembershipTableWithinErrorBound) {
+  const float bound = kernels::membership_table_error_bound();
+  EXPECT_LT(bound, 5e-5f);
+
+  for (const float alpha : {0.5f, 4.0f, 50.0f}) {
+    // t = alpha diff^2 on a grid eight times finer than the buckets, past the
+    // end of the table, on both sides of beta.
+    const float beta = 0.2f;
+    const int count = 10 * kernels::kMembershipTableBuckets;
+    std::vector<float> scores(count);
+    for (int i = 0; i < count; ++i) {
+      const float t = static_cast<float>(i) * kernels::kMembershipTableStep / 8.0f;
+      scores[i] = beta + (i % 2 == 0 ? 1.0f : -1.0f) * std::sqrt(t / alpha);
+    }
+
+    for (const auto isa : {kernels::CpuIsa::kScalar, kernels::CpuIsa::kAvx2, kernels::CpuIsa::kAvx512}) {
+      const auto* table = kernels::cpu_kernel_table(isa);
+      if (table == nullptr) {
+        continue;
+      }
+      std::vector<float> memberships(count);
+      const float sum = table->membership_lookup(scores.data(), count, alpha, beta, memberships.data());
+      double expected_sum = 0.0;
+      for (int i = 0; i < count; ++i) {
+        const double diff = scores[i] - beta;
+        const double t = alpha * diff * diff;
+        ASSERT_NEAR(memberships[i], std::exp(-t), bound)
+            << kernels::to_string(isa) << " alpha " << alpha << " t " << t;
+        ASSERT_NEAR(memberships[i], kernels::GaussianTableMembership::value(scores[i] - beta, alpha), 1e-6f);
+        if (t > kernels::kMembershipTableRange * 1.001) {
+          ASSERT_EQ(memberships[i], 0.0f) << kernels::to_string(isa) << " t " << t;
+        }
+        expected_sum += memberships[i];
+      }
+      EXPECT_NEAR(sum, expected_sum, 1e-4 * expected_sum) << kernels::to_string(isa);
+    }
+
+    using Membership = kernels::GaussianTableMembership;
+    for (const float epsilon : {1e-6f, 1e-3f, 0.1f}) {
+      const float cutoff = Membership::cutoff(alpha, epsilon);
+      EXPECT_LE(Membership::value(cutoff * 1.001f, alpha), epsilon);
+      EXPECT_LT(cutoff, kernels::GaussianMembership::cutoff(alpha, epsilon) * 1.01f);
+    }
+    EXPECT_FLOAT_EQ(Membership::cutoff(alpha, 0.0f), std::sqrt(kernels::kMembershipTableRange / alpha));
+  }
+  EXPECT_TRUE(has_compact_support(FuzzyMembership::kGaussianTable));
+}
+
+TEST(FuzzyAttentionTest, MembershipTableClampsNegativeAlpha) {
+  // alpha < 0 makes t negative; every path reads it as t = 0 rather than
+  // indexing before the table. 37 scores cover the vector bodies and tails.
+  const float alpha = -2.0f;
+  const float beta = 0.1f;
+  std::vector<float> scores(37);
+  for (int i = 0; i < static_cast<int>(scores.size()); ++i) {
+    scores[i] = -1.0f + 0.05f * static_cast<float>(i);
+  }
+  for (const auto isa : {kernels::CpuIsa::kScalar, kernels::CpuIsa::kAvx2, kernels::CpuIsa::kAvx512}) {
+    const auto* table = kernels::cpu_kernel_table(isa);
+    if (table == nullptr) {
+      continue;
+    }
+    std::vector<float> memberships(scores.size());
+    const float sum = table->membership_lookup(scores.data(), static_cast<int>(scores.size()), alpha, beta,
+                                               memberships.data());
+    for (float membership : memberships) {
+      ASSERT_EQ(membership, 1.0f) << kernels::to_string(isa);
+    }
+    EXPECT_FLOAT_EQ(sum, static_cast<float>(scores.size())) << kernels::to_string(isa);
+  }
+  EXPECT_EQ(kernels::GaussianTableMembership::value(0.5f, alpha), 1.0f);
+}
+
+TEST(FuzzyAttentionTest, TableMembershipMatchesGaussian) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 3, 37, 16}, options);
+    auto k = torch::randn({2, 3, 37, 16}, options);
+    auto v = torch::randn({2, 3, 37, 16}, options);
+    auto alpha = torch::rand({3}, options) * 8.0 + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+    FuzzyAttentionMask causal;
+    causal.causal = true;
+
+    // Each membership is within the table's error bound of the Gaussian, and
+    // the outputs are averages over the keys, so they stay within a few times
+    // that bound of the exact forward.
+    for (const auto mode : {FuzzyAttentionForwardMode::kTwoPass, FuzzyAttentionForwardMode::kFused,
+                            FuzzyAttentionForwardMode::kTiled}) {
+      FuzzyAttentionOptions attention;
+      attention.forward_mode = mode;
+      attention.membership = FuzzyMembership::kGaussianTable;
+      for (const auto& mask : {FuzzyAttentionMask{}, causal}) {
+        auto actual = fuzzy_attention_forward(q, k, v, alpha, beta, attention, mask);
+        EXPECT_TRUE(torch::allclose(actual, reference_forward(q, k, v, alpha, beta, mask), 1e-3, 1e-3))
+            << "device " << device << " mode " << static_cast<int>(mode) << " causal " << mask.causal;
+      }
+    }
+
+    // Like the Gaussian, the table only prunes with an epsilon.
+    metrics::MetricsCollector collector;
+    FuzzyAttentionOptions unpruned;
+    unpruned.membership = FuzzyMembership::kGaussianTable;
+    unpruned.metrics = &collector;
+    fuzzy_attention_forward(q, k, v, alpha, beta, unpruned);
+    EXPECT_EQ(collector.get_counter("fuzzy_attention.key_blocks"), 0u) << "device " << device;
+
+    auto qg = q.clone().requires_grad_(true);
+    auto kg = k.clone().requires_grad_(true);
+    auto vg = v.clone().requires_grad_(true);
+    auto alpha_g = alpha.clone().requires_grad_(true);
+    auto beta_g = beta.clone().requires_grad_(true);
+    auto grad_out = torch::randn({2, 3, 37, 16}, options);
+    reference_forward(qg, kg, vg, alpha_g, beta_g, causal).backward(grad_out);
+
+    FuzzyAttentionOptions attention;
+    attention.membership = FuzzyMembership::kGaussianTable;
+    auto context = fuzzy_attention_forward_with_context(q, k, v, alpha, beta, attention, causal);
+    auto grads = fuzzy_attention_backward(grad_out, context, attention);
+    const std::vector<torch::Tensor> expected = {qg.grad(), kg.grad(), vg.grad(), alpha_g.grad(), beta_g.grad()};
+    ASSERT_EQ(grads.size(), expected.size());
+    for (std::size_t i = 0; i < grads.size(); ++i) {
+      EXPECT_TRUE(torch::allclose(grads[i], expected[i], 1e-2, 1e-2)) << "device " << device << " gradient " << i;
+    }
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, HalfStorageTiledForwardMatchesFloat) {
+  // Widening is exact and the arithmetic is the float32 forward's, so the
+  // 16-bit forward is the float forward of the widened inputs, rounded once.
+  constexpr int kBatch = 2;
+  constexpr int kHeads = 2;
+  constexpr int kTokens = 70;
+  constexpr int kHeadDim = 32;
+  constexpr std::size_t kElements = static_cast<std::size_t>(kBatch) * kHeads * kTokens * kHeadDim;
+  std::mt19937 rng(5);
+  std::normal_distribution<float> dist;
+  const std::vector<float> alpha = {0.8f, 3.0f};
+  const std::vector<float> beta = {0.0f, 0.1f};
+  const std::vector<int> key_lengths = {70, 41};
+  const kernels::CpuTileConfig tiles{8, 16};
+
+  for (const auto storage : {kernels::StorageType::kFloat16, kernels::StorageType::kBFloat16}) {
+    const bool half = storage == kernels::StorageType::kFloat16;
+    std::vector<std::uint16_t> q(kElements), k(kElements), v(kElements), output(kElements);
+    std::vector<float> q_wide(kElements), k_wide(kElements), v_wide(kElements), expected(kElements);
+    for (auto [bits, wide] : {std::pair{&q, &q_wide}, std::pair{&k, &k_wide}, std::pair{&v, &v_wide}}) {
+      for (std::size_t i = 0; i < kElements; ++i) {
+        (*bits)[i] = half ? kernels::float_to_half(dist(rng)) : kernels::float_to_bfloat16(dist(rng));
+        (*wide)[i] = half ? kernels::half_to_float((*bits)[i]) : kernels::bfloat16_to_float((*bits)[i]);
+      }
+    }
+
+    for (const bool causal : {false, true}) {
+      std::vector<float> norms(kBatch * kHeads * kTokens), expected_norms(norms.size());
+      kernels::fuzzy_attention_forward_tiled_cpu(q_wide.data(), k_wide.data(), v_wide.data(), alpha.data(),
+                                                 beta.data(), FuzzyMembership::kGaussian, expected.data(),
+                                                 expected_norms.data(), key_lengths.data(), causal, 0, kBatch, kHeads,
+                                                 kTokens, kTokens, kHeadDim, tiles, nullptr, nullptr);
+      kernels::fuzzy_attention_forward_tiled_cpu(q.data(), k.data(), v.data(), storage, alpha.data(), beta.data(),
+                                                 FuzzyMembership::kGaussian, output.data(), norms.data(),
+                                                 key_lengths.data(), causal, 0, kBatch, kHeads, kTokens, kTokens,
+                                                 kHeadDim, tiles, nullptr, nullptr);
+      EXPECT_EQ(norms, expected_norms);
+      for (std::size_t i = 0; i < kElements; ++i) {
+        ASSERT_EQ(output[i], half ? kernels::float_to_half(expected[i]) : kernels::float_to_bfloat16(expected[i]))
+            << "storage " << static_cast<int>(storage) << " causal " << causal << " element " << i;
+      }
+    }
+  }
+}
+
+TEST(FuzzyAttentionTest, HalfStorageDecodeAndBackwardMatchFloat) {
+  // As for the tiled forward, each 16-bit kernel must equal its float32
+  // counterpart on the widened inputs with the results rounded once.
+  constexpr int kBatch = 2;
+  constexpr int kHeads = 2;
+  constexpr int kTokens = 70;
+  constexpr int kHeadDim = 32;
+  constexpr int kNewTokens = 3;
+  constexpr int kPageRows = 16;
+  constexpr int kPagesPerSequence = (kTokens + kPageRows - 1) / kPageRows;
+  constexpr std::size_t kElements = static_cast<std::size_t>(kBatch) * kHeads * kTokens * kHeadDim;
+  constexpr std::size_t kNewElements = static_cast<std::size_t>(kBatch) * kHeads * kNewTokens * kHeadDim;
+  constexpr std::size_t kPoolElements =
+      static_cast<std::size_t>(kBatch) * kPagesPerSequence * kHeads * kPageRows * kHeadDim;
+  std::mt19937 rng(6);
+  std::normal_distribution<float> dist;
+  const std::vector<float> alpha = {0.8f, 3.0f};
+  const std::vector<float> beta = {0.0f, 0.1f};
+  const std::vector<int> seq_lengths = {70, 41};
+
+  // Sequence b's pages in reverse pool order.
+  std::vector<int> block_tables(kBatch * kPagesPerSequence);
+  for (int b = 0; b < kBatch; ++b) {
+    for (int page = 0; page < kPagesPerSequence; ++page) {
+      block_tables[b * kPagesPerSequence + page] = (kBatch - b) * kPagesPerSequence - 1 - page;
+    }
+  }
+  auto to_pool = [&](const auto& rows) {
+    std::vector<typename std::decay_t<decltype(rows)>::value_type> pool(kPoolElements);
+    for (int b = 0; b < kBatch; ++b) {
+      for (int h = 0; h < kHeads; ++h) {
+        for (int j = 0; j < kTokens; ++j) {
+          const std::size_t page = block_tables[b * kPagesPerSequence + j / kPageRows];
+          std::copy_n(rows.begin() + ((static_cast<std::size_t>(b) * kHeads + h) * kTokens + j) * kHeadDim,
+                      kHeadDim,
+                      pool.begin() + ((page * kHeads + h) * kPageRows + j % kPageRows) * kHeadDim);
+        }
+      }
+    }
+    return pool;
+  };
+
+  // The decode queries are the last kNewTokens rows of q, read in place.
+  const std::size_t new_rows = static_cast<std::size_t>(kTokens - kNewTokens) * kHeadDim;
+  auto strides = kernels::contiguous_strides(kHeads, kTokens, kTokens, kHeadDim);
+  strides.output = kernels::contiguous_tensor_strides(kHeads, kNewTokens, kHeadDim);
+
+  for (const auto storage : {kernels::StorageType::kFloat16, kernels::StorageType::kBFloat16}) {
+    const bool half = storage == kernels::StorageType::kFloat16;
+    auto round = [&](float value) { return half ? kernels::float_to_half(value) : kernels::float_to_bfloat16(value); };
+    std::vector<std::uint16_t> q(kElements), k(kElements), v(kElements), grad(kElements);
+    std::vector<float> q_wide(kElements), k_wide(kElements), v_wide(kElements), grad_wide(kElements);
+    for (auto [bits, wide] : {std::pair{&q, &q_wide}, std::pair{&k, &k_wide}, std::pair{&v, &v_wide},
+                              std::pair{&grad, &grad_wide}}) {
+      for (std::size_t i = 0; i < kElements; ++i) {
+        (*bits)[i] = round(dist(rng));
+        (*wide)[i] = half ? kernels::half_to_float((*bits)[i]) : kernels::bfloat16_to_float((*bits)[i]);
+      }
+    }
+    auto expect_rounded = [&](const std::vector<std::uint16_t>& actual, const std::vector<float>& expected,
+                              const char* what) {
+      ASSERT_EQ(actual.size(), expected.size());
+      for (std::size_t i = 0; i < actual.size(); ++i) {
+        ASSERT_EQ(actual[i], round(expected[i])) << what << " storage " << static_cast<int>(storage) << " element "
+                                                 << i;
+      }
+    };
+
+    for (const int key_splits : {1, 3}) {
+      kernels::CpuTileConfig tiles{8, 16};
+      tiles.key_splits = key_splits;
+      std::vector<std::uint16_t> output(kNewElements);
+      std::vector<float> expected(kNewElements);
+      kernels::fuzzy_attention_forward_cached_cpu(q_wide.data() + new_rows, k_wide.data(), v_wide.data(),
+                                                  alpha.data(), beta.data(), FuzzyMembership::kGaussian,
+                                                  expected.data(), kBatch, kHeads, kNewTokens, kTokens, kHeadDim, 0,
+                                                  0, tiles, strides);
+      kernels::fuzzy_attention_forward_cached_cpu(q.data() + new_rows, k.data(), v.data(), storage, alpha.data(),
+                                                  beta.data(), FuzzyMembership::kGaussian, output.data(), kBatch,
+                                                  kHeads, kNewTokens, kTokens, kHeadDim, 0, 0, tiles, strides);
+      expect_rounded(output, expected, "cached");
+
+      const auto k_pool = to_pool(k), v_pool = to_pool(v);
+      const auto k_pool_wide = to_pool(k_wide), v_pool_wide = to_pool(v_wide);
+      kernels::fuzzy_attention_forward_paged_cpu(q_wide.data() + new_rows, k_pool_wide.data(), v_pool_wide.data(),
+                                                 block_tables.data(), seq_lengths.data(), alpha.data(), beta.data(),
+                                                 FuzzyMembership::kGaussian, expected.data(), kBatch, kHeads, kHeads,
+                                                 kNewTokens, kHeadDim, kPageRows, kPagesPerSequence, tiles,
+                                                 strides.queries, strides.output);
+      kernels::fuzzy_attention_forward_paged_cpu(q.data() + new_rows, k_pool.data(), v_pool.data(), storage,
+                                                 block_tables.data(), seq_lengths.data(), alpha.data(), beta.data(),
+                                                 FuzzyMembership::kGaussian, output.data(), kBatch, kHeads, kHeads,
+                                                 kNewTokens, kHeadDim, kPageRows, kPagesPerSequence, tiles,
+                                                 strides.queries, strides.output);
+      expect_rounded(output, expected, "paged");
+    }
+
+    std::vector<std::uint16_t> d_queries(kElements), d_keys(kElements), d_values(kElements);
+    std::vector<float> dq_expected(kElements), dk_expected(kElements), dv_expected(kElements);
+    std::vector<float> d_alpha(kHeads), d_beta(kHeads), d_alpha_expected(kHeads), d_beta_expected(kHeads);
+    kernels::fuzzy_attention_backward_cpu(grad_wide.data(), q_wide.data(), k_wide.data(), v_wide.data(),
+                                          alpha.data(), beta.data(), FuzzyMembership::kGaussian, nullptr,
+                                          seq_lengths.data(), true, 0, dq_expected.data(), dk_expected.data(),
+                                          dv_expected.data(), d_alpha_expected.data(), d_beta_expected.data(),
+                                          kBatch, kHeads, kTokens, kTokens, kHeadDim);
+    kernels::fuzzy_attention_backward_cpu(grad.data(), q.data(), k.data(), v.data(), storage, alpha.data(),
+                                          beta.data(), FuzzyMembership::kGaussian, nullptr, seq_lengths.data(), true,
+                                          0, d_queries.data(), d_keys.data(), d_values.data(), d_alpha.data(),
+                                          d_beta.data(), kBatch, kHeads, kTokens, kTokens, kHeadDim);
+    expect_rounded(d_queries, dq_expected, "d_queries");
+    expect_rounded(d_keys, dk_expected, "d_keys");
+    expect_rounded(d_values, dv_expected, "d_values");
+    EXPECT_EQ(d_alpha, d_alpha_expected);
+    EXPECT_EQ(d_beta, d_beta_expected);
+  }
+}
+
+TEST(FuzzyAttentionTest, HalfPrecisionForwardAndBackward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto alpha = torch::rand({3}, options) + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+    FuzzyAttentionMask causal;
+    causal.causal = true;
+
+    for (const auto dtype : {torch::kHalf, torch::kBFloat16}) {
+      auto q = torch::randn({2, 3, 33, 16}, options).to(dtype);
+      auto k = torch::randn({2, 3, 33, 16}, options).to(dtype);
+      auto v = torch::randn({2, 3, 33, 16}, options).to(dtype);
+      auto grad_out = torch::randn({2, 3, 33, 16}, options).to(dtype);
+      const double tolerance = dtype == torch::kHalf ? 2e-3 : 2e-2;
+
+      // Exact float32 results on the same (rounded) inputs.
+      FuzzyAttentionOptions attention;
+      auto expected = fuzzy_attention_forward_with_context(q.to(torch::kFloat32), k.to(torch::kFloat32),
+                                                           v.to(torch::kFloat32), alpha, beta, attention, causal);
+      auto expected_grads = fuzzy_attention_backward(grad_out.to(torch::kFloat32), expected, attention);
+
+      for (const auto mode : {FuzzyAttentionForwardMode::kAuto, FuzzyAttentionForwardMode::kFused}) {
+        attention.forward_mode = mode;
+        auto context = fuzzy_attention_forward_with_context(q, k, v, alpha, beta, attention, causal);
+        ASSERT_EQ(context.output.scalar_type(), dtype);
+        EXPECT_EQ(context.row_norms.scalar_type(), torch::kFloat32);
+        EXPECT_TRUE(torch::allclose(context.output.to(torch::kFloat32), expected.output, tolerance, tolerance))
+            << "device " << device << " dtype " << dtype << " mode " << static_cast<int>(mode);
+
+        auto grads = fuzzy_attention_backward(grad_out, context, attention);
+        ASSERT_EQ(grads.size(), expected_grads.size());
+        for (std::size_t i = 0; i < grads.size(); ++i) {
+          EXPECT_EQ(grads[i].scalar_type(), i < 3 ? dtype : torch::kFloat32);
+          EXPECT_TRUE(torch::allclose(grads[i].to(torch::kFloat32), expected_grads[i], tolerance, tolerance))
+              << "device " << device << " dtype " << dtype << " gradient " << i;
+        }
+      }
+
+      // The decode forward reads the same 16-bit cache.
+      auto new_queries = q.narrow(2, 30, 3);
+      auto cached = fuzzy_attention_forward_cached(new_queries, k, v, alpha, beta);
+      ASSERT_EQ(cached.scalar_type(), dtype);
+      auto expected_cached = fuzzy_attention_forward_cached(new_queries.to(torch::kFloat32), k.to(torch::kFloat32),
+                                                            v.to(torch::kFloat32), alpha, beta);
+      EXPECT_TRUE(torch::allclose(cached.to(torch::kFloat32), expected_cached, tolerance, tolerance))
+          << "device " << device << " dtype " << dtype << " cached";
+    }
+
+    auto q = torch::randn({1, 3, 8, 16}, options);
+    EXPECT_THROW(fuzzy_attention_forward(q.to(torch::kFloat64), q.to(torch::kFloat64), q.to(torch::kFloat64), alpha,
+                                         beta),
+                 c10::Error);
+    EXPECT_THROW(fuzzy_attention_forward(q.to(torch::kHalf), q, q, alpha, beta), c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(FuzzyAttentionTest, Int8ScoresBoundedError) {
+  // The model's heads run alpha around 1 and beta around 0; the sweep covers
+  // a few times either side. Per-row quantisation moves a score by about
+  // ||q|| ||k|| / (127 head_dim), and the Gaussian turns that into relative
+  // weight errors of 2 alpha |s - beta| times as much, largest for the first
+  // causal rows, which average only a few keys.
+  constexpr int kHeads = 4;
+  constexpr int kTokens = 150;
+  constexpr int kHeadDim = 64;
+  constexpr std::size_t kElements = static_cast<std::size_t>(kHeads) * kTokens * kHeadDim;
+  std::mt19937 rng(23);
+  std::normal_distribution<float> dist;
+  std::vector<float> q(kElements), k(kElements), v(kElements), expected(kElements), output(kElements);
+  for (auto* buffer : {&q, &k, &v}) {
+    for (auto& x : *buffer) {
+      x = dist(rng);
+    }
+  }
+  const kernels::CpuTileConfig tiles{16, 64};
+  kernels::CpuTileConfig int8_tiles = tiles;
+  int8_tiles.int8_scores = true;
+
+  for (const float alpha_value : {0.25f, 1.0f, 4.0f}) {
+    for (const float beta_value : {-0.5f, 0.0f, 0.5f}) {
+      const std::vector<float> alpha(kHeads, alpha_value);
+      const std::vector<float> beta(kHeads, beta_value);
+      for (const bool causal : {false, true}) {
+        kernels::fuzzy_attention_forward_tiled_cpu(q.data(), k.data(), v.data(), alpha.data(), beta.data(),
+                                                   FuzzyMembership::kGaussian, expected.data(), nullptr, nullptr,
+                                                   causal, 0, 1, kHeads, kTokens, kTokens, kHeadDim, tiles, nullptr,
+                                                   nullptr);
+        kernels::fuzzy_attention_forward_tiled_cpu(q.data(), k.data(), v.data(), alpha.data(), beta.data(),
+                                                   FuzzyMembership::kGaussian, output.data(), nullptr, nullptr,
+                                                   causal, 0, 1, kHeads, kTokens, kTokens, kHeadDim, int8_tiles,
+                                                   nullptr, nullptr);
+        double max_error = 0.0;
+        double total_error = 0.0;
+        for (std::size_t i = 0; i < kElements; ++i) {
+          const double error = std::abs(static_cast<double>(output[i]) - expected[i]);
+          max_error = std::max(max_error, error);
+          total_error += error;
+        }
+        // A few 1e-3 at most and about 1e-4 on average at alpha 1, growing
+        // with alpha.
+        const double scale = std::max(1.0f, alpha_value);
+        EXPECT_LT(max_error, 5e-3 * scale)
+            << "alpha " << alpha_value << " beta " << beta_value << " causal " << causal;
+        EXPECT_LT(total_error / kElements, 2e-4 * scale)
+            << "alpha " << alpha_value << " beta " << beta_value << " causal " << causal;
+      }
+    }
+  }
+}
+
+TEST(FuzzyAttentionTest, Int8ScoresVarlenAndGroupedHeads) {
+  // Grouped K/V heads share one quantised copy of each key row, and packed
+  // sequences quantise theirs in place, so both must stay as close to the
+  // float forward as the plain one does at alpha near 1.
+  constexpr int kHeads = 4;
+  constexpr int kKvHeads = 2;
+  constexpr int kTokens = 150;
+  constexpr int kHeadDim = 64;
+  const std::size_t query_elements = static_cast<std::size_t>(kHeads) * kTokens * kHeadDim;
+  const std::size_t key_elements = static_cast<std::size_t>(kKvHeads) * kTokens * kHeadDim;
+  std::mt19937 rng(24);
+  std::normal_distribution<float> dist;
+  std::vector<float> q(query_elements), k(key_elements), v(key_elements);
+  for (auto* buffer : {&q, &k, &v}) {
+    for (auto& x : *buffer) {
+      x = dist(rng);
+    }
+  }
+  const std::vector<float> alpha = {0.5f, 0.75f, 1.0f, 1.0f};
+  const std::vector<float> beta = {-0.25f, 0.0f, 0.25f, 0.5f};
+  const kernels::CpuTileConfig tiles{16, 64};
+  kernels::CpuTileConfig int8_tiles = tiles;
+  int8_tiles.int8_scores = true;
+
+  auto expect_close = [&](const std::vector<float>& output, const std::vector<float>& expected, const char* path,
+                          bool causal) {
+    double max_error = 0.0;
+    double total_error = 0.0;
+    for (std::size_t i = 0; i < query_elements; ++i) {
+      const double error = std::abs(static_cast<double>(output[i]) - expected[i]);
+      max_error = std::max(max_error, error);
+      total_error += error;
+    }
+    EXPECT_GT(max_error, 0.0) << path << " causal " << causal;
+    EXPECT_LT(max_error, 5e-3) << path << " causal " << causal;
+    EXPECT_LT(total_error / query_elements, 2e-4) << path << " causal " << causal;
+  };
+
+  auto strides = kernels::contiguous_strides(kHeads, kTokens, kTokens, kHeadDim);
+  strides.keys = kernels::contiguous_tensor_strides(kKvHeads, kTokens, kHeadDim);
+  strides.keys.head_group = kHeads / kKvHeads;
+  strides.values = strides.keys;
+  // The empty sequence owns no work items.
+  const std::vector<int> cu_seqlens = {0, 37, 37, 131, kTokens};
+  const int num_seqs = static_cast<int>(cu_seqlens.size()) - 1;
+
+  std::vector<float> expected(query_elements), output(query_elements);
+  for (const bool causal : {false, true}) {
+    kernels::fuzzy_attention_forward_tiled_cpu(q.data(), k.data(), v.data(), alpha.data(), beta.data(),
+                                               FuzzyMembership::kGaussian, expected.data(), nullptr, nullptr, causal,
+                                               0, 1, kHeads, kTokens, kTokens, kHeadDim, tiles, nullptr, &strides);
+    kernels::fuzzy_attention_forward_tiled_cpu(q.data(), k.data(), v.data(), alpha.data(), beta.data(),
+                                               FuzzyMembership::kGaussian, output.data(), nullptr, nullptr, causal,
+                                               0, 1, kHeads, kTokens, kTokens, kHeadDim, int8_tiles, nullptr,
+                                               &strides);
+    expect_close(output, expected, "grouped", causal);
+
+    kernels::fuzzy_attention_forward_varlen_cpu(q.data(), k.data(), v.data(), alpha.data(), beta.data(),
+                                                FuzzyMembership::kGaussian, expected.data(), cu_seqlens.data(),
+                                                causal, 0, num_seqs, kHeads, kKvHeads, kHeadDim, tiles);
+    kernels::fuzzy_attention_forward_varlen_cpu(q.data(), k.data(), v.data(), alpha.data(), beta.data(),
+                                                FuzzyMembership::kGaussian, output.data(), cu_seqlens.data(),
+                                                causal, 0, num_seqs, kHeads, kKvHeads, kHeadDim, int8_tiles);
+    expect_close(output, expected, "varlen", causal);
+  }
+}
+
+TEST(FuzzyAttentionTest, Int8ScoresOption) {
+#ifdef FUZZFORMER_HAS_TORCH
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+
+  for (const auto& device : devices) {
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    auto q = torch::randn({2, 3, 40, 32}, options);
+    auto k = torch::randn({2, 3, 40, 32}, options);
+    auto v = torch::randn({2, 3, 40, 32}, options);
+    auto alpha = torch::rand({3}, options) + 0.5;
+    auto beta = torch::randn({3}, options) * 0.1;
+    FuzzyAttentionMask causal;
+    causal.causal = true;
+
+    auto expected = fuzzy_attention_forward(q, k, v, alpha, beta, {}, causal);
+    FuzzyAttentionOptions int8;
+    int8.int8_scores = true;
+    auto output = fuzzy_attention_forward(q, k, v, alpha, beta, int8, causal);
+    EXPECT_TRUE(torch::allclose(output, expected, 1e-2, 1e-2)) << "device " << device;
+    if (device.is_cpu()) {
+      EXPECT_FALSE(torch::equal(output, expected));
+      // 16-bit storage quantises the widened rows the same way.
+      auto half = fuzzy_attention_forward(q.to(torch::kHalf), k.to(torch::kHalf), v.to(torch::kHalf), alpha, beta,
+                                          int8, causal);
+      EXPECT_TRUE(torch::allclose(half.to(torch::kFloat32), expected, 1e-2, 1e-2));
+
+      // The packed forward takes it too, with grouped K/V heads.
+      auto pack = [](const torch::Tensor& x) { return x.permute({0, 2, 1, 3}).reshape({-1, x.size(1), x.size(3)}); };
+      auto grouped_k = k.narrow(1, 0, 1);
+      auto grouped_v = v.narrow(1, 0, 1);
+      auto cu_seqlens = torch::tensor({0, 40, 80}, torch::kInt32);
+      auto expected_packed =
+          fuzzy_attention_forward_varlen(pack(q), pack(grouped_k), pack(grouped_v), cu_seqlens, alpha, beta, true);
+      auto packed = fuzzy_attention_forward_varlen(pack(q), pack(grouped_k), pack(grouped_v), cu_seqlens, alpha, beta,
+                                                   true, 0, FuzzyMembership::kGaussian, true);
+      EXPECT_TRUE(torch::allclose(packed, expected_packed, 1e-2, 1e-2));
+      EXPECT_FALSE(torch::equal(packed, expected_packed));
+    }
+    EXPECT_THROW(fuzzy_attention_forward_with_context(q, k, v, alpha, beta, int8, causal), c10::Error);
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+}  // namespace fuzzformer
@@ -39,6 +39,30 @@ TEST(MetricsCollectorTest, HandlesMissingMetrics) {
   EXPECT_EQ(metrics.duration_us, 0.0);
 }
 
+TEST(MetricsCollectorTest, AccumulatesCounters) {
+  MetricsCollector collector;
+  EXPECT_EQ(collector.get_counter("blocks"), 0u);
+  EXPECT_EQ(collector.counter_percent("skipped", "blocks"), 0.0);
+
+  collector.add_counter("blocks", 30);
+  collector.add_counter("blocks", 10);
+  collector.add_counter("skipped", 10);
+  EXPECT_EQ(collector.get_counter("blocks"), 40u);
+  EXPECT_DOUBLE_EQ(collector.counter_percent("skipped", "blocks"), 25.0);
+
+  collector.reset_counters();
+  EXPECT_EQ(collector.get_counter("blocks"), 0u);
+}
+
+TEST(MetricsCollectorTest, GaugesKeepLatestValue) {
+  MetricsCollector collector;
+  EXPECT_EQ(collector.get_gauge("occupancy"), 0.0);
+
+  collector.set_gauge("occupancy", 40.0);
+  collector.set_gauge("occupancy", 12.5);
+  EXPECT_DOUBLE_EQ(collector.get_gauge("occupancy"), 12.5);
+}
+
 }  // namespace metrics
 }  // namespace fuzzformer
 
@@ -1,7 +1,13 @@
 #include <gtest/gtest.h>
 
+#include <filesystem>
+#include <vector>
+
+#include "fuzzformer/checkpoint.h"
+#include "fuzzformer/kvCache.h"
 #include "fuzzformer/model.h"
 #include "fuzzformer/modelConfig.h"
+#include "fuzzformer/pagedKvCache.h"
 
 #ifdef FUZZFORMER_HAS_TORCH
 #include <torch/torch.h>
@@ -24,7 +30,331 @@ TEST(ModelInferenceTest, OutputMatchesInputShape) {
 #endif
 }
 
-}  // namespace fuzzformer
+TEST(ModelInferenceTest, PackedVarlenMatchesPerSequenceForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_layers = 2;
+
+  auto model = FuzzFormer(config);
+  const std::vector<int64_t> lengths = {5, 17, 2};
+  auto input = torch::randn({24, static_cast<long>(config.model_dim)});
+  auto cu_seqlens = torch::tensor({0, 5, 22, 24}, torch::TensorOptions().dtype(torch::kInt32));
+
+  auto packed = model->forward_varlen(input, cu_seqlens, true);
+  ASSERT_EQ(packed.sizes(), input.sizes());
+
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  int64_t offset = 0;
+  for (const auto length : lengths) {
+    auto expected = model->forward(input.slice(0, offset, offset + length).unsqueeze(0), mask).squeeze(0);
+    EXPECT_TRUE(torch::allclose(packed.slice(0, offset, offset + length), expected, 1e-4, 1e-5));
+    offset += length;
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
 
+TEST(ModelInferenceTest, StepMatchesCausalForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_layers = 2;
 
+  auto model = FuzzFormer(config);
+  auto input = torch::randn({2, 12, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  auto expected = model->forward(input, mask);
 
+  // A 5-token prompt, then one token per step.
+  KVCache cache(config, 2, 16);
+  auto prompt = model->step(input.slice(1, 0, 5), cache);
+  EXPECT_EQ(cache.length(), 5);
+  EXPECT_TRUE(torch::allclose(prompt, expected.slice(1, 0, 5), 1e-4, 1e-5));
+  for (int64_t position = 5; position < 12; ++position) {
+    auto output = model->step(input.slice(1, position, position + 1), cache);
+    EXPECT_TRUE(torch::allclose(output, expected.slice(1, position, position + 1), 1e-4, 1e-5))
+        << "position " << position;
+  }
+  EXPECT_EQ(cache.length(), 12);
+  EXPECT_EQ(cache.keys(0).sizes(), torch::IntArrayRef({2, 4, 12, 16}));
+
+  EXPECT_THROW(model->step(input.slice(1, 0, 5), cache), c10::Error);
+  cache.reset();
+  EXPECT_TRUE(torch::allclose(model->step(input.slice(1, 0, 5), cache), prompt, 1e-5, 1e-6));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(ModelInferenceTest, WindowedStepMatchesWindowedForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_layers = 2;
+  config.attention_windows = {4};
+
+  auto model = FuzzFormer(config);
+  auto input = torch::randn({2, 20, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  auto expected = model->forward(input, mask);
+
+  // Layer 0 keeps a 4-row ring, which the 6-token prompt grows to 9 rows
+  // until the step ends; layer 1 is unwindowed and keeps all 20 positions.
+  KVCache cache(config, 2, 20);
+  EXPECT_EQ(cache.window(0), 4);
+  EXPECT_EQ(cache.window(1), 0);
+  EXPECT_EQ(cache.keys(0).size(2), 4);
+  auto prompt = model->step(input.slice(1, 0, 6), cache);
+  EXPECT_TRUE(torch::allclose(prompt, expected.slice(1, 0, 6), 1e-4, 1e-5));
+  EXPECT_EQ(cache.keys(0).size(2), 4);
+  for (int64_t position = 6; position < 20; position += 2) {
+    auto output = model->step(input.slice(1, position, position + 2), cache);
+    EXPECT_TRUE(torch::allclose(output, expected.slice(1, position, position + 2), 1e-4, 1e-5))
+        << "position " << position;
+  }
+  EXPECT_EQ(cache.keys(0).size(2), 4);
+  EXPECT_EQ(cache.keys(1).size(2), 20);
+
+  PagedKVCache paged(config, 8, 4);
+  EXPECT_THROW(model->step(input.slice(1, 0, 1), paged, {paged.add_sequence(), paged.add_sequence()}), c10::Error);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(ModelInferenceTest, PagedStepMatchesCausalForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_layers = 2;
+
+  auto model = FuzzFormer(config);
+  auto input = torch::randn({2, 12, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  auto expected = model->forward(input, mask);
+
+  // Sequence a starts with a 7-token prompt; b joins later with 2 tokens, so
+  // the two decode together at different lengths.
+  PagedKVCache cache(config, 8, 4);
+  const auto a = cache.add_sequence();
+  const auto b = cache.add_sequence();
+  auto prompt = model->step(input.slice(0, 0, 1).slice(1, 0, 7), cache, {a});
+  EXPECT_TRUE(torch::allclose(prompt, expected.slice(0, 0, 1).slice(1, 0, 7), 1e-4, 1e-5));
+  model->step(input.slice(0, 1, 2).slice(1, 0, 2), cache, {b});
+  for (int64_t step = 0; step < 5; ++step) {
+    auto tokens = torch::cat({input.slice(0, 0, 1).slice(1, 7 + step, 8 + step),
+                              input.slice(0, 1, 2).slice(1, 2 + step, 3 + step)});
+    auto output = model->step(tokens, cache, {a, b});
+    EXPECT_TRUE(torch::allclose(output.slice(0, 0, 1), expected.slice(0, 0, 1).slice(1, 7 + step, 8 + step), 1e-4,
+                                1e-5))
+        << "step " << step;
+    EXPECT_TRUE(torch::allclose(output.slice(0, 1, 2), expected.slice(0, 1, 2).slice(1, 2 + step, 3 + step), 1e-4,
+                                1e-5))
+        << "step " << step;
+  }
+  EXPECT_EQ(cache.length(a), 12);
+  EXPECT_EQ(cache.length(b), 7);
+
+  // 12 + 7 tokens in 3 + 2 blocks of 4: 5 of 8 blocks used, 1 of 20 positions spare.
+  metrics::MetricsCollector collector;
+  cache.report_metrics(collector);
+  EXPECT_DOUBLE_EQ(collector.get_gauge("kv_pool.blocks_used"), 5.0);
+  EXPECT_DOUBLE_EQ(collector.get_gauge("kv_pool.tokens"), 19.0);
+  EXPECT_DOUBLE_EQ(collector.get_gauge("kv_pool.occupancy_percent"), 62.5);
+  EXPECT_DOUBLE_EQ(collector.get_gauge("kv_pool.fragmentation_percent"), 5.0);
+
+  // Finished sequences return their blocks: 6 of the 8 are free again, one
+  // short of the 7 a 25-token prompt needs.
+  cache.remove_sequence(a);
+  EXPECT_EQ(cache.free_blocks(), 6);
+  const auto c = cache.add_sequence();
+  EXPECT_THROW(model->step(torch::randn({1, 25, 64}), cache, {c}), c10::Error);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(ModelInferenceTest, GroupedQueryStepMatchesCausalForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_kv_heads = 2;
+  config.num_layers = 2;
+
+  auto model = FuzzFormer(config);
+  auto input = torch::randn({2, 9, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  auto expected = model->forward(input, mask);
+
+  auto packed = model->forward_varlen(input.reshape({18, 64}),
+                                      torch::tensor({0, 9, 18}, torch::TensorOptions().dtype(torch::kInt32)), true);
+  EXPECT_TRUE(torch::allclose(packed.view({2, 9, 64}), expected, 1e-4, 1e-5));
+
+  // The caches hold 2 K/V heads per layer, half of the 4 query heads.
+  KVCache cache(config, 2, 9);
+  EXPECT_EQ(cache.keys(0).size(1), 2);
+  auto prompt = model->step(input.slice(1, 0, 4), cache);
+  EXPECT_TRUE(torch::allclose(prompt, expected.slice(1, 0, 4), 1e-4, 1e-5));
+  for (int64_t position = 4; position < 9; ++position) {
+    auto output = model->step(input.slice(1, position, position + 1), cache);
+    EXPECT_TRUE(torch::allclose(output, expected.slice(1, position, position + 1), 1e-4, 1e-5))
+        << "position " << position;
+  }
+
+  PagedKVCache paged(config, 6, 4);
+  EXPECT_EQ(paged.key_pool(0).size(1), 2);
+  const auto a = paged.add_sequence();
+  const auto b = paged.add_sequence();
+  EXPECT_TRUE(torch::allclose(model->step(input, paged, {a, b}), expected, 1e-4, 1e-5));
+
+  config.num_kv_heads = 3;
+  EXPECT_THROW(FuzzFormer{config}, c10::Error);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(ModelInferenceTest, CompactMembershipStepMatchesCausalForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_layers = 2;
+  config.membership = FuzzyMembership::kTrapezoidal;
+
+  auto model = FuzzFormer(config);
+  auto input = torch::randn({2, 10, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  auto expected = model->forward(input, mask);
+
+  // Every path reads the membership from the config.
+  auto packed = model->forward_varlen(input.reshape({20, 64}),
+                                      torch::tensor({0, 10, 20}, torch::TensorOptions().dtype(torch::kInt32)), true);
+  EXPECT_TRUE(torch::allclose(packed.view({2, 10, 64}), expected, 1e-4, 1e-5));
+
+  KVCache cache(config, 2, 10);
+  auto prompt = model->step(input.slice(1, 0, 4), cache);
+  EXPECT_TRUE(torch::allclose(prompt, expected.slice(1, 0, 4), 1e-4, 1e-5));
+  for (int64_t position = 4; position < 10; ++position) {
+    auto output = model->step(input.slice(1, position, position + 1), cache);
+    EXPECT_TRUE(torch::allclose(output, expected.slice(1, position, position + 1), 1e-4, 1e-5))
+        << "position " << position;
+  }
+
+  PagedKVCache paged(config, 6, 4);
+  const auto a = paged.add_sequence();
+  const auto b = paged.add_sequence();
+  EXPECT_TRUE(torch::allclose(model->step(input, paged, {a, b}), expected, 1e-4, 1e-5));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(ModelInferenceTest, QuantizedWeightsStepMatchesForward) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_layers = 2;
+
+  auto model = FuzzFormer(config);
+  auto weight_bytes = [&] {
+    int64_t bytes = 0;
+    for (const auto& tensor : model->parameters()) {
+      bytes += static_cast<int64_t>(tensor.nbytes());
+    }
+    for (const auto& tensor : model->buffers()) {
+      bytes += static_cast<int64_t>(tensor.nbytes());
+    }
+    return bytes;
+  };
+  auto input = torch::randn({2, 10, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  torch::NoGradGuard no_grad;
+  auto float_output = model->forward(input, mask);
+  const auto float_bytes = weight_bytes();
+
+  model->quantize_weights();
+  // int8 weights plus a float scale and bias per output channel.
+  EXPECT_GT(static_cast<double>(float_bytes) / weight_bytes(), 3.5);
+  auto expected = model->forward(input, mask);
+  EXPECT_LT(((expected - float_output).norm() / float_output.norm()).item<double>(), 2e-2);
+
+  KVCache cache(config, 2, 10);
+  EXPECT_TRUE(torch::allclose(model->step(input.slice(1, 0, 4), cache), expected.slice(1, 0, 4), 1e-4, 1e-5));
+  for (int64_t position = 4; position < 10; ++position) {
+    auto output = model->step(input.slice(1, position, position + 1), cache);
+    EXPECT_TRUE(torch::allclose(output, expected.slice(1, position, position + 1), 1e-4, 1e-5))
+        << "position " << position;
+  }
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(ModelInferenceTest, QuantizedCheckpointRoundTrip) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+  config.num_kv_heads = 2;
+  config.num_layers = 2;
+
+  // A trained float checkpoint, converted in memory and through a file.
+  auto trained = FuzzFormer(config);
+  ParameterDict parameters;
+  for (const auto& item : trained->named_parameters()) {
+    parameters.insert(item.key(), item.value().detach().clone());
+  }
+  auto converted = FuzzFormer(config);
+  load_parameters(*converted, parameters);
+  converted->quantize_weights();
+
+  const auto path = (std::filesystem::temp_directory_path() / "fuzzformer_quantized_checkpoint.pt").string();
+  save_quantized_checkpoint(config, parameters, path);
+  auto loaded = load_quantized_checkpoint(config, path);
+  std::filesystem::remove(path);
+
+  auto converted_buffers = converted->named_buffers();
+  auto loaded_buffers = loaded->named_buffers();
+  ASSERT_EQ(loaded_buffers.size(), converted_buffers.size());
+  for (const auto& item : converted_buffers) {
+    const auto* buffer = loaded_buffers.find(item.key());
+    ASSERT_NE(buffer, nullptr) << item.key();
+    EXPECT_TRUE(torch::equal(*buffer, item.value())) << item.key();
+  }
+
+  // Decode-sized and prefill-sized batches take different int8 paths.
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  torch::NoGradGuard no_grad;
+  for (const int64_t seq_len : {3, 40}) {
+    auto input = torch::randn({2, seq_len, static_cast<long>(config.model_dim)});
+    auto expected = trained->forward(input, mask);
+    auto output = loaded->forward(input, mask);
+    EXPECT_TRUE(torch::equal(output, converted->forward(input, mask))) << "seq_len " << seq_len;
+    EXPECT_LT(((output - expected).norm() / expected.norm()).item<double>(), 2e-2) << "seq_len " << seq_len;
+  }
+
+  // Converted layers have no parameters left to load into.
+  EXPECT_THROW(load_parameters(*loaded, parameters), c10::Error);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+}  // namespace fuzzformer
@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 
+#include <string>
+
+#include "fuzzformer/checkpoint.h"
 #include "fuzzformer/modelConfig.h"
+#include "fuzzformer/quantizedLinear.h"
 #include "fuzzformer/transformerBlock.h"
 
 #ifdef FUZZFORMER_HAS_TORCH
@@ -25,5 +29,143 @@ TEST(TransformerBlockTest, PreservesInputShape) {
 #endif
 }
 
-}  // namespace fuzzformer
+TEST(TransformerBlockTest, CausalMaskIgnoresLaterTokens) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+
+  auto block = TransformerBlock(config);
+  auto input = torch::randn({1, 12, static_cast<long>(config.model_dim)});
+  auto altered = input.clone();
+  altered.slice(1, 6).normal_();
+
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  auto output = block->forward(input, mask);
+  auto altered_output = block->forward(altered, mask);
+  EXPECT_TRUE(torch::allclose(output.slice(1, 0, 6), altered_output.slice(1, 0, 6), 1e-5, 1e-6));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(TransformerBlockTest, LoadsLegacySeparateQkvWeights) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 32;
+  config.num_heads = 4;
+  const auto model_dim = static_cast<int64_t>(config.model_dim);
+  const auto num_heads = static_cast<int64_t>(config.num_heads);
+  const auto head_dim = model_dim / num_heads;
+
+  // A checkpoint in the pre-fusion layout.
+  ParameterDict legacy;
+  for (const char* name : {"q_proj", "k_proj", "v_proj", "out_proj"}) {
+    legacy.insert(std::string(name) + ".weight", torch::randn({model_dim, model_dim}));
+    legacy.insert(std::string(name) + ".bias", torch::randn({model_dim}));
+  }
+
+  auto block = TransformerBlock(config);
+  load_parameters(*block, legacy);
+
+  // The attention output computed with the three separate projections.
+  auto input = torch::randn({2, 9, model_dim});
+  auto project = [&](const char* name) {
+    auto projected = torch::nn::functional::linear(input, legacy[std::string(name) + ".weight"],
+                                                   legacy[std::string(name) + ".bias"]);
+    return projected.view({2, 9, num_heads, head_dim}).permute({0, 2, 1, 3}).contiguous();
+  };
+  auto attn = fuzzy_attention_forward(project("q_proj"), project("k_proj"), project("v_proj"),
+                                      torch::ones({num_heads}), torch::zeros({num_heads}));
+  auto merged = attn.permute({0, 2, 1, 3}).reshape({2, 9, model_dim});
+  auto expected = torch::nn::functional::linear(merged, legacy["out_proj.weight"], legacy["out_proj.bias"]) + input;
+
+  EXPECT_TRUE(torch::allclose(block->forward(input), expected, 1e-4, 1e-5));
+
+  // Current checkpoints round-trip unchanged.
+  auto reloaded = TransformerBlock(config);
+  load_parameters(*reloaded, block->named_parameters());
+  EXPECT_TRUE(torch::equal(reloaded->forward(input), block->forward(input)));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(TransformerBlockTest, RejectsIncompleteLegacyQkv) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ParameterDict legacy;
+  legacy.insert("block_0.q_proj.weight", torch::randn({8, 8}));
+  legacy.insert("block_0.k_proj.weight", torch::randn({8, 8}));
+  EXPECT_ANY_THROW(fuse_legacy_qkv(legacy));
+
+  legacy.insert("block_0.v_proj.weight", torch::randn({8, 8}));
+  legacy.insert("output_head.weight", torch::randn({8, 8}));
+  auto fused = fuse_legacy_qkv(legacy);
+  ASSERT_EQ(fused.size(), 2u);
+  EXPECT_EQ(fused["block_0.qkv_proj.weight"].sizes(), torch::IntArrayRef({24, 8}));
+  EXPECT_TRUE(fused.contains("output_head.weight"));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+TEST(TransformerBlockTest, QuantizedLinearMatchesDequantizedWeights) {
+#ifdef FUZZFORMER_HAS_TORCH
+  auto linear = torch::nn::Linear(torch::nn::LinearOptions(48, 40).bias(true));
+  auto quantized = QuantizedLinear(linear);
+  EXPECT_EQ(quantized->named_buffers()["weight"].scalar_type(), torch::kInt8);
+  EXPECT_EQ(quantized->named_buffers()["scale"].sizes(), torch::IntArrayRef({40}));
+
+  // One symmetric scale per output channel rounds each weight by at most
+  // half of it.
+  torch::NoGradGuard no_grad;
+  auto dequantized = quantized->dequantized_weight();
+  auto step = linear->weight.abs().amax(1, true) / 127;
+  EXPECT_TRUE(((dequantized - linear->weight).abs() <= step * 0.5001).all().item<bool>());
+
+  auto input = torch::randn({3, 5, 48});
+  auto expected = torch::nn::functional::linear(input, dequantized, linear->bias);
+  EXPECT_TRUE(torch::allclose(quantized->forward(input), expected, 1e-5, 1e-5));
+  // Other dtypes run a plain linear over the dequantised weights.
+  EXPECT_TRUE(torch::allclose(quantized->forward(input.to(torch::kFloat64)), expected.to(torch::kFloat64), 1e-5,
+                              1e-5));
+  // The dequantised weights they keep follow writes to the buffers.
+  quantized->named_buffers()["scale"].mul_(2);
+  auto doubled = torch::nn::functional::linear(input, dequantized * 2, linear->bias);
+  EXPECT_TRUE(torch::allclose(quantized->forward(input.to(torch::kFloat64)), doubled.to(torch::kFloat64), 1e-5,
+                              1e-5));
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
 
+TEST(TransformerBlockTest, QuantizeWeightsKeepsNamesAndOutput) {
+#ifdef FUZZFORMER_HAS_TORCH
+  ModelConfig config;
+  config.model_dim = 64;
+  config.num_heads = 4;
+
+  auto block = TransformerBlock(config);
+  auto input = torch::randn({2, 9, static_cast<long>(config.model_dim)});
+  FuzzyAttentionMask mask;
+  mask.causal = true;
+  torch::NoGradGuard no_grad;
+  auto expected = block->forward(input, mask);
+
+  block->quantize_weights();
+  EXPECT_TRUE(block->named_parameters().is_empty());
+  auto buffers = block->named_buffers();
+  EXPECT_EQ(buffers["qkv_proj.weight"].scalar_type(), torch::kInt8);
+  EXPECT_EQ(buffers["out_proj.weight"].scalar_type(), torch::kInt8);
+  EXPECT_EQ(buffers["qkv_proj.weight"].sizes(), torch::IntArrayRef({192, 64}));
+
+  auto output = block->forward(input, mask);
+  EXPECT_LT(((output - expected).norm() / (expected - input).norm()).item<double>(), 2e-2);
+  EXPECT_THROW(block->quantize_weights(), c10::Error);
+#else
+  GTEST_SKIP() << "libtorch not available";
+#endif
+}
+
+}  // namespace fuzzformer